@@ -422,6 +422,7 @@ static PyObject* Server_listen(hh_ServerObj* self, PyObject* args)
     case SERVER_RESULT_SUCCESS:
         Py_RETURN_TRUE;
     case SERVER_RESULT_FAIL:
+    case SERVER_RESULT_WOULD_BLOCK:
         Py_RETURN_FALSE;
     }
 
@@ -726,16 +727,14 @@ ServerConn_get_headers(hh_ServerConnObj* self, PyObject* args,
 
     unsigned num_headers = server_get_num_client_headers(self->conn);
     const char* name;
-    const darray* values;
-    size_t num_values;
+    unsigned num_values;
     PyObject* values_list;
     PyObject* value_str;
     int r;
     for (unsigned i = 0; i < num_headers; i++)
     {
         name = server_get_header_name(self->conn, i);
-        values = server_get_header_values(self->conn, i);
-        num_values = darray_get_len(values);
+        num_values = server_get_num_header_values(self->conn, i);
         values_list = PyList_New(num_values);
         if (values_list == NULL)
         {
@@ -745,8 +744,8 @@ ServerConn_get_headers(hh_ServerConnObj* self, PyObject* args,
 
         for (unsigned j = 0; j < num_values; j++)
         {
-            const char** value = darray_get_elem_addr(values, j);
-            value_str = PyString_FromString(*value);
+            const char* value = server_get_header_value(self->conn, i, j);
+            value_str = PyString_FromString(value);
             if (value_str == NULL)
             {
                 Py_DECREF(values_list);
@@ -31,8 +31,8 @@ class hhBuildExt(build_ext):
 
 # build heelhook objects to link with
 base_names = [
-    'hhmemory', 'darray', 'protocol', 'sha1', 'cencode', 'util',
-    'error_code', 'endpoint', 'hhlog', 'event', 'server', 'pqueue'
+    'hhmemory', 'darray', 'bufpool', 'mask', 'utf8', 'payload', 'wsaccept', 'pmdeflate', 'protocol', 'sha1', 'cencode', 'util',
+    'error_code', 'endpoint', 'hhlog', 'event', 'server', 'pqueue', 'timerwheel'
 ]
 
 library_path = os.path.join(SRC_DIR, 'libheelhook.a')
@@ -49,6 +49,7 @@ setup(
             sources=['_heelhook.c'],
             include_dirs=[SRC_DIR],
             extra_objects=objs,
+            libraries=['z', 'pthread'],
             extra_compile_args=["-std=c99"],
             depends=deps
         )
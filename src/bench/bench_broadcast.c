@@ -0,0 +1,208 @@
+/* bench_broadcast - benchmark sending one message to many connections
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bench.h"
+#include "../darray.h"
+#include "../endpoint.h"
+#include "../hhmemory.h"
+#include "../protocol.h"
+#include "../util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* subscribers a message is fanned out to */
+#define BENCH_NUM_CONNS 10000
+
+/* fan outs timed per measurement */
+#define BENCH_ROUNDS 20
+
+static const size_t g_sizes[] =
+{
+    128,        /* typical chat message */
+    10 * 1024,  /* typical market data snapshot */
+    64 * 1024
+};
+
+static endpoint_callbacks g_callbacks;
+
+static void init_settings(endpoint_settings* settings)
+{
+    protocol_settings* conn_settings = &settings->conn_settings;
+    conn_settings->write_max_frame_size = 16 * 1024;
+    conn_settings->read_max_msg_size = 1024 * 1024;
+    conn_settings->read_max_num_frames = 1024;
+    conn_settings->max_handshake_size = 2048;
+    conn_settings->init_buf_len = 1024;
+    conn_settings->rand_func = NULL;
+    conn_settings->deflate.enabled = false;
+}
+
+/* memory held for outgoing data across all of conns */
+static size_t queued_memory(endpoint* conns)
+{
+    size_t total = 0;
+    for (int i = 0; i < BENCH_NUM_CONNS; i++)
+    {
+        if (conns[i].write_queue == NULL) continue;
+
+        total += darray_get_bytes_reserved(conns[i].pconn.write_buffer);
+        total += darray_get_bytes_reserved(conns[i].write_queue);
+
+        endpoint_write_seg* segs = darray_get_data(conns[i].write_queue);
+        size_t num_segs = darray_get_len(conns[i].write_queue);
+        for (size_t j = conns[i].write_queue_head; j < num_segs; j++)
+        {
+            if (segs[j].chunk == NULL) continue;
+            total += darray_get_bytes_reserved(segs[j].chunk);
+        }
+    }
+    return total;
+}
+
+static void on_release(const char* data, void* release_data)
+{
+    hhunused(data);
+    (*(int*)release_data)--;
+}
+
+/*
+ * time queueing msg on every connection, either encoding and copying it
+ * for each one or sharing one encoded copy. reports nanoseconds and bytes
+ * of queued memory per recipient
+ */
+static void time_fan_out(endpoint* conns, endpoint_settings* settings,
+                         endpoint_msg* msg, bool shared, double* ns_each,
+                         double* bytes_each)
+{
+    uint64_t total_ns = 0;
+    size_t total_bytes = 0;
+
+    for (int round = 0; round < BENCH_ROUNDS; round++)
+    {
+        for (int i = 0; i < BENCH_NUM_CONNS; i++)
+        {
+            endpoint_init(&conns[i], ENDPOINT_SERVER, settings, &g_callbacks,
+                          NULL);
+        }
+        size_t before = queued_memory(conns);
+        int refs = 0;
+        darray* frames = NULL;
+
+        uint64_t start = bench_now_ns();
+        if (shared)
+        {
+            protocol_msg pmsg;
+            pmsg.data = msg->data;
+            pmsg.msg_len = msg->msg_len;
+            pmsg.type = PROTOCOL_MSG_BINARY;
+            frames = darray_create(sizeof(char), (size_t)msg->msg_len + 16);
+            protocol_encode_server_msg(&settings->conn_settings, &pmsg,
+                                       &frames);
+
+            for (int i = 0; i < BENCH_NUM_CONNS; i++)
+            {
+                refs++;
+                endpoint_send_frames_ref(&conns[i], darray_get_data(frames),
+                                         darray_get_len(frames), on_release,
+                                         &refs);
+            }
+        }
+        else
+        {
+            for (int i = 0; i < BENCH_NUM_CONNS; i++)
+            {
+                endpoint_send_msg(&conns[i], msg);
+            }
+        }
+        total_ns += bench_now_ns() - start;
+
+        total_bytes += queued_memory(conns) - before;
+        if (frames != NULL) total_bytes += darray_get_size_reserved(frames);
+
+        for (int i = 0; i < BENCH_NUM_CONNS; i++)
+        {
+            endpoint_deinit(&conns[i]);
+        }
+        if (refs != 0)
+        {
+            printf("%d frames never released\n", refs);
+            exit(1);
+        }
+        if (frames != NULL) darray_destroy(frames);
+    }
+
+    double num = (double)BENCH_ROUNDS * BENCH_NUM_CONNS;
+    *ns_each = (double)total_ns / num;
+    *bytes_each = (double)total_bytes / num;
+}
+
+int main(int argc, char** argv)
+{
+    hhunused(argc);
+    hhunused(argv);
+
+    memset(&g_callbacks, 0, sizeof(g_callbacks));
+
+    endpoint_settings settings;
+    init_settings(&settings);
+
+    endpoint* conns = hhmalloc(BENCH_NUM_CONNS * sizeof(*conns));
+    size_t max_len = g_sizes[hhcountof(g_sizes) - 1];
+    char* payload = hhmalloc(max_len);
+    if (conns == NULL || payload == NULL) return 1;
+    memset(payload, 'x', max_len);
+
+    printf("%d recipients\n", BENCH_NUM_CONNS);
+    printf("%-8s %-6s %10s %14s\n", "size", "mode", "ns each",
+           "bytes each");
+    for (size_t s = 0; s < hhcountof(g_sizes); s++)
+    {
+        endpoint_msg msg;
+        msg.is_text = false;
+        msg.data = payload;
+        msg.msg_len = (int64_t)g_sizes[s];
+
+        for (int shared = 0; shared <= 1; shared++)
+        {
+            double ns_each;
+            double bytes_each;
+            time_fan_out(conns, &settings, &msg, shared, &ns_each,
+                         &bytes_each);
+            printf("%-8zu %-6s %10.1f %14.1f\n", g_sizes[s],
+                   shared ? "shared" : "copy", ns_each, bytes_each);
+        }
+    }
+
+    hhfree(payload);
+    hhfree(conns);
+    return 0;
+}
@@ -0,0 +1,301 @@
+/* bench_loop - round trips through the server on each event loop
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bench.h"
+#include "../hhlog.h"
+#include "../server.h"
+#include "../util.h"
+#include "../loop_adapters/io_uring_iface.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* round trips per connection per measurement */
+#define BENCH_TOTAL_ROUNDS 20000
+
+#define BENCH_BASE_PORT 9300
+
+static const int g_num_conns[] =
+{
+    1,      /* request/response latency */
+    100,
+    1000    /* many fds ready per loop iteration */
+};
+
+static const char g_request[] =
+    "GET / HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "\r\n";
+
+/* 16 byte binary message, masked with a zero key */
+static const char g_frame[] =
+    "\x82\x90\x00\x00\x00\x00" "0123456789abcdef";
+
+/* the unmasked echo */
+#define BENCH_ECHO_LEN (2 + 16)
+
+static hhlog_options g_log_options =
+{
+    .loglevel = HHLOG_LEVEL_ERROR,
+    .syslogident = NULL,
+    .logfilepath = NULL,
+    .log_to_stdout = true,
+    .log_location = false
+};
+
+typedef struct
+{
+    const char* name;
+    server_attach_iloop* attach;
+} bench_loop;
+
+static volatile bool g_stop = false;
+
+static bool attach_event(server* serv, iloop* loop,
+                         config_server_options* options, void* userdata)
+{
+    hhunused(serv);
+    hhunused(userdata);
+    return iloop_event_attach_internal(loop, options);
+}
+
+static bool attach_io_uring(server* serv, iloop* loop,
+                            config_server_options* options, void* userdata)
+{
+    hhunused(serv);
+    hhunused(userdata);
+    return iloop_attach_io_uring(loop, options);
+}
+
+static const bench_loop g_loops[] =
+{
+    { "epoll", attach_event },
+    { "io_uring", attach_io_uring }
+};
+
+static void on_message(server_conn* conn, endpoint_msg* msg, void* userdata)
+{
+    hhunused(userdata);
+    server_conn_send_msg(conn, msg);
+}
+
+static bool should_stop(server* serv, void* userdata)
+{
+    hhunused(serv);
+    hhunused(userdata);
+    return g_stop;
+}
+
+static void* server_thread(void* data)
+{
+    server_listen(data);
+    return NULL;
+}
+
+static void fail(const char* what)
+{
+    printf("%s failed: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+static void read_all(int fd, char* buffer, size_t len)
+{
+    size_t pos = 0;
+    while (pos < len)
+    {
+        ssize_t n = read(fd, &buffer[pos], len - pos);
+        if (n <= 0) fail("read");
+        pos += (size_t)n;
+    }
+}
+
+static int connect_client(uint16_t port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) fail("socket");
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_aton("127.0.0.1", &addr.sin_addr);
+
+    /* the server thread might not be listening yet */
+    for (int i = 0; connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1;
+         i++)
+    {
+        if (errno != ECONNREFUSED || i == 1000) fail("connect");
+        usleep(1000);
+    }
+
+    if (write(fd, g_request, sizeof(g_request) - 1) !=
+        (ssize_t)(sizeof(g_request) - 1))
+    {
+        fail("write handshake");
+    }
+
+    /* read the response up to the blank line */
+    char window[4] = { 0 };
+    while (memcmp(window, "\r\n\r\n", 4) != 0)
+    {
+        memmove(window, window + 1, 3);
+        read_all(fd, &window[3], 1);
+    }
+
+    return fd;
+}
+
+/*
+ * every connection sends a message, then every echo is read back. reports
+ * round trips per second and the average time of a round
+ */
+static void time_round_trips(const bench_loop* bl, int num_conns,
+                             uint16_t port)
+{
+    config_server_options options;
+    memset(&options, 0, sizeof(options));
+    options.port = port;
+    options.max_clients = num_conns + 16;
+    options.edge_triggered = true;
+
+    protocol_settings* conn_settings = &options.endp_settings.conn_settings;
+    conn_settings->write_max_frame_size = 16 * 1024;
+    conn_settings->read_max_msg_size = 64 * 1024;
+    conn_settings->read_max_num_frames = 1024;
+    conn_settings->max_handshake_size = 2048;
+    conn_settings->init_buf_len = 1024;
+    conn_settings->rand_func = NULL;
+    conn_settings->deflate.enabled = false;
+
+    server_callbacks callbacks;
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.on_message = on_message;
+    callbacks.should_stop = should_stop;
+    callbacks.attach_loop = bl->attach;
+
+    g_stop = false;
+    server* serv = server_create_detached(&options, &callbacks, NULL);
+    if (serv == NULL) fail("server_create_detached");
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, server_thread, serv) != 0)
+    {
+        fail("pthread_create");
+    }
+
+    int* fds = malloc((size_t)num_conns * sizeof(*fds));
+    if (fds == NULL) fail("malloc");
+    for (int i = 0; i < num_conns; i++)
+    {
+        fds[i] = connect_client(port);
+    }
+
+    int num_rounds = hhmax(BENCH_TOTAL_ROUNDS / num_conns, 10);
+    char echo[BENCH_ECHO_LEN];
+
+    uint64_t start = bench_now_ns();
+    for (int r = 0; r < num_rounds; r++)
+    {
+        for (int i = 0; i < num_conns; i++)
+        {
+            if (write(fds[i], g_frame, sizeof(g_frame) - 1) !=
+                (ssize_t)(sizeof(g_frame) - 1))
+            {
+                fail("write");
+            }
+        }
+
+        for (int i = 0; i < num_conns; i++)
+        {
+            read_all(fds[i], echo, sizeof(echo));
+        }
+    }
+    uint64_t ns = bench_now_ns() - start;
+
+    double num_trips = (double)num_rounds * num_conns;
+    printf("%-10s %6d %14.0f %12.1f\n", bl->name, num_conns,
+           num_trips / ((double)ns / 1e9),
+           (double)ns / 1000.0 / num_rounds);
+
+    for (int i = 0; i < num_conns; i++)
+    {
+        close(fds[i]);
+    }
+    free(fds);
+
+    g_stop = true;
+    pthread_join(thread, NULL);
+    server_destroy(serv);
+}
+
+int main(int argc, char** argv)
+{
+    hhunused(argc);
+    hhunused(argv);
+
+    hhlog_set_options(&g_log_options);
+
+    /* both ends of every connection live in this process */
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    uint16_t port = BENCH_BASE_PORT;
+    printf("%-10s %6s %14s %12s\n", "loop", "conns", "round trips/s",
+           "us/round");
+    for (size_t c = 0; c < hhcountof(g_num_conns); c++)
+    {
+        for (size_t l = 0; l < hhcountof(g_loops); l++)
+        {
+            time_round_trips(&g_loops[l], g_num_conns[c], port++);
+        }
+    }
+
+    return 0;
+}
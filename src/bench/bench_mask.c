@@ -0,0 +1,109 @@
+/* bench_mask - measure masking throughput of each mask implementation
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bench.h"
+#include "../hhmemory.h"
+#include "../mask.h"
+#include "../util.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* total bytes masked per measurement, split over buffers of each size */
+#define BENCH_TOTAL_BYTES (1024ULL * 1024 * 1024)
+
+static const size_t g_sizes[] =
+{
+    125,                /* biggest control frame */
+    1024,               /* typical chat message */
+    64 * 1024,          /* large frame that still fits in L2 */
+    16 * 1024 * 1024    /* way bigger than any cache */
+};
+
+static uint64_t time_impl(mask_func* func, char* buf, size_t len)
+{
+    static const char key[4] = { (char)0x37, (char)0xfa, (char)0x21,
+                                 (char)0x3d };
+    uint64_t iterations = BENCH_TOTAL_BYTES / len;
+
+    /* warm up caches and the branch predictor */
+    func(buf, buf, len, key, 0);
+
+    uint64_t start = bench_now_ns();
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        /*
+         * offset the start by one byte so every run has an unaligned head
+         * and a non-zero mask_index, like continuation frames do
+         */
+        func(buf + 1, buf + 1, len, key, (int64_t)i);
+        bench_consume(buf);
+    }
+
+    return bench_now_ns() - start;
+}
+
+int main(int argc, char** argv)
+{
+    hhunused(argc);
+    hhunused(argv);
+
+    size_t max_len = g_sizes[hhcountof(g_sizes) - 1];
+    char* buf = hhmalloc(max_len + 1);
+    if (buf == NULL) return 1;
+    memset(buf, 'x', max_len + 1);
+
+    printf("%-10s %-6s %10s %10s\n", "size", "impl", "GB/s", "vs byte");
+    for (size_t s = 0; s < hhcountof(g_sizes); s++)
+    {
+        size_t len = g_sizes[s];
+        uint64_t bytes = (BENCH_TOTAL_BYTES / len) * len;
+        double byte_rate = 0.0;
+
+        for (int i = 0; i < MASK_NUMBER_OF_IMPLS; i++)
+        {
+            mask_impl impl = (mask_impl)i;
+            mask_func* func = mask_get_impl(impl);
+            if (func == NULL) continue;
+
+            uint64_t ns = time_impl(func, buf, len);
+            double rate = bench_gb_per_sec(bytes, ns);
+            if (impl == MASK_IMPL_BYTE) byte_rate = rate;
+
+            printf("%-10zu %-6s %10.2f %9.1fx\n", len, mask_impl_name(impl),
+                   rate, rate / byte_rate);
+        }
+    }
+
+    hhfree(buf);
+    return 0;
+}
@@ -0,0 +1,147 @@
+/* bench_payload - measure fused payload kernels against separate passes
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bench.h"
+#include "../hhmemory.h"
+#include "../mask.h"
+#include "../payload.h"
+#include "../utf8.h"
+#include "../util.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* total bytes processed per measurement, split over buffers of each size */
+#define BENCH_TOTAL_BYTES (1024ULL * 1024 * 1024)
+
+static const size_t g_sizes[] =
+{
+    1024,               /* typical chat message */
+    64 * 1024,          /* large frame that still fits in L2 */
+    1024 * 1024,        /* bigger than L2 */
+    16 * 1024 * 1024    /* way bigger than any cache */
+};
+
+/*
+ * an all zero key leaves the text alone, so it stays valid from one in
+ * place run to the next and costs the same as any other key
+ */
+static const char g_key[4] = { 0, 0, 0, 0 };
+
+static const char g_text[] = "{\"user\":\"J\xc3\xbcrgen\",\"text\":\"caf\xc3\xa9\"},";
+
+/* mask the whole payload, then validate the whole payload */
+static void two_pass(char* dest, const char* src, size_t len,
+                     const char* mask_key, int64_t mask_index,
+                     uint32_t* state, uint32_t* codepoint)
+{
+    mask_apply(dest, src, len, mask_key, mask_index);
+    utf8_validate(state, codepoint, dest, len);
+}
+
+static uint64_t time_kernel(payload_kernel* kernel, char* dest,
+                            const char* src, size_t len)
+{
+    uint64_t iterations = BENCH_TOTAL_BYTES / len;
+    uint32_t state = UTF8_ACCEPT;
+    uint32_t codepoint = 0;
+
+    /* warm up, and make sure we're timing the path that accepts */
+    kernel(dest, src, len, g_key, 0, &state, &codepoint);
+    if (state != UTF8_ACCEPT)
+    {
+        printf("benchmark text is not valid UTF-8\n");
+        exit(1);
+    }
+
+    uint64_t start = bench_now_ns();
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        kernel(dest, src, len, g_key, (int64_t)i, &state, &codepoint);
+        bench_consume(dest);
+    }
+
+    return bench_now_ns() - start;
+}
+
+static void run(const char* name, payload_kernel* kernel, char* dest,
+                const char* src, size_t len)
+{
+    uint64_t bytes = (BENCH_TOTAL_BYTES / len) * len;
+    double two_pass_rate = bench_gb_per_sec(bytes,
+                                            time_kernel(two_pass, dest, src,
+                                                        len));
+    double fused_rate = bench_gb_per_sec(bytes,
+                                         time_kernel(kernel, dest, src, len));
+
+    printf("%-10s %-10zu %10.2f %10.2f %9.2fx\n", name, len, two_pass_rate,
+           fused_rate, fused_rate / two_pass_rate);
+}
+
+int main(int argc, char** argv)
+{
+    hhunused(argc);
+    hhunused(argv);
+
+    size_t max_len = g_sizes[hhcountof(g_sizes) - 1];
+    char* src = hhmalloc(max_len);
+    char* dest = hhmalloc(max_len);
+    if (src == NULL || dest == NULL) return 1;
+
+    size_t text_len = sizeof(g_text) - 1;
+    size_t i = 0;
+    for (; i + text_len <= max_len; i += text_len)
+    {
+        memcpy(&src[i], g_text, text_len);
+    }
+    memset(&src[i], ' ', max_len - i);
+
+    payload_kernel* in_place =
+        payload_get_kernel(PAYLOAD_UNMASK | PAYLOAD_VALIDATE);
+    payload_kernel* move =
+        payload_get_kernel(PAYLOAD_UNMASK | PAYLOAD_VALIDATE | PAYLOAD_MOVE);
+
+    printf("%-10s %-10s %10s %10s %10s\n", "kernel", "size", "2pass GB/s",
+           "fused GB/s", "speedup");
+    for (size_t s = 0; s < hhcountof(g_sizes); s++)
+    {
+        run("in place", in_place, src, src, g_sizes[s]);
+    }
+    for (size_t s = 0; s < hhcountof(g_sizes); s++)
+    {
+        run("move", move, dest, src, g_sizes[s]);
+    }
+
+    hhfree(src);
+    hhfree(dest);
+    return 0;
+}
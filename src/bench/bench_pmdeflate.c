@@ -0,0 +1,119 @@
+/* bench_pmdeflate - benchmark permessage-deflate on chat-like json
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bench.h"
+#include "../pmdeflate.h"
+#include "../util.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* messages compressed and inflated per measurement */
+#define BENCH_NUM_MESSAGES 20000
+
+static const int g_levels[] = { 1, 6, 9 };
+
+/* a chat-like json message, similar from one message to the next */
+static size_t make_json(char* buf, size_t len, int i)
+{
+    int n = snprintf(buf, len,
+        "{\"type\":\"message\",\"room\":\"general\",\"user\":\"user%d\","
+        "\"timestamp\":%d,\"text\":\"message number %d, which says about "
+        "as much as a chat message usually does\"}",
+        i % 50, 1400000000 + i * 13, i);
+    return (size_t)n;
+}
+
+static void time_level(int level, bool no_context_takeover, int window_bits)
+{
+    pmdeflate_params params;
+    params.write_window_bits = window_bits;
+    params.read_window_bits = window_bits;
+    params.mem_level = 8;
+    params.write_no_context_takeover = no_context_takeover;
+    params.read_no_context_takeover = no_context_takeover;
+
+    pmdeflate* sender = pmdeflate_create(&params, level, -1);
+    pmdeflate* receiver = pmdeflate_create(&params, level, -1);
+
+    char msg[256];
+    size_t total_len = 0;
+    size_t total_compressed = 0;
+    uint64_t compress_ns = 0;
+    uint64_t inflate_ns = 0;
+    for (int i = 0; i < BENCH_NUM_MESSAGES; i++)
+    {
+        size_t len = make_json(msg, sizeof(msg), i);
+        const char* compressed;
+        size_t compressed_len;
+        char* inflated;
+        size_t inflated_len;
+
+        uint64_t start = bench_now_ns();
+        pmdeflate_compress(sender, msg, len, &compressed, &compressed_len);
+        uint64_t mid = bench_now_ns();
+        pmdeflate_decompress(receiver, compressed, compressed_len, -1,
+                             &inflated, &inflated_len);
+        uint64_t end = bench_now_ns();
+        bench_consume(inflated);
+
+        compress_ns += mid - start;
+        inflate_ns += end - mid;
+        total_len += len;
+        total_compressed += compressed_len;
+    }
+
+    printf("%-6d %-8s %-7d %7.2fx %12.0f %12.0f %8zu\n", level,
+           no_context_takeover ? "no" : "yes", window_bits,
+           (double)total_len / (double)total_compressed,
+           (double)compress_ns / BENCH_NUM_MESSAGES,
+           (double)inflate_ns / BENCH_NUM_MESSAGES,
+           pmdeflate_get_mem_used(sender) + pmdeflate_get_mem_used(receiver));
+
+    pmdeflate_destroy(sender);
+    pmdeflate_destroy(receiver);
+}
+
+int main(int argc, char** argv)
+{
+    hhunused(argc);
+    hhunused(argv);
+
+    printf("%-6s %-8s %-7s %8s %12s %12s %8s\n", "level", "takeover",
+           "window", "ratio", "deflate ns", "inflate ns", "mem");
+    for (size_t l = 0; l < hhcountof(g_levels); l++)
+    {
+        time_level(g_levels[l], false, 15);
+        time_level(g_levels[l], true, 15);
+        time_level(g_levels[l], false, 10);
+    }
+
+    return 0;
+}
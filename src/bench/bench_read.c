@@ -0,0 +1,232 @@
+/* bench_read - syscalls and throughput receiving messages with endpoint_read
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bench.h"
+#include "../darray.h"
+#include "../endpoint.h"
+#include "../protocol.h"
+#include "../util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* bytes received per message size */
+#define BENCH_TOTAL_BYTES (64 * 1024 * 1024)
+
+static const size_t g_sizes[] =
+{
+    128,        /* typical chat message */
+    16 * 1024,
+    256 * 1024,
+    1024 * 1024
+};
+
+static uint64_t g_num_syscalls;
+
+/*
+ * count every read the endpoint makes. the definitions here take the place
+ * of libc's for the whole program
+ */
+ssize_t readv(int fd, const struct iovec* iov, int iovcnt)
+{
+    g_num_syscalls++;
+    return syscall(SYS_readv, fd, iov, iovcnt);
+}
+
+ssize_t read(int fd, void* buf, size_t count)
+{
+    g_num_syscalls++;
+    return syscall(SYS_read, fd, buf, count);
+}
+
+static uint32_t random_callback(protocol_conn* conn)
+{
+    hhunused(conn);
+    return (uint32_t)random();
+}
+
+static void init_settings(endpoint_settings* settings)
+{
+    protocol_settings* conn_settings = &settings->conn_settings;
+    conn_settings->write_max_frame_size = -1;
+    conn_settings->read_max_msg_size = 2 * 1024 * 1024;
+    conn_settings->read_max_num_frames = 1024;
+    conn_settings->max_handshake_size = 2048;
+    conn_settings->init_buf_len = 1024;
+    conn_settings->rand_func = random_callback;
+    conn_settings->deflate.enabled = false;
+}
+
+static bool on_connect(endpoint* conn, protocol_conn* proto_conn,
+                       void* userdata)
+{
+    hhunused(proto_conn);
+    hhunused(userdata);
+    return endpoint_send_handshake_response(conn, NULL, NULL) ==
+        ENDPOINT_RESULT_SUCCESS;
+}
+
+static void on_message(endpoint* conn, endpoint_msg* msg, void* userdata)
+{
+    hhunused(conn);
+    bench_consume(msg->data);
+    (*(size_t*)userdata)++;
+}
+
+static void fail(const char* what)
+{
+    printf("%s failed: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+/* connect client to server over fds, leaving the client ready to read */
+static void handshake(endpoint* client, endpoint* server, int fds[2])
+{
+    endpoint_send_handshake_request(client, "/", "localhost", NULL, NULL,
+                                    NULL);
+    if (endpoint_write(client, fds[1]) != ENDPOINT_WRITE_DONE ||
+        endpoint_read(server, fds[0]) != ENDPOINT_READ_SUCCESS ||
+        endpoint_write(server, fds[0]) != ENDPOINT_WRITE_DONE ||
+        endpoint_read(client, fds[1]) != ENDPOINT_READ_SUCCESS)
+    {
+        fail("handshake");
+    }
+}
+
+/*
+ * stream BENCH_TOTAL_BYTES worth of len byte messages through a socket and
+ * receive them with endpoint_read. reports MB/s, reads per MB and
+ * endpoint_read calls per MB
+ */
+static void time_receive(endpoint_settings* settings, size_t len)
+{
+    endpoint_callbacks server_callbacks;
+    memset(&server_callbacks, 0, sizeof(server_callbacks));
+    server_callbacks.on_connect = on_connect;
+
+    size_t num_received = 0;
+    endpoint_callbacks client_callbacks;
+    memset(&client_callbacks, 0, sizeof(client_callbacks));
+    client_callbacks.on_message = on_message;
+
+    endpoint server;
+    endpoint client;
+    endpoint_init(&server, ENDPOINT_SERVER, settings, &server_callbacks,
+                  NULL);
+    endpoint_init(&client, ENDPOINT_CLIENT, settings, &client_callbacks,
+                  &num_received);
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) fail("socketpair");
+    for (int i = 0; i < 2; i++)
+    {
+        if (fcntl(fds[i], F_SETFL, O_NONBLOCK) == -1) fail("fcntl");
+    }
+    handshake(&client, &server, fds);
+
+    char* payload = malloc(len);
+    if (payload == NULL) fail("malloc");
+    memset(payload, 'x', len);
+
+    protocol_msg pmsg;
+    pmsg.data = payload;
+    pmsg.msg_len = (int64_t)len;
+    pmsg.type = PROTOCOL_MSG_BINARY;
+    darray* frames = darray_create(sizeof(char), len + 16);
+    protocol_encode_server_msg(&settings->conn_settings, &pmsg, &frames);
+    const char* frame = darray_get_data(frames);
+    size_t frame_len = darray_get_len(frames);
+
+    size_t num_msgs = hhmax(BENCH_TOTAL_BYTES / len, (size_t)1);
+    size_t total = num_msgs * frame_len;
+    size_t sent = 0;
+    uint64_t num_calls = 0;
+    g_num_syscalls = 0;
+
+    uint64_t start = bench_now_ns();
+    while (num_received < num_msgs)
+    {
+        /* fill the socket up, then let the endpoint take what's there */
+        while (sent < total)
+        {
+            size_t pos = sent % frame_len;
+            size_t n = hhmin(frame_len - pos, total - sent);
+            ssize_t num_written = write(fds[0], &frame[pos], n);
+            if (num_written <= 0) break;
+            sent += (size_t)num_written;
+        }
+
+        num_calls++;
+        if (endpoint_read(&client, fds[1]) != ENDPOINT_READ_SUCCESS)
+        {
+            fail("endpoint_read");
+        }
+    }
+    uint64_t ns = bench_now_ns() - start;
+
+    double mb = (double)total / (1024.0 * 1024.0);
+    printf("%-8zu %10.1f %10.1f %12.1f\n", len,
+           mb / ((double)ns / 1e9), (double)g_num_syscalls / mb,
+           (double)num_calls / mb);
+
+    darray_destroy(frames);
+    free(payload);
+    close(fds[0]);
+    close(fds[1]);
+    endpoint_deinit(&client);
+    endpoint_deinit(&server);
+}
+
+int main(int argc, char** argv)
+{
+    hhunused(argc);
+    hhunused(argv);
+
+    endpoint_settings settings;
+    init_settings(&settings);
+
+    /* a fixed 4k read per readable event needs 256 reads per MB */
+    printf("%d MB per size\n", BENCH_TOTAL_BYTES / (1024 * 1024));
+    printf("%-8s %10s %10s %12s\n", "size", "MB/s", "reads/MB",
+           "calls/MB");
+    for (size_t s = 0; s < hhcountof(g_sizes); s++)
+    {
+        time_receive(&settings, g_sizes[s]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,139 @@
+/* bench_utf8 - measure UTF-8 validation throughput
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bench.h"
+#include "../hhmemory.h"
+#include "../utf8.h"
+#include "../util.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* total bytes validated per measurement, split over buffers of each size */
+#define BENCH_TOTAL_BYTES (512ULL * 1024 * 1024)
+
+static const size_t g_sizes[] =
+{
+    125,                /* biggest control frame */
+    1024,               /* typical chat message */
+    64 * 1024,          /* large frame that still fits in L2 */
+};
+
+typedef struct
+{
+    const char* name;
+    const char* text; /* repeated to fill the buffer */
+} bench_text;
+
+static const bench_text g_texts[] =
+{
+    /* JSON chat traffic, pure ASCII */
+    { "ascii", "{\"type\":\"message\",\"user\":\"alice\",\"text\":\"hi all\"}," },
+    /* mostly ASCII with the odd accented letter */
+    { "latin", "{\"user\":\"J\xc3\xbcrgen\",\"text\":\"caf\xc3\xa9 \xc3\xa0 "
+               "10\xe2\x82\xac\"}," },
+    /* no ASCII at all, 3 byte characters */
+    { "cjk", "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e\xe3\x81\xae\xe6\x96\x87"
+             "\xe7\xab\xa0\xe3\x81\xa7\xe3\x81\x99" },
+};
+
+/* fill buf with whole copies of text, padded out with spaces */
+static void fill_text(char* buf, size_t len, const char* text)
+{
+    size_t text_len = strlen(text);
+    size_t i = 0;
+    for (; i + text_len <= len; i += text_len)
+    {
+        memcpy(&buf[i], text, text_len);
+    }
+    memset(&buf[i], ' ', len - i);
+}
+
+static uint64_t time_impl(utf8_func* func, const char* buf, size_t len)
+{
+    uint64_t iterations = BENCH_TOTAL_BYTES / len;
+
+    if (!func(buf, len))
+    {
+        printf("benchmark text is not valid UTF-8\n");
+        exit(1);
+    }
+
+    uint64_t start = bench_now_ns();
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        bool valid = func(buf, len);
+        bench_consume(&valid);
+    }
+
+    return bench_now_ns() - start;
+}
+
+int main(int argc, char** argv)
+{
+    hhunused(argc);
+    hhunused(argv);
+
+    size_t max_len = g_sizes[hhcountof(g_sizes) - 1];
+    char* buf = hhmalloc(max_len);
+    if (buf == NULL) return 1;
+
+    printf("%-6s %-10s %-6s %10s %10s\n", "text", "size", "impl", "GB/s",
+           "vs dfa");
+    for (size_t t = 0; t < hhcountof(g_texts); t++)
+    {
+        for (size_t s = 0; s < hhcountof(g_sizes); s++)
+        {
+            size_t len = g_sizes[s];
+            uint64_t bytes = (BENCH_TOTAL_BYTES / len) * len;
+            double dfa_rate = 0.0;
+            fill_text(buf, len, g_texts[t].text);
+
+            for (int i = 0; i < UTF8_NUMBER_OF_IMPLS; i++)
+            {
+                utf8_impl impl = (utf8_impl)i;
+                utf8_func* func = utf8_get_impl(impl);
+                if (func == NULL) continue;
+
+                uint64_t ns = time_impl(func, buf, len);
+                double rate = bench_gb_per_sec(bytes, ns);
+                if (impl == UTF8_IMPL_DFA) dfa_rate = rate;
+
+                printf("%-6s %-10zu %-6s %10.2f %9.1fx\n", g_texts[t].name,
+                       len, utf8_impl_name(impl), rate, rate / dfa_rate);
+            }
+        }
+    }
+
+    hhfree(buf);
+    return 0;
+}
@@ -0,0 +1,122 @@
+/* bench_wsaccept - benchmark Sec-WebSocket-Accept computation
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bench.h"
+#include "../hhmemory.h"
+#include "../util.h"
+#include "../wsaccept.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* accept values computed per measurement */
+#define BENCH_TOTAL_KEYS (2 * 1024 * 1024)
+
+/* distinct keys cycled through, like a crowd of reconnecting clients */
+#define BENCH_NUM_KEYS 4096
+
+static uint64_t time_impl(wsaccept_func* func, const char** keys,
+                          char** out)
+{
+    /* warm up caches and the branch predictor */
+    func(keys[0], out[0]);
+
+    uint64_t start = bench_now_ns();
+    size_t k = 0;
+    for (uint64_t i = 0; i < BENCH_TOTAL_KEYS; i++)
+    {
+        func(keys[k], out[k]);
+        bench_consume(out[k]);
+
+        k++;
+        if (k == BENCH_NUM_KEYS) k = 0;
+    }
+
+    return bench_now_ns() - start;
+}
+
+int main(int argc, char** argv)
+{
+    hhunused(argc);
+    hhunused(argv);
+
+    static const char chars[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    char* key_buf = hhmalloc(BENCH_NUM_KEYS * WSACCEPT_KEY_LEN);
+    char* out_buf = hhmalloc(BENCH_NUM_KEYS * WSACCEPT_LEN);
+    const char** keys = hhmalloc(BENCH_NUM_KEYS * sizeof(*keys));
+    char** out = hhmalloc(BENCH_NUM_KEYS * sizeof(*out));
+    if (key_buf == NULL || out_buf == NULL || keys == NULL || out == NULL)
+    {
+        return 1;
+    }
+
+    srand(1);
+    for (size_t i = 0; i < BENCH_NUM_KEYS; i++)
+    {
+        char* key = &key_buf[i * WSACCEPT_KEY_LEN];
+        for (int j = 0; j < WSACCEPT_KEY_LEN - 2; j++)
+        {
+            key[j] = chars[rand() % 64];
+        }
+        key[WSACCEPT_KEY_LEN - 2] = '=';
+        key[WSACCEPT_KEY_LEN - 1] = '=';
+
+        keys[i] = key;
+        out[i] = &out_buf[i * WSACCEPT_LEN];
+    }
+
+    printf("%-10s %12s %8s %13s\n", "impl", "handshakes/s", "ns each",
+           "vs reference");
+    double reference_rate = 0.0;
+    for (int i = 0; i < WSACCEPT_NUMBER_OF_IMPLS; i++)
+    {
+        wsaccept_impl impl = (wsaccept_impl)i;
+        wsaccept_func* func = wsaccept_get_impl(impl);
+        if (func == NULL) continue;
+
+        uint64_t ns = time_impl(func, keys, out);
+        if (ns == 0) ns = 1;
+        double rate = (double)BENCH_TOTAL_KEYS * 1e9 / (double)ns;
+        if (impl == WSACCEPT_IMPL_REFERENCE) reference_rate = rate;
+
+        printf("%-10s %12.0f %8.1f %12.1fx\n", wsaccept_impl_name(impl), rate,
+               (double)ns / (double)BENCH_TOTAL_KEYS, rate / reference_rate);
+    }
+
+    hhfree(out);
+    hhfree(keys);
+    hhfree(out_buf);
+    hhfree(key_buf);
+    return 0;
+}
@@ -0,0 +1,187 @@
+/* bufpool - Size class pools of darrays, so idle connections hold no buffers
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bufpool.h"
+#include "hhassert.h"
+#include "hhmemory.h"
+#include "util.h"
+
+#include <string.h>
+
+/* size classes are powers of two from 512 bytes to 64 KB */
+#define BUFPOOL_MIN_SHIFT 9
+#define BUFPOOL_NUM_CLASSES 8
+#define BUFPOOL_CLASS_SIZE(c) ((size_t)1 << (BUFPOOL_MIN_SHIFT + (c)))
+#define BUFPOOL_MIN_SIZE BUFPOOL_CLASS_SIZE(0)
+#define BUFPOOL_MAX_SIZE BUFPOOL_CLASS_SIZE(BUFPOOL_NUM_CLASSES - 1)
+
+/* most bytes each size class keeps around */
+#define BUFPOOL_MAX_CLASS_BYTES (512 * 1024)
+
+/*
+ * when a class is empty, how many classes up to look for a buffer. buffers
+ * that grew while in use come back in bigger classes than they were taken
+ * from
+ */
+#define BUFPOOL_MAX_CLASS_STEP 2
+
+struct bufpool
+{
+    /* darray of darray*, the free buffers of each size class */
+    darray* free[BUFPOOL_NUM_CLASSES];
+    size_t cached_bytes;
+};
+
+/* the smallest class that holds size bytes, or -1 if none is big enough */
+static int class_to_fit(size_t size)
+{
+    for (int c = 0; c < BUFPOOL_NUM_CLASSES; c++)
+    {
+        if (BUFPOOL_CLASS_SIZE(c) >= size) return c;
+    }
+    return -1;
+}
+
+/* the biggest class a buffer of size bytes can stand in for */
+static int class_of(size_t size)
+{
+    hhassert(size >= BUFPOOL_MIN_SIZE && size <= BUFPOOL_MAX_SIZE);
+    int c = BUFPOOL_NUM_CLASSES - 1;
+    while (BUFPOOL_CLASS_SIZE(c) > size) c--;
+    return c;
+}
+
+bufpool* bufpool_create(void)
+{
+    bufpool* pool = hhmalloc(sizeof(*pool));
+    if (pool == NULL) return NULL;
+
+    memset(pool, 0, sizeof(*pool));
+    for (int c = 0; c < BUFPOOL_NUM_CLASSES; c++)
+    {
+        size_t max_cached = BUFPOOL_MAX_CLASS_BYTES / BUFPOOL_CLASS_SIZE(c);
+        pool->free[c] = darray_create(sizeof(darray*), max_cached);
+        if (pool->free[c] == NULL)
+        {
+            bufpool_destroy(pool);
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+void bufpool_destroy(bufpool* pool)
+{
+    if (pool == NULL) return;
+
+    for (int c = 0; c < BUFPOOL_NUM_CLASSES; c++)
+    {
+        if (pool->free[c] == NULL) continue;
+
+        darray** bufs = darray_get_data(pool->free[c]);
+        for (size_t i = 0; i < darray_get_len(pool->free[c]); i++)
+        {
+            darray_destroy(bufs[i]);
+        }
+        darray_destroy(pool->free[c]);
+    }
+
+    hhfree(pool);
+}
+
+darray* bufpool_get(bufpool* pool, size_t elem_size, size_t num_elems)
+{
+    hhassert(elem_size > 0);
+
+    size_t size = hhmax(elem_size * num_elems, (size_t)1);
+    int c = class_to_fit(size);
+    if (pool == NULL || c < 0)
+    {
+        return darray_create(elem_size, num_elems);
+    }
+
+    int max_class = hhmin(c + BUFPOOL_MAX_CLASS_STEP, BUFPOOL_NUM_CLASSES - 1);
+    for (int i = c; i <= max_class; i++)
+    {
+        darray* free_list = pool->free[i];
+        size_t num_free = darray_get_len(free_list);
+        if (num_free == 0) continue;
+
+        darray** bufs = darray_get_data(free_list);
+        darray* array = bufs[num_free - 1];
+        darray_sub_len(free_list, 1);
+        pool->cached_bytes -= darray_get_bytes_reserved(array);
+
+        size_t num_reserved = darray_recycle(array, elem_size);
+        hhassert(num_reserved >= num_elems);
+        hhunused(num_reserved);
+        return array;
+    }
+
+    /* the whole class size, so it can go back in the same class */
+    return darray_create(elem_size, BUFPOOL_CLASS_SIZE(c) / elem_size);
+}
+
+void bufpool_put(bufpool* pool, darray* array)
+{
+    if (array == NULL) return;
+
+    size_t size = darray_get_bytes_reserved(array);
+    if (pool == NULL || size < BUFPOOL_MIN_SIZE)
+    {
+        darray_destroy(array);
+        return;
+    }
+
+    darray_recycle(array, sizeof(char));
+    if (size > BUFPOOL_MAX_SIZE)
+    {
+        /* grew past the biggest class, give the rest back to the system */
+        if (darray_trim_reserved(&array, BUFPOOL_MAX_SIZE) == NULL) return;
+        size = BUFPOOL_MAX_SIZE;
+    }
+
+    int c = class_of(size);
+    darray* free_list = pool->free[c];
+    if (darray_get_size_reserved(free_list) == darray_get_len(free_list))
+    {
+        darray_destroy(array);
+        return;
+    }
+
+    darray_append(&pool->free[c], &array, 1);
+    pool->cached_bytes += size;
+}
+
+size_t bufpool_get_cached_bytes(const bufpool* pool)
+{
+    return pool->cached_bytes;
+}
@@ -0,0 +1,61 @@
+/* bufpool - Size class pools of darrays, so idle connections hold no buffers
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BUFPOOL_H__
+#define BUFPOOL_H__
+
+#include "darray.h"
+
+typedef struct bufpool bufpool;
+
+/* create an empty pool */
+bufpool* bufpool_create(void);
+
+/* destroy a pool and every buffer it's holding on to */
+void bufpool_destroy(bufpool* pool);
+
+/*
+ * get an empty darray with room for at least num_elems elements of
+ * elem_size. reuses a buffer put back earlier if there is one of about the
+ * right size. pool can be NULL, in which case this is just darray_create
+ */
+darray* bufpool_get(bufpool* pool, size_t elem_size, size_t num_elems);
+
+/*
+ * give a darray back to the pool, whatever it held is thrown away. buffers
+ * that are too small to be worth keeping, or that would put the pool over
+ * its limit, are destroyed. array and pool can be NULL
+ */
+void bufpool_put(bufpool* pool, darray* array);
+
+/* number of bytes sitting in the pool waiting to be reused */
+size_t bufpool_get_cached_bytes(const bufpool* pool);
+
+#endif /* BUFPOOL_H__ */
@@ -34,6 +34,25 @@
 #include <stdint.h>
 #include "endpoint.h"
 
+/* what to do with sends to a connection over its write_high_watermark */
+typedef enum
+{
+    /*
+     * refuse them with SERVER_RESULT_WOULD_BLOCK. on_drain says when it's
+     * okay to send again
+     */
+    CONFIG_WRITE_OVERFLOW_BLOCK,
+
+    /* throw the messages away, the send still succeeds */
+    CONFIG_WRITE_OVERFLOW_DROP,
+
+    /*
+     * drop the connection without a close handshake, a client this far
+     * behind isn't going to read a close frame any time soon
+     */
+    CONFIG_WRITE_OVERFLOW_CLOSE
+} config_write_overflow_policy;
+
 typedef struct
 {
     /* addr to bind to, if NULL, all interfaces */
@@ -51,9 +70,48 @@ typedef struct
      */
     int num_workers;
 
+    /*
+     * each worker listens on its own SO_REUSEPORT socket, so the kernel
+     * spreads new connections across workers instead of waking them all to
+     * race for accept on one shared socket. Only relavent if enable_workers
+     * is set
+     */
+    bool reuseport;
+
+    /*
+     * with reuseport, hand each connection to the worker at the index of the
+     * CPU that received it, modulo num_workers. Linux only, ignored elsewhere
+     */
+    bool reuseport_cpu_steering;
+
+    /*
+     * the master accepts every connection and passes it to the worker with
+     * the fewest open connections, rather than leaving it to whichever
+     * worker wakes first. keeps long lived connections evenly spread. Only
+     * relavent if enable_workers is set, takes precedence over reuseport
+     */
+    bool master_dispatch;
+
+    /*
+     * number of threads running event loops for client connections, each
+     * owning an even share of max_clients. the thread running the server's
+     * own loop only accepts and hands connections to them round robin. a
+     * connection's callbacks always run on the thread that owns it, and
+     * server_conn_* calls for it must be made from that thread. loops are
+     * attached with attach_loop once per thread. set to 0 to run everything
+     * on one thread. with enable_workers, every worker gets this many
+     */
+    int num_threads;
+
     /* max clients we allow connected */
     int max_clients;
 
+    /*
+     * most connections to accept each time the listening socket is readable
+     * before going back to the event loop. set to 0 for the default
+     */
+    int accept_budget;
+
     /* set to 0 for none */
     uint64_t heartbeat_interval_ms;
 
@@ -70,6 +128,54 @@ typedef struct
      */
     uint64_t handshake_timeout_ms;
 
+    /*
+     * close connections that haven't sent anything for this long. set to 0
+     * for none
+     */
+    uint64_t idle_timeout_ms;
+
+    /*
+     * after the server sends a close frame, how long to wait for the
+     * client's before dropping the connection. set to 0 to wait forever
+     */
+    uint64_t close_timeout_ms;
+
+    /*
+     * register client sockets with the event loop once and only hear about
+     * edges, instead of adding and removing write interest with the kernel
+     * around every message. ignored by loops that can't do it
+     */
+    bool edge_triggered;
+
+    /*
+     * loops that sample the time once per iteration read the coarse
+     * monotonic clock, where there is one. cheaper, but only accurate to the
+     * kernel's tick (a few ms), which is plenty for timeouts
+     */
+    bool coarse_clock;
+
+    /*
+     * free the headers the client sent in its handshake once on_open
+     * returns, they take up more room than the rest of the connection. the
+     * server_get_header and similar getters find nothing after that
+     */
+    bool release_handshake_info;
+
+    /*
+     * once more than this many bytes sent on a connection are still waiting
+     * to be written, write_overflow_policy applies to the messages sent to
+     * it. pings, pongs and closes are always sent. set to 0 for no limit
+     */
+    size_t write_high_watermark;
+
+    /*
+     * a connection that went over write_high_watermark gets on_drain once
+     * it's back down to this many bytes waiting to be written
+     */
+    size_t write_low_watermark;
+
+    config_write_overflow_policy write_overflow_policy;
+
     /* endpoint settings */
     endpoint_settings endp_settings;
 } config_server_options;
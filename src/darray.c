@@ -138,12 +138,32 @@ size_t darray_get_size_reserved(const darray* array)
     return array->size_reserved;
 }
 
+/* get the number of bytes reserved for elements */
+size_t darray_get_bytes_reserved(const darray* array)
+{
+    return array->size_reserved * array->elem_size;
+}
+
 /* clear out the darray - set the len to 0 */
 void darray_clear(darray* array)
 {
     array->len = 0;
 }
 
+/*
+ * clear out the darray and reuse its memory for elements of elem_size.
+ * returns the number of elements it now has room for
+ */
+size_t darray_recycle(darray* array, size_t elem_size)
+{
+    hhassert(elem_size > 0);
+    array->size_reserved = (array->size_reserved * array->elem_size) /
+                           elem_size;
+    array->elem_size = elem_size;
+    array->len = 0;
+    return array->size_reserved;
+}
+
 /*
  * make the darray equal to the range [start, end).  if end is -1,
  * slice to the end of the darrray
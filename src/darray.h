@@ -69,9 +69,18 @@ size_t darray_get_len(const darray* array);
 /* get the number of additional elements available*/
 size_t darray_get_size_reserved(const darray* array);
 
+/* get the number of bytes reserved for elements */
+size_t darray_get_bytes_reserved(const darray* array);
+
 /* clear out the darray - set the len to 0 */
 void darray_clear(darray* array);
 
+/*
+ * clear out the darray and reuse its memory for elements of elem_size.
+ * returns the number of elements it now has room for
+ */
+size_t darray_recycle(darray* array, size_t elem_size);
+
 /*
  * make the darray equal to the range [start, end). if end is -1,
  * slice to the end of the darray
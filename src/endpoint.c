@@ -40,15 +40,45 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
-#define ENDPOINT_MAX_READ_LENGTH (1024 * 4)
+/*
+ * reads go into the free tail of the read buffer, which is this big unless
+ * a frame we're in the middle of needs more, up to ENDPOINT_MAX_READ_LENGTH.
+ * anything past the tail lands in a stack spill area and gets appended, so
+ * idle connections don't have to keep large buffers around
+ */
+#define ENDPOINT_MIN_READ_LENGTH (1024 * 4)
+#define ENDPOINT_MAX_READ_LENGTH (1024 * 1024)
+#define ENDPOINT_READ_SPILL_LENGTH (1024 * 64)
+
+/* most bytes read off one connection per readable event */
+#define ENDPOINT_READ_BUDGET (1024 * 1024)
+
 #define ENDPOINT_MAX_WRITE_LENGTH (1024 * 64)
 
+/*
+ * once the write buffer holds this much and not all of it is written yet,
+ * it goes on the write queue as it is and new frames go in a fresh one. a
+ * backlog is then a chain of buffers that never gets copied again, instead
+ * of one that keeps being reallocated and compacted
+ */
+#define ENDPOINT_WRITE_CHUNK_LENGTH (1024 * 64)
+
+/* most segments handed to a single writev */
+#define ENDPOINT_MAX_IOVECS 64
+
+/*
+ * payloads smaller than this are cheaper to copy into the write buffer than
+ * to send as a segment of their own
+ */
+#define ENDPOINT_MIN_REF_LENGTH 1024
+
 static endpoint_result endpoint_send_pmsg(endpoint* conn, protocol_msg* pmsg);
 
 /*
@@ -64,10 +94,264 @@ static void trim_buffer(darray** buf, size_t min_size_reserved)
     }
 }
 
-static void deactivate_conn(endpoint* conn)
+/*
+ * add whatever the protocol layer put on the write buffer since the last
+ * call to the end of the write queue
+ */
+static void queue_write_buffer(endpoint* conn)
+{
+    size_t len = darray_get_len(conn->pconn.write_buffer);
+    if (len == conn->write_queued_len) return;
+    hhassert(len > conn->write_queued_len);
+
+    size_t num_segs = darray_get_len(conn->write_queue);
+    endpoint_write_seg* last = (num_segs > conn->write_queue_head) ?
+        darray_get_last_addr(conn->write_queue) : NULL;
+
+    if (last != NULL && last->data == NULL &&
+        last->pos + last->len == conn->write_queued_len)
+    {
+        /* still contiguous with the last segment, just grow it */
+        last->len += len - conn->write_queued_len;
+    }
+    else
+    {
+        endpoint_write_seg seg;
+        seg.data = NULL;
+        seg.pos = conn->write_queued_len;
+        seg.len = len - conn->write_queued_len;
+        seg.on_release = NULL;
+        seg.release_ptr = NULL;
+        seg.release_data = NULL;
+        seg.chunk = NULL;
+        darray_append(&conn->write_queue, &seg, 1);
+    }
+
+    conn->write_unsent_len += len - conn->write_queued_len;
+    conn->write_queued_len = len;
+}
+
+static void queue_write_ref(endpoint* conn, const char* data, size_t len,
+                            endpoint_on_release* on_release,
+                            const char* release_ptr, void* release_data)
+{
+    /* everything already on the write buffer goes out first */
+    queue_write_buffer(conn);
+
+    endpoint_write_seg seg;
+    seg.data = data;
+    seg.pos = 0;
+    seg.len = len;
+    seg.on_release = on_release;
+    seg.release_ptr = release_ptr;
+    seg.release_data = release_data;
+    seg.chunk = NULL;
+    darray_append(&conn->write_queue, &seg, 1);
+    conn->write_unsent_len += len;
+}
+
+/* a segment is out of the queue, let go of whatever it was holding on to */
+static void release_seg(endpoint* conn, endpoint_write_seg* seg)
 {
-    size_t min_size_reserved = conn->pconn.settings->init_buf_len;
+    if (seg->on_release != NULL)
+    {
+        seg->on_release(seg->release_ptr, seg->release_data);
+    }
+    if (seg->chunk != NULL)
+    {
+        bufpool_put(conn->pconn.pool, seg->chunk);
+    }
+}
 
+/*
+ * forget everything on the write queue, letting the owners of any payloads
+ * that didn't get written know they can have them back
+ */
+static void release_write_queue(endpoint* conn)
+{
+    if (conn->write_queue != NULL)
+    {
+        while (conn->write_queue_head < darray_get_len(conn->write_queue))
+        {
+            endpoint_write_seg* seg = darray_get_elem_addr(
+                conn->write_queue, conn->write_queue_head);
+            conn->write_queue_head++;
+            release_seg(conn, seg);
+        }
+
+        darray_clear(conn->write_queue);
+    }
+
+    conn->write_queue_head = 0;
+    conn->write_seg_pos = 0;
+    conn->write_queued_len = 0;
+    conn->write_unsent_len = 0;
+    conn->write_pos = 0;
+}
+
+/* point iov at the unwritten segments. returns the number filled in */
+static int fill_write_iovecs(endpoint* conn, struct iovec* iov, int max_iov)
+{
+    char* buf = darray_get_data(conn->pconn.write_buffer);
+    endpoint_write_seg* segs = darray_get_data(conn->write_queue);
+    size_t num_segs = darray_get_len(conn->write_queue);
+    size_t seg_pos = conn->write_seg_pos;
+    int num_iov = 0;
+
+    for (size_t i = conn->write_queue_head;
+         i < num_segs && num_iov < max_iov; i++)
+    {
+        endpoint_write_seg* seg = &segs[i];
+        const char* base = (seg->data != NULL) ? seg->data : &buf[seg->pos];
+
+        iov[num_iov].iov_base = (char*)&base[seg_pos];
+        iov[num_iov].iov_len = seg->len - seg_pos;
+        num_iov++;
+        seg_pos = 0;
+    }
+
+    return num_iov;
+}
+
+/*
+ * move the head of the write queue past num_written bytes, releasing
+ * payloads that are now completely written. empty segments at the head
+ * are always skipped
+ */
+static void advance_write_queue(endpoint* conn, size_t num_written)
+{
+    hhassert(num_written <= conn->write_unsent_len);
+    conn->write_unsent_len -= num_written;
+
+    while (conn->write_queue_head < darray_get_len(conn->write_queue))
+    {
+        endpoint_write_seg* seg =
+            darray_get_elem_addr(conn->write_queue, conn->write_queue_head);
+        size_t left = seg->len - conn->write_seg_pos;
+        bool in_buffer = (seg->data == NULL);
+
+        if (num_written < left)
+        {
+            conn->write_seg_pos += num_written;
+            if (in_buffer) conn->write_pos += num_written;
+            break;
+        }
+
+        num_written -= left;
+        if (in_buffer) conn->write_pos += left;
+        conn->write_seg_pos = 0;
+        conn->write_queue_head++;
+        release_seg(conn, seg);
+    }
+}
+
+/* drop the segments that have been written from the front of the queue */
+static void compact_write_queue(endpoint* conn)
+{
+    darray_remove(conn->write_queue, 0, (ssize_t)conn->write_queue_head);
+    conn->write_queue_head = 0;
+}
+
+/*
+ * make sure frames can be added to the write buffer without reallocating
+ * more than a chunk's worth of it. a full one that's still being written
+ * moves onto the write queue and a new one takes its place
+ */
+static int prepare_write_buffer(endpoint* conn)
+{
+    protocol_conn* pconn = &conn->pconn;
+    size_t len = darray_get_len(pconn->write_buffer);
+    if (len == conn->write_pos)
+    {
+        /* all of it's been written, start over at the front */
+        darray_clear(pconn->write_buffer);
+        conn->write_queued_len = 0;
+        conn->write_pos = 0;
+        return 0;
+    }
+
+    if (len < ENDPOINT_WRITE_CHUNK_LENGTH) return 0;
+
+    darray* fresh = bufpool_get(pconn->pool, sizeof(char),
+                                (size_t)pconn->settings->init_buf_len);
+    if (fresh == NULL) return -1;
+
+    /*
+     * the segments still to go point straight at the old buffer now, and
+     * the last of them gives it back
+     */
+    queue_write_buffer(conn);
+    darray* chunk = pconn->write_buffer;
+    const char* buf = darray_get_data(chunk);
+    endpoint_write_seg* segs = darray_get_data(conn->write_queue);
+    endpoint_write_seg* last = NULL;
+    for (size_t i = conn->write_queue_head;
+         i < darray_get_len(conn->write_queue); i++)
+    {
+        if (segs[i].data != NULL) continue;
+        segs[i].data = &buf[segs[i].pos];
+        segs[i].pos = 0;
+        last = &segs[i];
+    }
+    hhassert(last != NULL);
+    last->chunk = chunk;
+
+    pconn->write_buffer = fresh;
+    conn->write_queued_len = 0;
+    conn->write_pos = 0;
+    return 0;
+}
+
+/*
+ * make sure the buffers for reading and writing are there. connections
+ * only hold them while they have something in them
+ */
+static int acquire_buffers(endpoint* conn)
+{
+    if (conn->write_queue == NULL)
+    {
+        conn->write_queue = bufpool_get(conn->pconn.pool,
+                                        sizeof(endpoint_write_seg), 8);
+        if (conn->write_queue == NULL) return -1;
+    }
+
+    return protocol_acquire_buffers(&conn->pconn);
+}
+
+static void release_buffers(endpoint* conn)
+{
+    release_write_queue(conn);
+    bufpool_put(conn->pconn.pool, conn->write_queue);
+    conn->write_queue = NULL;
+    protocol_release_buffers(&conn->pconn);
+}
+
+/*
+ * give the buffers back if the connection is between messages with nothing
+ * left to write. a close in progress keeps them, the close reason points
+ * into the read buffer. so does a streamed frame, which leaves nothing in
+ * the read buffer while the rest of it is still on the way
+ */
+static void release_idle_buffers(endpoint* conn)
+{
+    protocol_conn* pconn = &conn->pconn;
+    if (pconn->read_buffer == NULL ||
+        pconn->state != PROTOCOL_STATE_CONNECTED ||
+        conn->close_received || conn->close_send_pending ||
+        darray_get_len(pconn->read_buffer) > 0 ||
+        protocol_get_pending_read_len(pconn) > 0 ||
+        darray_get_len(pconn->write_buffer) > 0 ||
+        conn->write_queue_head < darray_get_len(conn->write_queue))
+    {
+        return;
+    }
+
+    hhassert(conn->read_pos == 0);
+    release_buffers(conn);
+}
+
+static void deactivate_conn(endpoint* conn)
+{
     if (conn->callbacks->on_close != NULL)
     {
         conn->callbacks->on_close(conn, conn->pconn.error_code,
@@ -76,16 +360,25 @@ static void deactivate_conn(endpoint* conn)
                                   conn->userdata);
     }
 
-    /* It's possible the on_close callback called endpoint_reset */
-    if (conn->pconn.read_buffer != NULL && conn->pconn.write_buffer != NULL)
-    {
-        /* release memory back to the system */
-        darray_clear(conn->pconn.read_buffer);
-        darray_trim_reserved(&conn->pconn.read_buffer, min_size_reserved);
+    /*
+     * nothing more is getting written, hand back any queued payloads, and
+     * the memory this connection was using
+     */
+    release_buffers(conn);
+    protocol_release_handshake(&conn->pconn);
+}
 
-        darray_clear(conn->pconn.write_buffer);
-        darray_trim_reserved(&conn->pconn.write_buffer, min_size_reserved);
+size_t endpoint_get_buffered_bytes(endpoint* conn)
+{
+    /* the protocol layer may have framed things that aren't queued yet */
+    size_t unqueued = 0;
+    if (conn->pconn.write_buffer != NULL)
+    {
+        unqueued = darray_get_len(conn->pconn.write_buffer) -
+                   conn->write_queued_len;
     }
+
+    return conn->write_unsent_len + unqueued;
 }
 
 endpoint_write_result endpoint_write(endpoint* conn, int fd)
@@ -93,30 +386,50 @@ endpoint_write_result endpoint_write(endpoint* conn, int fd)
     endpoint_write_result result = ENDPOINT_WRITE_CONTINUE;
     protocol_conn* pconn = &conn->pconn;
 
-    char* out_buf = darray_get_data(pconn->write_buffer);
-    size_t buf_len = darray_get_len(pconn->write_buffer);
     ssize_t num_written = 0;
-    ssize_t total_written = 0;
+    size_t total_written = 0;
 
-    while (conn->write_pos < buf_len)
+    if (acquire_buffers(conn) < 0)
     {
-        size_t len = buf_len - conn->write_pos;
-        num_written = write(fd, &out_buf[conn->write_pos], len);
+        hhlog(HHLOG_LEVEL_ERROR, "closing, out of memory. fd: %d", fd);
+        deactivate_conn(conn);
+        return ENDPOINT_WRITE_ERROR;
+    }
+
+    queue_write_buffer(conn);
+    advance_write_queue(conn, 0);
+    conn->write_blocked = false;
+
+    while (conn->write_queue_head < darray_get_len(conn->write_queue))
+    {
+        struct iovec iov[ENDPOINT_MAX_IOVECS];
+        int num_iov = fill_write_iovecs(conn, iov, ENDPOINT_MAX_IOVECS);
+        size_t iov_len = 0;
+        for (int i = 0; i < num_iov; i++) iov_len += iov[i].iov_len;
+
+        num_written = writev(fd, iov, num_iov);
         if (num_written <= 0) break;
 
-        if (num_written > 0)
+        hhlog(HHLOG_LEVEL_DEBUG_3, "WROTE %zd bytes", num_written);
+        advance_write_queue(conn, (size_t)num_written);
+        total_written += (size_t)num_written;
+
+        /* a short write means the socket buffer is full */
+        if ((size_t)num_written < iov_len)
         {
-            hhlog(HHLOG_LEVEL_DEBUG_3, "WROTE %lu bytes", buf_len -
-                        conn->write_pos);
+            conn->write_blocked = true;
+            break;
         }
-        conn->write_pos += (size_t)num_written;
-        total_written += num_written;
 
         /* don't want to block for too long here writing stuff... */
         if (total_written >= ENDPOINT_MAX_WRITE_LENGTH) break;
     }
 
-    if (num_written == -1)
+    if (num_written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        conn->write_blocked = true;
+    }
+    else if (num_written == -1)
     {
         hhlog(HHLOG_LEVEL_WARNING,
               "closing, error writing to endpoint. fd: %d, error: %s", fd,
@@ -124,7 +437,7 @@ endpoint_write_result endpoint_write(endpoint* conn, int fd)
         deactivate_conn(conn);
         return ENDPOINT_WRITE_ERROR;
     }
-    else if (conn->write_pos == buf_len)
+    else if (conn->write_queue_head == darray_get_len(conn->write_queue))
     {
         if (conn->close_send_pending) conn->close_sent = true;
 
@@ -146,24 +459,16 @@ endpoint_write_result endpoint_write(endpoint* conn, int fd)
              * and get rid of the write callback
              */
             darray_clear(pconn->write_buffer);
-            conn->write_pos = 0;
-            result = ENDPOINT_WRITE_DONE;
+            release_write_queue(conn);
+            release_idle_buffers(conn);
+            return ENDPOINT_WRITE_DONE;
         }
     }
 
-    if (pconn->settings->read_max_msg_size > 0 &&
-        darray_get_len(pconn->write_buffer) >
-        (uint64_t)pconn->settings->read_max_msg_size)
+    /* keep the queue from growing without end under a slow reader */
+    if (conn->write_queue_head > darray_get_len(conn->write_queue) / 2)
     {
-        /*
-         * don't let the write buffer get above the max the read buffer len
-         */
-        darray_slice(pconn->write_buffer, conn->write_pos, -1);
-        conn->write_pos = 0;
-
-        /* release some memory back, if necessary */
-        size_t min_size_reserved = conn->pconn.settings->init_buf_len;
-        trim_buffer(&conn->pconn.write_buffer, min_size_reserved);
+        compact_write_queue(conn);
     }
 
     return result;
@@ -199,6 +504,7 @@ static parse_result parse_endpoint_messages(endpoint* conn)
     parse_result pr = PARSE_CONTINUE;
     protocol_msg msg;
     endpoint_msg smsg;
+    endpoint_msg_chunk chunk;
     size_t parsed_start = 0;
     size_t parsed_end = 0;
 
@@ -226,6 +532,19 @@ static parse_result parse_endpoint_messages(endpoint* conn)
             case PROTOCOL_MSG_TEXT:
                 is_text = true; /* fallthru */
             case PROTOCOL_MSG_BINARY:
+                if (conn->pconn.stream_msgs)
+                {
+                    /* came in compressed, so it was put together anyway */
+                    chunk.is_text = is_text;
+                    chunk.start = true;
+                    chunk.final = true;
+                    chunk.data = msg.data;
+                    chunk.len = (size_t)msg.msg_len;
+                    conn->callbacks->on_message_chunk(conn, &chunk,
+                                                      conn->userdata);
+                    break;
+                }
+
                 smsg.data = msg.data;
                 smsg.msg_len = msg.msg_len;
                 smsg.is_text = is_text;
@@ -297,6 +616,21 @@ static parse_result parse_endpoint_messages(endpoint* conn)
             }
             parsed_end = conn->read_pos;
             break;
+        case PROTOCOL_RESULT_MESSAGE_CHUNK:
+            chunk.is_text = (msg.type == PROTOCOL_MSG_TEXT);
+            chunk.start = msg.chunk_start;
+            chunk.final = msg.chunk_final;
+            chunk.data = msg.data;
+            chunk.len = (size_t)msg.msg_len;
+            conn->callbacks->on_message_chunk(conn, &chunk, conn->userdata);
+
+            /* the piece is done with, it goes along with any messages */
+            if (parsed_end == 0)
+            {
+                parsed_start = msg.pos.full_msg_start_pos;
+            }
+            parsed_end = conn->read_pos;
+            break;
         case PROTOCOL_RESULT_CONTINUE:
         case PROTOCOL_RESULT_FRAME_FINISHED:
             /* we're still reading this message */
@@ -318,17 +652,23 @@ static parse_result parse_endpoint_messages(endpoint* conn)
      */
     if (parsed_start != parsed_end)
     {
-        hhassert(parsed_end > parsed_start);
+        size_t removed = protocol_remove_read(&conn->pconn, parsed_start,
+                                              parsed_end);
 
-        /* remove the range [parsed_start, parsed_end) from the read buffer */
-        darray_remove(conn->pconn.read_buffer, parsed_start, parsed_end);
+        /* the rest of the buffer moved back this far, if it moved at all */
+        hhassert(conn->read_pos >= parsed_end);
+        conn->read_pos -= removed;
 
-        /* release some memory back, if necessary */
-        size_t min_size_reserved = conn->pconn.settings->init_buf_len;
-        trim_buffer(&conn->pconn.read_buffer, min_size_reserved);
-
-        /* the rest of the buffer now lives at parsed_start */
-        conn->read_pos = parsed_start;
+        /*
+         * release some memory back, if necessary. not while a frame is
+         * still coming in, the next read would only need it again
+         */
+        if (conn->pconn.read_start == 0 &&
+            protocol_get_pending_read_len(&conn->pconn) == 0)
+        {
+            size_t min_size_reserved = conn->pconn.settings->init_buf_len;
+            trim_buffer(&conn->pconn.read_buffer, min_size_reserved);
+        }
     }
 
     return pr;
@@ -388,9 +728,63 @@ static endpoint_read_result read_handshake(endpoint* conn, int fd)
     return ENDPOINT_READ_SUCCESS;
 }
 
+/*
+ * size of the next read. grows toward whatever the frame being read still
+ * needs, so the kernel copies a large payload straight into place
+ */
+static size_t get_read_len(protocol_conn* pconn)
+{
+    size_t read_len = hhmax(protocol_get_pending_read_len(pconn),
+                            ENDPOINT_MIN_READ_LENGTH);
+    read_len = hhmin(read_len, ENDPOINT_MAX_READ_LENGTH);
+    return hhmin((size_t)pconn->settings->read_max_msg_size, read_len);
+}
+
+/* parse whatever was just read according to the state of the connection */
+static endpoint_read_result parse_read(endpoint* conn, int fd)
+{
+    protocol_conn* pconn = &conn->pconn;
+    endpoint_read_result r = ENDPOINT_READ_SUCCESS;
+    parse_result pr = PARSE_CONTINUE;
+    switch (pconn->state)
+    {
+    case PROTOCOL_STATE_READ_HANDSHAKE:
+        /* fd used only for logging, message is read off of buffers in conn */
+        r = read_handshake(conn, fd);
+
+        /*
+         * if the handshake read caused us to become connected, it's possible
+         * there are already messages to parse
+         */
+        if (r == ENDPOINT_READ_SUCCESS &&
+            pconn->state == PROTOCOL_STATE_CONNECTED)
+        {
+            pr = parse_endpoint_messages(conn);
+            r = parse_result_to_endpoint_read_result(pr);
+        }
+        break;
+    case PROTOCOL_STATE_WRITE_HANDSHAKE:
+        hhlog(HHLOG_LEVEL_WARNING,
+              "closing, tried to read when we were writing handshake: %d", fd);
+        deactivate_conn(conn);
+        r = ENDPOINT_READ_ERROR;
+        break;
+    case PROTOCOL_STATE_CONNECTED:
+        /*hhlog(HHLOG_LEVEL_DEBUG, "read %lu msg bytes", num_read);*/
+        pr = parse_endpoint_messages(conn);
+        r = parse_result_to_endpoint_read_result(pr);
+        break;
+    }
+
+    return r;
+}
+
 endpoint_read_result endpoint_read(endpoint* conn, int fd)
 {
     protocol_conn* pconn = &conn->pconn;
+    endpoint_read_result result = ENDPOINT_READ_SUCCESS;
+    size_t total_read = 0;
+    char spill[ENDPOINT_READ_SPILL_LENGTH];
 
     /*
      * we're trying to close the connection and we already heard the client
@@ -402,11 +796,133 @@ endpoint_read_result endpoint_read(endpoint* conn, int fd)
         return ENDPOINT_READ_CLOSED;
     }
 
-    size_t read_len = hhmin((size_t)pconn->settings->read_max_msg_size,
-                            ENDPOINT_MAX_READ_LENGTH);
-    char* buf = protocol_prepare_read(pconn, read_len);
+    if (acquire_buffers(conn) < 0)
+    {
+        hhlog(HHLOG_LEVEL_ERROR, "closing, out of memory. fd: %d", fd);
+        deactivate_conn(conn);
+        return ENDPOINT_READ_ERROR;
+    }
+
+    /*
+     * keep reading until the socket is drained or this connection has had
+     * its share of the event, parsing as we go so the read buffer doesn't
+     * have to hold everything at once
+     */
+    conn->read_blocked = false;
+    while (total_read < ENDPOINT_READ_BUDGET)
+    {
+        size_t read_len = get_read_len(pconn);
+
+        /*
+         * the handshake has a size limit of its own, don't pull in more
+         * than a buffer's worth of it at a time
+         */
+        int num_iov = 2;
+        size_t spill_len = sizeof(spill);
+        if (pconn->state == PROTOCOL_STATE_READ_HANDSHAKE)
+        {
+            num_iov = 1;
+            spill_len = 0;
+        }
+
+        struct iovec iov[2];
+        conn->read_pos -= protocol_compact_read(pconn, read_len);
+        iov[0].iov_base = protocol_prepare_read(pconn, read_len);
+        iov[0].iov_len = read_len;
+        iov[1].iov_base = spill;
+        iov[1].iov_len = spill_len;
 
-    ssize_t num_read = read(fd, buf, read_len);
+        ssize_t num_read = readv(fd, iov, num_iov);
+
+        if (num_read == -1)
+        {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                conn->read_blocked = true;
+                break;
+            }
+
+            hhlog(HHLOG_LEVEL_WARNING,
+                  "closing, error reading from endpoint. fd: %d, error: %s",
+                  fd, strerror(errno));
+            deactivate_conn(conn);
+            return ENDPOINT_READ_ERROR;
+        }
+        else if (num_read == 0)
+        {
+            hhlog(HHLOG_LEVEL_DEBUG,
+                  "closing, endpoint closed connection. fd: %d", fd);
+            deactivate_conn(conn);
+            return ENDPOINT_READ_ERROR;
+        }
+        /* else ... */
+
+        /*hhlog(HHLOG_LEVEL_DEBUG, "READ %lu bytes: %.*s", num_read,
+                  (int)num_read, buf);*/
+        hhlog(HHLOG_LEVEL_DEBUG_3, "READ %lu bytes", num_read);
+
+        hhassert(num_read > 0);
+        size_t num_tail = hhmin((size_t)num_read, read_len);
+        size_t num_spilled = (size_t)num_read - num_tail;
+        protocol_update_read(pconn, num_tail);
+        if (num_spilled > 0)
+        {
+            conn->read_pos -= protocol_compact_read(pconn, num_spilled);
+            char* buf = protocol_prepare_read(pconn, num_spilled);
+            memcpy(buf, spill, num_spilled);
+            protocol_update_read(pconn, num_spilled);
+        }
+        total_read += (size_t)num_read;
+
+        endpoint_read_result r = parse_read(conn, fd);
+        switch (r)
+        {
+        case ENDPOINT_READ_SUCCESS:
+            break;
+        case ENDPOINT_READ_SUCCESS_WROTE_DATA:
+            result = r;
+            break;
+        case ENDPOINT_READ_ERROR:
+        case ENDPOINT_READ_CLOSED:
+            return r;
+        }
+
+        /*
+         * a short read means the socket buffer was empty as of this call,
+         * so skip the readv that would only come back with EAGAIN
+         */
+        if ((size_t)num_read < read_len + spill_len)
+        {
+            conn->read_blocked = true;
+            break;
+        }
+
+        /*
+         * the handshake response or our close has to go out before we read
+         * any further
+         */
+        if (pconn->state == PROTOCOL_STATE_WRITE_HANDSHAKE ||
+            conn->close_send_pending)
+        {
+            break;
+        }
+    }
+
+    release_idle_buffers(conn);
+    return result;
+}
+
+endpoint_read_result endpoint_read_data(endpoint* conn, int fd,
+                                        const char* buf, ssize_t num_read)
+{
+    protocol_conn* pconn = &conn->pconn;
+
+    /* see endpoint_read */
+    if (conn->close_received)
+    {
+        return ENDPOINT_READ_CLOSED;
+    }
 
     if (num_read == -1)
     {
@@ -418,49 +934,30 @@ endpoint_read_result endpoint_read(endpoint* conn, int fd)
     }
     else if (num_read == 0)
     {
-        hhlog(HHLOG_LEVEL_DEBUG, "closing, endpoint closed connection. fd: %d",
-              fd);
+        hhlog(HHLOG_LEVEL_DEBUG,
+              "closing, endpoint closed connection. fd: %d", fd);
+        deactivate_conn(conn);
+        return ENDPOINT_READ_ERROR;
+    }
+
+    if (acquire_buffers(conn) < 0)
+    {
+        hhlog(HHLOG_LEVEL_ERROR, "closing, out of memory. fd: %d", fd);
         deactivate_conn(conn);
         return ENDPOINT_READ_ERROR;
     }
-    /* else ... */
 
-    /*hhlog(HHLOG_LEVEL_DEBUG, "READ %lu bytes: %.*s", num_read,
-              (int)num_read, buf);*/
     hhlog(HHLOG_LEVEL_DEBUG_3, "READ %lu bytes", num_read);
 
-    hhassert(num_read > 0);
-    protocol_update_read(pconn, (size_t)num_read);
+    size_t len = (size_t)num_read;
+    conn->read_pos -= protocol_compact_read(pconn, len);
+    memcpy(protocol_prepare_read(pconn, len), buf, len);
+    protocol_update_read(pconn, len);
 
-    endpoint_read_result r = ENDPOINT_READ_SUCCESS;
-    parse_result pr = PARSE_CONTINUE;
-    switch (pconn->state)
+    endpoint_read_result r = parse_read(conn, fd);
+    if (r == ENDPOINT_READ_SUCCESS || r == ENDPOINT_READ_SUCCESS_WROTE_DATA)
     {
-    case PROTOCOL_STATE_READ_HANDSHAKE:
-        /* fd used only for logging, message is read off of buffers in conn */
-        r = read_handshake(conn, fd);
-
-        /*
-         * if the handshake read caused us to become connected, it's possible
-         * there are already messages to parse
-         */
-        if (pconn->state == PROTOCOL_STATE_CONNECTED)
-        {
-            pr = parse_endpoint_messages(conn);
-            r = parse_result_to_endpoint_read_result(pr);
-        }
-        break;
-    case PROTOCOL_STATE_WRITE_HANDSHAKE:
-        hhlog(HHLOG_LEVEL_WARNING,
-              "closing, tried to read when we were writing handshake: %d", fd);
-        deactivate_conn(conn);
-        r = ENDPOINT_READ_ERROR;
-        break;
-    case PROTOCOL_STATE_CONNECTED:
-        /*hhlog(HHLOG_LEVEL_DEBUG, "read %lu msg bytes", num_read);*/
-        pr = parse_endpoint_messages(conn);
-        r = parse_result_to_endpoint_read_result(pr);
-        break;
+        release_idle_buffers(conn);
     }
 
     return r;
@@ -468,12 +965,14 @@ endpoint_read_result endpoint_read(endpoint* conn, int fd)
 
 static void endpoint_state_clear(endpoint* conn)
 {
-    conn->write_pos = 0;
+    release_write_queue(conn);
     conn->read_pos = 0;
     conn->close_received = false;
     conn->close_sent = false;
     conn->close_send_pending = false;
     conn->should_fail = false;
+    conn->read_blocked = false;
+    conn->write_blocked = false;
 }
 
 /* reset buffers etc but don't deallocate  */
@@ -492,6 +991,7 @@ endpoint_send_handshake_response(
 )
 {
     hhassert(conn->type == ENDPOINT_SERVER);
+    if (acquire_buffers(conn) < 0) return ENDPOINT_RESULT_FAIL;
 
     protocol_handshake_result hr;
     hr = protocol_write_handshake_response(&conn->pconn, protocol,
@@ -517,6 +1017,7 @@ endpoint_send_handshake_request(
 )
 {
     hhassert(conn->type == ENDPOINT_CLIENT);
+    if (acquire_buffers(conn) < 0) return ENDPOINT_RESULT_FAIL;
 
     protocol_handshake_result hr;
     hr = protocol_write_handshake_request(&conn->pconn, resource, host,
@@ -540,12 +1041,24 @@ int endpoint_init(endpoint* conn, endpoint_type type,
     int r = protocol_init_conn(&conn->pconn, &(settings->conn_settings), NULL);
     conn->callbacks = callbacks;
     conn->userdata = userdata;
+    conn->write_queue = NULL;
+    conn->write_queue_head = 0;
+    conn->pconn.stream_msgs = (callbacks->on_message_chunk != NULL);
     endpoint_state_clear(conn);
     return r;
 }
 
+/* take buffers from pool from now on. NULL for the heap */
+void endpoint_set_bufpool(endpoint* conn, bufpool* pool)
+{
+    protocol_set_bufpool(&conn->pconn, pool);
+}
+
 void endpoint_deinit(endpoint* conn)
 {
+    release_write_queue(conn);
+    bufpool_put(conn->pconn.pool, conn->write_queue);
+    conn->write_queue = NULL;
     protocol_deinit_conn(&conn->pconn);
 }
 
@@ -556,6 +1069,12 @@ static endpoint_result endpoint_send_pmsg(endpoint* conn, protocol_msg* pmsg)
         return ENDPOINT_RESULT_SUCCESS;
     }
 
+    if (acquire_buffers(conn) < 0 || prepare_write_buffer(conn) < 0)
+    {
+        hhlog(HHLOG_LEVEL_ERROR, "out of memory sending message");
+        return ENDPOINT_RESULT_FAIL;
+    }
+
     protocol_result pr;
 
     switch(conn->type)
@@ -594,6 +1113,93 @@ endpoint_result endpoint_send_msg(endpoint* conn, endpoint_msg* msg)
     return endpoint_send_pmsg(conn, &pmsg);
 }
 
+/* queue up a message that's sent from the caller's buffer without a copy */
+endpoint_result endpoint_send_msg_ref(endpoint* conn, endpoint_msg* msg,
+                                      endpoint_on_release* on_release,
+                                      void* release_data)
+{
+    protocol_msg pmsg;
+    pmsg.data = msg->data;
+    pmsg.msg_len = msg->msg_len;
+    pmsg.type = (msg->is_text) ? PROTOCOL_MSG_TEXT : PROTOCOL_MSG_BINARY;
+
+    if (conn->type == ENDPOINT_CLIENT || conn->close_send_pending ||
+        msg->msg_len < ENDPOINT_MIN_REF_LENGTH)
+    {
+        endpoint_result r = endpoint_send_pmsg(conn, &pmsg);
+        if (on_release != NULL) on_release(msg->data, release_data);
+        return r;
+    }
+
+    if (acquire_buffers(conn) < 0 || prepare_write_buffer(conn) < 0)
+    {
+        hhlog(HHLOG_LEVEL_ERROR, "out of memory sending message");
+        if (on_release != NULL) on_release(msg->data, release_data);
+        return ENDPOINT_RESULT_FAIL;
+    }
+
+    /*
+     * the frame headers go on the write buffer, each followed by a segment
+     * pointing at its slice of the payload. only the last segment releases
+     * the payload
+     */
+    protocol_result pr;
+    int64_t payload_pos = 0;
+    do
+    {
+        int64_t frame_len = 0;
+        pr = protocol_write_server_frame_hdr(&conn->pconn, &pmsg, payload_pos,
+                                             &frame_len);
+        if (pr == PROTOCOL_RESULT_FAIL)
+        {
+            /* bad messages are caught before anything is queued */
+            hhassert(payload_pos == 0);
+            hhlog(HHLOG_LEVEL_ERROR, "protocol_write_server_frame_hdr error");
+            if (on_release != NULL) on_release(msg->data, release_data);
+            return ENDPOINT_RESULT_FAIL;
+        }
+
+        bool last = (pr == PROTOCOL_RESULT_MESSAGE_FINISHED);
+        queue_write_ref(conn, &msg->data[payload_pos], (size_t)frame_len,
+                        last ? on_release : NULL, msg->data, release_data);
+        payload_pos += frame_len;
+    } while (pr != PROTOCOL_RESULT_MESSAGE_FINISHED);
+
+    return ENDPOINT_RESULT_SUCCESS;
+}
+
+/* queue up frames that are already encoded, without a copy */
+endpoint_result endpoint_send_frames_ref(endpoint* conn, const char* data,
+                                         size_t len,
+                                         endpoint_on_release* on_release,
+                                         void* release_data)
+{
+    hhassert(conn->type == ENDPOINT_SERVER);
+
+    if (conn->close_send_pending)
+    {
+        if (on_release != NULL) on_release(data, release_data);
+        return ENDPOINT_RESULT_SUCCESS;
+    }
+
+    if (acquire_buffers(conn) < 0 || prepare_write_buffer(conn) < 0)
+    {
+        hhlog(HHLOG_LEVEL_ERROR, "out of memory sending frames");
+        if (on_release != NULL) on_release(data, release_data);
+        return ENDPOINT_RESULT_FAIL;
+    }
+
+    if (len < ENDPOINT_MIN_REF_LENGTH)
+    {
+        darray_append(&conn->pconn.write_buffer, data, len);
+        if (on_release != NULL) on_release(data, release_data);
+        return ENDPOINT_RESULT_SUCCESS;
+    }
+
+    queue_write_ref(conn, data, len, on_release, data, release_data);
+    return ENDPOINT_RESULT_SUCCESS;
+}
+
 /* send a ping with payload (NULL for no payload)*/
 endpoint_result
 endpoint_send_ping(endpoint* conn, char* payload, int payload_len)
@@ -34,6 +34,7 @@
 #include "protocol.h"
 #include "util.h"
 #include <stdint.h>
+#include <sys/types.h>
 
 typedef enum
 {
@@ -48,17 +49,73 @@ typedef struct
 
 typedef struct endpoint_callbacks endpoint_callbacks;
 
+/*
+ * called once a buffer passed to endpoint_send_msg_ref has been completely
+ * written to the socket, or the connection it was queued on went away.
+ * after this, the buffer can be freed or reused
+ */
+typedef void (endpoint_on_release)(const char* data, void* release_data);
+
+/* a run of outgoing bytes waiting to be written to the socket */
+typedef struct
+{
+    const char* data; /* NULL if the bytes live in pconn.write_buffer */
+    size_t pos; /* offset into pconn.write_buffer, if data is NULL */
+    size_t len;
+    endpoint_on_release* on_release; /* NULL if nothing to release */
+    const char* release_ptr; /* start of the payload, for on_release */
+    void* release_data;
+
+    /*
+     * a full write buffer that was swapped out for a new one, given back
+     * once this segment, the last one pointing into it, is written
+     */
+    darray* chunk;
+} endpoint_write_seg;
+
 typedef struct
 {
     endpoint_type type;
     endpoint_callbacks* callbacks;
+
+    /* bytes of pconn.write_buffer that have been written to the socket */
     size_t write_pos;
+
+    /*
+     * endpoint_write_seg, in the order they go out. the segments cover all
+     * of pconn.write_buffer, with caller owned payloads and write buffers
+     * that filled up before it in between. NULL, like pconn's buffers, while
+     * there's nothing to read or write
+     */
+    darray* write_queue;
+
+    /* index of the first segment in write_queue that isn't fully written */
+    size_t write_queue_head;
+
+    /* bytes of the first segment that have been written */
+    size_t write_seg_pos;
+
+    /* bytes of pconn.write_buffer that are covered by write_queue */
+    size_t write_queued_len;
+
+    /* bytes on write_queue that haven't been written yet */
+    size_t write_unsent_len;
+
     size_t read_pos;
     protocol_conn pconn;
     bool close_received;
     bool close_sent;
     bool close_send_pending;
     bool should_fail;
+
+    /*
+     * the last endpoint_read emptied the socket, or the last endpoint_write
+     * filled it up. edge triggered loops won't report the socket again
+     * until that changes
+     */
+    bool read_blocked;
+    bool write_blocked;
+
     void* userdata;
 } endpoint;
 
@@ -92,10 +149,23 @@ typedef struct
     int64_t msg_len;
 } endpoint_msg;
 
+/* a piece of a text or binary message, see on_message_chunk */
+typedef struct
+{
+    bool is_text;
+    bool start; /* first piece of its message */
+    bool final; /* last piece of its message */
+    char* data; /* unmasked, only valid until the callback returns */
+    size_t len; /* may be 0 */
+} endpoint_msg_chunk;
+
 typedef bool (endpoint_on_connect)(endpoint* conn, protocol_conn* proto_conn,
                                    void* userdata);
 typedef void (endpoint_on_message)(endpoint* conn, endpoint_msg* msg,
                                    void* userdata);
+typedef void (endpoint_on_message_chunk)(endpoint* conn,
+                                         endpoint_msg_chunk* chunk,
+                                         void* userdata);
 typedef void (endpoint_on_ping)(endpoint* conn_info, char* payload,
                                 int payload_len, void* userdata);
 typedef void (endpoint_on_pong)(endpoint* conn_info, char* payload,
@@ -126,6 +196,16 @@ struct endpoint_callbacks
     /* called when a full message is received from a client */
     endpoint_on_message* on_message;
 
+    /*
+     * if set, text and binary messages are passed to this a piece at a
+     * time as they're read, instead of to on_message once they're all
+     * there. each piece is dropped from the read buffer right after, so
+     * a message doesn't have to fit in memory. text pieces may split a
+     * utf-8 character, the message as a whole is still validated. ones
+     * compressed with permessage-deflate come in a single piece
+     */
+    endpoint_on_message_chunk* on_message_chunk;
+
     /*
      * called when a ping was received.  a pong is always sent for you
      * automatically to conform to the RFC
@@ -150,6 +230,12 @@ int endpoint_init(endpoint* conn, endpoint_type type,
                   endpoint_settings* settings, endpoint_callbacks* callbacks,
                   void* userdata);
 
+/*
+ * take buffers from pool, NULL for the heap (the default). the endpoint only
+ * holds buffers while it's reading or writing something
+ */
+void endpoint_set_bufpool(endpoint* conn, bufpool* pool);
+
 /* deinitialize the endpoint */
 void endpoint_deinit(endpoint* conn);
 
@@ -178,6 +264,29 @@ endpoint_send_handshake_request(
 /* queue up a message to send on this connection */
 endpoint_result endpoint_send_msg(endpoint* conn, endpoint_msg* msg);
 
+/*
+ * queue up a message whose payload is written straight from msg->data
+ * instead of being copied. msg->data must stay valid and unchanged until
+ * on_release(msg->data, release_data) is called, which happens once the
+ * whole payload has been written or the connection is closed. small
+ * payloads are copied anyway and released before this returns, as are all
+ * payloads sent by clients, since their frames have to be masked
+ */
+endpoint_result endpoint_send_msg_ref(endpoint* conn, endpoint_msg* msg,
+                                      endpoint_on_release* on_release,
+                                      void* release_data);
+
+/*
+ * queue up len bytes of frames that were already encoded with
+ * protocol_encode_server_msg, written straight from data. the same data can
+ * be queued on any number of server endpoints. data is handed back through
+ * on_release like it is for endpoint_send_msg_ref
+ */
+endpoint_result endpoint_send_frames_ref(endpoint* conn, const char* data,
+                                         size_t len,
+                                         endpoint_on_release* on_release,
+                                         void* release_data);
+
 /* send a ping with payload (NULL for no payload)*/
 endpoint_result
 endpoint_send_ping(endpoint* conn, char* payload, int payload_len);
@@ -194,6 +303,12 @@ endpoint_result
 endpoint_close(endpoint* conn, uint16_t code, const char* reason,
                int reason_len);
 
+/*
+ * number of bytes that have been sent on this endpoint but not yet written
+ * to the socket
+ */
+size_t endpoint_get_buffered_bytes(endpoint* conn);
+
 /*
  * write data from endpoint to a ready socket
  */
@@ -204,5 +319,13 @@ endpoint_write_result endpoint_write(endpoint* conn, int fd);
  */
 endpoint_read_result endpoint_read(endpoint* conn, int fd);
 
+/*
+ * hand the endpoint data that was already read off of fd, for loops that do
+ * the reading themselves. num_read is what read(2) would have returned, with
+ * errno set when it's -1. buf is copied before anything is parsed
+ */
+endpoint_read_result endpoint_read_data(endpoint* conn, int fd,
+                                        const char* buf, ssize_t num_read);
+
 #endif /* __ENDPOINT_H_ */
 
@@ -46,6 +46,9 @@ typedef struct
     void* data;
     event_io_callback* read_callback;
     event_io_callback* write_callback;
+    int edge; /* registered with EVENT_EDGE_TRIGGERED */
+    int ready; /* edges seen since the last event_io_blocked, if edge */
+    int pending; /* fd is in the loop's pending list */
 } event_io;
 
 struct event_time
@@ -71,10 +74,25 @@ struct event_loop
     event_fired* fired_events; /* events that were just fired */
     int num_events; /* max size of io_events and fired_events */
     int max_fd; /* max fd in io_events; current size of io_events */
+
+    /*
+     * edge triggered fds that are still ready for something a callback is
+     * waiting on. the kernel won't report them again, so they're fired from
+     * here. firing is the list being worked through
+     */
+    int* pending;
+    int* firing;
+    int num_pending;
+
     void* platform_data; /* platform-specific polling API data */
     event_time_id id_counter;
     pqueue* time_events;
+    event_tick_callback* tick_callback;
+    void* tick_data;
     int stop;
+
+    uint64_t now_ms; /* sampled once per iteration, see event_get_time_ms */
+    int coarse_clock;
 };
 
 typedef enum
@@ -126,8 +144,11 @@ event_loop* event_create_loop(int max_io_events)
         hhmalloc(sizeof(*(loop->io_events)) * (size_t)max_io_events);
     loop->fired_events =
         hhmalloc(sizeof(*(loop->fired_events)) * (size_t)max_io_events);
+    loop->pending = hhmalloc(sizeof(*(loop->pending)) * (size_t)max_io_events);
+    loop->firing = hhmalloc(sizeof(*(loop->firing)) * (size_t)max_io_events);
 
-    if (loop->io_events == NULL || loop->fired_events == NULL)
+    if (loop->io_events == NULL || loop->fired_events == NULL ||
+        loop->pending == NULL || loop->firing == NULL)
     {
         goto create_error;
     }
@@ -136,7 +157,12 @@ event_loop* event_create_loop(int max_io_events)
 
     loop->num_events = max_io_events;
     loop->max_fd = -1;
+    loop->num_pending = 0;
+    loop->tick_callback = NULL;
+    loop->tick_data = NULL;
     loop->stop = 0;
+    loop->now_ms = hhclock_get_now_ms();
+    loop->coarse_clock = 0;
 
     if (event_platform_create(loop) != PLATFORM_RESULT_SUCCESS)
     {
@@ -151,6 +177,9 @@ event_loop* event_create_loop(int max_io_events)
         event->mask = EVENT_NONE;
         event->read_callback = NULL;
         event->write_callback = NULL;
+        event->edge = 0;
+        event->ready = EVENT_NONE;
+        event->pending = 0;
     }
 
     return loop;
@@ -160,6 +189,8 @@ create_error:
     {
         hhfree(loop->io_events);
         hhfree(loop->fired_events);
+        hhfree(loop->pending);
+        hhfree(loop->firing);
         hhfree(loop);
     }
 
@@ -171,6 +202,36 @@ void event_stop_loop(event_loop* loop)
     loop->stop = 1;
 }
 
+uint64_t event_get_time_ms(event_loop* loop)
+{
+    return loop->now_ms;
+}
+
+void event_set_coarse_clock(event_loop* loop, int coarse)
+{
+    loop->coarse_clock = coarse;
+}
+
+static uint64_t update_time(event_loop* loop)
+{
+    loop->now_ms = loop->coarse_clock ? hhclock_get_coarse_now_ms() :
+                                        hhclock_get_now_ms();
+    return loop->now_ms;
+}
+
+/*
+ * put an edge triggered fd on the pending list if it's ready for something
+ * a callback is waiting on
+ */
+static void queue_ready(event_loop* loop, event_io* event, int fd)
+{
+    if (event->edge && !event->pending && (event->mask & event->ready))
+    {
+        event->pending = 1;
+        loop->pending[loop->num_pending++] = fd;
+    }
+}
+
 event_result event_add_io_event(event_loop* loop, int fd, int mask,
                                 event_io_callback* callback, void* data)
 {
@@ -178,10 +239,23 @@ event_result event_add_io_event(event_loop* loop, int fd, int mask,
 
     event_io* event = &loop->io_events[fd];
 
-    if (event_platform_add(loop, fd, mask) != PLATFORM_RESULT_SUCCESS)
+    if (!EVENT_PLATFORM_EDGE_TRIGGERED) mask &= ~EVENT_EDGE_TRIGGERED;
+
+    /* edge triggered fds are only registered with the kernel once */
+    if (event->mask == EVENT_NONE || !event->edge)
     {
-        return EVENT_RESULT_PLATFORM_ERROR;
+        if (event_platform_add(loop, fd, mask) != PLATFORM_RESULT_SUCCESS)
+        {
+            return EVENT_RESULT_PLATFORM_ERROR;
+        }
+
+        if (event->mask == EVENT_NONE)
+        {
+            event->edge = (mask & EVENT_EDGE_TRIGGERED) != 0;
+            event->ready = EVENT_NONE;
+        }
     }
+    mask &= ~EVENT_EDGE_TRIGGERED;
 
     event->fd = fd;
     event->mask |= mask;
@@ -192,6 +266,9 @@ event_result event_add_io_event(event_loop* loop, int fd, int mask,
 
     if (loop->max_fd < fd) loop->max_fd = fd;
 
+    /* an edge that already came in won't come again */
+    queue_ready(loop, event, fd);
+
     return EVENT_RESULT_SUCCESS;
 }
 
@@ -202,6 +279,7 @@ void event_delete_io_event(event_loop* loop, int fd, int mask)
     event_io* event = &loop->io_events[fd];
     if (event->mask == EVENT_NONE) return; /* event already deleted... */
 
+    mask &= ~EVENT_EDGE_TRIGGERED;
     event->mask &= (~mask);
 
     if (fd == loop->max_fd && event->mask == EVENT_NONE)
@@ -215,7 +293,23 @@ void event_delete_io_event(event_loop* loop, int fd, int mask)
             }
         }
     }
-    event_platform_remove(loop, fd, mask);
+
+    /* edge triggered fds stay registered for everything until they're gone */
+    if (!event->edge || event->mask == EVENT_NONE)
+    {
+        event_platform_remove(loop, fd, mask);
+    }
+}
+
+/*
+ * a read or write on an edge triggered fd came back with EAGAIN, don't fire
+ * callbacks in mask again until the kernel reports it ready
+ */
+void event_io_blocked(event_loop* loop, int fd, int mask)
+{
+    if (fd >= loop->num_events) return;
+
+    loop->io_events[fd].ready &= ~mask;
 }
 
 event_time_id
@@ -265,11 +359,20 @@ void event_delete_time_event(event_loop* loop, event_time_id id)
     hhfree(et);
 }
 
+void event_set_tick_callback(event_loop* loop, event_tick_callback* callback,
+                             void* data)
+{
+    loop->tick_callback = callback;
+    loop->tick_data = data;
+}
+
 void event_destroy_loop(event_loop* loop)
 {
     event_platform_destroy(loop);
     hhfree(loop->io_events);
     hhfree(loop->fired_events);
+    hhfree(loop->pending);
+    hhfree(loop->firing);
 
     /* destroy all time events */
     pqueue* q = loop->time_events;
@@ -289,21 +392,50 @@ void event_destroy_loop(event_loop* loop)
     hhfree(loop);
 }
 
+static void fire_io_event(event_loop* loop, int fd, int fired_mask)
+{
+    event_io* event = &loop->io_events[fd];
+
+    /*
+     * Make sure to also check the original mask, it might have
+     * been cleared by a call to event_delete_io_event while processing
+     * a previous event.
+     */
+    int read_fired = 0;
+    if (event->mask & (fired_mask & EVENT_READABLE))
+    {
+        read_fired = 1;
+        event->read_callback(loop, fd, event->data);
+    }
+
+    if (event->mask & (fired_mask & EVENT_WRITEABLE))
+    {
+        if (!read_fired || event->read_callback != event->write_callback)
+        {
+            event->write_callback(loop, fd, event->data);
+        }
+    }
+
+    /* if the callbacks didn't run into EAGAIN, go again */
+    queue_ready(loop, event, fd);
+}
+
 static void event_process_all_events(event_loop* loop, int flags)
 {
     int time_ms;
     uint64_t now;
     event_time* et;
 
-    if (flags & EVENT_DONT_BLOCK)
+    if ((flags & EVENT_DONT_BLOCK) || loop->num_pending > 0)
     {
         /* blocking for 0 means don't block */
         time_ms = 0;
     }
     else if (pqueue_get_size(loop->time_events) > 0)
     {
+        /* only read the clock twice when we're about to block anyway */
         et = pqueue_peek(loop->time_events).p_val;
-        now = hhclock_get_now_ms();
+        now = update_time(loop);
         time_ms = (int)(et->next_fire_time_ms - now);
 
         /* don't block if somehow we went back to the future */
@@ -325,10 +457,12 @@ static void event_process_all_events(event_loop* loop, int flags)
         return;
     }
 
+    /* everything this iteration runs sees this time */
+    now = update_time(loop);
+
     /* fire time events */
     if (pqueue_get_size(loop->time_events) > 0)
     {
-        now = hhclock_get_now_ms();
         et = pqueue_peek(loop->time_events).p_val;
         while (now >= et->next_fire_time_ms)
         {
@@ -373,30 +507,32 @@ static void event_process_all_events(event_loop* loop, int flags)
     for (int i = 0; i < num_fired; i++)
     {
         event_fired* fired = &loop->fired_events[i];
-        int fd = fired->fd;
-        int fired_mask = fired->mask;
+        event_io* event = &loop->io_events[fired->fd];
+        if (event->edge) event->ready |= fired->mask;
 
-        event_io* event = &loop->io_events[fd];
+        fire_io_event(loop, fired->fd, fired->mask);
+    }
 
-        /*
-         * Make sure to also check the original mask, it might have
-         * been cleared by a call to event_delete_io_event while processing
-         * a previous event.
-         */
-        int read_fired = 0;
-        if (event->mask & (fired_mask & EVENT_READABLE))
-        {
-            read_fired = 1;
-            event->read_callback(loop, fd, event->data);
-        }
+    /*
+     * then edge triggered fds that are still ready, including writes queued
+     * up by the callbacks above. anything these queue waits for next time
+     */
+    int num_pending = loop->num_pending;
+    int* firing = loop->pending;
+    loop->pending = loop->firing;
+    loop->firing = firing;
+    loop->num_pending = 0;
+
+    for (int i = 0; i < num_pending; i++)
+    {
+        event_io* event = &loop->io_events[firing[i]];
+        event->pending = 0;
+        fire_io_event(loop, firing[i], event->ready);
+    }
 
-        if (event->mask & (fired_mask & EVENT_WRITEABLE))
-        {
-            if (!read_fired || event->read_callback != event->write_callback)
-            {
-                event->write_callback(loop, fd, event->data);
-            }
-        }
+    if (loop->tick_callback != NULL)
+    {
+        loop->tick_callback(loop, loop->tick_data);
     }
 }
 
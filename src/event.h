@@ -37,6 +37,16 @@
 #define EVENT_READABLE 1
 #define EVENT_WRITEABLE 2
 
+/*
+ * add to the mask the first time an fd is added to have it registered with
+ * the kernel once, for both read and write edges. after that, adding or
+ * deleting EVENT_READABLE and EVENT_WRITEABLE only picks which callbacks
+ * fire. callbacks keep firing while the fd is ready, call event_io_blocked
+ * when a read or write comes back with EAGAIN. ignored on platforms without
+ * edge triggered polling
+ */
+#define EVENT_EDGE_TRIGGERED 4
+
 /* flags for event_pump_events */
 #define EVENT_DONT_BLOCK 1
 
@@ -58,12 +68,14 @@ typedef struct event_time* event_time_id;
 typedef void (event_io_callback)(event_loop* loop, int fd, void* data);
 typedef void (event_time_callback)(event_loop* loop, event_time_id id,
                                    void* data);
+typedef void (event_tick_callback)(event_loop* loop, void* data);
 
 event_loop*     event_create_loop(int max_io_events);
 void            event_stop_loop(event_loop* loop);
 event_result    event_add_io_event(event_loop* loop, int fd, int mask,
                                    event_io_callback* callback, void* data);
 void            event_delete_io_event(event_loop* loop, int fd, int mask);
+void            event_io_blocked(event_loop* loop, int fd, int mask);
 event_time_id   event_add_time_event(event_loop* loop,
                                      event_time_callback* callback,
                                      uint64_t frequency_ms,
@@ -74,8 +86,28 @@ event_time_id   event_add_time_event_with_delay(event_loop* loop,
                                      uint64_t initial_delay_ms,
                                      void* data);
 void            event_delete_time_event(event_loop* loop, event_time_id id);
+
+/*
+ * callback is called once at the end of every loop iteration, after all the
+ * io and time callbacks for it have run. NULL removes it
+ */
+void            event_set_tick_callback(event_loop* loop,
+                                        event_tick_callback* callback,
+                                        void* data);
 void            event_destroy_loop(event_loop* loop);
 
+/*
+ * the time in ms when the loop woke up for this iteration, on the same clock
+ * as hhclock_get_now_ms. saves callbacks from each reading the clock
+ */
+uint64_t        event_get_time_ms(event_loop* loop);
+
+/*
+ * set to 1 to sample the loop's time from the coarse monotonic clock where
+ * there is one. cheaper, but only as precise as the kernel's tick
+ */
+void            event_set_coarse_clock(event_loop* loop, int coarse);
+
 /* This function blocks until an event calls event_stop_loop */
 void            event_pump_events(event_loop* loop, int flags);
 
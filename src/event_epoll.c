@@ -32,6 +32,9 @@
 #include <sys/epoll.h>
 #include <string.h>
 
+/* EVENT_EDGE_TRIGGERED is supported */
+#define EVENT_PLATFORM_EDGE_TRIGGERED 1
+
 typedef struct
 {
     int epollfd;
@@ -89,6 +92,12 @@ static event_platform_result event_platform_add(event_loop* loop, int fd,
     if (mask & EVENT_READABLE) epevent.events |= EPOLLIN;
     if (mask & EVENT_WRITEABLE) epevent.events |= EPOLLOUT;
 
+    /* registered for everything at once, see EVENT_EDGE_TRIGGERED */
+    if (mask & EVENT_EDGE_TRIGGERED)
+    {
+        epevent.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    }
+
     epevent.data.fd = fd;
     if (epoll_ctl(state->epollfd, op, fd, &epevent) == -1)
     {
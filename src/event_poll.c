@@ -31,6 +31,9 @@
 
 #include <poll.h>
 
+/* poll only does level triggered, EVENT_EDGE_TRIGGERED is ignored */
+#define EVENT_PLATFORM_EDGE_TRIGGERED 0
+
 typedef struct platform_state
 {
     struct pollfd* poll_fds;
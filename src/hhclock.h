@@ -27,6 +27,10 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+
+#ifndef HHCLOCK_H__
+#define HHCLOCK_H__
+
 #include "platform.h"
 
 #include <stdint.h>
@@ -46,3 +50,21 @@ static inline uint64_t hhclock_get_now_ms(void)
 #endif
 }
 
+/*
+ * same clock as hhclock_get_now_ms, but only as precise as the kernel's tick
+ * (a few ms) in exchange for being cheaper to read. falls back to
+ * hhclock_get_now_ms where there's no coarse clock
+ */
+static inline uint64_t hhclock_get_coarse_now_ms(void)
+{
+#if defined(HAVE_MONOTONIC_CLOCK) && defined(CLOCK_MONOTONIC_COARSE)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t)((uint64_t)now.tv_sec*1000 +
+                         (uint64_t)now.tv_nsec/1000000);
+#else
+    return hhclock_get_now_ms();
+#endif
+}
+
+#endif /* HHCLOCK_H__ */
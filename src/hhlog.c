@@ -86,12 +86,13 @@ void hhlog_log__(hhlog_level level, const char* filename, int line, ...)
     char buffer[ENDPOINT_MAX_LOG_LENGTH];
 
     struct timeval tv;
+    struct tm tm; /* localtime isn't safe with server loop threads */
     char time_buffer[64];
     gettimeofday(&tv, NULL);
     size_t sz = sizeof(time_buffer);
     int n = (int)strftime(time_buffer, sz,
         "%d %b %H:%M:%S.",
-        localtime(&tv.tv_sec)
+        localtime_r(&tv.tv_sec, &tm)
     );
     size_t num_written = hhmin((size_t)n, sz);
 
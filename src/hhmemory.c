@@ -29,26 +29,352 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <stdlib.h>
 #include "hhmemory.h"
+#include "hhassert.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+/* every block starts with a header holding how many bytes it has for use */
+#define HDR_LEN 16
+
+/* size classes go four to a power of two, from 4 KB to 1 MB */
+#define MIN_CLASS_SHIFT 12
+#define MAX_CLASS_SHIFT 20
+#define CLASS_STEP_BITS 2
+#define CLASSES_PER_SHIFT (1 << CLASS_STEP_BITS)
+#define NUM_CLASSES \
+    ((MAX_CLASS_SHIFT - MIN_CLASS_SHIFT) * CLASSES_PER_SHIFT + 1)
+#define MIN_CLASS_SIZE ((size_t)1 << MIN_CLASS_SHIFT)
+#define MAX_CLASS_SIZE ((size_t)1 << MAX_CLASS_SHIFT)
+
+/* most bytes a thread caches of any one size class */
+#define MAX_CACHED_CLASS_BYTES (1024 * 1024)
+
+#define DEFAULT_THREAD_CACHE_LIMIT (8 * 1024 * 1024)
+
+/*
+ * stats are only written by the thread that owns them, but read by
+ * hhmemory_get_stats from any thread
+ */
+#define STAT_ADD(cache, field, n) \
+    __atomic_store_n(&(cache)->stats.field, (cache)->stats.field + (n), \
+                     __ATOMIC_RELAXED)
+
+typedef struct thread_cache thread_cache;
+struct thread_cache
+{
+    void* free[NUM_CLASSES]; /* freed blocks, linked through their data */
+    size_t num_free[NUM_CLASSES];
+    hhmemory_stats stats;
+    thread_cache* next; /* in g_caches */
+    thread_cache* prev; /* in g_caches */
+};
+
+static hhmemory_allocator g_allocator = { malloc, realloc, free };
+static size_t g_thread_cache_limit = DEFAULT_THREAD_CACHE_LIMIT;
+
+static pthread_once_t g_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_key;
+static bool g_key_valid = false;
+
+/* all live thread caches and the totals of exited threads */
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_cache* g_caches = NULL;
+static hhmemory_stats g_retired_stats;
+
+static __thread thread_cache* t_cache = NULL;
+
+static bool is_class_size(size_t size)
+{
+    return size >= MIN_CLASS_SIZE && size <= MAX_CLASS_SIZE;
+}
+
+/* the smallest size class that holds size bytes */
+static int size_class(size_t size)
+{
+    hhassert(is_class_size(size));
+    if (size == MIN_CLASS_SIZE) return 0;
+
+    size_t s = size - 1;
+    int shift = 63 - __builtin_clzll((unsigned long long)s);
+    int step = (int)(s >> (shift - CLASS_STEP_BITS)) & (CLASSES_PER_SHIFT - 1);
+    return (shift - MIN_CLASS_SHIFT) * CLASSES_PER_SHIFT + step + 1;
+}
+
+static size_t class_size(int c)
+{
+    if (c == 0) return MIN_CLASS_SIZE;
+
+    int shift = MIN_CLASS_SHIFT + (c - 1) / CLASSES_PER_SHIFT;
+    int step = (c - 1) % CLASSES_PER_SHIFT;
+    return ((size_t)1 << shift) +
+           (size_t)(step + 1) * ((size_t)1 << (shift - CLASS_STEP_BITS));
+}
+
+static size_t get_usable(const void* ptr)
+{
+    size_t usable;
+    memcpy(&usable, (const char*)ptr - HDR_LEN, sizeof(usable));
+    return usable;
+}
+
+static void* set_usable(char* block, size_t usable)
+{
+    memcpy(block, &usable, sizeof(usable));
+    return block + HDR_LEN;
+}
+
+static void add_stats(hhmemory_stats* dest, const hhmemory_stats* src)
+{
+    dest->num_allocs += __atomic_load_n(&src->num_allocs, __ATOMIC_RELAXED);
+    dest->num_frees += __atomic_load_n(&src->num_frees, __ATOMIC_RELAXED);
+    dest->num_reallocs +=
+        __atomic_load_n(&src->num_reallocs, __ATOMIC_RELAXED);
+    dest->num_reallocs_in_place +=
+        __atomic_load_n(&src->num_reallocs_in_place, __ATOMIC_RELAXED);
+    dest->num_cache_hits +=
+        __atomic_load_n(&src->num_cache_hits, __ATOMIC_RELAXED);
+    dest->num_cache_misses +=
+        __atomic_load_n(&src->num_cache_misses, __ATOMIC_RELAXED);
+
+    /* per thread this wraps when blocks are freed on another thread */
+    dest->bytes_in_use +=
+        __atomic_load_n(&src->bytes_in_use, __ATOMIC_RELAXED);
+    dest->bytes_cached +=
+        __atomic_load_n(&src->bytes_cached, __ATOMIC_RELAXED);
+}
+
+static void release_cache(thread_cache* cache)
+{
+    for (int c = 0; c < NUM_CLASSES; c++)
+    {
+        while (cache->free[c] != NULL)
+        {
+            void* ptr = cache->free[c];
+            memcpy(&cache->free[c], ptr, sizeof(void*));
+            g_allocator.free_fn((char*)ptr - HDR_LEN);
+        }
+        cache->num_free[c] = 0;
+    }
+    __atomic_store_n(&cache->stats.bytes_cached, 0, __ATOMIC_RELAXED);
+}
+
+/* runs as the thread exits */
+static void destroy_cache(void* data)
+{
+    thread_cache* cache = data;
+    t_cache = NULL;
+    release_cache(cache);
+
+    pthread_mutex_lock(&g_lock);
+    if (cache->prev != NULL) cache->prev->next = cache->next;
+    else g_caches = cache->next;
+    if (cache->next != NULL) cache->next->prev = cache->prev;
+    add_stats(&g_retired_stats, &cache->stats);
+    pthread_mutex_unlock(&g_lock);
+
+    g_allocator.free_fn(cache);
+}
+
+static void create_key(void)
+{
+    g_key_valid = (pthread_key_create(&g_key, destroy_cache) == 0);
+}
+
+/* NULL if the thread can't have a cache, it then goes without */
+static thread_cache* get_cache(void)
+{
+    thread_cache* cache = t_cache;
+    if (cache != NULL) return cache;
+
+    pthread_once(&g_key_once, create_key);
+    if (!g_key_valid) return NULL;
+
+    cache = g_allocator.malloc_fn(sizeof(*cache));
+    if (cache == NULL) return NULL;
+    memset(cache, 0, sizeof(*cache));
+
+    if (pthread_setspecific(g_key, cache) != 0)
+    {
+        g_allocator.free_fn(cache);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&g_lock);
+    cache->next = g_caches;
+    if (g_caches != NULL) g_caches->prev = cache;
+    g_caches = cache;
+    pthread_mutex_unlock(&g_lock);
+
+    t_cache = cache;
+    return cache;
+}
+
+static void* alloc_block(thread_cache* cache, size_t size)
+{
+    /* no room left for the header, like malloc(SIZE_MAX) */
+    if (size > (size_t)-1 - HDR_LEN) return NULL;
+
+    size_t usable = size;
+    if (is_class_size(size))
+    {
+        int c = size_class(size);
+        usable = class_size(c);
+
+        if (cache != NULL && cache->free[c] != NULL)
+        {
+            void* ptr = cache->free[c];
+            memcpy(&cache->free[c], ptr, sizeof(void*));
+            cache->num_free[c]--;
+            STAT_ADD(cache, bytes_cached, -usable);
+            STAT_ADD(cache, num_cache_hits, 1);
+            STAT_ADD(cache, num_allocs, 1);
+            STAT_ADD(cache, bytes_in_use, usable);
+            return ptr;
+        }
+
+        if (cache != NULL) STAT_ADD(cache, num_cache_misses, 1);
+    }
+
+    char* block = g_allocator.malloc_fn(HDR_LEN + usable);
+    if (block == NULL) return NULL;
+
+    if (cache != NULL)
+    {
+        STAT_ADD(cache, num_allocs, 1);
+        STAT_ADD(cache, bytes_in_use, usable);
+    }
+    return set_usable(block, usable);
+}
+
+static void free_block(thread_cache* cache, void* ptr)
+{
+    size_t usable = get_usable(ptr);
+    if (cache != NULL)
+    {
+        STAT_ADD(cache, num_frees, 1);
+        STAT_ADD(cache, bytes_in_use, -usable);
+    }
+
+    if (cache != NULL && is_class_size(usable))
+    {
+        int c = size_class(usable);
+        size_t limit = __atomic_load_n(&g_thread_cache_limit,
+                                       __ATOMIC_RELAXED);
+        if ((cache->num_free[c] + 1) * usable <= MAX_CACHED_CLASS_BYTES &&
+            cache->stats.bytes_cached + usable <= limit)
+        {
+            memcpy(ptr, &cache->free[c], sizeof(void*));
+            cache->free[c] = ptr;
+            cache->num_free[c]++;
+            STAT_ADD(cache, bytes_cached, usable);
+            return;
+        }
+    }
+
+    g_allocator.free_fn((char*)ptr - HDR_LEN);
+}
 
 void* hhmalloc(size_t size)
 {
-    return malloc(size);
+    return alloc_block(get_cache(), size);
 }
 
 void* hhcalloc(size_t nmemb, size_t size)
 {
-    return calloc(nmemb, size);
+    if (size != 0 && nmemb > ((size_t)-1 - HDR_LEN) / size) return NULL;
+
+    void* ptr = hhmalloc(nmemb * size);
+    if (ptr != NULL) memset(ptr, 0, nmemb * size);
+    return ptr;
 }
 
 void* hhrealloc(void* ptr, size_t size)
 {
-    return realloc(ptr, size);
+    if (ptr == NULL) return hhmalloc(size);
+
+    thread_cache* cache = get_cache();
+    size_t usable = get_usable(ptr);
+    if (cache != NULL) STAT_ADD(cache, num_reallocs, 1);
+
+    if (is_class_size(usable))
+    {
+        /*
+         * keep the block unless it's too small, or it would be more than
+         * half empty. darrays trimmed back down then only move when it
+         * gives back real memory, and when they do it's to a cached block
+         */
+        if (size <= usable && size > usable / 2)
+        {
+            if (cache != NULL) STAT_ADD(cache, num_reallocs_in_place, 1);
+            return ptr;
+        }
+    }
+    else if (!is_class_size(size))
+    {
+        /* neither size has a class, the allocator underneath does better */
+        if (size > (size_t)-1 - HDR_LEN) return NULL;
+
+        char* block = g_allocator.realloc_fn((char*)ptr - HDR_LEN,
+                                             HDR_LEN + size);
+        if (block == NULL) return NULL;
+
+        if (cache != NULL) STAT_ADD(cache, bytes_in_use, size - usable);
+        return set_usable(block, size);
+    }
+
+    void* new_ptr = alloc_block(cache, size);
+    if (new_ptr == NULL) return NULL;
+
+    memcpy(new_ptr, ptr, (size < usable) ? size : usable);
+    free_block(cache, ptr);
+    return new_ptr;
 }
 
 void hhfree(void* ptr)
 {
-    free(ptr);
+    if (ptr == NULL) return;
+    free_block(get_cache(), ptr);
 }
 
+void hhmemory_set_allocator(const hhmemory_allocator* allocator)
+{
+    hhmemory_release_thread_cache();
+
+    if (allocator == NULL)
+    {
+        g_allocator.malloc_fn = malloc;
+        g_allocator.realloc_fn = realloc;
+        g_allocator.free_fn = free;
+        return;
+    }
+
+    hhassert(allocator->malloc_fn != NULL && allocator->realloc_fn != NULL &&
+             allocator->free_fn != NULL);
+    g_allocator = *allocator;
+}
+
+void hhmemory_set_thread_cache_limit(size_t max_bytes)
+{
+    __atomic_store_n(&g_thread_cache_limit, max_bytes, __ATOMIC_RELAXED);
+}
+
+void hhmemory_release_thread_cache(void)
+{
+    if (t_cache != NULL) release_cache(t_cache);
+}
+
+void hhmemory_get_stats(hhmemory_stats* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_lock(&g_lock);
+    add_stats(stats, &g_retired_stats);
+    for (thread_cache* cache = g_caches; cache != NULL; cache = cache->next)
+    {
+        add_stats(stats, &cache->stats);
+    }
+    pthread_mutex_unlock(&g_lock);
+}
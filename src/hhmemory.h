@@ -32,11 +32,57 @@
 #ifndef __HHMEMORY_H__
 #define __HHMEMORY_H__
 
+#include <stdint.h>
 #include <stdlib.h>
 
+/*
+ * blocks from 4 KB to 1 MB are rounded up to a size class, and freed ones
+ * are kept in a cache local to the freeing thread to hand out again before
+ * asking the allocator underneath for more
+ */
+
+/* what hhmemory gets its memory from */
+typedef struct
+{
+    void* (*malloc_fn)(size_t size);
+    void* (*realloc_fn)(void* ptr, size_t size);
+    void (*free_fn)(void* ptr);
+} hhmemory_allocator;
+
+typedef struct
+{
+    uint64_t num_allocs; /* blocks handed out, including by moving reallocs */
+    uint64_t num_frees; /* blocks given back, including by moving reallocs */
+    uint64_t num_reallocs;
+    uint64_t num_reallocs_in_place; /* reallocs that kept their block */
+    uint64_t num_cache_hits; /* size class allocs served from a cache */
+    uint64_t num_cache_misses; /* size class allocs that went underneath */
+    size_t bytes_in_use; /* handed out and not freed yet */
+    size_t bytes_cached; /* freed, but held in thread caches */
+} hhmemory_stats;
+
 void* hhmalloc(size_t size);
 void* hhcalloc(size_t nmemb, size_t size);
 void* hhrealloc(void* ptr, size_t size);
 void hhfree(void* ptr);
 
+/*
+ * get memory from allocator instead of the C library. only call this
+ * before anything has been allocated, a block has to go back to the
+ * allocator it came from. NULL goes back to the C library
+ */
+void hhmemory_set_allocator(const hhmemory_allocator* allocator);
+
+/*
+ * most bytes each thread's cache may hold, 8 MB by default. 0 turns the
+ * caches off
+ */
+void hhmemory_set_thread_cache_limit(size_t max_bytes);
+
+/* give everything the calling thread has cached back to the allocator */
+void hhmemory_release_thread_cache(void);
+
+/* totals over all threads, including ones that have exited */
+void hhmemory_get_stats(hhmemory_stats* stats);
+
 #endif /* __HHMEMORY_H__ */
@@ -32,11 +32,21 @@
 #ifndef ILOOP_H__
 #define ILOOP_H__
 
+#include <sys/types.h>
+
 /* flags for mask in add_io_event_cb */
 #define ILOOP_NONE 0
 #define ILOOP_READABLE 1
 #define ILOOP_WRITEABLE 2
 
+/*
+ * add_io mask flag, only looked at the first time an fd is added. the loop
+ * may register the fd once for everything and only report edges. callbacks
+ * for it keep getting called until io_blocked says a read or write ran into
+ * EAGAIN. loops that don't do this ignore the flag
+ */
+#define ILOOP_EDGE_TRIGGERED 4
+
 typedef struct iloop iloop;
 
 typedef enum
@@ -51,20 +61,23 @@ typedef enum
     ILOOP_READ_CB,
     ILOOP_WRITE_CB,
     ILOOP_WORKER_CB,
+    ILOOP_HANDOFF_CB,
     ILOOP_NUMBER_OF_IO_CB
 } iloop_cb_type;
 
 typedef enum
 {
     ILOOP_WATCHDOG_CB,
-    ILOOP_HEARTBEAT_CB,
-    ILOOP_HEARTBEAT_EXPIRE_CB,
-    ILOOP_HANDSHAKE_TIMEOUT_CB,
+    ILOOP_TIMERS_CB,
     ILOOP_NUMBER_OF_TIME_CB
 } iloop_time_cb_type;
 
 typedef void (iloop_io_callback)(iloop* loop, int fd, void* data);
 
+/* num_read is what read(2) would have returned, with errno set when it's -1 */
+typedef void (iloop_recv_callback)(iloop* loop, int fd, const char* buf,
+                                   ssize_t num_read, void* data);
+
 typedef void (iloop_time_callback)(iloop* loop, iloop_time_cb_type type,
                                    void* data);
 
@@ -79,6 +92,13 @@ typedef void (iloop_cleanup_cb)(iloop* loop);
 
 typedef void (iloop_delete_io_event_cb)(iloop* loop, int fd, int mask);
 
+typedef void (iloop_io_blocked_cb)(iloop* loop, int fd, int mask);
+
+typedef void (iloop_tick_callback)(iloop* loop, void* data);
+
+typedef void (iloop_set_tick_cb)(iloop* loop, iloop_tick_callback* callback,
+                                 void* data);
+
 typedef void
 (iloop_add_time_event_with_delay_cb)(iloop* loop,
                                   iloop_time_cb_type type,
@@ -88,6 +108,8 @@ typedef void
 
 typedef void (iloop_delete_time_event_cb)(iloop* loop, iloop_time_cb_type type);
 
+typedef uint64_t (iloop_now_cb)(iloop* loop);
+
 struct iloop
 {
     /* array of size ILOOP_NUMBER_OF_IO_CB */
@@ -96,12 +118,37 @@ struct iloop
     /* array of size ILOOP_NUMBER_OF_TIME_CB */
     iloop_time_callback** time_cbs;
 
+    /*
+     * for loops that accept and read on their own. instead of calling
+     * ILOOP_ACCEPT_CB when the listener is readable, such a loop accepts and
+     * calls accepted_cb with each new client fd, and instead of calling
+     * ILOOP_READ_CB it reads and calls recv_cb with what it got. both get the
+     * data passed to add_io. loops that don't can ignore them
+     */
+    iloop_io_callback* accepted_cb;
+    iloop_recv_callback* recv_cb;
+
     void* userdata;
 
     iloop_add_io_event_cb* add_io;
     iloop_delete_io_event_cb* delete_io;
+    iloop_io_blocked_cb* io_blocked; /* NULL is okay */
     iloop_add_time_event_with_delay_cb* add_time;
     iloop_delete_time_event_cb* delete_time;
+
+    /*
+     * calls callback once at the end of every loop iteration. NULL is okay,
+     * the server then waits for ILOOP_WRITEABLE before every write
+     */
+    iloop_set_tick_cb* set_tick;
+
+    /*
+     * the time in ms the loop sampled for this iteration, on the same clock
+     * as hhclock_get_now_ms. NULL is okay, the server then reads the clock
+     * itself whenever it needs the time
+     */
+    iloop_now_cb* now;
+
     iloop_cleanup_cb* cleanup; /* NULL is okay */
     iloop_listen_cb* listen; /* NULL is okay if you don't call server_listen */
 
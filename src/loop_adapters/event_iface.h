@@ -42,6 +42,9 @@ typedef struct
 {
     event_loop* eloop;
     event_time_id time_ids[ILOOP_NUMBER_OF_TIME_CB];
+    iloop* loop;
+    iloop_tick_callback* tick_cb;
+    void* tick_data;
 } iloop_event_data;
 
 static inline 
@@ -75,12 +78,19 @@ static void iloop_worker_cb(event_loop* loop, int fd, void* data)
     iloop_call_io_cb(ILOOP_WORKER_CB, fd, data);
 }
 
+static void iloop_handoff_cb(event_loop* loop, int fd, void* data)
+{
+    hhunused(loop);
+    iloop_call_io_cb(ILOOP_HANDOFF_CB, fd, data);
+}
+
 static event_io_callback* const g_iloop_event_io_cbs[ILOOP_NUMBER_OF_IO_CB] =
 {
     iloop_accept_cb, /* ILOOP_ACCEPT_CB */
     iloop_read_cb, /* ILOOP_READ_CB */
     iloop_write_cb, /* ILOOP_WRITE_CB */
-    iloop_worker_cb /* ILOOP_WORKER_CB */
+    iloop_worker_cb, /* ILOOP_WORKER_CB */
+    iloop_handoff_cb /* ILOOP_HANDOFF_CB */
 };
 
 static
@@ -93,6 +103,7 @@ iloop_result iloop_add_io(iloop* loop, int fd, int mask, iloop_cb_type type,
     int emask = 0;
     if (mask & ILOOP_READABLE) emask |= EVENT_READABLE;
     if (mask & ILOOP_WRITEABLE) emask |= EVENT_WRITEABLE;
+    if (mask & ILOOP_EDGE_TRIGGERED) emask |= EVENT_EDGE_TRIGGERED;
 
     r = event_add_io_event(eloop,fd,emask,g_iloop_event_io_cbs[type],data);
 
@@ -117,6 +128,17 @@ static void iloop_delete_io(iloop* loop, int fd, int mask)
     event_delete_io_event(eloop, fd, emask); 
 }
 
+static void iloop_io_blocked(iloop* loop, int fd, int mask)
+{
+    iloop_event_data* iloop_data = loop->userdata;
+    event_loop* eloop = iloop_data->eloop;
+    int emask = 0;
+    if (mask & ILOOP_READABLE) emask |= EVENT_READABLE;
+    if (mask & ILOOP_WRITEABLE) emask |= EVENT_WRITEABLE;
+
+    event_io_blocked(eloop, fd, emask);
+}
+
 static inline
 void iloop_call_time_cb(iloop_time_cb_type type, void* data)
 {
@@ -131,36 +153,18 @@ static void iloop_watchdog_cb(event_loop* loop, event_time_id id, void* data)
     iloop_call_time_cb(ILOOP_WATCHDOG_CB, data);
 }
 
-static void iloop_heartbeat_cb(event_loop* loop, event_time_id id, void* data)
+static void iloop_timers_cb(event_loop* loop, event_time_id id, void* data)
 {
     hhunused(loop);
     hhunused(id);
-    iloop_call_time_cb(ILOOP_HEARTBEAT_CB, data);
-}
-
-static
-void iloop_heartbeat_expire_cb(event_loop* loop, event_time_id id, void* data)
-{
-    hhunused(loop);
-    hhunused(id);
-    iloop_call_time_cb(ILOOP_HEARTBEAT_EXPIRE_CB, data);
-}
-
-static void
-iloop_handshake_timeout_cb(event_loop* loop, event_time_id id, void* data)
-{
-    hhunused(loop);
-    hhunused(id);
-    iloop_call_time_cb(ILOOP_HANDSHAKE_TIMEOUT_CB, data);
+    iloop_call_time_cb(ILOOP_TIMERS_CB, data);
 }
 
 static
 event_time_callback* const g_iloop_event_time_cbs[ILOOP_NUMBER_OF_TIME_CB] =
 {
     iloop_watchdog_cb, /* ILOOP_WATCHDOG_CB */
-    iloop_heartbeat_cb, /* ILOOP_HEARTBEAT_CB */
-    iloop_heartbeat_expire_cb, /* ILOOP_HEARTBEAT_EXPIRE_CB */
-    iloop_handshake_timeout_cb /* ILOOP_HANDSHAKE_TIMEOUT_CB */
+    iloop_timers_cb /* ILOOP_TIMERS_CB */
 };
 
 static void iloop_add_time(iloop* loop, iloop_time_cb_type type,
@@ -187,6 +191,30 @@ static void iloop_delete_time(iloop* loop, iloop_time_cb_type type)
     }
 }
 
+static void iloop_tick_cb(event_loop* loop, void* data)
+{
+    hhunused(loop);
+    iloop_event_data* iloop_data = data;
+    iloop_data->tick_cb(iloop_data->loop, iloop_data->tick_data);
+}
+
+static void iloop_set_tick(iloop* loop, iloop_tick_callback* callback,
+                           void* data)
+{
+    iloop_event_data* iloop_data = loop->userdata;
+    iloop_data->tick_cb = callback;
+    iloop_data->tick_data = data;
+    event_set_tick_callback(iloop_data->eloop,
+                            (callback != NULL) ? iloop_tick_cb : NULL,
+                            iloop_data);
+}
+
+static uint64_t iloop_now(iloop* loop)
+{
+    iloop_event_data* iloop_data = loop->userdata;
+    return event_get_time_ms(iloop_data->eloop);
+}
+
 static void iloop_cleanup(iloop* loop)
 {
     iloop_event_data* iloop_data = loop->userdata;
@@ -208,16 +236,23 @@ static bool iloop_event_attach_internal(iloop* loop,
     if (iloop_data == NULL) return false;
 
     iloop_data->eloop = event_create_loop(options->max_clients + 1024);
+    event_set_coarse_clock(iloop_data->eloop, options->coarse_clock);
     for (unsigned i = 0; i < hhcountof(iloop_data->time_ids); i++)
     {
         iloop_data->time_ids[i] = EVENT_INVALID_TIME_ID;
     }
+    iloop_data->loop = loop;
+    iloop_data->tick_cb = NULL;
+    iloop_data->tick_data = NULL;
 
     loop->userdata = iloop_data;
     loop->add_io = iloop_add_io;
     loop->delete_io = iloop_delete_io;
+    loop->io_blocked = iloop_io_blocked;
     loop->add_time = iloop_add_time;
     loop->delete_time = iloop_delete_time;
+    loop->set_tick = iloop_set_tick;
+    loop->now = iloop_now;
     loop->cleanup = iloop_cleanup;
     loop->listen = iloop_listen;
     loop->stop = iloop_stop_loop;
@@ -0,0 +1,1071 @@
+/* io_uring_iface - loop interface implementation on top of io_uring.
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef IO_URING_IFACE_H__
+#define IO_URING_IFACE_H__
+
+#include "../config.h"
+#include "../hhassert.h"
+#include "../hhclock.h"
+#include "../hhlog.h"
+#include "../hhmemory.h"
+#include "../iloop.h"
+#include "../platform.h"
+#include "../util.h"
+#include "event_iface.h"
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+#if defined(HAVE_IO_URING) && defined(IORING_POLL_ADD_MULTI) && \
+    defined(IORING_FEAT_EXT_ARG) && defined(IORING_RECV_MULTISHOT)
+
+/*
+ * the listener and client sockets are read through completions rather than
+ * readiness. a multishot accept hands over every new client, and a multishot
+ * recv per client fills buffers the kernel picks from a ring we registered,
+ * so data arrives without a wakeup followed by a read syscall. the server
+ * gets both through loop->accepted_cb and loop->recv_cb.
+ *
+ * writes and every other fd are still polled, the same way event_epoll.c
+ * uses epoll. fds added with ILOOP_EDGE_TRIGGERED get a single multishot poll
+ * for both directions, the rest get a one shot poll that's armed again after
+ * it fires.
+ *
+ * all of it is queued on the submission ring and handed to the kernel with
+ * the same io_uring_enter that waits for completions, one syscall per loop
+ * iteration.
+ *
+ * needs linux 5.13 for multishot poll and 6.0 for multishot recv. in between
+ * sockets are polled for reads too, before that iloop_attach_io_uring falls
+ * back to the built-in event loop
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define ILOOP_IO_URING_SQ_ENTRIES 1024
+#define ILOOP_IO_URING_CQ_ENTRIES 8192
+
+/* provided buffers for multishot recv, the count has to be a power of 2 */
+#define ILOOP_IO_URING_BUF_ENTRIES 512
+#define ILOOP_IO_URING_BUF_LEN (1024 * 8)
+#define ILOOP_IO_URING_BUF_GROUP 0
+
+/* what an sqe was for */
+#define ILOOP_IO_URING_OP_POLL 0
+#define ILOOP_IO_URING_OP_RECV 1
+#define ILOOP_IO_URING_OP_ACCEPT 2
+
+/*
+ * an sqe's user_data, its generation in the high 32 bits, the op in the next
+ * 8 and the fd in the low 24. completions with generation 0 are ignored
+ */
+#define ILOOP_IO_URING_MAX_FDS (1 << 24)
+#define ILOOP_IO_URING_DATA(gen, op, fd) \
+    (((uint64_t)(gen) << 32) | ((uint64_t)(op) << 24) | \
+     ((uint64_t)(uint32_t)(fd) & (ILOOP_IO_URING_MAX_FDS - 1)))
+
+typedef struct
+{
+    int mask; /* ILOOP_READABLE/ILOOP_WRITEABLE callbacks waiting */
+    int ready; /* edges seen since the last io_blocked, if edge */
+    unsigned armed_events; /* poll events of the armed poll */
+    uint32_t gen; /* generation of the last poll armed, never 0 */
+    bool armed; /* the poll with gen is in the kernel */
+    bool edge; /* added with ILOOP_EDGE_TRIGGERED */
+    bool pending; /* in the pending list */
+    bool dirty; /* in the arm list */
+
+    /* ILOOP_READABLE through a multishot recv or accept, if not polled */
+    int read_op;
+    uint32_t read_gen; /* generation of the last one armed, never 0 */
+    bool read_armed; /* the one with read_gen is in the kernel */
+
+    iloop_cb_type read_type;
+    iloop_cb_type write_type;
+    void* data;
+} iloop_io_uring_fd;
+
+typedef struct
+{
+    bool active;
+    uint64_t frequency_ms;
+    uint64_t next_fire_ms;
+    void* data;
+} iloop_io_uring_timer;
+
+typedef struct
+{
+    int ring_fd;
+    void* ring_ptr;
+    size_t ring_len;
+    struct io_uring_sqe* sqes;
+    size_t sqes_len;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    struct io_uring_cqe* cqes;
+    unsigned cq_mask;
+
+    iloop_io_uring_fd* fds;
+    int num_fds;
+
+    /* NULL if the kernel can't do multishot recv, see iloop_io_uring_create */
+    struct io_uring_buf_ring* buf_ring;
+    size_t buf_ring_len;
+    char* bufs;
+    unsigned short buf_tail;
+
+    /* fds whose poll has to change before the next wait */
+    int* arm;
+    int num_arm;
+
+    /* edge triggered fds that are still ready, see event.c */
+    int* pending;
+    int* firing;
+    int num_pending;
+
+    iloop_io_uring_timer timers[ILOOP_NUMBER_OF_TIME_CB];
+    iloop* loop;
+    iloop_tick_callback* tick_cb;
+    void* tick_data;
+    bool stop;
+
+    uint64_t now_ms; /* sampled once per iteration, see iloop_io_uring_now */
+    bool coarse_clock;
+} iloop_io_uring_data;
+
+static int iloop_io_uring_enter(iloop_io_uring_data* d, unsigned min_complete,
+                                unsigned flags, void* arg, size_t argsz)
+{
+    unsigned head = __atomic_load_n(d->sq_head, __ATOMIC_ACQUIRE);
+    unsigned to_submit = *d->sq_tail - head;
+
+    return (int)syscall(__NR_io_uring_enter, d->ring_fd, to_submit,
+                        min_complete, flags, arg, argsz);
+}
+
+/* returns a cleared sqe, iloop_io_uring_push_sqe queues it */
+static struct io_uring_sqe* iloop_io_uring_get_sqe(iloop_io_uring_data* d)
+{
+    unsigned tail = *d->sq_tail;
+    if (tail - __atomic_load_n(d->sq_head, __ATOMIC_ACQUIRE) == d->sq_entries)
+    {
+        /* full, hand what's there to the kernel first */
+        iloop_io_uring_enter(d, 0, 0, NULL, 0);
+        if (tail - __atomic_load_n(d->sq_head, __ATOMIC_ACQUIRE) ==
+            d->sq_entries)
+        {
+            hhlog(HHLOG_LEVEL_ERROR, "io_uring submission queue full: %s",
+                  strerror(errno));
+            return NULL;
+        }
+    }
+
+    unsigned index = tail & d->sq_mask;
+    struct io_uring_sqe* sqe = &d->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    d->sq_array[index] = index;
+    return sqe;
+}
+
+static void iloop_io_uring_push_sqe(iloop_io_uring_data* d)
+{
+    __atomic_store_n(d->sq_tail, *d->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+/* give a buffer back to the kernel to recv into */
+static void iloop_io_uring_put_buf(iloop_io_uring_data* d, unsigned short bid)
+{
+    unsigned short mask = ILOOP_IO_URING_BUF_ENTRIES - 1;
+    struct io_uring_buf* b = &d->buf_ring->bufs[d->buf_tail & mask];
+    b->addr = (uint64_t)(uintptr_t)(d->bufs + bid * ILOOP_IO_URING_BUF_LEN);
+    b->len = ILOOP_IO_URING_BUF_LEN;
+    b->bid = bid;
+
+    d->buf_tail++;
+    __atomic_store_n(&d->buf_ring->tail, d->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void iloop_io_uring_mark_dirty(iloop_io_uring_data* d, int fd)
+{
+    iloop_io_uring_fd* f = &d->fds[fd];
+    if (f->dirty) return;
+
+    f->dirty = true;
+    d->arm[d->num_arm++] = fd;
+}
+
+/* how ILOOP_READABLE is served for callbacks of type */
+static int iloop_io_uring_read_op(iloop_io_uring_data* d, iloop_cb_type type)
+{
+    if (d->buf_ring == NULL) return ILOOP_IO_URING_OP_POLL;
+
+    if (type == ILOOP_READ_CB && d->loop->recv_cb != NULL)
+    {
+        return ILOOP_IO_URING_OP_RECV;
+    }
+    if (type == ILOOP_ACCEPT_CB && d->loop->accepted_cb != NULL)
+    {
+        return ILOOP_IO_URING_OP_ACCEPT;
+    }
+
+    return ILOOP_IO_URING_OP_POLL;
+}
+
+static void iloop_io_uring_cancel_read(iloop_io_uring_data* d, int fd)
+{
+    iloop_io_uring_fd* f = &d->fds[fd];
+    struct io_uring_sqe* sqe = iloop_io_uring_get_sqe(d);
+    if (sqe == NULL) return;
+
+    /* completions still on their way are told apart by generation */
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = ILOOP_IO_URING_DATA(f->read_gen, f->read_op, fd);
+    sqe->user_data = ILOOP_IO_URING_DATA(0, 0, 0);
+    iloop_io_uring_push_sqe(d);
+    f->read_armed = false;
+}
+
+static void iloop_io_uring_arm_read(iloop_io_uring_data* d, int fd)
+{
+    iloop_io_uring_fd* f = &d->fds[fd];
+    struct io_uring_sqe* sqe = iloop_io_uring_get_sqe(d);
+    if (sqe == NULL) return;
+
+    f->read_gen++;
+    if (f->read_gen == 0) f->read_gen++;
+
+    sqe->fd = fd;
+    if (f->read_op == ILOOP_IO_URING_OP_RECV)
+    {
+        /* the kernel takes a buffer off of buf_ring for every completion */
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = ILOOP_IO_URING_BUF_GROUP;
+    }
+    else
+    {
+        /* see accept_client in server.c */
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    }
+    sqe->user_data = ILOOP_IO_URING_DATA(f->read_gen, f->read_op, fd);
+    iloop_io_uring_push_sqe(d);
+
+    f->read_armed = true;
+}
+
+/*
+ * make the recv, accept and poll in the kernel match what the fd's callbacks
+ * wait on
+ */
+static void iloop_io_uring_arm(iloop_io_uring_data* d, int fd)
+{
+    iloop_io_uring_fd* f = &d->fds[fd];
+    struct io_uring_sqe* sqe;
+
+    bool completes = (f->read_op != ILOOP_IO_URING_OP_POLL);
+    if (completes && (f->mask & ILOOP_READABLE))
+    {
+        if (!f->read_armed) iloop_io_uring_arm_read(d, fd);
+    }
+    else if (f->read_armed)
+    {
+        iloop_io_uring_cancel_read(d, fd);
+    }
+
+    /* a socket read through completions is only polled for writes */
+    unsigned events = 0;
+    if (f->edge)
+    {
+        if (f->mask != ILOOP_NONE) events = completes ? POLLOUT :
+                                                        POLLIN | POLLOUT;
+    }
+    else
+    {
+        if ((f->mask & ILOOP_READABLE) && !completes) events |= POLLIN;
+        if (f->mask & ILOOP_WRITEABLE) events |= POLLOUT;
+    }
+
+    if (f->armed && f->armed_events == events) return;
+
+    if (f->armed)
+    {
+        sqe = iloop_io_uring_get_sqe(d);
+        if (sqe == NULL) return;
+
+        /* completions of the removed poll are told apart by generation */
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = ILOOP_IO_URING_DATA(f->gen, ILOOP_IO_URING_OP_POLL, fd);
+        sqe->user_data = ILOOP_IO_URING_DATA(0, 0, 0);
+        iloop_io_uring_push_sqe(d);
+        f->armed = false;
+    }
+
+    if (events == 0) return;
+
+    sqe = iloop_io_uring_get_sqe(d);
+    if (sqe == NULL) return;
+
+    f->gen++;
+    if (f->gen == 0) f->gen++;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    if (f->edge) sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = ILOOP_IO_URING_DATA(f->gen, ILOOP_IO_URING_OP_POLL, fd);
+    iloop_io_uring_push_sqe(d);
+
+    f->armed = true;
+    f->armed_events = events;
+}
+
+static void iloop_io_uring_queue_ready(iloop_io_uring_data* d, int fd)
+{
+    iloop_io_uring_fd* f = &d->fds[fd];
+    if (f->edge && !f->pending && (f->mask & f->ready))
+    {
+        f->pending = true;
+        d->pending[d->num_pending++] = fd;
+    }
+}
+
+static
+iloop_result iloop_io_uring_add_io(iloop* loop, int fd, int mask,
+                                   iloop_cb_type type, void* data)
+{
+    iloop_io_uring_data* d = loop->userdata;
+    if (fd < 0 || fd >= d->num_fds) return ILOOP_FAILURE;
+
+    iloop_io_uring_fd* f = &d->fds[fd];
+    if (f->mask == ILOOP_NONE)
+    {
+        f->edge = (mask & ILOOP_EDGE_TRIGGERED) != 0;
+        f->ready = ILOOP_NONE;
+    }
+
+    mask &= ILOOP_READABLE | ILOOP_WRITEABLE;
+    if ((mask & ILOOP_READABLE) && !(f->mask & ILOOP_READABLE))
+    {
+        /* a recv or accept from before can still be waiting to be removed */
+        int read_op = iloop_io_uring_read_op(d, type);
+        if (f->read_armed && f->read_op != read_op)
+        {
+            iloop_io_uring_cancel_read(d, fd);
+        }
+        f->read_op = read_op;
+    }
+
+    f->mask |= mask;
+    if (mask & ILOOP_READABLE) f->read_type = type;
+    if (mask & ILOOP_WRITEABLE) f->write_type = type;
+    f->data = data;
+
+    iloop_io_uring_mark_dirty(d, fd);
+    iloop_io_uring_queue_ready(d, fd);
+
+    return ILOOP_SUCCESS;
+}
+
+static void iloop_io_uring_delete_io(iloop* loop, int fd, int mask)
+{
+    iloop_io_uring_data* d = loop->userdata;
+    if (fd < 0 || fd >= d->num_fds) return;
+
+    iloop_io_uring_fd* f = &d->fds[fd];
+    f->mask &= ~(mask & (ILOOP_READABLE | ILOOP_WRITEABLE));
+
+    if (f->mask == ILOOP_NONE)
+    {
+        /*
+         * the fd is usually closed next and its number reused, so the poll
+         * or recv has to be queued for removal before anything is added
+         * again. until the recv is gone the socket isn't really closed
+         */
+        iloop_io_uring_arm(d, fd);
+    }
+    else
+    {
+        iloop_io_uring_mark_dirty(d, fd);
+    }
+}
+
+static void iloop_io_uring_io_blocked(iloop* loop, int fd, int mask)
+{
+    iloop_io_uring_data* d = loop->userdata;
+    if (fd < 0 || fd >= d->num_fds) return;
+
+    d->fds[fd].ready &= ~mask;
+}
+
+static void iloop_io_uring_fire(iloop_io_uring_data* d, int fd, int fired)
+{
+    iloop* loop = d->loop;
+    iloop_io_uring_fd* f = &d->fds[fd];
+
+    /* the read callback can delete the write callback */
+    if (f->mask & fired & ILOOP_READABLE)
+    {
+        loop->io_cbs[f->read_type](loop, fd, f->data);
+    }
+
+    if (f->mask & fired & ILOOP_WRITEABLE)
+    {
+        loop->io_cbs[f->write_type](loop, fd, f->data);
+    }
+
+    /* if the callbacks didn't run into EAGAIN, go again */
+    iloop_io_uring_queue_ready(d, fd);
+}
+
+static void iloop_io_uring_complete_recv(iloop_io_uring_data* d, int fd,
+                                         uint32_t gen,
+                                         struct io_uring_cqe* cqe)
+{
+    iloop* loop = d->loop;
+    iloop_io_uring_fd* f = &d->fds[fd];
+    bool current = (gen != 0 && f->read_armed && f->read_gen == gen);
+
+    const char* buf = NULL;
+    unsigned short bid = 0;
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        buf = d->bufs + bid * ILOOP_IO_URING_BUF_LEN;
+    }
+
+    if (current && !(cqe->flags & IORING_CQE_F_MORE))
+    {
+        /* the kernel ended the recv, it's armed again if still wanted */
+        f->read_armed = false;
+        iloop_io_uring_mark_dirty(d, fd);
+    }
+
+    /*
+     * running out of buffers ends the recv without losing anything, the
+     * buffers come back before it's armed again
+     */
+    if (current && cqe->res != -ENOBUFS)
+    {
+        ssize_t num_read = cqe->res;
+        if (cqe->res < 0)
+        {
+            errno = -cqe->res;
+            num_read = -1;
+        }
+
+        loop->recv_cb(loop, fd, buf, num_read, f->data);
+    }
+
+    /* the callback is done with it, even if it closed the fd */
+    if (buf != NULL) iloop_io_uring_put_buf(d, bid);
+}
+
+static void iloop_io_uring_complete_accept(iloop_io_uring_data* d, int fd,
+                                           uint32_t gen,
+                                           struct io_uring_cqe* cqe)
+{
+    iloop* loop = d->loop;
+    iloop_io_uring_fd* f = &d->fds[fd];
+    bool current = (gen != 0 && f->read_armed && f->read_gen == gen);
+
+    if (current && !(cqe->flags & IORING_CQE_F_MORE))
+    {
+        f->read_armed = false;
+        iloop_io_uring_mark_dirty(d, fd);
+    }
+
+    if (cqe->res < 0)
+    {
+        /* see accept_callback in server.c */
+        int err = -cqe->res;
+        if (current && err != ECONNABORTED && err != EINTR && err != EAGAIN)
+        {
+            hhlog(HHLOG_LEVEL_ERROR,
+                  "-1 fd when accepting socket, fd: %d, err: %d (%s)", fd,
+                  err, strerror(err));
+        }
+        return;
+    }
+
+    /* accepted just before we stopped listening */
+    if (!current)
+    {
+        close(cqe->res);
+        return;
+    }
+
+    loop->accepted_cb(loop, cqe->res, f->data);
+}
+
+static void iloop_io_uring_complete(iloop_io_uring_data* d,
+                                    struct io_uring_cqe* cqe)
+{
+    uint32_t gen = (uint32_t)(cqe->user_data >> 32);
+    int op = (int)((cqe->user_data >> 24) & 0xff);
+    int fd = (int)(cqe->user_data & (ILOOP_IO_URING_MAX_FDS - 1));
+
+    switch (op)
+    {
+    case ILOOP_IO_URING_OP_RECV:
+        iloop_io_uring_complete_recv(d, fd, gen, cqe);
+        return;
+    case ILOOP_IO_URING_OP_ACCEPT:
+        iloop_io_uring_complete_accept(d, fd, gen, cqe);
+        return;
+    }
+
+    /* poll removals and cancels */
+    if (gen == 0) return;
+
+    /* a poll that's been removed since */
+    iloop_io_uring_fd* f = &d->fds[fd];
+    if (!f->armed || f->gen != gen) return;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        /* one shot, or the kernel ended a multishot poll */
+        f->armed = false;
+        iloop_io_uring_mark_dirty(d, fd);
+    }
+
+    if (cqe->res <= 0) return;
+
+    int fired = ILOOP_NONE;
+    if (cqe->res & POLLIN) fired |= ILOOP_READABLE;
+    if (cqe->res & POLLOUT) fired |= ILOOP_WRITEABLE;
+
+    /* inform the user on whatever events they're listening to */
+    if (cqe->res & (POLLERR | POLLHUP)) fired |= f->mask;
+
+    /* reading here could overtake recv completions that are still queued */
+    if (f->read_op != ILOOP_IO_URING_OP_POLL) fired &= ~ILOOP_READABLE;
+
+    if (f->edge) f->ready |= fired;
+    iloop_io_uring_fire(d, fd, fired);
+}
+
+static void iloop_io_uring_add_time(iloop* loop, iloop_time_cb_type type,
+                                    uint64_t frequency_ms,
+                                    uint64_t initial_delay_ms, void* data)
+{
+    iloop_io_uring_data* d = loop->userdata;
+    iloop_io_uring_timer* t = &d->timers[type];
+
+    hhassert(frequency_ms > 0);
+
+    t->active = true;
+    t->frequency_ms = frequency_ms;
+    t->next_fire_ms = hhclock_get_now_ms() + frequency_ms + initial_delay_ms;
+    t->data = data;
+}
+
+static void iloop_io_uring_delete_time(iloop* loop, iloop_time_cb_type type)
+{
+    iloop_io_uring_data* d = loop->userdata;
+    d->timers[type].active = false;
+}
+
+static void iloop_io_uring_set_tick(iloop* loop, iloop_tick_callback* callback,
+                                    void* data)
+{
+    iloop_io_uring_data* d = loop->userdata;
+    d->tick_cb = callback;
+    d->tick_data = data;
+}
+
+static uint64_t iloop_io_uring_update_time(iloop_io_uring_data* d)
+{
+    d->now_ms = d->coarse_clock ? hhclock_get_coarse_now_ms() :
+                                  hhclock_get_now_ms();
+    return d->now_ms;
+}
+
+static uint64_t iloop_io_uring_now(iloop* loop)
+{
+    iloop_io_uring_data* d = loop->userdata;
+    return d->now_ms;
+}
+
+/* ms until the next time event, -1 to wait forever */
+static int64_t iloop_io_uring_get_wait_ms(iloop_io_uring_data* d)
+{
+    if (d->num_pending > 0) return 0;
+
+    /* only read the clock twice when we're about to block anyway */
+    int64_t wait_ms = -1;
+    uint64_t now = iloop_io_uring_update_time(d);
+    for (int i = 0; i < ILOOP_NUMBER_OF_TIME_CB; i++)
+    {
+        iloop_io_uring_timer* t = &d->timers[i];
+        if (!t->active) continue;
+
+        int64_t ms = 0;
+        if (t->next_fire_ms > now) ms = (int64_t)(t->next_fire_ms - now);
+        if (wait_ms == -1 || ms < wait_ms) wait_ms = ms;
+    }
+
+    return wait_ms;
+}
+
+static void iloop_io_uring_fire_timers(iloop_io_uring_data* d)
+{
+    iloop* loop = d->loop;
+    uint64_t now = d->now_ms;
+    for (int i = 0; i < ILOOP_NUMBER_OF_TIME_CB; i++)
+    {
+        iloop_io_uring_timer* t = &d->timers[i];
+        if (!t->active || now < t->next_fire_ms) continue;
+
+        /* the callback is free to delete or re-add this */
+        t->next_fire_ms = now + t->frequency_ms;
+        loop->time_cbs[i](loop, (iloop_time_cb_type)i, t->data);
+    }
+}
+
+static void iloop_io_uring_process(iloop_io_uring_data* d)
+{
+    /* queue up the polls that changed since the last wait */
+    for (int i = 0; i < d->num_arm; i++)
+    {
+        int fd = d->arm[i];
+        d->fds[fd].dirty = false;
+        iloop_io_uring_arm(d, fd);
+    }
+    d->num_arm = 0;
+
+    /* submit them and wait in one go */
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    memset(&arg, 0, sizeof(arg));
+
+    unsigned min_complete = 1;
+    int64_t wait_ms = iloop_io_uring_get_wait_ms(d);
+    if (wait_ms >= 0)
+    {
+        ts.tv_sec = wait_ms / 1000;
+        ts.tv_nsec = (wait_ms % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        if (wait_ms == 0) min_complete = 0;
+    }
+
+    int r = iloop_io_uring_enter(d, min_complete,
+                                 IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                                 &arg, sizeof(arg));
+    if (r == -1 && errno != ETIME && errno != EINTR)
+    {
+        hhlog(HHLOG_LEVEL_ERROR, "io_uring_enter failed: %s",
+              strerror(errno));
+    }
+
+    /* everything this iteration runs sees this time */
+    iloop_io_uring_update_time(d);
+    iloop_io_uring_fire_timers(d);
+
+    unsigned head = *d->cq_head;
+    unsigned tail = __atomic_load_n(d->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail)
+    {
+        struct io_uring_cqe cqe = d->cqes[head & d->cq_mask];
+        head++;
+        __atomic_store_n(d->cq_head, head, __ATOMIC_RELEASE);
+
+        iloop_io_uring_complete(d, &cqe);
+    }
+
+    /* then edge triggered fds that are still ready */
+    int num_pending = d->num_pending;
+    int* firing = d->pending;
+    d->pending = d->firing;
+    d->firing = firing;
+    d->num_pending = 0;
+
+    for (int i = 0; i < num_pending; i++)
+    {
+        iloop_io_uring_fd* f = &d->fds[firing[i]];
+        f->pending = false;
+        iloop_io_uring_fire(d, firing[i], f->ready);
+    }
+
+    if (d->tick_cb != NULL)
+    {
+        d->tick_cb(d->loop, d->tick_data);
+    }
+}
+
+static void iloop_io_uring_listen(iloop* loop)
+{
+    iloop_io_uring_data* d = loop->userdata;
+
+    d->stop = false;
+    while (!d->stop)
+    {
+        iloop_io_uring_process(d);
+    }
+}
+
+static void iloop_io_uring_stop_loop(iloop* loop)
+{
+    iloop_io_uring_data* d = loop->userdata;
+    d->stop = true;
+}
+
+static void iloop_io_uring_destroy(iloop_io_uring_data* d)
+{
+    if (d->sqes != NULL) munmap(d->sqes, d->sqes_len);
+    if (d->ring_ptr != NULL) munmap(d->ring_ptr, d->ring_len);
+    close(d->ring_fd);
+    if (d->buf_ring != NULL) munmap(d->buf_ring, d->buf_ring_len);
+    hhfree(d->bufs);
+    hhfree(d->fds);
+    hhfree(d->arm);
+    hhfree(d->pending);
+    hhfree(d->firing);
+    hhfree(d);
+}
+
+static void iloop_io_uring_cleanup(iloop* loop)
+{
+    iloop_io_uring_destroy(loop->userdata);
+    loop->userdata = NULL;
+}
+
+/*
+ * kernels before 5.13 reject IORING_POLL_ADD_MULTI, try one on a pipe that's
+ * always writeable
+ */
+static bool iloop_io_uring_probe(iloop_io_uring_data* d)
+{
+    int p[2];
+    if (pipe(p) == -1) return false;
+
+    bool supported = false;
+    struct io_uring_sqe* sqe = iloop_io_uring_get_sqe(d);
+    if (sqe == NULL) goto done;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = p[1];
+    sqe->poll32_events = POLLOUT;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = ILOOP_IO_URING_DATA(0, 0, 0);
+    iloop_io_uring_push_sqe(d);
+
+    if (iloop_io_uring_enter(d, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1)
+    {
+        goto done;
+    }
+
+    unsigned head = *d->cq_head;
+    if (head == __atomic_load_n(d->cq_tail, __ATOMIC_ACQUIRE)) goto done;
+
+    struct io_uring_cqe* cqe = &d->cqes[head & d->cq_mask];
+    supported = (cqe->res > 0 && (cqe->flags & IORING_CQE_F_MORE));
+    __atomic_store_n(d->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    if (supported)
+    {
+        /* what's left completes with generation 0 and is ignored */
+        sqe = iloop_io_uring_get_sqe(d);
+        if (sqe == NULL) goto done;
+
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = ILOOP_IO_URING_DATA(0, 0, 0);
+        sqe->user_data = ILOOP_IO_URING_DATA(0, 0, 0);
+        iloop_io_uring_push_sqe(d);
+        iloop_io_uring_enter(d, 0, 0, NULL, 0);
+    }
+
+done:
+    close(p[0]);
+    close(p[1]);
+    return supported;
+}
+
+static bool iloop_io_uring_setup_bufs(iloop_io_uring_data* d)
+{
+    size_t ring_len = ILOOP_IO_URING_BUF_ENTRIES * sizeof(struct io_uring_buf);
+    void* ring = mmap(NULL, ring_len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) return false;
+
+    char* bufs = hhmalloc(ILOOP_IO_URING_BUF_ENTRIES * ILOOP_IO_URING_BUF_LEN);
+    if (bufs == NULL)
+    {
+        munmap(ring, ring_len);
+        return false;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring;
+    reg.ring_entries = ILOOP_IO_URING_BUF_ENTRIES;
+    reg.bgid = ILOOP_IO_URING_BUF_GROUP;
+    if (syscall(__NR_io_uring_register, d->ring_fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) == -1)
+    {
+        hhfree(bufs);
+        munmap(ring, ring_len);
+        return false;
+    }
+
+    d->buf_ring = ring;
+    d->buf_ring_len = ring_len;
+    d->bufs = bufs;
+    d->buf_tail = 0;
+    for (int i = 0; i < ILOOP_IO_URING_BUF_ENTRIES; i++)
+    {
+        iloop_io_uring_put_buf(d, (unsigned short)i);
+    }
+
+    return true;
+}
+
+/*
+ * kernels before 6.0 reject IORING_RECV_MULTISHOT or end the recv after one
+ * completion, try one on a socketpair with a byte waiting in it
+ */
+static bool iloop_io_uring_probe_recv(iloop_io_uring_data* d)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) return false;
+
+    bool supported = false;
+    uint64_t probe_data = ILOOP_IO_URING_DATA(0, ILOOP_IO_URING_OP_RECV, 0);
+    if (write(sv[1], "x", 1) != 1) goto done;
+
+    struct io_uring_sqe* sqe = iloop_io_uring_get_sqe(d);
+    if (sqe == NULL) goto done;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sv[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = ILOOP_IO_URING_BUF_GROUP;
+    sqe->user_data = probe_data;
+    iloop_io_uring_push_sqe(d);
+
+    /* whatever iloop_io_uring_probe left behind can complete first */
+    for (int i = 0; i < 8; i++)
+    {
+        if (iloop_io_uring_enter(d, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1)
+        {
+            goto done;
+        }
+
+        unsigned head = *d->cq_head;
+        if (head == __atomic_load_n(d->cq_tail, __ATOMIC_ACQUIRE)) goto done;
+
+        struct io_uring_cqe cqe = d->cqes[head & d->cq_mask];
+        __atomic_store_n(d->cq_head, head + 1, __ATOMIC_RELEASE);
+        if (cqe.user_data != probe_data) continue;
+
+        supported = (cqe.res == 1 && (cqe.flags & IORING_CQE_F_MORE));
+
+        /* generation 0, this only gives the buffer back */
+        iloop_io_uring_complete(d, &cqe);
+        break;
+    }
+
+done:
+    /* the recv ends when it sees the other end close */
+    close(sv[0]);
+    close(sv[1]);
+    return supported;
+}
+
+static iloop_io_uring_data* iloop_io_uring_create(int num_fds)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = ILOOP_IO_URING_CQ_ENTRIES;
+
+    int ring_fd = (int)syscall(__NR_io_uring_setup, ILOOP_IO_URING_SQ_ENTRIES,
+                               &params);
+    if (ring_fd == -1)
+    {
+        hhlog(HHLOG_LEVEL_WARNING, "io_uring_setup failed: %s",
+              strerror(errno));
+        return NULL;
+    }
+
+    unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+                      IORING_FEAT_EXT_ARG;
+    if ((params.features & needed) != needed)
+    {
+        hhlog(HHLOG_LEVEL_WARNING, "io_uring missing features: %x",
+              needed & ~params.features);
+        close(ring_fd);
+        return NULL;
+    }
+
+    iloop_io_uring_data* d = hhcalloc(1, sizeof(*d));
+    if (d == NULL)
+    {
+        close(ring_fd);
+        return NULL;
+    }
+    d->ring_fd = ring_fd;
+
+    size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_len = params.cq_off.cqes +
+                    params.cq_entries * sizeof(struct io_uring_cqe);
+    d->ring_len = hhmax(sq_len, cq_len);
+    d->ring_ptr = mmap(NULL, d->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       ring_fd, IORING_OFF_SQ_RING);
+    d->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    d->sqes = mmap(NULL, d->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   ring_fd, IORING_OFF_SQES);
+
+    if (d->ring_ptr == MAP_FAILED) d->ring_ptr = NULL;
+    if (d->sqes == MAP_FAILED) d->sqes = NULL;
+    if (d->ring_ptr == NULL || d->sqes == NULL) goto create_error;
+
+    char* ring = d->ring_ptr;
+    d->sq_head = (unsigned*)(ring + params.sq_off.head);
+    d->sq_tail = (unsigned*)(ring + params.sq_off.tail);
+    d->sq_array = (unsigned*)(ring + params.sq_off.array);
+    d->sq_mask = *(unsigned*)(ring + params.sq_off.ring_mask);
+    d->sq_entries = params.sq_entries;
+    d->cq_head = (unsigned*)(ring + params.cq_off.head);
+    d->cq_tail = (unsigned*)(ring + params.cq_off.tail);
+    d->cqes = (struct io_uring_cqe*)(ring + params.cq_off.cqes);
+    d->cq_mask = *(unsigned*)(ring + params.cq_off.ring_mask);
+
+    hhassert(num_fds <= ILOOP_IO_URING_MAX_FDS);
+    d->num_fds = num_fds;
+    d->fds = hhcalloc((size_t)num_fds, sizeof(*d->fds));
+    d->arm = hhmalloc((size_t)num_fds * sizeof(*d->arm));
+    d->pending = hhmalloc((size_t)num_fds * sizeof(*d->pending));
+    d->firing = hhmalloc((size_t)num_fds * sizeof(*d->firing));
+    if (d->fds == NULL || d->arm == NULL || d->pending == NULL ||
+        d->firing == NULL)
+    {
+        goto create_error;
+    }
+
+    if (!iloop_io_uring_probe(d))
+    {
+        hhlog(HHLOG_LEVEL_WARNING, "io_uring doesn't support multishot poll");
+        goto create_error;
+    }
+
+    if (!iloop_io_uring_setup_bufs(d))
+    {
+        hhlog(HHLOG_LEVEL_INFO,
+              "io_uring can't provide buffers, polling sockets for reads");
+    }
+    else if (!iloop_io_uring_probe_recv(d))
+    {
+        hhlog(HHLOG_LEVEL_INFO,
+              "io_uring doesn't support multishot recv, polling sockets");
+
+        /* a NULL buf_ring is what keeps reads on polls */
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.bgid = ILOOP_IO_URING_BUF_GROUP;
+        syscall(__NR_io_uring_register, d->ring_fd,
+                IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        munmap(d->buf_ring, d->buf_ring_len);
+        hhfree(d->bufs);
+        d->buf_ring = NULL;
+        d->bufs = NULL;
+    }
+
+    return d;
+
+create_error:
+    iloop_io_uring_destroy(d);
+    return NULL;
+}
+
+/*
+ * attaches an io_uring loop, or the built-in event loop if the kernel can't
+ * run one
+ */
+static bool iloop_attach_io_uring(iloop* loop, config_server_options* options)
+{
+    iloop_io_uring_data* d = iloop_io_uring_create(options->max_clients + 1024);
+    if (d == NULL)
+    {
+        hhlog(HHLOG_LEVEL_WARNING,
+              "io_uring unavailable, using the built-in event loop");
+        return iloop_event_attach_internal(loop, options);
+    }
+
+    d->loop = loop;
+    d->coarse_clock = options->coarse_clock;
+    iloop_io_uring_update_time(d);
+
+    loop->userdata = d;
+    loop->add_io = iloop_io_uring_add_io;
+    loop->delete_io = iloop_io_uring_delete_io;
+    loop->io_blocked = iloop_io_uring_io_blocked;
+    loop->add_time = iloop_io_uring_add_time;
+    loop->delete_time = iloop_io_uring_delete_time;
+    loop->set_tick = iloop_io_uring_set_tick;
+    loop->now = iloop_io_uring_now;
+    loop->cleanup = iloop_io_uring_cleanup;
+    loop->listen = iloop_io_uring_listen;
+    loop->stop = iloop_io_uring_stop_loop;
+
+    return true;
+}
+
+#else
+
+/* built without io_uring support, the built-in event loop is used instead */
+static bool iloop_attach_io_uring(iloop* loop, config_server_options* options)
+{
+    return iloop_event_attach_internal(loop, options);
+}
+
+#endif
+
+#endif /* IO_URING_IFACE_H__ */
@@ -79,12 +79,19 @@ static void iloop_libevent_worker_cb(int fd, short event, void* data)
     iloop_libevent_call_io_cb(ILOOP_WORKER_CB, fd, data);
 }
 
+static void iloop_libevent_handoff_cb(int fd, short event, void* data)
+{
+    hhunused(event);
+    iloop_libevent_call_io_cb(ILOOP_HANDOFF_CB, fd, data);
+}
+
 static event_callback_fn const g_iloop_libevent_io_cbs[ILOOP_NUMBER_OF_IO_CB] =
 {
     iloop_libevent_accept_cb, /* ILOOP_ACCEPT_CB */
     iloop_libevent_read_cb, /* ILOOP_READ_CB */
     iloop_libevent_write_cb, /* ILOOP_WRITE_CB */
-    iloop_libevent_worker_cb /* ILOOP_WORKER_CB */
+    iloop_libevent_worker_cb, /* ILOOP_WORKER_CB */
+    iloop_libevent_handoff_cb /* ILOOP_HANDOFF_CB */
 };
 
 static iloop_result
@@ -190,35 +197,17 @@ static void iloop_libevent_watchdog_cb(int fd, short event, void *data)
     iloop_call_time_cb(ILOOP_WATCHDOG_CB, data);
 }
 
-static void iloop_libevent_heartbeat_cb(int fd, short event, void *data)
-{
-    hhunused(fd);
-    hhunused(event);
-    iloop_call_time_cb(ILOOP_HEARTBEAT_CB, data);
-}
-
-static
-void iloop_libevent_heartbeat_expire_cb(int fd, short event, void *data)
-{
-    hhunused(fd);
-    hhunused(event);
-    iloop_call_time_cb(ILOOP_HEARTBEAT_EXPIRE_CB, data);
-}
-
-static void
-iloop_libevent_handshake_timeout_cb(int fd, short event, void *data)
+static void iloop_libevent_timers_cb(int fd, short event, void *data)
 {
     hhunused(fd);
     hhunused(event);
-    iloop_call_time_cb(ILOOP_HANDSHAKE_TIMEOUT_CB, data);
+    iloop_call_time_cb(ILOOP_TIMERS_CB, data);
 }
 
 static event_callback_fn const g_iloop_event_time_cbs[ILOOP_NUMBER_OF_TIME_CB] =
 {
     iloop_libevent_watchdog_cb, /* ILOOP_WATCHDOG_CB */
-    iloop_libevent_heartbeat_cb, /* ILOOP_HEARTBEAT_CB */
-    iloop_libevent_heartbeat_expire_cb, /* ILOOP_HEARTBEAT_EXPIRE_CB */
-    iloop_libevent_handshake_timeout_cb /* ILOOP_HANDSHAKE_TIMEOUT_CB */
+    iloop_libevent_timers_cb /* ILOOP_TIMERS_CB */
 };
 
 typedef struct
@@ -0,0 +1,350 @@
+/* mask - apply/remove WebSocket frame masking (RFC 6455 Section 5.3)
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "mask.h"
+#include "hhassert.h"
+#include "util.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define MASK_HAVE_X86
+    #include <immintrin.h>
+    #define MASK_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+/*
+ * only bother aligning dest when there's enough data for aligned stores to
+ * pay for the byte-wise head
+ */
+#define MASK_ALIGN_THRESHOLD 256
+
+/*
+ * below this, setting up vector keys costs more than it saves and the
+ * 64 bit loop wins
+ */
+#define MASK_VECTOR_THRESHOLD 256
+
+static mask_func* g_mask_best = NULL;
+
+/*
+ * fill out with the key bytes that line up with payload index
+ * mask_index + 0, 1, 2, ...
+ */
+static void mask_expand_key(unsigned char* out, size_t out_len,
+                            const char* mask_key, int64_t mask_index)
+{
+    size_t start = (size_t)(mask_index % 4);
+    for (size_t i = 0; i < out_len; i++)
+    {
+        out[i] = (unsigned char)mask_key[(start + i) & 3];
+    }
+}
+
+/*
+ * the original loop. everything else is checked against this in
+ * test_mask, and the benchmark uses it as the baseline
+ */
+static void mask_byte(char* dest, const char* src, size_t len,
+                      const char* mask_key, int64_t mask_index)
+{
+    uint8_t* d = (uint8_t*)dest;
+    const uint8_t* s = (const uint8_t*)src;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        d[i] = s[i] ^ (uint8_t)mask_key[mask_index++ % 4];
+    }
+}
+
+/*
+ * mask a byte at a time until dest + return value is aligned to align
+ * bytes (or we run out of data). key must be the 4 key bytes rotated so
+ * key[0] lines up with src[0]
+ */
+static HH_INLINE size_t mask_head(uint8_t* d, const uint8_t* s, size_t len,
+                                  const unsigned char* key, uintptr_t align)
+{
+    size_t i = 0;
+    while (i < len && ((uintptr_t)(d + i) & (align - 1)) != 0)
+    {
+        d[i] = s[i] ^ key[i & 3];
+        i++;
+    }
+
+    return i;
+}
+
+/*
+ * mask [i, len), 64 bits at a time and then a byte at a time. key must be
+ * the 4 key bytes rotated so key[0] lines up with src[0]
+ */
+static HH_INLINE void mask_tail(uint8_t* d, const uint8_t* s, size_t i,
+                                size_t len, const unsigned char* key)
+{
+    unsigned char key_bytes[sizeof(uint64_t)];
+    for (size_t j = 0; j < sizeof(key_bytes); j++)
+    {
+        key_bytes[j] = key[(i + j) & 3];
+    }
+
+    uint64_t key64;
+    memcpy(&key64, key_bytes, sizeof(key64));
+
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+    {
+        uint64_t w;
+        memcpy(&w, &s[i], sizeof(w));
+        w ^= key64;
+        memcpy(&d[i], &w, sizeof(w));
+    }
+
+    for (; i < len; i++)
+    {
+        d[i] = s[i] ^ key[i & 3];
+    }
+}
+
+static void mask_word(char* dest, const char* src, size_t len,
+                      const char* mask_key, int64_t mask_index)
+{
+    uint8_t* d = (uint8_t*)dest;
+    const uint8_t* s = (const uint8_t*)src;
+    unsigned char key[4];
+    mask_expand_key(key, sizeof(key), mask_key, mask_index);
+
+    size_t i = 0;
+    if (len >= MASK_ALIGN_THRESHOLD)
+    {
+        i = mask_head(d, s, len, key, sizeof(uint64_t));
+    }
+
+    mask_tail(d, s, i, len, key);
+}
+
+#ifdef MASK_HAVE_X86
+
+MASK_TARGET("sse2")
+static void mask_sse2(char* dest, const char* src, size_t len,
+                      const char* mask_key, int64_t mask_index)
+{
+    uint8_t* d = (uint8_t*)dest;
+    const uint8_t* s = (const uint8_t*)src;
+    unsigned char key[4];
+    mask_expand_key(key, sizeof(key), mask_key, mask_index);
+
+    size_t i = 0;
+    if (len >= MASK_ALIGN_THRESHOLD)
+    {
+        i = mask_head(d, s, len, key, sizeof(__m128i));
+    }
+
+    unsigned char block_key[sizeof(__m128i)];
+    mask_expand_key(block_key, sizeof(block_key), mask_key,
+                    mask_index + (int64_t)i);
+    __m128i k = _mm_loadu_si128((const __m128i*)block_key);
+
+    /* dest is aligned now if the data was big enough, src may not be */
+    for (; i + 4 * sizeof(__m128i) <= len; i += 4 * sizeof(__m128i))
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)&s[i]);
+        __m128i b = _mm_loadu_si128((const __m128i*)&s[i + 16]);
+        __m128i c = _mm_loadu_si128((const __m128i*)&s[i + 32]);
+        __m128i e = _mm_loadu_si128((const __m128i*)&s[i + 48]);
+        _mm_storeu_si128((__m128i*)&d[i], _mm_xor_si128(a, k));
+        _mm_storeu_si128((__m128i*)&d[i + 16], _mm_xor_si128(b, k));
+        _mm_storeu_si128((__m128i*)&d[i + 32], _mm_xor_si128(c, k));
+        _mm_storeu_si128((__m128i*)&d[i + 48], _mm_xor_si128(e, k));
+    }
+
+    for (; i + sizeof(__m128i) <= len; i += sizeof(__m128i))
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)&s[i]);
+        _mm_storeu_si128((__m128i*)&d[i], _mm_xor_si128(a, k));
+    }
+
+    mask_tail(d, s, i, len, key);
+}
+
+MASK_TARGET("avx2")
+static void mask_avx2(char* dest, const char* src, size_t len,
+                      const char* mask_key, int64_t mask_index)
+{
+    uint8_t* d = (uint8_t*)dest;
+    const uint8_t* s = (const uint8_t*)src;
+    unsigned char key[4];
+    mask_expand_key(key, sizeof(key), mask_key, mask_index);
+
+    size_t i = 0;
+    if (len >= MASK_ALIGN_THRESHOLD)
+    {
+        i = mask_head(d, s, len, key, sizeof(__m256i));
+    }
+
+    unsigned char block_key[sizeof(__m256i)];
+    mask_expand_key(block_key, sizeof(block_key), mask_key,
+                    mask_index + (int64_t)i);
+    __m256i k = _mm256_loadu_si256((const __m256i*)block_key);
+
+    for (; i + 4 * sizeof(__m256i) <= len; i += 4 * sizeof(__m256i))
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*)&s[i]);
+        __m256i b = _mm256_loadu_si256((const __m256i*)&s[i + 32]);
+        __m256i c = _mm256_loadu_si256((const __m256i*)&s[i + 64]);
+        __m256i e = _mm256_loadu_si256((const __m256i*)&s[i + 96]);
+        _mm256_storeu_si256((__m256i*)&d[i], _mm256_xor_si256(a, k));
+        _mm256_storeu_si256((__m256i*)&d[i + 32], _mm256_xor_si256(b, k));
+        _mm256_storeu_si256((__m256i*)&d[i + 64], _mm256_xor_si256(c, k));
+        _mm256_storeu_si256((__m256i*)&d[i + 96], _mm256_xor_si256(e, k));
+    }
+
+    for (; i + sizeof(__m256i) <= len; i += sizeof(__m256i))
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*)&s[i]);
+        _mm256_storeu_si256((__m256i*)&d[i], _mm256_xor_si256(a, k));
+    }
+
+    mask_tail(d, s, i, len, key);
+}
+
+#endif /* MASK_HAVE_X86 */
+
+static bool mask_cpu_supports(mask_impl impl)
+{
+    switch (impl)
+    {
+    case MASK_IMPL_BYTE:
+    case MASK_IMPL_WORD:
+    case MASK_IMPL_BEST:
+        return true;
+    case MASK_IMPL_SSE2:
+#ifdef MASK_HAVE_X86
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse2");
+#else
+        return false;
+#endif
+    case MASK_IMPL_AVX2:
+#ifdef MASK_HAVE_X86
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#else
+        return false;
+#endif
+    case MASK_NUMBER_OF_IMPLS:
+        break;
+    }
+
+    return false;
+}
+
+static mask_func* mask_resolve_best(void)
+{
+#ifdef MASK_HAVE_X86
+    if (mask_cpu_supports(MASK_IMPL_AVX2)) return mask_avx2;
+    if (mask_cpu_supports(MASK_IMPL_SSE2)) return mask_sse2;
+#endif
+    return mask_word;
+}
+
+/*
+ * loops on several threads can get here first at the same time. they all
+ * resolve to the same function, the pointer just has to be read and written
+ * atomically
+ */
+static mask_func* mask_get_best(void)
+{
+    mask_func* best = __atomic_load_n(&g_mask_best, __ATOMIC_ACQUIRE);
+    if (best == NULL)
+    {
+        best = mask_resolve_best();
+        __atomic_store_n(&g_mask_best, best, __ATOMIC_RELEASE);
+    }
+
+    return best;
+}
+
+mask_func* mask_get_impl(mask_impl impl)
+{
+    if (!mask_cpu_supports(impl)) return NULL;
+
+    switch (impl)
+    {
+    case MASK_IMPL_BYTE:
+        return mask_byte;
+    case MASK_IMPL_WORD:
+        return mask_word;
+#ifdef MASK_HAVE_X86
+    case MASK_IMPL_SSE2:
+        return mask_sse2;
+    case MASK_IMPL_AVX2:
+        return mask_avx2;
+#endif
+    case MASK_IMPL_BEST:
+        return mask_get_best();
+    default:
+        return NULL;
+    }
+}
+
+const char* mask_impl_name(mask_impl impl)
+{
+    switch (impl)
+    {
+    case MASK_IMPL_BYTE:
+        return "byte";
+    case MASK_IMPL_WORD:
+        return "word";
+    case MASK_IMPL_SSE2:
+        return "sse2";
+    case MASK_IMPL_AVX2:
+        return "avx2";
+    case MASK_IMPL_BEST:
+        return "best";
+    case MASK_NUMBER_OF_IMPLS:
+        break;
+    }
+
+    hhassert(0);
+    return "unknown";
+}
+
+void mask_apply(char* dest, const char* src, size_t len,
+                const char* mask_key, int64_t mask_index)
+{
+    if (len < MASK_VECTOR_THRESHOLD)
+    {
+        mask_word(dest, src, len, mask_key, mask_index);
+        return;
+    }
+
+    mask_get_best()(dest, src, len, mask_key, mask_index);
+}
@@ -0,0 +1,74 @@
+/* mask - apply/remove WebSocket frame masking (RFC 6455 Section 5.3)
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __MASK_H_
+#define __MASK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "util.h"
+
+typedef enum
+{
+    MASK_IMPL_BYTE,  /* one byte at a time, the reference implementation */
+    MASK_IMPL_WORD,  /* 64 bits at a time, works everywhere */
+    MASK_IMPL_SSE2,  /* 16 bytes at a time, x86 only */
+    MASK_IMPL_AVX2,  /* 32 bytes at a time, x86 only, checked with cpuid */
+    MASK_IMPL_BEST,  /* fastest implementation supported by this cpu */
+    MASK_NUMBER_OF_IMPLS
+} mask_impl;
+
+/*
+ * XOR len bytes of src with mask_key and store the result in dest.
+ * mask_index is the index of the first byte of src in the frame payload, so
+ * the key lines up with where a previous call left off. dest and src may be
+ * the same buffer, or dest may come before src in a buffer (the data gets
+ * moved towards the front), but dest must not start after src.
+ */
+typedef void (mask_func)(char* dest, const char* src, size_t len,
+                         const char* mask_key, int64_t mask_index);
+
+/*
+ * get the masking function for impl, or NULL if this cpu doesn't support it.
+ * MASK_IMPL_BEST is always supported
+ */
+mask_func* mask_get_impl(mask_impl impl);
+
+/* get a printable name for impl */
+const char* mask_impl_name(mask_impl impl);
+
+/*
+ * mask (or unmask, it's the same operation) using the best implementation
+ * for this cpu. see mask_func for a description of the arguments
+ */
+void mask_apply(char* dest, const char* src, size_t len,
+                const char* mask_key, int64_t mask_index);
+
+#endif /* __MASK_H_ */
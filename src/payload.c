@@ -0,0 +1,310 @@
+/* payload - unmask, validate and move frame payloads in one pass
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "payload.h"
+#include "hhassert.h"
+#include "mask.h"
+#include "utf8.h"
+#include "utf8_lookup.h"
+#include "util.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+/*
+ * payloads are processed in blocks this big: small enough that a block
+ * we just unmasked is still in L1 when the validator reads it back
+ */
+#define PAYLOAD_BLOCK_SIZE 4096
+
+/*
+ * every kernel is this with constant flags, so the compiler drops the
+ * branches that don't apply
+ */
+static HH_INLINE void payload_process(char* dest, const char* src,
+                                      size_t len, const char* mask_key,
+                                      int64_t mask_index, uint32_t* state,
+                                      uint32_t* codepoint, bool unmask,
+                                      bool validate, bool move)
+{
+    if (!unmask && !move)
+    {
+        if (validate) utf8_validate(state, codepoint, src, len);
+        return;
+    }
+
+    /* the move we're about to do might write over the key */
+    char key[4];
+    if (unmask) memcpy(key, mask_key, sizeof(key));
+
+    for (size_t off = 0; off < len; off += PAYLOAD_BLOCK_SIZE)
+    {
+        size_t n = hhmin(PAYLOAD_BLOCK_SIZE, len - off);
+        if (unmask)
+        {
+            mask_apply(&dest[off], &src[off], n, key,
+                       mask_index + (int64_t)off);
+        }
+        else
+        {
+            memmove(&dest[off], &src[off], n);
+        }
+
+        /* keep going after a reject, the caller expects it all moved */
+        if (validate && *state != UTF8_REJECT)
+        {
+            utf8_validate(state, codepoint, &dest[off], n);
+        }
+    }
+}
+
+#define PAYLOAD_KERNEL(name, unmask, validate, move)                        \
+    static void name(char* dest, const char* src, size_t len,              \
+                     const char* mask_key, int64_t mask_index,              \
+                     uint32_t* state, uint32_t* codepoint)                  \
+    {                                                                       \
+        payload_process(dest, src, len, mask_key, mask_index, state,       \
+                        codepoint, unmask, validate, move);                 \
+    }
+
+PAYLOAD_KERNEL(payload_none, false, false, false)
+PAYLOAD_KERNEL(payload_unmask, true, false, false)
+PAYLOAD_KERNEL(payload_validate, false, true, false)
+PAYLOAD_KERNEL(payload_unmask_validate, true, true, false)
+PAYLOAD_KERNEL(payload_move, false, false, true)
+PAYLOAD_KERNEL(payload_unmask_move, true, false, true)
+PAYLOAD_KERNEL(payload_validate_move, false, true, true)
+PAYLOAD_KERNEL(payload_unmask_validate_move, true, true, true)
+
+#ifdef UTF8_HAVE_X86
+
+/*
+ * below this, setting up vector keys and validator state costs more than
+ * it saves and the block loop wins
+ */
+#define PAYLOAD_VECTOR_THRESHOLD 128
+
+/*
+ * fill out with the key bytes that line up with payload index
+ * mask_index + 0, 1, 2, ...
+ */
+static void payload_expand_key(char* out, size_t out_len, const char* key,
+                               int64_t mask_index)
+{
+    for (size_t i = 0; i < out_len; i++)
+    {
+        out[i] = key[(size_t)(mask_index + (int64_t)i) & 3];
+    }
+}
+
+/*
+ * unmask a byte at a time while the validator is in the middle of a
+ * character carried over from the last piece, so the vector loop starts
+ * between characters. returns how many bytes were done
+ */
+static size_t payload_finish_char(char* dest, const char* src, size_t len,
+                                  const char* key, int64_t mask_index,
+                                  uint32_t* state, uint32_t* codepoint)
+{
+    size_t i = 0;
+    while (i < len && *state != UTF8_ACCEPT && *state != UTF8_REJECT)
+    {
+        dest[i] = src[i] ^ key[(size_t)(mask_index + (int64_t)i) & 3];
+        utf8_validate(state, codepoint, &dest[i], 1);
+        i++;
+    }
+
+    return i;
+}
+
+/*
+ * the vector loop validated [start, end) except for whether the last
+ * character is complete. unmask the rest and run the streaming validator
+ * from where that character starts to the end
+ */
+static void payload_finish(char* dest, const char* src, size_t start,
+                           size_t end, size_t len, const char* key,
+                           int64_t mask_index, uint32_t* state,
+                           uint32_t* codepoint)
+{
+    mask_apply(&dest[end], &src[end], len - end, key,
+               mask_index + (int64_t)end);
+
+    size_t p = start + utf8_last_boundary((const uint8_t*)&dest[start],
+                                          end - start);
+    utf8_validate(state, codepoint, &dest[p], len - p);
+}
+
+/*
+ * unmask, move if dest != src, and validate, 16 bytes at a time. each
+ * block goes from src into a register, gets unmasked, stored and fed to
+ * the validator without being read back from memory
+ */
+UTF8_TARGET("ssse3")
+static void payload_unmask_validate_ssse3(char* dest, const char* src,
+                                          size_t len, const char* mask_key,
+                                          int64_t mask_index,
+                                          uint32_t* state,
+                                          uint32_t* codepoint)
+{
+    char key[4];
+    memcpy(key, mask_key, sizeof(key));
+
+    size_t i = payload_finish_char(dest, src, len, key, mask_index, state,
+                                   codepoint);
+    if (*state == UTF8_REJECT || len - i < PAYLOAD_VECTOR_THRESHOLD)
+    {
+        payload_process(&dest[i], &src[i], len - i, key,
+                        mask_index + (int64_t)i, state, codepoint, true,
+                        true, true);
+        return;
+    }
+
+    char block_key[sizeof(__m128i)];
+    payload_expand_key(block_key, sizeof(block_key), key,
+                       mask_index + (int64_t)i);
+    __m128i k = _mm_loadu_si128((const __m128i*)block_key);
+
+    utf8_sse_state st;
+    st.prev_input = _mm_setzero_si128();
+    st.prev_incomplete = _mm_setzero_si128();
+    st.error = _mm_setzero_si128();
+
+    size_t start = i;
+    for (; i + sizeof(__m128i) <= len; i += sizeof(__m128i))
+    {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i*)&src[i]),
+                                  k);
+        _mm_storeu_si128((__m128i*)&dest[i], v);
+        utf8_check_ssse3(&st, v);
+    }
+
+    __m128i zero = _mm_setzero_si128();
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(st.error, zero)) != 0xffff)
+    {
+        *state = UTF8_REJECT;
+        mask_apply(&dest[i], &src[i], len - i, key, mask_index + (int64_t)i);
+        return;
+    }
+
+    payload_finish(dest, src, start, i, len, key, mask_index, state,
+                   codepoint);
+}
+
+/* the same, 32 bytes at a time */
+UTF8_TARGET("avx2")
+static void payload_unmask_validate_avx2(char* dest, const char* src,
+                                         size_t len, const char* mask_key,
+                                         int64_t mask_index, uint32_t* state,
+                                         uint32_t* codepoint)
+{
+    char key[4];
+    memcpy(key, mask_key, sizeof(key));
+
+    size_t i = payload_finish_char(dest, src, len, key, mask_index, state,
+                                   codepoint);
+    if (*state == UTF8_REJECT || len - i < PAYLOAD_VECTOR_THRESHOLD)
+    {
+        payload_process(&dest[i], &src[i], len - i, key,
+                        mask_index + (int64_t)i, state, codepoint, true,
+                        true, true);
+        return;
+    }
+
+    char block_key[sizeof(__m256i)];
+    payload_expand_key(block_key, sizeof(block_key), key,
+                       mask_index + (int64_t)i);
+    __m256i k = _mm256_loadu_si256((const __m256i*)block_key);
+
+    utf8_avx_state st;
+    st.prev_input = _mm256_setzero_si256();
+    st.prev_incomplete = _mm256_setzero_si256();
+    st.error = _mm256_setzero_si256();
+
+    size_t start = i;
+    for (; i + sizeof(__m256i) <= len; i += sizeof(__m256i))
+    {
+        __m256i v = _mm256_xor_si256(
+            _mm256_loadu_si256((const __m256i*)&src[i]), k);
+        _mm256_storeu_si256((__m256i*)&dest[i], v);
+        utf8_check_avx2(&st, v);
+    }
+
+    if (!_mm256_testz_si256(st.error, st.error))
+    {
+        *state = UTF8_REJECT;
+        mask_apply(&dest[i], &src[i], len - i, key, mask_index + (int64_t)i);
+        return;
+    }
+
+    payload_finish(dest, src, start, i, len, key, mask_index, state,
+                   codepoint);
+}
+
+#endif /* UTF8_HAVE_X86 */
+
+/* indexed by payload_flags */
+static payload_kernel* const g_payload_kernels[PAYLOAD_NUMBER_OF_KERNELS] =
+{
+    payload_none,
+    payload_unmask,
+    payload_validate,
+    payload_unmask_validate,
+    payload_move,
+    payload_unmask_move,
+    payload_validate_move,
+    payload_unmask_validate_move
+};
+
+payload_kernel* payload_get_kernel(int flags)
+{
+    hhassert(flags >= 0 && flags < PAYLOAD_NUMBER_OF_KERNELS);
+
+#ifdef UTF8_HAVE_X86
+    /*
+     * text frames from clients are always masked, so that's the one that
+     * gets a hand written vector kernel. it moves too when dest != src
+     */
+    if ((flags & (PAYLOAD_UNMASK | PAYLOAD_VALIDATE)) ==
+        (PAYLOAD_UNMASK | PAYLOAD_VALIDATE))
+    {
+        if (utf8_get_impl(UTF8_IMPL_AVX2) != NULL)
+        {
+            return payload_unmask_validate_avx2;
+        }
+        if (utf8_get_impl(UTF8_IMPL_SSSE3) != NULL)
+        {
+            return payload_unmask_validate_ssse3;
+        }
+    }
+#endif
+
+    return g_payload_kernels[flags];
+}
@@ -0,0 +1,63 @@
+/* payload - unmask, validate and move frame payloads in one pass
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __PAYLOAD_H_
+#define __PAYLOAD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* what a payload kernel does, or these together for payload_get_kernel */
+typedef enum
+{
+    PAYLOAD_UNMASK = 1 << 0,   /* xor with the masking key */
+    PAYLOAD_VALIDATE = 1 << 1, /* run the UTF-8 validator over the result */
+    PAYLOAD_MOVE = 1 << 2,     /* result goes to dest instead of src */
+    PAYLOAD_NUMBER_OF_KERNELS = 1 << 3
+} payload_flags;
+
+/*
+ * process len bytes of payload from src. mask_key and mask_index are only
+ * used with PAYLOAD_UNMASK, state and codepoint only with PAYLOAD_VALIDATE
+ * (see utf8_validate). With PAYLOAD_MOVE dest may be another buffer or
+ * earlier in the same one, without it dest must be src. mask_key may point
+ * into the data being moved over.
+ */
+typedef void (payload_kernel)(char* dest, const char* src, size_t len,
+                              const char* mask_key, int64_t mask_index,
+                              uint32_t* state, uint32_t* codepoint);
+
+/*
+ * get the kernel for flags, a combination of payload_flags. Picked once
+ * per frame, so nothing on the per-byte path branches on what to do.
+ */
+payload_kernel* payload_get_kernel(int flags);
+
+#endif /* __PAYLOAD_H_ */
@@ -30,6 +30,10 @@
 
 #ifdef __linux__
     #define HAVE_EPOLL
+    #define HAVE_IO_URING
+    #define HAVE_REUSEPORT_CBPF
+    #define HAVE_EVENTFD
+    #define HAVE_ACCEPT4
 #else
     #define HAVE_POLL
 #endif
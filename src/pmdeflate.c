@@ -0,0 +1,619 @@
+/* pmdeflate - permessage-deflate (RFC 7692) negotiation and compression
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "hhassert.h"
+#include "hhmemory.h"
+#include "pmdeflate.h"
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+/*
+ * every message is compressed with a sync flush, which always ends in this
+ * empty stored block. it's left off on the wire (Section 7.2.1)
+ */
+static const char g_tail[] = { 0x00, 0x00, (char)0xff, (char)0xff };
+#define TAIL_LEN sizeof(g_tail)
+
+/* zlib can't compress with a 256 byte window, so we never ask for one */
+#define MIN_WINDOW_BITS 9
+#define MAX_WINDOW_BITS 15
+#define DEFAULT_MEM_LEVEL 8
+
+/* generous sizes of zlib's deflate_state and inflate_state */
+#define DEFLATE_STATE_LEN (6 * 1024)
+#define INFLATE_STATE_LEN (8 * 1024)
+
+/* how much room to make for output at a time when inflating */
+#define INFLATE_CHUNK_LEN (16 * 1024)
+
+/* output buffers are trimmed back toward this after a large message */
+#define INIT_BUF_LEN 1024
+
+/* zlib allocations are prefixed with their size, so the cap can be kept */
+#define ALLOC_HDR_LEN 16
+
+struct pmdeflate
+{
+    z_stream deflater;
+    z_stream inflater;
+    bool deflater_init;
+    bool inflater_init;
+    pmdeflate_params params;
+
+    /*
+     * compressed and decompressed output. kept apart so a message handler
+     * can send while the message it was given is still in use
+     */
+    darray* write_buf;
+    darray* read_buf;
+
+    size_t mem_used; /* bytes zlib has allocated */
+    int64_t max_mem;
+};
+
+/* parameters of one offer or response, as they appeared */
+typedef struct
+{
+    int server_max_window_bits; /* 0 if not sent */
+    int client_max_window_bits; /* 0 if not sent, -1 if sent without value */
+    bool server_no_context_takeover;
+    bool client_no_context_takeover;
+} ext_params;
+
+static const char* skip_space(const char* p)
+{
+    while (*p != '\0' && isspace((unsigned char)*p)) p++;
+    return p;
+}
+
+static bool param_is(const char* name, size_t len, const char* expected)
+{
+    return strlen(expected) == len && strncasecmp(name, expected, len) == 0;
+}
+
+/*
+ * parse an extension value like "permessage-deflate; a=10; b". fails on
+ * anything unknown, repeated or out of range, since a client must not
+ * accept those and a server should decline the offer (Section 7)
+ */
+static bool parse_params(const char* ext, ext_params* params)
+{
+    memset(params, 0, sizeof(*params));
+    if (!pmdeflate_is_extension(ext)) return false;
+
+    const char* p = ext + sizeof(PMDEFLATE_EXTENSION_NAME) - 1;
+    while (true)
+    {
+        p = skip_space(p);
+        if (*p == '\0') return true;
+        if (*p != ';') return false;
+        p = skip_space(p + 1);
+
+        const char* name = p;
+        while (*p != '\0' && *p != '=' && *p != ';' &&
+               !isspace((unsigned char)*p))
+        {
+            p++;
+        }
+        size_t name_len = (size_t)(p - name);
+        p = skip_space(p);
+
+        /* the only values we know are window sizes, possibly quoted */
+        int value = -1;
+        if (*p == '=')
+        {
+            p = skip_space(p + 1);
+            bool quoted = (*p == '"');
+            if (quoted) p++;
+            if (!isdigit((unsigned char)*p)) return false;
+
+            value = 0;
+            while (isdigit((unsigned char)*p))
+            {
+                value = value * 10 + (*p - '0');
+                if (value > MAX_WINDOW_BITS) return false;
+                p++;
+            }
+            if (quoted && *(p++) != '"') return false;
+            if (value < 8) return false;
+        }
+
+        if (param_is(name, name_len, "server_no_context_takeover"))
+        {
+            if (value != -1 || params->server_no_context_takeover)
+            {
+                return false;
+            }
+            params->server_no_context_takeover = true;
+        }
+        else if (param_is(name, name_len, "client_no_context_takeover"))
+        {
+            if (value != -1 || params->client_no_context_takeover)
+            {
+                return false;
+            }
+            params->client_no_context_takeover = true;
+        }
+        else if (param_is(name, name_len, "server_max_window_bits"))
+        {
+            if (value == -1 || params->server_max_window_bits != 0)
+            {
+                return false;
+            }
+            params->server_max_window_bits = value;
+        }
+        else if (param_is(name, name_len, "client_max_window_bits"))
+        {
+            if (params->client_max_window_bits != 0) return false;
+            params->client_max_window_bits = value;
+        }
+        else
+        {
+            return false;
+        }
+    }
+}
+
+static size_t deflate_mem(int window_bits, int mem_level)
+{
+    /* see the memory footprint notes in zconf.h */
+    return ((size_t)1 << (window_bits + 2)) +
+           ((size_t)1 << (mem_level + 9)) + DEFLATE_STATE_LEN;
+}
+
+static size_t inflate_mem(int window_bits)
+{
+    return ((size_t)1 << window_bits) + INFLATE_STATE_LEN;
+}
+
+/*
+ * shrink whichever of the compressor window, its hash tables and the
+ * decompressor window is biggest until they all fit in max_mem. the
+ * decompressor window can only be shrunk if the peer lets us choose it
+ */
+static bool fit_mem(pmdeflate_params* params, int64_t max_mem,
+                    bool can_shrink_read)
+{
+    if (max_mem < 0) return true;
+
+    while (deflate_mem(params->write_window_bits, params->mem_level) +
+           inflate_mem(params->read_window_bits) > (size_t)max_mem)
+    {
+        size_t window = (params->write_window_bits > MIN_WINDOW_BITS) ?
+            (size_t)1 << (params->write_window_bits + 2) : 0;
+        size_t hash = (params->mem_level > 1) ?
+            (size_t)1 << (params->mem_level + 9) : 0;
+        size_t read = (can_shrink_read &&
+                       params->read_window_bits > MIN_WINDOW_BITS) ?
+            (size_t)1 << params->read_window_bits : 0;
+
+        if (window == 0 && hash == 0 && read == 0) return false;
+
+        if (window >= hash && window >= read)
+        {
+            params->write_window_bits--;
+        }
+        else if (read >= hash)
+        {
+            params->read_window_bits--;
+        }
+        else
+        {
+            params->mem_level--;
+        }
+    }
+
+    return true;
+}
+
+/* what we'd like to use, before hearing from the peer */
+static void init_params(const pmdeflate_settings* settings,
+                        pmdeflate_params* params)
+{
+    int bits = settings->max_window_bits;
+    if (bits < MIN_WINDOW_BITS || bits > MAX_WINDOW_BITS)
+    {
+        bits = MAX_WINDOW_BITS;
+    }
+
+    params->write_window_bits = bits;
+    params->read_window_bits = bits;
+    params->mem_level = DEFAULT_MEM_LEVEL;
+    params->write_no_context_takeover = settings->no_context_takeover;
+    params->read_no_context_takeover = settings->peer_no_context_takeover;
+}
+
+bool pmdeflate_is_extension(const char* extension)
+{
+    size_t len = sizeof(PMDEFLATE_EXTENSION_NAME) - 1;
+    if (strncasecmp(extension, PMDEFLATE_EXTENSION_NAME, len) != 0)
+    {
+        return false;
+    }
+
+    char next = extension[len];
+    return next == '\0' || next == ';' || isspace((unsigned char)next);
+}
+
+bool pmdeflate_accept_offer(const char* offer,
+                            const pmdeflate_settings* settings,
+                            pmdeflate_params* params)
+{
+    ext_params ext;
+    if (!parse_params(offer, &ext)) return false;
+
+    init_params(settings, params);
+
+    /* our window can be smaller than the client allows, never bigger */
+    if (ext.server_max_window_bits != 0)
+    {
+        if (ext.server_max_window_bits < MIN_WINDOW_BITS) return false;
+        params->write_window_bits =
+            hhmin(params->write_window_bits, ext.server_max_window_bits);
+    }
+
+    /* the client's window is only ours to pick if it says so */
+    bool can_shrink_read = (ext.client_max_window_bits != 0);
+    if (ext.client_max_window_bits > 0)
+    {
+        params->read_window_bits =
+            hhmin(params->read_window_bits, ext.client_max_window_bits);
+    }
+    else if (ext.client_max_window_bits == 0)
+    {
+        params->read_window_bits = MAX_WINDOW_BITS;
+    }
+
+    if (ext.server_no_context_takeover)
+    {
+        params->write_no_context_takeover = true;
+    }
+    if (ext.client_no_context_takeover)
+    {
+        params->read_no_context_takeover = true;
+    }
+
+    return fit_mem(params, settings->max_mem, can_shrink_read);
+}
+
+bool pmdeflate_make_offer(const pmdeflate_settings* settings,
+                          pmdeflate_params* params)
+{
+    init_params(settings, params);
+    return fit_mem(params, settings->max_mem, true);
+}
+
+bool pmdeflate_confirm_response(const char* response,
+                                const pmdeflate_params* offered,
+                                pmdeflate_params* params)
+{
+    ext_params ext;
+    if (!parse_params(response, &ext)) return false;
+
+    *params = *offered;
+
+    /*
+     * the server's window. it must answer a limit we asked for, and can't
+     * go over it
+     */
+    if (ext.server_max_window_bits != 0)
+    {
+        if (ext.server_max_window_bits > offered->read_window_bits)
+        {
+            return false;
+        }
+        params->read_window_bits = ext.server_max_window_bits;
+    }
+    else if (offered->read_window_bits < MAX_WINDOW_BITS)
+    {
+        return false;
+    }
+
+    /* our window, which the server may lower */
+    if (ext.client_max_window_bits != 0)
+    {
+        if (ext.client_max_window_bits < MIN_WINDOW_BITS ||
+            ext.client_max_window_bits > offered->write_window_bits)
+        {
+            return false;
+        }
+        params->write_window_bits = ext.client_max_window_bits;
+    }
+
+    if (offered->read_no_context_takeover && !ext.server_no_context_takeover)
+    {
+        return false;
+    }
+    params->read_no_context_takeover = ext.server_no_context_takeover;
+    params->write_no_context_takeover =
+        offered->write_no_context_takeover || ext.client_no_context_takeover;
+
+    return true;
+}
+
+size_t pmdeflate_write_params(const pmdeflate_params* params, bool is_server,
+                              char* buf, size_t len)
+{
+    const char* ours = is_server ? "server" : "client";
+    const char* peers = is_server ? "client" : "server";
+
+    int n = snprintf(buf, len, "%s", PMDEFLATE_EXTENSION_NAME);
+    if (params->write_window_bits < MAX_WINDOW_BITS)
+    {
+        n += snprintf(&buf[n], len - (size_t)n, "; %s_max_window_bits=%d",
+                      ours, params->write_window_bits);
+    }
+    else if (!is_server)
+    {
+        /* let the server shrink our window if it wants to save memory */
+        n += snprintf(&buf[n], len - (size_t)n, "; %s_max_window_bits",
+                      ours);
+    }
+
+    if (params->read_window_bits < MAX_WINDOW_BITS)
+    {
+        n += snprintf(&buf[n], len - (size_t)n, "; %s_max_window_bits=%d",
+                      peers, params->read_window_bits);
+    }
+
+    if (params->write_no_context_takeover)
+    {
+        n += snprintf(&buf[n], len - (size_t)n, "; %s_no_context_takeover",
+                      ours);
+    }
+
+    if (params->read_no_context_takeover)
+    {
+        n += snprintf(&buf[n], len - (size_t)n, "; %s_no_context_takeover",
+                      peers);
+    }
+
+    hhassert(n > 0 && (size_t)n < len);
+    return (size_t)n;
+}
+
+static voidpf capped_alloc(voidpf opaque, uInt items, uInt size)
+{
+    pmdeflate* pmd = opaque;
+    size_t len = (size_t)items * size;
+    if (pmd->max_mem >= 0 && pmd->mem_used + len > (size_t)pmd->max_mem)
+    {
+        return Z_NULL;
+    }
+
+    char* p = hhmalloc(ALLOC_HDR_LEN + len);
+    if (p == NULL) return Z_NULL;
+
+    memcpy(p, &len, sizeof(len));
+    pmd->mem_used += len;
+    return p + ALLOC_HDR_LEN;
+}
+
+static void capped_free(voidpf opaque, voidpf address)
+{
+    pmdeflate* pmd = opaque;
+    char* p = (char*)address - ALLOC_HDR_LEN;
+
+    size_t len;
+    memcpy(&len, p, sizeof(len));
+    pmd->mem_used -= len;
+    hhfree(p);
+}
+
+pmdeflate* pmdeflate_create(const pmdeflate_params* params, int level,
+                            int64_t max_mem)
+{
+    pmdeflate* pmd = hhmalloc(sizeof(*pmd));
+    if (pmd == NULL) return NULL;
+
+    memset(pmd, 0, sizeof(*pmd));
+    pmd->params = *params;
+    pmd->max_mem = max_mem;
+    pmd->deflater.zalloc = capped_alloc;
+    pmd->deflater.zfree = capped_free;
+    pmd->deflater.opaque = pmd;
+    pmd->inflater.zalloc = capped_alloc;
+    pmd->inflater.zfree = capped_free;
+    pmd->inflater.opaque = pmd;
+
+    pmd->write_buf = darray_create(sizeof(char), INIT_BUF_LEN);
+    pmd->read_buf = darray_create(sizeof(char), INIT_BUF_LEN);
+    if (pmd->write_buf == NULL || pmd->read_buf == NULL) goto create_error;
+
+    if (level < 1 || level > 9) level = Z_DEFAULT_COMPRESSION;
+
+    /* negative window bits for raw deflate, without a zlib header */
+    if (deflateInit2(&pmd->deflater, level, Z_DEFLATED,
+                     -params->write_window_bits, params->mem_level,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        goto create_error;
+    }
+    pmd->deflater_init = true;
+
+    if (inflateInit2(&pmd->inflater, -params->read_window_bits) != Z_OK)
+    {
+        goto create_error;
+    }
+    pmd->inflater_init = true;
+
+    return pmd;
+
+create_error:
+    pmdeflate_destroy(pmd);
+    return NULL;
+}
+
+void pmdeflate_destroy(pmdeflate* pmd)
+{
+    if (pmd == NULL) return;
+
+    if (pmd->deflater_init) deflateEnd(&pmd->deflater);
+    if (pmd->inflater_init) inflateEnd(&pmd->inflater);
+    if (pmd->write_buf != NULL) darray_destroy(pmd->write_buf);
+    if (pmd->read_buf != NULL) darray_destroy(pmd->read_buf);
+    hhfree(pmd);
+}
+
+/* empty buf for a new message, giving back memory a big one left behind */
+static void reset_buf(darray** buf, size_t expected_len)
+{
+    darray_clear(*buf);
+
+    size_t keep = hhmax(expected_len, INIT_BUF_LEN);
+    if (darray_get_size_reserved(*buf) > 2 * keep)
+    {
+        darray_trim_reserved(buf, keep);
+    }
+}
+
+pmdeflate_result pmdeflate_compress(pmdeflate* pmd, const char* data,
+                                    size_t len, const char** out,
+                                    size_t* out_len)
+{
+    z_stream* strm = &pmd->deflater;
+    hhassert(len <= UINT_MAX);
+
+    strm->next_in = (Bytef*)data;
+    strm->avail_in = (uInt)len;
+
+    /* room for the whole message, plus the flush, usually does it in one */
+    size_t room = deflateBound(strm, (uLong)len) + TAIL_LEN + 1;
+    reset_buf(&pmd->write_buf, room);
+
+    do
+    {
+        char* buf = darray_ensure(&pmd->write_buf, room);
+        buf = &buf[darray_get_len(pmd->write_buf)];
+        strm->next_out = (Bytef*)buf;
+        strm->avail_out = (uInt)room;
+
+        int zr = deflate(strm, Z_SYNC_FLUSH);
+        if (zr != Z_OK && zr != Z_BUF_ERROR) return PMDEFLATE_ERROR;
+
+        darray_add_len(pmd->write_buf, room - strm->avail_out);
+    } while (strm->avail_out == 0);
+
+    size_t total = darray_get_len(pmd->write_buf);
+    char* buf = darray_get_data(pmd->write_buf);
+    hhassert(total >= TAIL_LEN);
+    hhassert(memcmp(&buf[total - TAIL_LEN], g_tail, TAIL_LEN) == 0);
+
+    if (pmd->params.write_no_context_takeover &&
+        deflateReset(strm) != Z_OK)
+    {
+        return PMDEFLATE_ERROR;
+    }
+
+    *out = buf;
+    *out_len = total - TAIL_LEN;
+    return PMDEFLATE_SUCCESS;
+}
+
+/* inflate len bytes of data onto the end of read_buf */
+static pmdeflate_result inflate_input(pmdeflate* pmd, const char* data,
+                                      size_t len, int64_t max_len)
+{
+    z_stream* strm = &pmd->inflater;
+    hhassert(len <= UINT_MAX);
+
+    strm->next_in = (Bytef*)data;
+    strm->avail_in = (uInt)len;
+
+    do
+    {
+        char* buf = darray_ensure(&pmd->read_buf, INFLATE_CHUNK_LEN);
+        buf = &buf[darray_get_len(pmd->read_buf)];
+        strm->next_out = (Bytef*)buf;
+        strm->avail_out = INFLATE_CHUNK_LEN;
+
+        int zr = inflate(strm, Z_SYNC_FLUSH);
+        darray_add_len(pmd->read_buf, INFLATE_CHUNK_LEN - strm->avail_out);
+
+        /* stop a small message from inflating into a huge one */
+        if (max_len >= 0 && darray_get_len(pmd->read_buf) > (size_t)max_len)
+        {
+            return PMDEFLATE_TOO_LARGE;
+        }
+
+        switch (zr)
+        {
+        case Z_OK:
+            break;
+        case Z_STREAM_END:
+            /* the peer ended with a final block, the next one starts over */
+            if (inflateReset(strm) != Z_OK) return PMDEFLATE_ERROR;
+            break;
+        case Z_BUF_ERROR:
+            /* nothing left to inflate */
+            if (strm->avail_in == 0) return PMDEFLATE_SUCCESS;
+            return PMDEFLATE_ERROR;
+        default:
+            return PMDEFLATE_ERROR;
+        }
+    } while (strm->avail_in > 0 || strm->avail_out == 0);
+
+    return PMDEFLATE_SUCCESS;
+}
+
+pmdeflate_result pmdeflate_decompress(pmdeflate* pmd, const char* data,
+                                      size_t len, int64_t max_len,
+                                      char** out, size_t* out_len)
+{
+    reset_buf(&pmd->read_buf, 2 * len + INFLATE_CHUNK_LEN);
+
+    /* put back the tail the sender left off */
+    pmdeflate_result r = inflate_input(pmd, data, len, max_len);
+    if (r == PMDEFLATE_SUCCESS)
+    {
+        r = inflate_input(pmd, g_tail, TAIL_LEN, max_len);
+    }
+    if (r != PMDEFLATE_SUCCESS) return r;
+
+    if (pmd->params.read_no_context_takeover &&
+        inflateReset(&pmd->inflater) != Z_OK)
+    {
+        return PMDEFLATE_ERROR;
+    }
+
+    *out = darray_get_data(pmd->read_buf);
+    *out_len = darray_get_len(pmd->read_buf);
+    return PMDEFLATE_SUCCESS;
+}
+
+size_t pmdeflate_get_mem_used(pmdeflate* pmd)
+{
+    return pmd->mem_used;
+}
@@ -0,0 +1,158 @@
+/* pmdeflate - permessage-deflate (RFC 7692) negotiation and compression
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __PMDEFLATE_H_
+#define __PMDEFLATE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "darray.h"
+#include "util.h"
+
+/* name of the extension in Sec-WebSocket-Extensions */
+#define PMDEFLATE_EXTENSION_NAME "permessage-deflate"
+
+/* longest offer or response pmdeflate_write_params can produce */
+#define PMDEFLATE_MAX_PARAMS_LEN 128
+
+/* settings for permessage-deflate, part of protocol_settings */
+typedef struct
+{
+    /* offer (client) or accept (server) permessage-deflate */
+    bool enabled;
+
+    /* zlib compression level, 1 (fastest) to 9 (smallest), else default */
+    int level;
+
+    /*
+     * largest LZ77 window, as a power of two (9-15, else 15), used for
+     * compressing and asked of the peer when it lets us choose
+     */
+    int max_window_bits;
+
+    /* reset our compressor after every message */
+    bool no_context_takeover;
+
+    /* ask the peer to reset its compressor after every message */
+    bool peer_no_context_takeover;
+
+    /*
+     * cap on the compressor and decompressor state kept for each connection,
+     * in bytes. windows are shrunk during negotiation to fit, and the
+     * extension is declined if they can't. -1 is no limit
+     */
+    int64_t max_mem;
+} pmdeflate_settings;
+
+/* parameters of a negotiated extension, from one endpoint's point of view */
+typedef struct
+{
+    int write_window_bits; /* window our compressor uses */
+    int read_window_bits; /* largest window the peer's compressor uses */
+    int mem_level; /* zlib memLevel for our compressor */
+    bool write_no_context_takeover;
+    bool read_no_context_takeover;
+} pmdeflate_params;
+
+typedef enum
+{
+    PMDEFLATE_SUCCESS,
+    PMDEFLATE_TOO_LARGE,
+    PMDEFLATE_ERROR
+} pmdeflate_result;
+
+/* compression state for one connection */
+typedef struct pmdeflate pmdeflate;
+
+/* does this Sec-WebSocket-Extensions value name permessage-deflate? */
+bool pmdeflate_is_extension(const char* extension);
+
+/*
+ * server: decide whether to accept the client's offer, an extension value
+ * like "permessage-deflate; client_max_window_bits". on success, params is
+ * filled in with what to respond with and use
+ */
+bool pmdeflate_accept_offer(const char* offer,
+                            const pmdeflate_settings* settings,
+                            pmdeflate_params* params);
+
+/*
+ * client: fill in params with what to offer. false if no offer fits in
+ * settings->max_mem
+ */
+bool pmdeflate_make_offer(const pmdeflate_settings* settings,
+                          pmdeflate_params* params);
+
+/*
+ * client: check the server's response against what we offered, and fill in
+ * params with what to use. false if the client must fail the connection
+ */
+bool pmdeflate_confirm_response(const char* response,
+                                const pmdeflate_params* offered,
+                                pmdeflate_params* params);
+
+/*
+ * write the extension value for params as an offer (client) or response
+ * (server) to buf, which should be PMDEFLATE_MAX_PARAMS_LEN bytes. returns
+ * the length written, not counting the terminator
+ */
+size_t pmdeflate_write_params(const pmdeflate_params* params, bool is_server,
+                              char* buf, size_t len);
+
+/*
+ * create the compressor and decompressor for a negotiated extension. NULL if
+ * their state won't fit in max_mem (-1 is no limit)
+ */
+pmdeflate* pmdeflate_create(const pmdeflate_params* params, int level,
+                            int64_t max_mem);
+
+void pmdeflate_destroy(pmdeflate* pmd);
+
+/*
+ * compress a message. out points at the compressed payload, which is valid
+ * until the next call to pmdeflate_compress
+ */
+pmdeflate_result pmdeflate_compress(pmdeflate* pmd, const char* data,
+                                    size_t len, const char** out,
+                                    size_t* out_len);
+
+/*
+ * decompress a whole message payload. fails with PMDEFLATE_TOO_LARGE as
+ * soon as the output passes max_len (-1 is no limit). out is valid until
+ * the next call to pmdeflate_decompress
+ */
+pmdeflate_result pmdeflate_decompress(pmdeflate* pmd, const char* data,
+                                      size_t len, int64_t max_len,
+                                      char** out, size_t* out_len);
+
+/* bytes of compressor and decompressor state currently allocated */
+size_t pmdeflate_get_mem_used(pmdeflate* pmd);
+
+#endif /* __PMDEFLATE_H_ */
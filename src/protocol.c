@@ -32,9 +32,13 @@
 #include "error_code.h"
 #include "hhassert.h"
 #include "hhmemory.h"
+#include "mask.h"
+#include "payload.h"
+#include "pmdeflate.h"
 #include "protocol.h"
-#include "sha1/sha1.h"
+#include "utf8.h"
 #include "util.h"
+#include "wsaccept.h"
 
 #include <ctype.h>
 #include <stdint.h>
@@ -54,6 +58,9 @@ typedef enum
 #define KEY_LEN 16
 #define BASE64_MAX_OUTPUT_LEN(n) ((4 * (((n) + 3) / 3)) + 1)
 
+/* data messages shorter than this aren't worth deflating */
+#define DEFLATE_MIN_MSG_LEN 32
+
 static const char g_header_template[] = "%s: %s\r\n";
 #define HEADER_TEMPLATE_LEN 5 /* colon,<space>\r,\n,null  */
 
@@ -148,133 +155,155 @@ static int get_num_extra_len_bytes(int64_t payload_len)
     }
 }
 
+static bool is_comma_delimited_header(const char* header)
+{
+    static const char* comma_headers[] =
+    {
+        HEADER_PROTOCOL,
+        HEADER_EXTENSION,
+        "Accept-Encoding",
+        "TE"
+    };
+
+    for (unsigned int i = 0; i < hhcountof(comma_headers); i++)
+    {
+        if (strcmp(header, comma_headers[i]) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* names of the known headers, in protocol_known_header order */
+static const char* g_known_header_names[PROTOCOL_NUMBER_OF_KNOWN_HEADERS] =
+{
+    "Host",
+    "Upgrade",
+    "Origin",
+    "Connection",
+    HEADER_KEY,
+    "Sec-WebSocket-Accept",
+    "Sec-WebSocket-Version",
+    HEADER_PROTOCOL,
+    HEADER_EXTENSION
+};
+
 /*
- * Copyright (c) 2008-2009 Bjoern Hoehrmann <bjoern@hoehrmann.de>
- * See http://bjoern.hoehrmann.de/utf-8/decoder/dfa/ for details.
+ * the known header names all have different lengths, so the length is a
+ * perfect hash for them: it picks out the only candidate, and one
+ * strcasecmp says whether it's a match. entries are the
+ * protocol_known_header + 1, 0 means nothing is that long
  */
-
-#define UTF8_ACCEPT 0
-#define UTF8_REJECT 1
-
-static const uint32_t utf8d[] = {
-    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // 00..1f
-    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // 20..3f
-    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // 40..5f
-    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // 60..7f
-    1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, // 80..9f
-    7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7, // a0..bf
-    8,8,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2, // c0..df
-    0xa,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x4,0x3,0x3, // e0..ef
-    0xb,0x6,0x6,0x6,0x5,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8, // f0..ff
-    0x0,0x1,0x2,0x3,0x5,0x8,0x7,0x1,0x1,0x1,0x4,0x6,0x1,0x1,0x1,0x1, // s0..s0
-    1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,0,1,1,1,1,1,0,1,0,1,1,1,1,1,1, // s1..s2
-    1,2,1,1,1,1,1,2,1,2,1,1,1,1,1,1,1,1,1,1,1,1,1,2,1,1,1,1,1,1,1,1, // s3..s4
-    1,2,1,1,1,1,1,1,1,2,1,1,1,1,1,1,1,1,1,1,1,1,1,3,1,3,1,1,1,1,1,1, // s5..s6
-    1,3,1,1,1,1,1,3,1,3,1,1,1,1,1,1,1,3,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // s7..s8
+#define KNOWN_HEADER_MAX_LEN 24
+static const uint8_t g_known_header_by_len[KNOWN_HEADER_MAX_LEN + 1] =
+{
+    [4] = PROTOCOL_HEADER_HOST + 1,
+    [7] = PROTOCOL_HEADER_UPGRADE + 1,
+    [6] = PROTOCOL_HEADER_ORIGIN + 1,
+    [10] = PROTOCOL_HEADER_CONNECTION + 1,
+    [17] = PROTOCOL_HEADER_SEC_KEY + 1,
+    [20] = PROTOCOL_HEADER_SEC_ACCEPT + 1,
+    [21] = PROTOCOL_HEADER_SEC_VERSION + 1,
+    [22] = PROTOCOL_HEADER_SEC_PROTOCOL + 1,
+    [24] = PROTOCOL_HEADER_SEC_EXTENSIONS + 1
 };
 
-static HH_INLINE uint32_t utf8_decode(uint32_t* state, uint32_t* codep,
-                                      uint32_t byte)
+/* returns the protocol_known_header for name, or -1 if it isn't one */
+static int known_header_from_name(const char* name, size_t name_len)
 {
-    uint32_t type = utf8d[byte];
+    if (name_len > KNOWN_HEADER_MAX_LEN) return -1;
 
-    *codep = (*state != UTF8_ACCEPT) ?
-        (byte & 0x3fu) | (*codep << 6) :
-        (0xff >> type) & (byte);
+    int known = (int)g_known_header_by_len[name_len] - 1;
+    if (known < 0 || strcasecmp(name, g_known_header_names[known]) != 0)
+    {
+        return -1;
+    }
 
-    *state = utf8d[256 + *state*16 + type];
-    return *state;
+    return known;
 }
 
-static bool is_valid_utf8(const char* str, int64_t length)
+static void reset_known_headers(protocol_handshake* info)
 {
-    uint32_t codepoint, state = 0;
-    const uint8_t* s = (const uint8_t*)str;
-    const uint8_t* end = s + length;
-    while (s != end)
+    for (int i = 0; i < PROTOCOL_NUMBER_OF_KNOWN_HEADERS; i++)
     {
-        utf8_decode(&state, &codepoint, *s++);
+        info->known[i] = -1;
     }
-
-    return state == UTF8_ACCEPT;
 }
 
-static void mask_data(char* data, size_t len, char* mask_key,
-                      int64_t mask_index, bool validate_utf8, uint32_t* state,
-                      uint32_t* codepoint)
+/* index in info->headers of the header called name, or -1 */
+static int find_header(protocol_handshake* info, const char* name,
+                       size_t name_len)
 {
-    uint8_t* d = (uint8_t*)data;
+    int known = known_header_from_name(name, name_len);
+    if (known >= 0) return info->known[known];
+    if (info->headers == NULL) return -1;
 
-    for (size_t i = 0; i < len; i++)
+    const char* buf = darray_get_data(info->buffer);
+    protocol_header* headers = darray_get_data(info->headers);
+    size_t num_headers = darray_get_len(info->headers);
+
+    for (size_t i = 0; i < num_headers; i++)
     {
-        if (mask_key != NULL)
-        {
-            d[i] ^= mask_key[mask_index++ % 4];
-        }
-        if (validate_utf8)
+        if (headers[i].name_len == name_len &&
+            strcasecmp(&buf[headers[i].name_pos], name) == 0)
         {
-            utf8_decode(state, codepoint, d[i]);
-            if (*state == UTF8_REJECT) return;
+            return (int)i;
         }
     }
+
+    return -1;
 }
 
-static void mask_and_move_data(char* dest, char* src, size_t len,
-                               char* mask_key_ptr, int64_t mask_index,
-                               bool validate_utf8, uint32_t* state,
-                               uint32_t* codepoint)
+static const char* get_header_value(protocol_handshake* info,
+                                    const protocol_header* header,
+                                    unsigned index)
 {
-    /*
-     * the move we're about to do might overwrite the data at
-     * mask_key_ptr... copy the key into another place
-     */
-    char mask_key[4];
-    if(mask_key_ptr != NULL)
+    hhassert(index < header->num_values);
+    const protocol_header_value* values = darray_get_data(info->values);
+    int32_t value_index = header->first_value;
+    for (unsigned i = 0; i < index; i++)
     {
-        memcpy(mask_key, mask_key_ptr, sizeof(mask_key));
+        value_index = values[value_index].next;
     }
 
-    uint8_t* d = (uint8_t*)dest;
-    for (size_t i = 0; i < len; i++)
-    {
-        d[i] = (uint8_t)src[i];
-        if (mask_key_ptr != NULL)
-        {
-            d[i] ^= mask_key[mask_index++ % 4];
-        }
-        if (validate_utf8)
-        {
-            utf8_decode(state, codepoint, d[i]);
-            if (*state == UTF8_REJECT) return;
-        }
-    }
+    const char* buf = darray_get_data(info->buffer);
+    return &buf[values[value_index].pos];
 }
 
-static bool is_comma_delimited_header(const char* header)
+/* get a value of a known header, NULL if it wasn't sent */
+static const char* get_known_header_value(protocol_handshake* info,
+                                          protocol_known_header known,
+                                          unsigned index)
 {
-    static const char* comma_headers[] =
-    {
-        HEADER_PROTOCOL,
-        HEADER_EXTENSION,
-        "Accept-Encoding",
-        "TE"
-    };
+    if (info->known[known] < 0) return NULL;
 
-    for (unsigned int i = 0; i < hhcountof(comma_headers); i++)
-    {
-        if (strcmp(header, comma_headers[i]) == 0)
-        {
-            return 1;
-        }
-    }
+    const protocol_header* header =
+        darray_get_elem_addr(info->headers, (size_t)info->known[known]);
+    return get_header_value(info, header, index);
+}
 
-    return 0;
+static unsigned get_num_known_header_values(protocol_handshake* info,
+                                            protocol_known_header known)
+{
+    if (info->known[known] < 0) return 0;
+
+    const protocol_header* header =
+        darray_get_elem_addr(info->headers, (size_t)info->known[known]);
+    return header->num_values;
 }
 
-static char* eat_non_whitespace_or_comma(char* buf)
+/*
+ * find the end of a comma delimited token. parameters after the token are
+ * part of it, like "permessage-deflate; client_max_window_bits"
+ */
+static char* find_token_end(char* buf)
 {
-    while (*buf != '\0' && !isspace(*buf) && *buf != ',') buf++;
-    return buf;
+    char* end = buf;
+    while (*end != '\0' && *end != ',') end++;
+    while (end > buf && isspace(*(end - 1))) end--;
+    return end;
 }
 
 static char* eat_whitespace(char* buf)
@@ -352,42 +381,66 @@ static char* parse_http_line(protocol_handshake* info, char* buf,
     return buf;
 }
 
-static void add_comma_delimited_token(protocol_header* header, char* value)
+/* add value, which is value_len bytes long, to the end of header's values */
+static void add_header_value(protocol_handshake* info, int header_index,
+                             char* value, size_t value_len)
+{
+    char* buf = darray_get_data(info->buffer);
+    protocol_header_value new_value;
+    new_value.pos = (uint32_t)(value - buf);
+    new_value.len = (uint32_t)value_len;
+    new_value.next = -1;
+
+    int32_t value_index = (int32_t)darray_get_len(info->values);
+    darray_append(&info->values, &new_value, 1);
+
+    protocol_header* header =
+        darray_get_elem_addr(info->headers, (size_t)header_index);
+    if (header->last_value >= 0)
+    {
+        protocol_header_value* last =
+            darray_get_elem_addr(info->values, (size_t)header->last_value);
+        last->next = value_index;
+    }
+    else
+    {
+        header->first_value = value_index;
+    }
+
+    header->last_value = value_index;
+    header->num_values++;
+}
+
+static void add_comma_delimited_token(protocol_handshake* info,
+                                      int header_index, char* value)
 {
     value = eat_whitespace(value);
-    char* value_end = eat_non_whitespace_or_comma(value);
+    char* value_end = find_token_end(value);
     (*value_end) = '\0';
-    darray_append(&header->values, &value, 1);
+    add_header_value(info, header_index, value, (size_t)(value_end - value));
 }
 
 static void add_header(protocol_handshake* info, char* name, char* value)
 {
-    protocol_header* header = NULL;
-    protocol_header* all_headers = darray_get_data(info->headers);
-    size_t num_headers = darray_get_len(info->headers);
+    size_t name_len = strlen(name);
+    int header_index = find_header(info, name, name_len);
 
-    for (unsigned i = 0; i < num_headers; i++)
+    if (header_index < 0)
     {
-        protocol_header* hdr = &all_headers[i];
-        if (strcasecmp(hdr->name, name) == 0)
-        {
-            header = hdr;
-            break;
-        }
-    }
-
-    if (header == NULL )
-    {
-        /* first time this header has appeared, create a new header object */
+        /* first time this header has appeared, add it to our list */
+        char* buf = darray_get_data(info->buffer);
         protocol_header new_header;
-        new_header.name = name;
-        new_header.values = darray_create(sizeof(char*), 1);
+        new_header.name_pos = (uint32_t)(name - buf);
+        new_header.name_len = (uint32_t)name_len;
+        new_header.first_value = -1;
+        new_header.last_value = -1;
+        new_header.num_values = 0;
 
-        /* now add it to our list of headers */
+        header_index = (int)darray_get_len(info->headers);
         darray_append(&info->headers, &new_header, 1);
 
-        /* retrieve it */
-        header = darray_get_last_addr(info->headers);
+        int known = known_header_from_name(name, name_len);
+        if (known >= 0) info->known[known] = header_index;
     }
 
     if (is_comma_delimited_header(name))
@@ -396,17 +449,17 @@ static void add_header(protocol_handshake* info, char* name, char* value)
         char* value_comma = strchr(value, ',');
         while (value_comma != NULL && *value != '\0')
         {
-            add_comma_delimited_token(header, value);
+            add_comma_delimited_token(info, header_index, value);
             value = value_comma + 1;
             value_comma = strchr(value, ',');
         }
 
         /* add last value */
-        add_comma_delimited_token(header, value);
+        add_comma_delimited_token(info, header_index, value);
     }
     else
     {
-        darray_append(&header->values, &value, 1);
+        add_header_value(info, header_index, value, strlen(value));
     }
 }
 
@@ -436,6 +489,12 @@ static char* parse_headers(protocol_handshake* info, char* buf, char* end_buf)
     return buf;
 }
 
+/* whether a data message is handed out in pieces, see stream_msgs */
+static bool is_streamed(protocol_conn* conn, bool compressed)
+{
+    return conn->stream_msgs && !compressed;
+}
+
 static void handle_violation(protocol_conn* conn, uint16_t code,
                              const char* msg)
 {
@@ -461,18 +520,24 @@ protocol_parse_frame_hdr(protocol_conn* conn, bool expect_mask,
     if (data_len < 2) return PROTOCOL_RESULT_CONTINUE;
 
     unsigned char first = (unsigned char)(*data);
-    int fin = (first & 0xf0);
+    int fin = (first & 0x80);
+    int rsv = (first & 0x70);
+    protocol_opcode opcode = (first & 0x0f);
+    protocol_msg_type msg_type = msg_type_from_opcode(opcode);
 
-    /* you're not allowed to have the RSV bits set  */
-    if (fin != 0 && fin != 0x80)
+    /*
+     * with permessage-deflate, RSV1 marks the first frame of a compressed
+     * data message. you're not allowed to have the RSV bits set otherwise
+     */
+    bool compressed = (rsv == 0x40 && conn->deflate != NULL &&
+                       (opcode == PROTOCOL_OPCODE_TEXT ||
+                        opcode == PROTOCOL_OPCODE_BINARY));
+    if (rsv != 0 && !compressed)
     {
         handle_violation(conn, HH_ERROR_PROTOCOL, "RSV bit set");
         return PROTOCOL_RESULT_FAIL;
     }
 
-    protocol_opcode opcode = (first & 0x0f);
-    protocol_msg_type msg_type = msg_type_from_opcode(opcode);
-
     /* if this is a bogus opcode, fail */
     if (!is_valid_opcode(opcode))
     {
@@ -623,6 +688,27 @@ protocol_parse_frame_hdr(protocol_conn* conn, bool expect_mask,
     }
     hdr->masked = is_masked;
     hdr->fin = (fin != 0);
+
+    /*
+     * continuations get moved up against the fragments before them, unless
+     * they're streamed, and everything that ends up in a text message gets
+     * validated. compressed text is validated once it's inflated instead
+     */
+    int flags = is_masked ? PAYLOAD_UNMASK : 0;
+    protocol_msg_type payload_type = msg_type;
+    if (opcode == PROTOCOL_OPCODE_CONTINUATION)
+    {
+        payload_type = msg->type;
+        compressed = msg->compressed;
+        if (!is_streamed(conn, compressed)) flags |= PAYLOAD_MOVE;
+    }
+    if (payload_type == PROTOCOL_MSG_TEXT && !compressed)
+    {
+        flags |= PAYLOAD_VALIDATE;
+    }
+    hdr->kernel = payload_get_kernel(flags);
+    hdr->compressed = compressed;
+
     hdr->frame_start_pos = pos;
     pos += (size_t)(data - &raw_buffer[pos]);
     hdr->data_start_pos = pos;
@@ -635,25 +721,12 @@ protocol_parse_frame_hdr(protocol_conn* conn, bool expect_mask,
 protocol_conn* protocol_create_conn(protocol_settings* settings, void* userdata)
 {
     protocol_conn* conn = hhmalloc(sizeof(*conn));
-    if (conn == NULL ||
-        protocol_init_conn(conn, settings, userdata) < 0)
+    if (conn == NULL) return NULL;
+
+    if (protocol_init_conn(conn, settings, userdata) < 0 ||
+        protocol_acquire_buffers(conn) < 0)
     {
-        if (conn != NULL && conn->info.headers != NULL)
-        {
-            darray_destroy(conn->info.headers);
-        }
-        if (conn != NULL && conn->read_buffer != NULL)
-        {
-            darray_destroy(conn->read_buffer);
-        }
-        if (conn != NULL && conn->write_buffer != NULL)
-        {
-            darray_destroy(conn->write_buffer);
-        }
-        if (conn != NULL)
-        {
-            hhfree(conn);
-        }
+        protocol_destroy_conn(conn);
         conn = NULL;
     }
 
@@ -661,24 +734,17 @@ protocol_conn* protocol_create_conn(protocol_settings* settings, void* userdata)
 }
 
 /*
- * initialize an already allocated protocol_conn. allocates read and
- * write buffers
+ * initialize an already allocated protocol_conn. nothing is allocated until
+ * protocol_acquire_buffers is called
 */
 int protocol_init_conn(protocol_conn* conn, protocol_settings* settings,
                        void* userdata)
 {
-    size_t init_buf_len = settings->init_buf_len;
     memset(conn, 0, sizeof(*conn));
     conn->settings = settings;
     conn->state = PROTOCOL_STATE_READ_HANDSHAKE;
     conn->info.resource = NULL;
-    conn->info.headers = darray_create(sizeof(protocol_header), 8);
-    if (conn->info.headers == NULL) return -1;
-    conn->info.buffer = darray_create(sizeof(char), 1024);
-    conn->read_buffer = darray_create(sizeof(char), init_buf_len);
-    if (conn->read_buffer == NULL) return -1;
-    conn->write_buffer = darray_create(sizeof(char), init_buf_len);
-    if (conn->write_buffer == NULL) return -1;
+    reset_known_headers(&conn->info);
     conn->frag_msg.type = PROTOCOL_MSG_NONE;
     conn->frag_msg.msg_len = 0;
     conn->frag_msg.pos.data_start_pos = 0;
@@ -694,6 +760,76 @@ int protocol_init_conn(protocol_conn* conn, protocol_settings* settings,
     return 0;
 }
 
+/* take buffers from pool from now on. NULL for the heap */
+void protocol_set_bufpool(protocol_conn* conn, bufpool* pool)
+{
+    conn->pool = pool;
+}
+
+static int acquire_buffer(protocol_conn* conn, darray** array,
+                          size_t elem_size, size_t num_elems)
+{
+    if (*array == NULL)
+    {
+        *array = bufpool_get(conn->pool, elem_size, num_elems);
+    }
+    return (*array == NULL) ? -1 : 0;
+}
+
+/*
+ * make sure the read and write buffers are allocated, and the handshake info
+ * too while the handshake is in progress
+ */
+int protocol_acquire_buffers(protocol_conn* conn)
+{
+    size_t init_buf_len = (size_t)conn->settings->init_buf_len;
+    if (acquire_buffer(conn, &conn->read_buffer, sizeof(char),
+                       init_buf_len) < 0 ||
+        acquire_buffer(conn, &conn->write_buffer, sizeof(char),
+                       init_buf_len) < 0)
+    {
+        return -1;
+    }
+
+    if (conn->state == PROTOCOL_STATE_CONNECTED) return 0;
+
+    protocol_handshake* info = &conn->info;
+    if (acquire_buffer(conn, &info->headers, sizeof(protocol_header), 8) < 0 ||
+        acquire_buffer(conn, &info->values, sizeof(protocol_header_value),
+                       16) < 0 ||
+        acquire_buffer(conn, &info->buffer, sizeof(char), 1024) < 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* give back the read and write buffers, whatever is in them */
+void protocol_release_buffers(protocol_conn* conn)
+{
+    bufpool_put(conn->pool, conn->read_buffer);
+    conn->read_buffer = NULL;
+    conn->read_start = 0;
+    bufpool_put(conn->pool, conn->write_buffer);
+    conn->write_buffer = NULL;
+}
+
+/* give back the handshake info. the header getters find nothing after this */
+void protocol_release_handshake(protocol_conn* conn)
+{
+    protocol_handshake* info = &conn->info;
+    info->resource = NULL;
+    info->scan_pos = 0;
+    reset_known_headers(info);
+
+    bufpool_put(conn->pool, info->headers);
+    info->headers = NULL;
+    bufpool_put(conn->pool, info->values);
+    info->values = NULL;
+    bufpool_put(conn->pool, info->buffer);
+    info->buffer = NULL;
+}
 
 /* free/destroy a protocol_conn */
 void protocol_destroy_conn(protocol_conn* conn)
@@ -705,24 +841,10 @@ void protocol_destroy_conn(protocol_conn* conn)
 /* destroy everything in the conn but leave the conn intact */
 void protocol_deinit_conn(protocol_conn* conn)
 {
-    if (conn->info.headers != NULL)
-    {
-        size_t num_headers = darray_get_len(conn->info.headers);
-        protocol_header* headers = darray_get_data(conn->info.headers);
-        for (unsigned i = 0; i < num_headers; i++)
-        {
-            darray_destroy(headers[i].values);
-        }
-    }
-
-    darray_destroy(conn->info.headers);
-    conn->info.headers = NULL;
-    darray_destroy(conn->info.buffer);
-    conn->info.buffer = NULL;
-    darray_destroy(conn->read_buffer);
-    conn->read_buffer = NULL;
-    darray_destroy(conn->write_buffer);
-    conn->write_buffer = NULL;
+    protocol_release_handshake(conn);
+    protocol_release_buffers(conn);
+    pmdeflate_destroy(conn->deflate);
+    conn->deflate = NULL;
 }
 
 /*
@@ -735,33 +857,64 @@ void protocol_reset_conn(protocol_conn* conn)
     conn->frag_msg.msg_len = 0;
     conn->frag_msg.pos.data_start_pos = 0;
     conn->frag_msg.pos.full_msg_start_pos = 0;
+    conn->frag_msg.compressed = false;
     conn->num_fragments_read = 0;
     conn->info.resource = NULL;
+    conn->info.scan_pos = 0;
     conn->frame_hdr.payload_len = -1;
     conn->valid_state.state = 0;
     conn->valid_state.codepoint = 0;
     conn->error_msg = NULL;
     conn->error_code = 0;
     conn->error_len = 0;
+    pmdeflate_destroy(conn->deflate);
+    conn->deflate = NULL;
+    memset(&conn->deflate_offer, 0, sizeof(conn->deflate_offer));
+
+    reset_known_headers(&conn->info);
+    if (conn->info.headers != NULL) darray_clear(conn->info.headers);
+    if (conn->info.values != NULL) darray_clear(conn->info.values);
+    if (conn->info.buffer != NULL) darray_clear(conn->info.buffer);
+    if (conn->read_buffer != NULL) darray_clear(conn->read_buffer);
+    conn->read_start = 0;
+    if (conn->write_buffer != NULL) darray_clear(conn->write_buffer);
+}
+
+/*
+ * look for the blank line that ends the handshake. picks up where the last
+ * call left off, so a handshake that trickles in a few bytes at a time is
+ * still only scanned once
+ */
+static bool find_handshake_end(protocol_handshake* info, const char* buf,
+                               size_t length)
+{
+    static const char terminator[] = "\r\n\r\n";
+    const size_t term_len = sizeof(terminator) - 1;
+
+    size_t i = info->scan_pos;
+    hhassert(i <= length);
 
-    size_t num_headers = darray_get_len(conn->info.headers);
-    protocol_header* headers = darray_get_data(conn->info.headers);
-    for (unsigned i = 0; i < num_headers; i++)
+    while (length - i >= term_len)
     {
-        headers[i].name = NULL;
-        /*
-         * destroy here instead of clear.  If we just clear, we can
-         * end up leaking values because num_headers will change
-         * and the loop in protocol_deinit_conn won't free some values
-         */
-        darray_destroy(headers[i].values);
-        headers[i].values = NULL;
+        /* only look for a '\r' that has room for the rest after it */
+        const char* cr = memchr(&buf[i], '\r', length - i - (term_len - 1));
+        if (cr == NULL)
+        {
+            i = length - (term_len - 1);
+            break;
+        }
+
+        i = (size_t)(cr - buf);
+        if (memcmp(&buf[i], terminator, term_len) == 0)
+        {
+            info->scan_pos = i;
+            return true;
+        }
+        i++;
     }
 
-    darray_clear(conn->info.headers);
-    darray_clear(conn->info.buffer);
-    darray_clear(conn->read_buffer);
-    darray_clear(conn->write_buffer);
+    info->scan_pos = i;
+    return false;
 }
 
 static protocol_handshake_result
@@ -782,18 +935,7 @@ protocol_read_handshake(protocol_conn* conn, protocol_endpoint type)
         return PROTOCOL_HANDSHAKE_FAIL_TOO_LARGE;
     }
 
-    bool found_end = false;
-    for (size_t i = 0; i < length-3; i++)
-    {
-        if (buf[i] == '\r' && buf[i+1] == '\n' &&
-            buf[i+2] == '\r' && buf[i+3] == '\n')
-        {
-            found_end = true;
-            break;
-        }
-    }
-
-    if (!found_end)
+    if (!find_handshake_end(info, buf, length))
     {
         return PROTOCOL_HANDSHAKE_CONTINUE;
     }
@@ -851,6 +993,47 @@ protocol_handshake_result protocol_read_handshake_request(protocol_conn* conn)
     return protocol_read_handshake(conn, PROTOCOL_ENDPOINT_SERVER);
 }
 
+/*
+ * the protocol negotiates permessage-deflate itself when it's enabled, so
+ * extensions passed in by name are left out of the handshake
+ */
+static bool is_owned_extension(protocol_conn* conn, const char* extension)
+{
+    return conn->settings->deflate.enabled &&
+           pmdeflate_is_extension(extension);
+}
+
+/*
+ * server: accept the first permessage-deflate offer we can. writes the
+ * response to ext, which is PMDEFLATE_MAX_PARAMS_LEN long, and returns its
+ * length, or 0 if nothing was accepted
+ */
+static size_t accept_deflate_offer(protocol_conn* conn, char* ext)
+{
+    pmdeflate_settings* settings = &conn->settings->deflate;
+    protocol_handshake* info = &conn->info;
+    unsigned num_extensions =
+        get_num_known_header_values(info, PROTOCOL_HEADER_SEC_EXTENSIONS);
+
+    for (unsigned i = 0; i < num_extensions; i++)
+    {
+        const char* offer =
+            get_known_header_value(info, PROTOCOL_HEADER_SEC_EXTENSIONS, i);
+
+        pmdeflate_params params;
+        if (!pmdeflate_accept_offer(offer, settings, &params)) continue;
+
+        conn->deflate =
+            pmdeflate_create(&params, settings->level, settings->max_mem);
+        if (conn->deflate == NULL) continue;
+
+        return pmdeflate_write_params(&params, true, ext,
+                                      PMDEFLATE_MAX_PARAMS_LEN);
+    }
+
+    return 0;
+}
+
 /*
  * write the handshake response to conn->write_buffer.  must be called after
  * protocol_read_handshake_request.  on success, DOES NOT advance state.  This should
@@ -862,64 +1045,49 @@ protocol_write_handshake_response(protocol_conn* conn, const char* protocol,
 {
     hhassert(conn->state == PROTOCOL_STATE_WRITE_HANDSHAKE);
 
-    /* this constant comes straight from RFC 6455 */
-    static const char key_guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
     static const char protocol_template[] = HEADER_PROTOCOL ": %s\r\n";
     static const char extension_template[] =
         HEADER_EXTENSION ": %s\r\n";
-    static const char response_template[] =
+    static const char response_prefix[] =
         "HTTP/1.1 101 Switching Protocols\r\n"
         "Upgrade: websocket\r\n"
         "Connection: Upgrade\r\n"
-        "Sec-WebSocket-Accept: %s\r\n";
+        "Sec-WebSocket-Accept: ";
 
-    const char* upgrade = protocol_get_header_value(conn, "Upgrade", 0);
+    protocol_handshake* info = &conn->info;
+    const char* upgrade =
+        get_known_header_value(info, PROTOCOL_HEADER_UPGRADE, 0);
     if (upgrade == NULL || strcasecmp(upgrade, "websocket") != 0)
     {
         return PROTOCOL_HANDSHAKE_FAIL;
     }
 
-    const char* connection = protocol_get_header_value(conn, "Connection", 0);
+    const char* connection =
+        get_known_header_value(info, PROTOCOL_HEADER_CONNECTION, 0);
     if (connection == NULL || strcasecmp(connection, "Upgrade") != 0)
     {
         return PROTOCOL_HANDSHAKE_FAIL;
     }
 
     const char* web_sock_key =
-        protocol_get_header_value(conn, "Sec-WebSocket-Key", 0);
+        get_known_header_value(info, PROTOCOL_HEADER_SEC_KEY, 0);
     if (web_sock_key == NULL) return PROTOCOL_HANDSHAKE_FAIL;
-    if (strlen(web_sock_key) != 24) return PROTOCOL_HANDSHAKE_FAIL;
-
-    if (protocol_get_header_value(conn, "Host", 0) == NULL)
+    if (strlen(web_sock_key) != WSACCEPT_KEY_LEN)
     {
         return PROTOCOL_HANDSHAKE_FAIL;
     }
 
-    char sha_buf[64];
-    int num_written = snprintf(sha_buf, sizeof(sha_buf),
-        "%s%s",
-        web_sock_key,
-        key_guid
-    );
-
-    hhassert(num_written >= 0);
-
-    /* create our response SHA1 */
-    char sha_result[SHA1HashSize];
-    SHA1Context context;
-    SHA1Reset(&context);
-    SHA1Input(&context, (uint8_t*)sha_buf, (unsigned)num_written);
-    SHA1Result(&context, (uint8_t*)sha_result);
+    if (get_known_header_value(info, PROTOCOL_HEADER_HOST, 0) == NULL)
+    {
+        return PROTOCOL_HANDSHAKE_FAIL;
+    }
 
-    /* encode our SHA1 as base64 */
-    char response_key[BASE64_MAX_OUTPUT_LEN(SHA1HashSize)];
-    base64_encodestate encode_state;
-    base64_init_encodestate(&encode_state);
-    int num_encoded = base64_encode_block(sha_result, SHA1HashSize,
-                                          response_key, &encode_state);
-    num_encoded += base64_encode_blockend(&response_key[num_encoded],
-                                          &encode_state);
-    size_t response_key_len = (size_t)num_encoded - 1;
+    char deflate_ext[PMDEFLATE_MAX_PARAMS_LEN];
+    size_t deflate_ext_len = 0;
+    if (conn->settings->deflate.enabled)
+    {
+        deflate_ext_len = accept_deflate_offer(conn, deflate_ext);
+    }
 
     /*
      * put the whole response on the connection's write buffer
@@ -928,9 +1096,12 @@ protocol_write_handshake_response(protocol_conn* conn, const char* protocol,
     /* this should be the first thing ever written to a client */
     hhassert(darray_get_len(conn->write_buffer) == 0);
 
-    /* -2 because of %s in response_template, +2 because of trailing \r\n */
+    /*
+     * the accept value and its \r\n, the trailing \r\n, and room for the
+     * terminator snprintf writes
+     */
     unsigned total_len =
-        (unsigned)((sizeof(response_template)-2) + (response_key_len)+2);
+        (unsigned)((sizeof(response_prefix) - 1) + WSACCEPT_LEN + 2 + 2 + 1);
 
     if (protocol != NULL)
     {
@@ -945,19 +1116,34 @@ protocol_write_handshake_response(protocol_conn* conn, const char* protocol,
         const char** exts = extensions;
         while ((*exts) != NULL)
         {
-            total_len += strlen(*exts);
+            if (!is_owned_extension(conn, *exts))
+            {
+                total_len += strlen(*exts);
 
-            /* -1 for terminator, -2 for %s in extension_template */
-            total_len += sizeof(extension_template) - 1 - 2;
+                /* -1 for terminator, -2 for %s in extension_template */
+                total_len += sizeof(extension_template) - 1 - 2;
+            }
             exts++;
         }
     }
 
+    if (deflate_ext_len > 0)
+    {
+        total_len += deflate_ext_len + sizeof(extension_template) - 1 - 2;
+    }
+
     char* buf = darray_ensure(&conn->write_buffer, total_len);
 
-    /* write out the mandatory stuff */
-    num_written = 0;
-    num_written = snprintf(buf, total_len, response_template, response_key);
+    /*
+     * write out the mandatory stuff. the accept value is computed straight
+     * into the write buffer
+     */
+    int num_written = (int)(sizeof(response_prefix) - 1);
+    memcpy(buf, response_prefix, (size_t)num_written);
+    wsaccept_compute(web_sock_key, &buf[num_written]);
+    num_written += WSACCEPT_LEN;
+    buf[num_written++] = '\r';
+    buf[num_written++] = '\n';
 
     /* write out protocol header, if necessary */
     if (protocol != NULL)
@@ -973,13 +1159,23 @@ protocol_write_handshake_response(protocol_conn* conn, const char* protocol,
         const char** exts = extensions;
         while ((*exts) != NULL)
         {
-            num_written += snprintf(&buf[num_written],
-                                    total_len - (unsigned)num_written,
-                                    extension_template, *exts);
+            if (!is_owned_extension(conn, *exts))
+            {
+                num_written += snprintf(&buf[num_written],
+                                        total_len - (unsigned)num_written,
+                                        extension_template, *exts);
+            }
             exts++;
         }
     }
 
+    if (deflate_ext_len > 0)
+    {
+        num_written += snprintf(&buf[num_written],
+                                total_len - (unsigned)num_written,
+                                extension_template, deflate_ext);
+    }
+
     /* write out the closing CRLF */
     num_written += snprintf(&buf[num_written],
                             total_len - (unsigned)num_written, "\r\n");
@@ -1001,10 +1197,53 @@ protocol_write_handshake_response(protocol_conn* conn, const char* protocol,
  * On success, advances state from
  * PROTOCOL_STATE_READ_HANDSHAKE -> PROTOCOL_STATE_CONNECTED
  */
+/*
+ * client: set up permessage-deflate if the server accepted our offer.
+ * false if the server responded with something we have to fail on
+ */
+static bool confirm_deflate_response(protocol_conn* conn)
+{
+    pmdeflate_settings* settings = &conn->settings->deflate;
+    protocol_handshake* info = &conn->info;
+    unsigned num_extensions =
+        get_num_known_header_values(info, PROTOCOL_HEADER_SEC_EXTENSIONS);
+
+    for (unsigned i = 0; i < num_extensions; i++)
+    {
+        const char* response =
+            get_known_header_value(info, PROTOCOL_HEADER_SEC_EXTENSIONS, i);
+        if (!pmdeflate_is_extension(response)) continue;
+
+        /* there can only be one response, to an offer we actually made */
+        pmdeflate_params params;
+        if (conn->deflate != NULL ||
+            conn->deflate_offer.write_window_bits == 0 ||
+            !pmdeflate_confirm_response(response, &conn->deflate_offer,
+                                        &params))
+        {
+            return false;
+        }
+
+        conn->deflate =
+            pmdeflate_create(&params, settings->level, settings->max_mem);
+        if (conn->deflate == NULL) return false;
+    }
+
+    return true;
+}
+
 protocol_handshake_result
 protocol_read_handshake_response(protocol_conn* conn)
 {
-    return protocol_read_handshake(conn, PROTOCOL_ENDPOINT_CLIENT);
+    protocol_handshake_result r =
+        protocol_read_handshake(conn, PROTOCOL_ENDPOINT_CLIENT);
+
+    if (r == PROTOCOL_HANDSHAKE_SUCCESS && !confirm_deflate_response(conn))
+    {
+        return PROTOCOL_HANDSHAKE_FAIL;
+    }
+
+    return r;
 }
 
 static size_t append_key_header(darray** array, protocol_conn* conn)
@@ -1117,6 +1356,21 @@ protocol_write_handshake_request(
                                              HEADER_EXTENSION, extensions);
     }
 
+    /* offer permessage-deflate in a header of its own */
+    pmdeflate_params offer_params;
+    memset(&conn->deflate_offer, 0, sizeof(conn->deflate_offer));
+    if (conn->settings->deflate.enabled &&
+        pmdeflate_make_offer(&conn->settings->deflate, &offer_params))
+    {
+        char offer[PMDEFLATE_MAX_PARAMS_LEN];
+        conn->deflate_offer = offer_params;
+        pmdeflate_write_params(&offer_params, false, offer, sizeof(offer));
+
+        const char* offers[] = { offer, NULL };
+        total_written += append_headers_list(&conn->write_buffer,
+                                             HEADER_EXTENSION, offers);
+    }
+
     /* buf could have changed */
     buf = darray_get_data(conn->write_buffer);
 
@@ -1204,32 +1458,161 @@ void protocol_update_read(protocol_conn* conn, size_t num_read)
 
     darray_add_len((*read_buffer), num_read);
 }
+
+static void shift_read_pos(size_t* pos, size_t end, size_t removed)
+{
+    if (*pos >= end) *pos -= removed;
+}
+
+/* the data from end on moved back by removed, move positions into it too */
+static void shift_read_positions(protocol_conn* conn, size_t end,
+                                 size_t removed)
+{
+    protocol_frame_hdr* hdr = &conn->frame_hdr;
+    if (hdr->payload_len >= 0)
+    {
+        shift_read_pos(&hdr->frame_start_pos, end, removed);
+        shift_read_pos(&hdr->data_start_pos, end, removed);
+    }
+
+    protocol_offset_msg* msg = &conn->frag_msg;
+    if (msg->type != PROTOCOL_MSG_NONE)
+    {
+        shift_read_pos(&msg->pos.full_msg_start_pos, end, removed);
+        shift_read_pos(&msg->pos.data_start_pos, end, removed);
+    }
+}
+
+/*
+ * remove the range [start, end) of already parsed messages from the read
+ * buffer. from the front of it, that's only moving read_start past it,
+ * unless nothing is left and the buffer starts over. a message that was
+ * partly read past end keeps absolute positions into the buffer, so those
+ * move back with its data if it has to move
+ */
+size_t protocol_remove_read(protocol_conn* conn, size_t start, size_t end)
+{
+    hhassert(end > start);
+    hhassert(start >= conn->read_start);
+    hhassert(end <= darray_get_len(conn->read_buffer));
+
+    /*
+     * a fragmented message that began before end gets its later fragments
+     * moved down over the control frames that came in between, so [start,
+     * end) may hold its data by now. it all goes once that message is done.
+     * streamed messages are never moved, their pieces go as they're read
+     */
+    protocol_offset_msg* msg = &conn->frag_msg;
+    if (msg->type != PROTOCOL_MSG_NONE && !is_streamed(conn, msg->compressed) &&
+        msg->pos.full_msg_start_pos < end)
+    {
+        return 0;
+    }
+
+    if (start > conn->read_start)
+    {
+        /* what's in front is still needed, cut the range out from under it */
+        darray_remove(conn->read_buffer, start, (ssize_t)end);
+        shift_read_positions(conn, end, end - start);
+        return end - start;
+    }
+
+    if (end < darray_get_len(conn->read_buffer))
+    {
+        conn->read_start = end;
+        return 0;
+    }
+
+    /* nothing left, so starting over at the front costs nothing */
+    darray_clear(conn->read_buffer);
+    conn->read_start = 0;
+    shift_read_positions(conn, end, end);
+    return end;
+}
+
+/*
+ * move what's left in the read buffer to the front if that's where the
+ * room for the next read is. the buffer only ever grows at the end, so a
+ * message is always in one piece, and each byte moves at most once for
+ * every time the buffer fills up
+ */
+size_t protocol_compact_read(protocol_conn* conn, size_t ensure_len)
+{
+    if (conn->state == PROTOCOL_STATE_READ_HANDSHAKE || conn->read_start == 0)
+    {
+        return 0;
+    }
+
+    darray* buf = conn->read_buffer;
+    if (darray_get_size_reserved(buf) - darray_get_len(buf) >= ensure_len)
+    {
+        return 0;
+    }
+
+    size_t removed = conn->read_start;
+    darray_remove(buf, 0, (ssize_t)removed);
+    shift_read_positions(conn, removed, removed);
+    conn->read_start = 0;
+    return removed;
+}
+
+/*
+ * number of payload bytes the frame currently being read still needs. every
+ * buffered byte of the frame has been processed by the time a read returns,
+ * so this is all still on the wire
+ */
+size_t protocol_get_pending_read_len(protocol_conn* conn)
+{
+    protocol_frame_hdr* hdr = &conn->frame_hdr;
+    if (conn->state != PROTOCOL_STATE_CONNECTED || hdr->payload_len < 0)
+    {
+        return 0;
+    }
+
+    hhassert(hdr->payload_len >= hdr->payload_processed);
+    return (size_t)(hdr->payload_len - hdr->payload_processed);
+}
+
 /*
  * Get the the field name of one of the headers sent by the client
  */
 const char* protocol_get_header_name(protocol_conn* conn, unsigned index)
 {
-    hhassert(index < darray_get_len(conn->info.headers));
-    protocol_header* headers = darray_get_data(conn->info.headers);
-    return headers[index].name;
+    hhassert(index < protocol_get_num_headers(conn));
+    protocol_header* header = darray_get_elem_addr(conn->info.headers, index);
+    const char* buf = darray_get_data(conn->info.buffer);
+    return &buf[header->name_pos];
+}
+
+/*
+ * Get the number of values for a given header index
+ */
+unsigned protocol_get_num_header_values_at(protocol_conn* conn,
+                                           unsigned index)
+{
+    hhassert(index < protocol_get_num_headers(conn));
+    protocol_header* header = darray_get_elem_addr(conn->info.headers, index);
+    return header->num_values;
 }
 
 /*
- * Get the darray of values (type char*) for a given header index
+ * Get one of the values for a given header index
  */
-const darray* protocol_get_header_values(protocol_conn* conn, unsigned index)
+const char* protocol_get_header_value_at(protocol_conn* conn, unsigned index,
+                                         unsigned value_index)
 {
-    hhassert(index < darray_get_len(conn->info.headers));
-    protocol_header* headers = darray_get_data(conn->info.headers);
-    return headers[index].values;
+    hhassert(index < protocol_get_num_headers(conn));
+    protocol_header* header = darray_get_elem_addr(conn->info.headers, index);
+    return get_header_value(&conn->info, header, value_index);
 }
 
 /*
  * Get the number of headers sent by the client any index less than this
- * can be used in protocol_get_header_name and protocol_get_header_values
+ * can be used in protocol_get_header_name and protocol_get_header_value_at
  */
 unsigned protocol_get_num_headers(protocol_conn* conn)
 {
+    if (conn->info.headers == NULL) return 0;
     return darray_get_len(conn->info.headers);
 }
 
@@ -1238,18 +1621,10 @@ unsigned protocol_get_num_headers(protocol_conn* conn)
  */
 unsigned protocol_get_num_header_values(protocol_conn* conn, const char* name)
 {
-    protocol_header* headers = darray_get_data(conn->info.headers);
-    size_t len = darray_get_len(conn->info.headers);
+    int index = find_header(&conn->info, name, strlen(name));
+    if (index < 0) return 0;
 
-    for (unsigned i = 0; i < len; i++)
-    {
-        if (strcasecmp(name, headers[i].name) == 0)
-        {
-            return (unsigned)darray_get_len(headers[i].values);
-        }
-    }
-
-    return 0;
+    return protocol_get_num_header_values_at(conn, (unsigned)index);
 }
 
 /*
@@ -1258,20 +1633,10 @@ unsigned protocol_get_num_header_values(protocol_conn* conn, const char* name)
 const char* protocol_get_header_value(protocol_conn* conn, const char* name,
                                       unsigned index)
 {
-    protocol_header* headers = darray_get_data(conn->info.headers);
-    size_t len = darray_get_len(conn->info.headers);
-
-    for (unsigned i = 0; i < len; i++)
-    {
-        if (strcasecmp(name, headers[i].name) == 0)
-        {
-            hhassert(index < darray_get_len(headers[i].values));
-            char** val = darray_get_elem_addr(headers[i].values, index);
-            return *val;
-        }
-    }
+    int header_index = find_header(&conn->info, name, strlen(name));
+    if (header_index < 0) return NULL;
 
-    return NULL;
+    return protocol_get_header_value_at(conn, (unsigned)header_index, index);
 }
 
 /*
@@ -1280,7 +1645,8 @@ const char* protocol_get_header_value(protocol_conn* conn, const char* name,
  */
 unsigned protocol_get_num_subprotocols(protocol_conn* conn)
 {
-    return protocol_get_num_header_values(conn, HEADER_PROTOCOL);
+    return get_num_known_header_values(&conn->info,
+                                       PROTOCOL_HEADER_SEC_PROTOCOL);
 }
 
 /*
@@ -1289,7 +1655,8 @@ unsigned protocol_get_num_subprotocols(protocol_conn* conn)
  */
 const char* protocol_get_subprotocol(protocol_conn* conn, unsigned index)
 {
-    return protocol_get_header_value(conn, HEADER_PROTOCOL, index);
+    return get_known_header_value(&conn->info, PROTOCOL_HEADER_SEC_PROTOCOL,
+                                  index);
 }
 
 /*
@@ -1298,7 +1665,8 @@ const char* protocol_get_subprotocol(protocol_conn* conn, unsigned index)
  */
 unsigned protocol_get_num_extensions(protocol_conn* conn)
 {
-    return protocol_get_num_header_values(conn, HEADER_EXTENSION);
+    return get_num_known_header_values(&conn->info,
+                                       PROTOCOL_HEADER_SEC_EXTENSIONS);
 }
 
 /*
@@ -1307,7 +1675,8 @@ unsigned protocol_get_num_extensions(protocol_conn* conn)
  */
 const char* protocol_get_extension(protocol_conn* conn, unsigned index)
 {
-    return protocol_get_header_value(conn, HEADER_EXTENSION, index);
+    return get_known_header_value(&conn->info,
+                                  PROTOCOL_HEADER_SEC_EXTENSIONS, index);
 }
 
 /*
@@ -1318,6 +1687,138 @@ const char* protocol_get_resource(protocol_conn* conn)
     return conn->info.resource;
 }
 
+/*
+ * replace a finished permessage-deflate message with its inflated payload.
+ * read_msg->data points into conn->deflate's buffer afterwards, and pos
+ * still describes the compressed message in the read buffer
+ */
+static bool inflate_msg(protocol_conn* conn, protocol_msg* read_msg)
+{
+    char* data;
+    size_t len;
+    pmdeflate_result r =
+        pmdeflate_decompress(conn->deflate, read_msg->data,
+                             (size_t)read_msg->msg_len,
+                             conn->settings->read_max_msg_size, &data, &len);
+
+    switch (r)
+    {
+    case PMDEFLATE_SUCCESS:
+        break;
+    case PMDEFLATE_TOO_LARGE:
+        handle_violation(conn, HH_ERROR_LARGE_MESSAGE,
+                         "inflated message was too large");
+        return false;
+    case PMDEFLATE_ERROR:
+        handle_violation(conn, HH_ERROR_BAD_DATA,
+                         "could not inflate message");
+        return false;
+    }
+
+    if (read_msg->type == PROTOCOL_MSG_TEXT && !utf8_is_valid(data, len))
+    {
+        handle_violation(conn, HH_ERROR_BAD_DATA,
+                         "text frame was not valid utf-8 text");
+        return false;
+    }
+
+    read_msg->data = data;
+    read_msg->msg_len = (int64_t)len;
+    return true;
+}
+
+/*
+ * unmask and validate, in place, whatever has arrived of the streamed data
+ * frame at pos, and hand it out as the next piece of its message. the
+ * piece starts at its frame header if it's the first of the frame, so the
+ * caller can remove the whole frame a piece at a time
+ */
+static protocol_result
+read_msg_chunk(protocol_conn* conn, size_t* start_pos, size_t pos,
+               protocol_msg* read_msg)
+{
+    protocol_frame_hdr* hdr = &conn->frame_hdr;
+    protocol_offset_msg* msg = &conn->frag_msg;
+    char* raw_buffer = darray_get_data(conn->read_buffer);
+    char* data = &raw_buffer[pos];
+    char* masking_key = (hdr->masked) ? hdr->masking_key : NULL;
+
+    hhassert(hdr->payload_len >= hdr->payload_processed);
+    size_t len = hhmin(darray_get_len(conn->read_buffer) - pos,
+                       (size_t)(hdr->payload_len - hdr->payload_processed));
+
+    bool first_frame = (hdr->opcode != PROTOCOL_OPCODE_CONTINUATION);
+    bool chunk_start = (first_frame && hdr->payload_processed == 0);
+    size_t chunk_pos = (hdr->payload_processed == 0) ? hdr->frame_start_pos
+                                                     : *start_pos;
+    protocol_msg_type msg_type = first_frame ? hdr->msg_type : msg->type;
+
+    if (chunk_start && !hdr->fin)
+    {
+        /* the continuations to come need to know what they belong to */
+        msg->type = msg_type;
+        msg->msg_len = 0;
+        msg->pos.data_start_pos = pos;
+        msg->pos.full_msg_start_pos = hdr->frame_start_pos;
+        msg->compressed = false;
+    }
+
+    hdr->kernel(data, data, len, masking_key, hdr->payload_processed,
+                &conn->valid_state.state, &conn->valid_state.codepoint);
+    hdr->payload_processed += (int64_t)len;
+    if (msg->type != PROTOCOL_MSG_NONE) msg->msg_len += (int64_t)len;
+    pos += len;
+    (*start_pos) = pos;
+
+    if (conn->valid_state.state == UTF8_REJECT)
+    {
+        handle_violation(conn, HH_ERROR_BAD_DATA,
+                         "text frame was not valid utf-8 text");
+        return PROTOCOL_RESULT_FAIL;
+    }
+
+    bool frame_finished = (hdr->payload_processed == hdr->payload_len);
+
+    /* the header's been read, but none of the payload yet */
+    if (len == 0 && !frame_finished) return PROTOCOL_RESULT_CONTINUE;
+
+    bool msg_finished = (frame_finished && hdr->fin);
+    if (frame_finished)
+    {
+        hdr->payload_len = -1;
+        if (!msg_finished) conn->num_fragments_read++;
+    }
+
+    if (msg_finished)
+    {
+        if (msg_type == PROTOCOL_MSG_TEXT &&
+            conn->valid_state.state != UTF8_ACCEPT)
+        {
+            handle_violation(conn, HH_ERROR_BAD_DATA,
+                             "text frame was not valid utf-8 text");
+            return PROTOCOL_RESULT_FAIL;
+        }
+
+        msg->type = PROTOCOL_MSG_NONE;
+        msg->pos.data_start_pos = 0;
+        msg->pos.full_msg_start_pos = 0;
+        msg->msg_len = 0;
+        conn->num_fragments_read = 0;
+        conn->valid_state.state = 0;
+        conn->valid_state.codepoint = 0;
+    }
+
+    read_msg->type = msg_type;
+    read_msg->msg_len = (int64_t)len;
+    read_msg->data = data;
+    read_msg->pos.full_msg_start_pos = chunk_pos;
+    read_msg->pos.data_start_pos = (size_t)(data - raw_buffer);
+    read_msg->chunk_start = chunk_start;
+    read_msg->chunk_final = msg_finished;
+
+    return PROTOCOL_RESULT_MESSAGE_CHUNK;
+}
+
 /*
  * process a frame from the read buffer starting at start_pos into
  * conn->read_msg. read_msg will contain the read message if protocol_result
@@ -1340,6 +1841,14 @@ protocol_read_msg(protocol_conn* conn, size_t* start_pos, bool expect_mask,
     }
     protocol_frame_hdr* hdr = &conn->frame_hdr;
 
+    if ((hdr->opcode == PROTOCOL_OPCODE_TEXT ||
+         hdr->opcode == PROTOCOL_OPCODE_BINARY ||
+         hdr->opcode == PROTOCOL_OPCODE_CONTINUATION) &&
+        is_streamed(conn, hdr->compressed))
+    {
+        return read_msg_chunk(conn, start_pos, pos, read_msg);
+    }
+
     /*
      * protocol_parse_frame_hdr may have advanced buffer...
      * update data to reflect that
@@ -1380,16 +1889,16 @@ protocol_read_msg(protocol_conn* conn, size_t* start_pos, bool expect_mask,
                 msg->msg_len = 0;
                 msg->pos.data_start_pos = pos;
                 msg->pos.full_msg_start_pos = hdr->frame_start_pos;
+                msg->compressed = hdr->compressed;
             }
 
             /*
              * mask data in place, no need to move it,
              * since this is the first fragment
              */
-            mask_data(data, len, masking_key, hdr->payload_processed,
-                      (msg->type == PROTOCOL_MSG_TEXT),
-                      &conn->valid_state.state,
-                      &conn->valid_state.codepoint);
+            hdr->kernel(data, data, len, masking_key, hdr->payload_processed,
+                        &conn->valid_state.state,
+                        &conn->valid_state.codepoint);
             hdr->payload_processed += len;
             msg->msg_len += len;
             pos += len;
@@ -1408,11 +1917,9 @@ protocol_read_msg(protocol_conn* conn, size_t* start_pos, bool expect_mask,
              */
             size_t data_start_pos = msg->pos.data_start_pos;
             void* dest = &raw_buffer[data_start_pos+(size_t)msg->msg_len];
-            mask_and_move_data(dest, data, len, masking_key,
-                               hdr->payload_processed,
-                               (msg->type == PROTOCOL_MSG_TEXT),
-                               &conn->valid_state.state,
-                               &conn->valid_state.codepoint);
+            hdr->kernel(dest, data, len, masking_key, hdr->payload_processed,
+                        &conn->valid_state.state,
+                        &conn->valid_state.codepoint);
             hdr->payload_processed += len;
             msg->msg_len += len;
             pos += len;
@@ -1454,11 +1961,9 @@ protocol_read_msg(protocol_conn* conn, size_t* start_pos, bool expect_mask,
              */
             size_t data_start_pos = msg->pos.data_start_pos;
             void* dest = &raw_buffer[data_start_pos+(size_t)msg->msg_len];
-            mask_and_move_data(dest, data, len, masking_key,
-                               hdr->payload_processed,
-                               (msg->type == PROTOCOL_MSG_TEXT),
-                               &conn->valid_state.state,
-                               &conn->valid_state.codepoint);
+            hdr->kernel(dest, data, len, masking_key, hdr->payload_processed,
+                        &conn->valid_state.state,
+                        &conn->valid_state.codepoint);
             msg->msg_len += len;
             hdr->payload_processed += len;
             pos += len;
@@ -1481,6 +1986,7 @@ protocol_read_msg(protocol_conn* conn, size_t* start_pos, bool expect_mask,
                 msg->pos.data_start_pos = 0;
                 msg->pos.full_msg_start_pos = 0;
                 msg->msg_len = 0;
+                msg->compressed = false;
 
                 /* we just read a full message, reset the fragment counter */
                 conn->num_fragments_read = 0;
@@ -1498,10 +2004,9 @@ protocol_read_msg(protocol_conn* conn, size_t* start_pos, bool expect_mask,
              * mask data in place, no need to move it,
              * since this is the only fragment
              */
-            mask_data(data, len, hdr->masking_key, hdr->payload_processed,
-                      (msg_type == PROTOCOL_MSG_TEXT),
-                      &conn->valid_state.state,
-                      &conn->valid_state.codepoint);
+            hdr->kernel(data, data, len, masking_key, hdr->payload_processed,
+                        &conn->valid_state.state,
+                        &conn->valid_state.codepoint);
 
             hdr->payload_processed += len;
             pos += len;
@@ -1527,6 +2032,11 @@ protocol_read_msg(protocol_conn* conn, size_t* start_pos, bool expect_mask,
 
         (*start_pos) = pos;
 
+        if (msg_finished && hdr->compressed && !inflate_msg(conn, read_msg))
+        {
+            return PROTOCOL_RESULT_FAIL;
+        }
+
         if (msg_type == PROTOCOL_MSG_TEXT &&
             (conn->valid_state.state == UTF8_REJECT ||
                 (msg_finished && conn->valid_state.state != UTF8_ACCEPT)))
@@ -1548,8 +2058,8 @@ protocol_read_msg(protocol_conn* conn, size_t* start_pos, bool expect_mask,
                 return PROTOCOL_RESULT_FAIL;
             }
             else if (read_msg->msg_len > 2 &&
-                     !is_valid_utf8(&read_msg->data[2],
-                                    (int64_t)read_msg->msg_len-2))
+                     !utf8_is_valid(&read_msg->data[2],
+                                    (size_t)read_msg->msg_len-2))
             {
                 handle_violation(conn, HH_ERROR_PROTOCOL,
                                  "Invalid utf-8 in close frame");
@@ -1592,14 +2102,90 @@ protocol_read_server_msg(protocol_conn* conn, size_t* start_pos,
     return protocol_read_msg(conn, start_pos, false, read_msg);
 }
 
+/*
+ * write the header of a frame carrying payload_len bytes to data, which must
+ * have room for the largest possible header. for clients, a new mask key is
+ * written and mask_key is pointed at it. returns a pointer just past the
+ * header
+ */
+static char* write_frame_hdr(protocol_conn* conn, char* data,
+                             protocol_opcode opcode, bool fin,
+                             bool compressed, int64_t payload_len,
+                             protocol_endpoint type, char** mask_key)
+{
+    int num_extra_len_bytes = get_num_extra_len_bytes(payload_len);
+
+    /* write the first byte to the buffer, RSV1 marks compressed messages */
+    *data = (char)((fin ? 0x80 : 0x00) | (compressed ? 0x40 : 0x00) |
+                   (unsigned char)opcode);
+    data++;
+
+    /* set the mask bit if appropriate */
+    *data = (char)((type == PROTOCOL_ENDPOINT_CLIENT) ? 0x80 : 0x00);
+
+    /* write the payload length to the buffer */
+    uint16_t short_len;
+    uint64_t long_len;
+    switch (num_extra_len_bytes)
+    {
+    case 0:
+        *data |= (char)payload_len; /* |= to avoid blowing away mask bit */
+        data++;
+        break;
+
+    case 2:
+        *data |= 126; /* |= to avoid blowing away mask bit */
+        data++;
+        short_len = hh_htons((uint16_t)payload_len);
+        memcpy(data, &short_len, sizeof(uint16_t));
+        data += sizeof(uint16_t);
+        break;
+
+    case 8:
+        *data |= 127; /* |= to avoid blowing away mask bit */
+        data++;
+        long_len = hh_htonll((uint64_t)payload_len);
+        memcpy(data, &long_len, sizeof(uint64_t));
+        data += sizeof(uint64_t);
+        break;
+
+    default:
+        hhassert(0);
+        break;
+    }
+
+    uint32_t val;
+    switch (type)
+    {
+    case PROTOCOL_ENDPOINT_SERVER:
+        *mask_key = NULL;
+        break;
+    case PROTOCOL_ENDPOINT_CLIENT:
+        hhassert(conn->settings->rand_func != NULL);
+        val = conn->settings->rand_func(conn);
+        memcpy(data, &val, sizeof(val));
+        *mask_key = data;
+        data += sizeof(val);
+        break;
+    }
+
+    return data;
+}
+
+/*
+ * encode write_msg onto the end of buf. conn is used to get mask keys for
+ * client frames and to compress with permessage-deflate, and may be NULL
+ * for server frames. frames encoded without a connection can be shared by
+ * many of them, so they're never compressed
+ */
 static protocol_result
-protocol_write_msg(protocol_conn* conn, protocol_msg* write_msg,
-                   protocol_endpoint type)
+encode_msg(protocol_conn* conn, protocol_settings* settings, darray** buf,
+           protocol_msg* write_msg, protocol_endpoint type)
 {
     protocol_msg_type msg_type = write_msg->type;
     int64_t msg_len = write_msg->msg_len;
-    char* msg_data = write_msg->data;
-    int64_t max_frame_size = conn->settings->write_max_frame_size;
+    const char* msg_data = write_msg->data;
+    int64_t max_frame_size = settings->write_max_frame_size;
     if (max_frame_size < 0) max_frame_size = INT64_MAX;
 
     protocol_opcode opcode = opcode_from_msg_type(msg_type);
@@ -1615,7 +2201,21 @@ protocol_write_msg(protocol_conn* conn, protocol_msg* write_msg,
         return PROTOCOL_RESULT_FAIL;
     }
 
-    int64_t num_written = 0;
+    bool compressed = false;
+    if (conn != NULL && conn->deflate != NULL &&
+        protocol_is_data(msg_type) && msg_len >= DEFLATE_MIN_MSG_LEN)
+    {
+        size_t compressed_len;
+        if (pmdeflate_compress(conn->deflate, msg_data, (size_t)msg_len,
+                               &msg_data, &compressed_len)
+                != PMDEFLATE_SUCCESS)
+        {
+            return PROTOCOL_RESULT_FAIL;
+        }
+        msg_len = (int64_t)compressed_len;
+        compressed = true;
+    }
+
     int64_t payload_num_written = 0;
     unsigned num_mask_bytes = (type == PROTOCOL_ENDPOINT_SERVER) ? 0 : 4;
     do
@@ -1628,70 +2228,18 @@ protocol_write_msg(protocol_conn* conn, protocol_msg* write_msg,
 
         hhassert(total_frame_len >= 0);
         /* make sure there is enough room for this frame */
-        char* data = darray_ensure(&conn->write_buffer,
-                                   (size_t)total_frame_len);
+        char* data = darray_ensure(buf, (size_t)total_frame_len);
 
         /* get the data */
-        data = &data[darray_get_len(conn->write_buffer)];
+        data = &data[darray_get_len(*buf)];
         const char* start_data = data;
 
         /* determine if this is the fin frame */
-        unsigned char first_byte_mask =
-            ((num_written + payload_len) >= msg_len) ? 0x80 : 0x00;
-
-        /* write the first byte to the buffer */
-        *data = (char)(first_byte_mask | (unsigned char)opcode);
-        data++;
-
-        /* set the mask bit if appropriate */
-        *data = (char)((type == PROTOCOL_ENDPOINT_CLIENT) ? 0x80 : 0x00);
-
-        /* write the payload length to the buffer */
-        uint16_t short_len;
-        uint64_t long_len;
-        switch (num_extra_len_bytes)
-        {
-        case 0:
-            *data |= (char)payload_len; /* |= to avoid blowing away mask bit */
-            data++;
-            break;
-
-        case 2:
-            *data |= 126; /* |= to avoid blowing away mask bit */
-            data++;
-            short_len = hh_htons((uint16_t)payload_len);
-            memcpy(data, &short_len, sizeof(uint16_t));
-            data += sizeof(uint16_t);
-            break;
-
-        case 8:
-            *data |= 127; /* |= to avoid blowing away mask bit */
-            data++;
-            long_len = hh_htonll((uint64_t)payload_len);
-            memcpy(data, &long_len, sizeof(uint64_t));
-            data += sizeof(uint64_t);
-            break;
-
-        default:
-            hhassert(0);
-            break;
-        }
+        bool fin = (payload_num_written + payload_len) >= msg_len;
 
-        uint32_t val;
         char* mask_key = NULL;
-        switch (type)
-        {
-        case PROTOCOL_ENDPOINT_SERVER:
-            break;
-        case PROTOCOL_ENDPOINT_CLIENT:
-            hhassert(conn->settings->rand_func != NULL);
-            val = conn->settings->rand_func(conn);
-            hhassert(sizeof(val) == num_mask_bytes);
-            memcpy(data, &val, num_mask_bytes);
-            mask_key = data;
-            data += num_mask_bytes;
-            break;
-        }
+        data = write_frame_hdr(conn, data, opcode, fin, compressed,
+                               payload_len, type, &mask_key);
 
     #ifdef DEBUG
         hhassert(start_data+2+num_extra_len_bytes+num_mask_bytes == data);
@@ -1708,22 +2256,29 @@ protocol_write_msg(protocol_conn* conn, protocol_msg* write_msg,
             break;
         case PROTOCOL_ENDPOINT_CLIENT:
             hhassert(payload_len >= 0);
-            mask_and_move_data(data, msg_data, (size_t)payload_len, mask_key,
-                               0, false, NULL, NULL);
+            mask_apply(data, msg_data, (size_t)payload_len, mask_key, 0);
             break;
         }
 
         /* bookkeeping */
-        darray_add_len(conn->write_buffer, (size_t)total_frame_len);
+        darray_add_len(*buf, (size_t)total_frame_len);
         msg_data += payload_len;
         payload_num_written += payload_len;
-        num_written += total_frame_len;
         opcode = PROTOCOL_OPCODE_CONTINUATION;
+        compressed = false;
     } while (payload_num_written < msg_len);
 
     return PROTOCOL_RESULT_MESSAGE_FINISHED;
 }
 
+static protocol_result
+protocol_write_msg(protocol_conn* conn, protocol_msg* write_msg,
+                   protocol_endpoint type)
+{
+    return encode_msg(conn, conn->settings, &conn->write_buffer, write_msg,
+                      type);
+}
+
 /*
  * put the message in write_msg on conn->write_buffer.
  * msg will be broken up into frames of size write_max_frame_size
@@ -1734,6 +2289,18 @@ protocol_write_server_msg(protocol_conn* conn, protocol_msg* write_msg)
     return protocol_write_msg(conn, write_msg, PROTOCOL_ENDPOINT_SERVER);
 }
 
+/*
+ * encode write_msg as server frames onto the end of buf, without needing
+ * a connection
+ */
+protocol_result
+protocol_encode_server_msg(protocol_settings* settings,
+                           protocol_msg* write_msg, darray** buf)
+{
+    return encode_msg(NULL, settings, buf, write_msg,
+                      PROTOCOL_ENDPOINT_SERVER);
+}
+
 /*
  * write write_msg to conn->write_buffer.  must be called after
  * protocol_read_handshake_request.
@@ -1744,6 +2311,52 @@ protocol_write_client_msg(protocol_conn* conn, protocol_msg* write_msg)
     return protocol_write_msg(conn, write_msg, PROTOCOL_ENDPOINT_CLIENT);
 }
 
+/*
+ * write only the header of the frame of write_msg that starts at payload_pos
+ * to conn->write_buffer, for servers that send the payload from a buffer of
+ * their own. frames are split the same way protocol_write_server_msg splits
+ * them.
+ */
+protocol_result
+protocol_write_server_frame_hdr(protocol_conn* conn, protocol_msg* write_msg,
+                                int64_t payload_pos, int64_t* frame_len)
+{
+    int64_t msg_len = write_msg->msg_len;
+    int64_t max_frame_size = conn->settings->write_max_frame_size;
+    if (max_frame_size < 0) max_frame_size = INT64_MAX;
+
+    protocol_opcode opcode = opcode_from_msg_type(write_msg->type);
+
+    /* please provide valid inputs... */
+    if (msg_len < 0 || payload_pos < 0 || payload_pos > msg_len)
+    {
+        return PROTOCOL_RESULT_FAIL;
+    }
+
+    if (msg_len > max_frame_size && !multiple_frames_allowed(opcode))
+    {
+        return PROTOCOL_RESULT_FAIL;
+    }
+
+    if (payload_pos > 0) opcode = PROTOCOL_OPCODE_CONTINUATION;
+
+    int64_t payload_len = hhmin(msg_len - payload_pos, max_frame_size);
+    bool fin = (payload_pos + payload_len) >= msg_len;
+
+    /* 2 bytes, plus at most 8 extra length bytes */
+    char* data = darray_ensure(&conn->write_buffer, 2 + sizeof(uint64_t));
+    data = &data[darray_get_len(conn->write_buffer)];
+
+    char* mask_key = NULL;
+    char* end = write_frame_hdr(conn, data, opcode, fin, false, payload_len,
+                                PROTOCOL_ENDPOINT_SERVER, &mask_key);
+    darray_add_len(conn->write_buffer, (size_t)(end - data));
+
+    *frame_len = payload_len;
+    return fin ? PROTOCOL_RESULT_MESSAGE_FINISHED :
+                 PROTOCOL_RESULT_FRAME_FINISHED;
+}
+
 bool protocol_is_data(protocol_msg_type msg_type)
 {
     switch (msg_type)
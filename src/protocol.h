@@ -31,7 +31,10 @@
 #ifndef __PROTOCOL_H_
 #define __PROTOCOL_H_
 
+#include "bufpool.h"
 #include "darray.h"
+#include "payload.h"
+#include "pmdeflate.h"
 #include "util.h"
 
 typedef enum
@@ -75,6 +78,7 @@ typedef enum
 typedef enum
 {
     PROTOCOL_RESULT_MESSAGE_FINISHED,
+    PROTOCOL_RESULT_MESSAGE_CHUNK, /* a piece of a streamed message */
     PROTOCOL_RESULT_FRAME_FINISHED,
     PROTOCOL_RESULT_CONTINUE,
     PROTOCOL_RESULT_FAIL,
@@ -110,6 +114,13 @@ typedef struct
     protocol_msg_type type;
     int64_t msg_len;
     char* data;
+
+    /*
+     * with PROTOCOL_RESULT_MESSAGE_CHUNK, whether this is the first and the
+     * last piece of its message
+     */
+    bool chunk_start;
+    bool chunk_final;
 } protocol_msg;
 
 /* represents a WebSocket message, but without a pointer to the actual data */
@@ -118,6 +129,7 @@ typedef struct
     buffer_info pos;
     int64_t msg_len;
     protocol_msg_type type;
+    bool compressed; /* RSV1 was set on the first frame */
 } protocol_offset_msg;
 
 /* represents a WebSocket frame header */
@@ -132,6 +144,8 @@ typedef struct
     char masking_key[4];
     bool fin;
     bool masked;
+    bool compressed; /* first frame of a permessage-deflate message */
+    payload_kernel* kernel; /* unmasks, validates and moves the payload */
 } protocol_frame_hdr;
 
 /* state needed across calls for ut8 validator */
@@ -141,19 +155,57 @@ typedef struct
     uint32_t codepoint;
 } protocol_utf8_valid_state;
 
-/* represeents a single handshake header */
+/* headers that get a fixed slot in protocol_handshake, see known */
+typedef enum
+{
+    PROTOCOL_HEADER_HOST,
+    PROTOCOL_HEADER_UPGRADE,
+    PROTOCOL_HEADER_ORIGIN,
+    PROTOCOL_HEADER_CONNECTION,
+    PROTOCOL_HEADER_SEC_KEY,
+    PROTOCOL_HEADER_SEC_ACCEPT,
+    PROTOCOL_HEADER_SEC_VERSION,
+    PROTOCOL_HEADER_SEC_PROTOCOL,
+    PROTOCOL_HEADER_SEC_EXTENSIONS,
+    PROTOCOL_NUMBER_OF_KNOWN_HEADERS
+} protocol_known_header;
+
+/*
+ * one value of a handshake header. the value itself is a null terminated
+ * string in protocol_handshake's buffer
+ */
 typedef struct
 {
-    char* name;
-    darray* values; /* darray of char*, i.e. char** */
+    uint32_t pos; /* offset of the value in buffer */
+    uint32_t len;
+    int32_t next; /* index of the header's next value, -1 if this is last */
+} protocol_header_value;
+
+/* represents a single handshake header */
+typedef struct
+{
+    uint32_t name_pos; /* offset of the null terminated name in buffer */
+    uint32_t name_len;
+    int32_t first_value; /* index in protocol_handshake's values */
+    int32_t last_value;
+    unsigned num_values;
 } protocol_header;
 
-/* info about the connection obtained during the WebSocket handshake */
+/*
+ * info about the connection obtained during the WebSocket handshake. the
+ * headers and values arrays are kept from one handshake to the next, so
+ * parsing a handshake doesn't allocate once they've grown big enough
+ */
 typedef struct
 {
     char* resource;
     darray* headers; /* array of protocol_header that contains all headers */
+    darray* values;  /* array of protocol_header_value for all headers */
     darray* buffer;  /* buffer that contains all headers and resource name */
+    size_t scan_pos; /* where to resume looking for the end of the headers */
+
+    /* index in headers of each known header, -1 if it wasn't sent */
+    int32_t known[PROTOCOL_NUMBER_OF_KNOWN_HEADERS];
 } protocol_handshake;
 
 typedef struct protocol_conn protocol_conn;
@@ -184,6 +236,9 @@ typedef struct
      * random number generator for creating client frames
      */
     random_func* rand_func;
+
+    /* permessage-deflate, off unless deflate.enabled is set */
+    pmdeflate_settings deflate;
 } protocol_settings;
 
 /* represents the buffers/info for a websocket connection */
@@ -195,12 +250,33 @@ struct protocol_conn
     /* char* buffer used for reading from an endpoint */
     darray* read_buffer;
 
+    /*
+     * everything in read_buffer before this has been parsed and removed.
+     * the space is only reclaimed, by moving what's after it to the front,
+     * once the buffer runs out of room at the end
+     */
+    size_t read_start;
+
     /* char* buffer used for writing to a endpoint */
     darray* write_buffer;
 
+    /*
+     * where buffers come from when they're needed and go back to when
+     * they're not. NULL for the heap
+     */
+    bufpool* pool;
+
     /* current state of this connection */
     protocol_state state;
 
+    /*
+     * hand out text and binary messages a piece at a time, as they arrive,
+     * instead of putting their fragments back together in read_buffer.
+     * permessage-deflate messages are still put together and inflated
+     * first, they come out as a single piece
+     */
+    bool stream_msgs;
+
     int error_len;
 
     /* fragmented msg we're currently reading from a endpoint */
@@ -233,6 +309,12 @@ struct protocol_conn
      */
     uint16_t error_code;
 
+    /* compression state, NULL unless permessage-deflate was negotiated */
+    pmdeflate* deflate;
+
+    /* what a client offered, kept until the server responds */
+    pmdeflate_params deflate_offer;
+
     /*
      * arbitrary data to associate with this object
      */
@@ -247,12 +329,35 @@ protocol_conn* protocol_create_conn(protocol_settings* settings,
                                     void* userdata);
 
 /*
- * initialize an already allocated protocol_conn. allocates read and
- * write buffers
+ * initialize an already allocated protocol_conn. nothing is allocated until
+ * protocol_acquire_buffers is called
 */
 int protocol_init_conn(protocol_conn* conn, protocol_settings* settings,
                        void* userdata);
 
+/* take buffers from pool from now on. NULL for the heap */
+void protocol_set_bufpool(protocol_conn* conn, bufpool* pool);
+
+/*
+ * make sure the read and write buffers are allocated, and the handshake info
+ * too while the handshake is in progress. must be called before reading or
+ * writing anything on a connection made with protocol_init_conn. returns -1
+ * if out of memory
+ */
+int protocol_acquire_buffers(protocol_conn* conn);
+
+/*
+ * give back the read and write buffers, if there's nothing in them. they're
+ * acquired again the next time they're needed
+ */
+void protocol_release_buffers(protocol_conn* conn);
+
+/*
+ * give back the handshake info once the handshake is done. the header
+ * getters find nothing after this
+ */
+void protocol_release_handshake(protocol_conn* conn);
+
 /*
  * free/destroy a protocol_conn
  */
@@ -326,19 +431,52 @@ char* protocol_prepare_read(protocol_conn* conn, size_t ensure_len);
  */
 void protocol_update_read(protocol_conn* conn, size_t num_read);
 
+/*
+ * remove the range [start, end) of already parsed messages from the read
+ * buffer. returns how far any position past end moved back with its data,
+ * callers subtract it from positions they hold. that's end - start if there
+ * was data in front of the range, and end if the range ran from the front
+ * to the end of the buffer, which is cleared. it's 0 if bytes remain after
+ * end and the range was at the front, so read_start just advances past it,
+ * or if a fragmented message still needs the range and it was left alone
+ */
+size_t protocol_remove_read(protocol_conn* conn, size_t start, size_t end);
+
+/*
+ * call before protocol_prepare_read. if there isn't room for ensure_len more
+ * bytes at the end of the read buffer, reclaims what was removed from its
+ * front instead of growing it. returns how far any position into the buffer
+ * moved back
+ */
+size_t protocol_compact_read(protocol_conn* conn, size_t ensure_len);
+
+/*
+ * number of payload bytes the frame currently being read still needs. 0 if
+ * we're between frames or still in the handshake. lets the caller size its
+ * next read so a large frame lands in the read buffer in a few calls
+ */
+size_t protocol_get_pending_read_len(protocol_conn* conn);
+
 /*
  * Get the the field name of one of the headers sent by the client
  */
 const char* protocol_get_header_name(protocol_conn* conn, unsigned index);
 
 /*
- * Get the darray of values (type char*) for a given header index
+ * Get the number of values for a given header index
  */
-const darray* protocol_get_header_values(protocol_conn* conn, unsigned index);
+unsigned protocol_get_num_header_values_at(protocol_conn* conn,
+                                           unsigned index);
+
+/*
+ * Get one of the values for a given header index
+ */
+const char* protocol_get_header_value_at(protocol_conn* conn, unsigned index,
+                                         unsigned value_index);
 
 /*
  * Get the number of headers sent by the client any index less than this
- * can be used in protocol_get_header_name and protocol_get_header_values
+ * can be used in protocol_get_header_name and protocol_get_header_value_at
  */
 unsigned protocol_get_num_headers(protocol_conn* conn);
 
@@ -389,6 +527,11 @@ const char* protocol_get_resource(protocol_conn* conn);
  * untouched.  The data pointer in read_msg will be a pointer into
  * conn->read_buffer, and as such will NOT be valid after any changes to
  * conn->read_buffer
+ *
+ * with stream_msgs set, PROTOCOL_RESULT_MESSAGE_CHUNK means read_msg holds
+ * the part of a text or binary message that just arrived. everything from
+ * read_msg->pos.full_msg_start_pos up to start_pos can then be removed with
+ * protocol_remove_read
  */
 protocol_result
 protocol_read_client_msg(protocol_conn* conn, size_t* start_pos,
@@ -413,6 +556,17 @@ protocol_read_server_msg(protocol_conn* conn, size_t* start_pos,
 protocol_result
 protocol_write_server_msg(protocol_conn* conn, protocol_msg* write_msg);
 
+/*
+ * encode write_msg as server frames onto the end of buf, exactly as
+ * protocol_write_server_msg would put them on a connection's write buffer.
+ * server frames aren't masked, so the same bytes can be sent to any number
+ * of connections that share settings. they're never compressed, since
+ * each connection has its own permessage-deflate context
+ */
+protocol_result
+protocol_encode_server_msg(protocol_settings* settings,
+                           protocol_msg* write_msg, darray** buf);
+
 /*
  * write write_msg to conn->write_buffer.  must be called after
  * protocol_read_handshake_request.
@@ -420,6 +574,19 @@ protocol_write_server_msg(protocol_conn* conn, protocol_msg* write_msg);
 protocol_result
 protocol_write_client_msg(protocol_conn* conn, protocol_msg* write_msg);
 
+/*
+ * write only the header of the frame of write_msg whose payload starts at
+ * payload_pos to conn->write_buffer, so a server can send the payload
+ * straight from its own buffer. start with payload_pos at 0. frame_len is
+ * set to the number of payload bytes the frame carries; add it to
+ * payload_pos for the next call. returns PROTOCOL_RESULT_FRAME_FINISHED
+ * while there are more frames to write, PROTOCOL_RESULT_MESSAGE_FINISHED
+ * after the last one. the payload is sent uncompressed.
+ */
+protocol_result
+protocol_write_server_frame_hdr(protocol_conn* conn, protocol_msg* write_msg,
+                                int64_t payload_pos, int64_t* frame_len);
+
 /* Convienence functions */
 bool protocol_is_data(protocol_msg_type msg_type);
 bool protocol_is_control(protocol_msg_type msg_type);
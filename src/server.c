@@ -28,6 +28,12 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+/* for accept4 */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "bufpool.h"
 #include "error_code.h"
 #include "endpoint.h"
 #include "event.h"
@@ -38,8 +44,10 @@
 #include "hhclock.h"
 #include "hhlog.h"
 #include "hhmemory.h"
+#include "platform.h"
 #include "protocol.h"
 #include "server.h"
+#include "timerwheel.h"
 
 #include <arpa/inet.h>
 #include <errno.h>
@@ -47,7 +55,9 @@
 #include <limits.h>
 #include <inttypes.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/time.h>
 #include <stdio.h>
 #include <stdarg.h>
@@ -55,13 +65,24 @@
 #include <time.h>
 #include <unistd.h>
 
+#ifdef HAVE_REUSEPORT_CBPF
+#include <linux/filter.h>
+#endif
+
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
 #define SERVER_LISTEN_BACKLOG               512
 #define SERVER_WATCHDOG_FREQ_MS             100
-#define SERVER_HANDSHAKE_TIMEOUT_FREQ_MS    300
-#define SERVER_HEARTBEAT_PENDING            0
-#define SERVER_HEARTEAT_RECEIVED            ULLONG_MAX
+#define SERVER_TIMER_RESOLUTION_MS          50
+#define SERVER_MIN_HANDOFF_QUEUE            64
+#define SERVER_DEFAULT_ACCEPT_BUDGET        64
+#define SERVER_ACCEPT_REPORT_MS             10000
 
 #define COMMAND_SHUT_DOWN   ((char)1)
+#define COMMAND_NEW_CONN    ((char)2) /* sent with the client fd attached */
+#define COMMAND_CONN_DONE   ((char)3) /* worker to master, one per conn */
 
 static char g_heartbeat_msg[] = "heartbeat";
 
@@ -71,60 +92,108 @@ struct server_conn
     endpoint endp;
     server* serv;
     void* userdata;
-    uint64_t timeout;
+    timerwheel_timer deadline; /* handshake, idle or close timeout */
+    timerwheel_timer heartbeat; /* next heartbeat, or pong due */
+    uint64_t last_read_ms; /* only kept with idle_timeout_ms */
+    bool pong_pending; /* sent a heartbeat ping, waiting on the pong */
+    bool closing; /* sent a close frame */
     server_conn* next; /* in either active or free list */
     server_conn* prev; /* in either active or free list */
-    server_conn* timeout_next; /* in either handshake or heartbeat list */
-    server_conn* timeout_prev; /* in either handshake or heartbeat list */
+    server_conn* dirty_next; /* in dirty list */
+    server_conn* dirty_prev; /* in dirty list */
+    bool dirty; /* has output to flush at the end of this loop iteration */
+    bool write_waiting; /* waiting on ILOOP_WRITEABLE to write more */
+    bool write_throttled; /* went over the high watermark, owed on_drain */
+    bool write_overflowed; /* over it with the close policy, being dropped */
+};
+
+struct server_frame
+{
+    unsigned refcount;
+    darray* data; /* the encoded frames */
 };
 
+/*
+ * connections handed from the accepting thread to a loop thread. lock free,
+ * only safe with exactly one thread pushing and one popping
+ */
+typedef struct
+{
+    int* fds;
+    unsigned mask; /* size - 1, size is a power of 2 */
+    unsigned head; /* next to pop, only written by the loop thread */
+    unsigned tail; /* next to push, only written by the accepting thread */
+} server_fd_queue;
+
 struct server
 {
     bool stopping;
     int fd;
     int num_connected;
     server_conn* connections;
+    int num_initialized; /* connections that have been through init_conn */
+    bufpool* pool; /* where connections get their buffers while in use */
     server_conn* active_head;
     server_conn* active_tail;
     server_conn* free_head;
     server_conn* free_tail;
-    server_conn* handshake_head;
-    server_conn* handshake_tail;
-    server_conn* heartbeat_head;
-    server_conn* heartbeat_tail;
+    timerwheel* timers; /* every connection's deadlines */
+    server_conn* dirty_head;
+    server_conn* dirty_tail;
+    bool flush_on_tick; /* loop supports set_tick, see flush_dirty_conns */
     iloop loop;
     config_server_options options;
     server_callbacks cbs;
     void* userdata;
     int* pipes;
+    int* worker_conns; /* master_dispatch only, open conns per worker */
+    bool* pipe_full; /* master_dispatch only, pipes[i] had no room */
+    server_fd_queue dispatch_queue; /* master_dispatch only, see above */
+    int worker_fd; /* worker's end of the master's pipe */
+    int report_fd; /* where to send COMMAND_CONN_DONE, -1 for nowhere */
+    int num_unreported; /* COMMAND_CONN_DONEs report_fd had no room for */
+    bool report_blocked; /* waiting for room on report_fd */
+    server** threads; /* loop threads' servers, NULL if not threaded */
+    pthread_t* thread_ids;
+    int num_threads_running;
+    int next_thread; /* where the next accepted connection goes */
+    server_fd_queue handoff; /* only used on loop threads */
+    int wake_fds[2]; /* read, write end. the same fd with eventfd */
+    uint64_t num_accepted; /* since stats_start_ms */
+    uint64_t num_rejected; /* since the last watchdog run */
+    uint64_t stats_start_ms;
 };
 
 static void accept_callback(iloop* loop, int fd, void* data);
 static void worker_pipe_callback(iloop* loop, int fd, void* data);
+static void handoff_callback(iloop* loop, int fd, void* data);
 static void read_from_client_callback(iloop* loop, int fd, void* data);
 static void write_to_client_callback(iloop* loop, int fd, void* data);
+static void accepted_callback(iloop* loop, int client_fd, void* data);
+static void recv_from_client_callback(iloop* loop, int fd, const char* buf,
+                                      ssize_t num_read, void* data);
 
 static iloop_io_callback* g_io_cbs[ILOOP_NUMBER_OF_IO_CB] =
 {
     accept_callback, /* ILOOP_ACCEPT_CB */
     read_from_client_callback, /* ILOOP_READ_CB */
     write_to_client_callback, /* ILOOP_WRITE_CB */
-    worker_pipe_callback /* ILOOP_WORKER_CB */
+    worker_pipe_callback, /* ILOOP_WORKER_CB */
+    handoff_callback /* ILOOP_HANDOFF_CB */
 };
 
 static void stop_watchdog(iloop* loop,iloop_time_cb_type type,void* data);
-static void send_heartbeats(iloop* loop,iloop_time_cb_type type,void* data);
-static void expire_heartbeats(iloop* loop,iloop_time_cb_type type,void* data);
-static void timeout_handshakes(iloop* loop,iloop_time_cb_type type,void* data);
+static void run_timers(iloop* loop, iloop_time_cb_type type, void* data);
 
 static iloop_time_callback* g_time_cbs[ILOOP_NUMBER_OF_TIME_CB] =
 {
     stop_watchdog, /* ILOOP_WATCHDOG_CB */
-    send_heartbeats, /* ILOOP_HEARTBEAT_CB */
-    expire_heartbeats, /* ILOOP_HEARTBEAT_EXPIRE_CB */
-    timeout_handshakes /* ILOOP_HANDSHAKE_TIMEOUT_CB */
+    run_timers /* ILOOP_TIMERS_CB */
 };
 
+static void deadline_expired(timerwheel_timer* timer, void* data);
+static void heartbeat_due(timerwheel_timer* timer, void* data);
+
 /*
  * Required when including iloop.h
  */
@@ -134,6 +203,7 @@ iloop* iloop_from_io(iloop_cb_type type, void *data)
     {
     case ILOOP_ACCEPT_CB:
     case ILOOP_WORKER_CB:
+    case ILOOP_HANDOFF_CB:
         return &(((server*)data)->loop);
 
     case ILOOP_READ_CB:
@@ -155,12 +225,30 @@ iloop* iloop_from_time(iloop_time_cb_type type, void *data)
     return &(((server*)data)->loop);
 }
 
+/*
+ * the time the loop sampled for this iteration. connection bookkeeping uses
+ * this rather than reading the clock for every event
+ */
+static uint64_t get_now_ms(server* serv)
+{
+    iloop* loop = &serv->loop;
+    return (loop->now != NULL) ? loop->now(loop) : hhclock_get_now_ms();
+}
+
+static void stop_threads(server* serv);
+static void join_threads(server* serv);
+static void report_conn_done(server* serv);
+
 static bool server_on_connect_callback(endpoint* conn, protocol_conn* proto_conn,
                                     void* userdata);
 
 static void server_on_message_callback(endpoint* conn, endpoint_msg* msg,
                                        void* userdata);
 
+static void server_on_message_chunk_callback(endpoint* conn_info,
+                                             endpoint_msg_chunk* chunk,
+                                             void* userdata);
+
 static void server_on_ping_callback(endpoint* conn_info, char* payload,
                                     int payload_len, void* userdata);
 
@@ -175,6 +263,7 @@ static endpoint_callbacks g_server_cbs =
 {
     .on_connect = server_on_connect_callback,
     .on_message = server_on_message_callback,
+    .on_message_chunk = server_on_message_chunk_callback,
     .on_ping = server_on_ping_callback,
     .on_pong = server_on_pong_callback,
     .on_close = server_on_close_callback
@@ -184,12 +273,25 @@ static int init_conn(server_conn* conn, server* serv)
 {
     conn->serv = serv;
     conn->userdata = NULL;
-    conn->timeout_next = NULL;
-    conn->timeout_prev = NULL;
+    timerwheel_timer_init(&conn->deadline, deadline_expired, conn);
+    timerwheel_timer_init(&conn->heartbeat, heartbeat_due, conn);
+    conn->last_read_ms = 0;
+    conn->pong_pending = false;
+    conn->closing = false;
     conn->prev = NULL;
     conn->next = NULL;
+    conn->dirty_next = NULL;
+    conn->dirty_prev = NULL;
+    conn->dirty = false;
+    conn->write_waiting = false;
+    conn->write_throttled = false;
+    conn->write_overflowed = false;
     int r = endpoint_init(&conn->endp, ENDPOINT_SERVER,
                           &serv->options.endp_settings, &g_server_cbs, conn);
+    endpoint_set_bufpool(&conn->endp, serv->pool);
+
+    /* g_server_cbs always has on_message_chunk, only stream if asked to */
+    conn->endp.pconn.stream_msgs = (serv->cbs.on_message_chunk != NULL);
 
     return r;
 }
@@ -199,9 +301,35 @@ static void deinit_conn(server_conn* conn)
     endpoint_deinit(&conn->endp);
 }
 
+static void deinit_conns(server* serv)
+{
+    for (int i = 0; i < serv->num_initialized; i++)
+    {
+        deinit_conn(&serv->connections[i]);
+    }
+    serv->num_initialized = 0;
+}
+
+/*
+ * connection objects are initialized the first time they're needed, so
+ * the memory for max_clients of them isn't touched until that many have
+ * connected at once
+ */
+static bool init_next_conn(server* serv)
+{
+    if (serv->num_initialized >= serv->options.max_clients) return false;
+
+    server_conn* conn = &serv->connections[serv->num_initialized];
+    if (init_conn(conn, serv) < 0) return false;
+    serv->num_initialized++;
+
+    INLIST_APPEND(serv, conn, next, prev, free_head, free_tail);
+    return true;
+}
+
 static server_conn* activate_conn(server* serv, int client_fd)
 {
-    if (serv->free_head == NULL) return NULL;
+    if (serv->free_head == NULL && !init_next_conn(serv)) return NULL;
 
     server_conn* conn = serv->free_head;
 
@@ -211,16 +339,20 @@ static server_conn* activate_conn(server* serv, int client_fd)
     /* push it to the back of the active list of connections */
     INLIST_APPEND(serv, conn, next, prev, active_head, active_tail);
 
-    /* push it to the back of the list of hanshake timeouts */
     config_server_options* opt = &serv->options;
     if (opt->handshake_timeout_ms > 0)
     {
-        INLIST_APPEND(serv, conn, timeout_next, timeout_prev, handshake_head,
-                      handshake_tail);
-        conn->timeout = hhclock_get_now_ms() + opt->handshake_timeout_ms;
+        timerwheel_add(serv->timers, &conn->deadline,
+                       get_now_ms(serv) + opt->handshake_timeout_ms);
     }
 
     conn->fd = client_fd;
+    conn->dirty = false;
+    conn->write_waiting = false;
+    conn->pong_pending = false;
+    conn->closing = false;
+    conn->write_throttled = false;
+    conn->write_overflowed = false;
     endpoint_reset(&conn->endp);
     serv->num_connected++;
 
@@ -234,35 +366,155 @@ static void deactivate_conn(server* serv, server_conn* conn)
 
     serv->num_connected--;
 
+    /* nothing left to flush */
+    if (conn->dirty)
+    {
+        INLIST_REMOVE(serv, conn, dirty_next, dirty_prev, dirty_head,
+                      dirty_tail);
+        conn->dirty = false;
+    }
+
     /* put it on the end of the free list */
     INLIST_APPEND(serv, conn, next, prev, free_head, free_tail);
 
-    /* remove from any timeout lists */
-    switch (conn->endp.pconn.state)
-    {
-    case PROTOCOL_STATE_READ_HANDSHAKE:
-    case PROTOCOL_STATE_WRITE_HANDSHAKE:
-        INLIST_REMOVE(serv, conn, timeout_next, timeout_prev, handshake_head,
-                      handshake_tail);
-        break;
-
-    case PROTOCOL_STATE_CONNECTED:
-        INLIST_REMOVE(serv, conn, timeout_next, timeout_prev, heartbeat_head,
-                      heartbeat_tail);
-        break;
-    }
+    timerwheel_cancel(&conn->deadline);
+    timerwheel_cancel(&conn->heartbeat);
 }
 
-static iloop_result queue_write(server_conn* conn)
+static iloop_result wait_writeable(server_conn* conn)
 {
     /* queue up writing response back */
     iloop_result er;
     iloop* loop = &conn->serv->loop;
     er = loop->add_io(loop, conn->fd, ILOOP_WRITEABLE, ILOOP_WRITE_CB, conn);
+    conn->write_waiting = (er == ILOOP_SUCCESS);
 
     return er;
 }
 
+static iloop_result queue_write(server_conn* conn)
+{
+    server* serv = conn->serv;
+
+    /*
+     * write directly at the end of this loop iteration, so everything sent
+     * on this connection until then goes out in one writev. only wait on
+     * the socket if it's already full
+     */
+    if (serv->flush_on_tick && !conn->write_waiting)
+    {
+        if (!conn->dirty)
+        {
+            conn->dirty = true;
+            INLIST_APPEND(serv, conn, dirty_next, dirty_prev, dirty_head,
+                          dirty_tail);
+        }
+        return ILOOP_SUCCESS;
+    }
+
+    return wait_writeable(conn);
+}
+
+/*
+ * whether a message can be queued on conn, going by how much it still has
+ * to write. if not, result_out is what the send should return
+ */
+static bool can_queue_msg(server_conn* conn, server_result* result_out)
+{
+    server* serv = conn->serv;
+    config_server_options* opt = &serv->options;
+
+    *result_out = SERVER_RESULT_FAIL;
+    if (conn->write_overflowed) return false;
+
+    if (opt->write_high_watermark == 0 ||
+        endpoint_get_buffered_bytes(&conn->endp) <= opt->write_high_watermark)
+    {
+        return true;
+    }
+
+    conn->write_throttled = true;
+    switch (opt->write_overflow_policy)
+    {
+    case CONFIG_WRITE_OVERFLOW_BLOCK:
+        *result_out = SERVER_RESULT_WOULD_BLOCK;
+        break;
+    case CONFIG_WRITE_OVERFLOW_DROP:
+        hhlog(HHLOG_LEVEL_DEBUG_2, "dropping msg to client %d, %zu buffered",
+              conn->fd, endpoint_get_buffered_bytes(&conn->endp));
+        *result_out = SERVER_RESULT_SUCCESS;
+        break;
+    case CONFIG_WRITE_OVERFLOW_CLOSE:
+        /*
+         * see deadline_expired. the caller may be in the middle of going
+         * through its connections, so on_close can't be called from here
+         */
+        conn->write_overflowed = true;
+        timerwheel_add(serv->timers, &conn->deadline, get_now_ms(serv));
+        break;
+    }
+
+    return false;
+}
+
+/* call on_drain if conn was over its high watermark and has caught up */
+static void check_write_drained(server_conn* conn)
+{
+    server* serv = conn->serv;
+    if (!conn->write_throttled || conn->write_overflowed ||
+        endpoint_get_buffered_bytes(&conn->endp) >
+        serv->options.write_low_watermark)
+    {
+        return;
+    }
+
+    conn->write_throttled = false;
+    if (serv->cbs.on_drain != NULL)
+    {
+        serv->cbs.on_drain(conn, serv->userdata);
+    }
+}
+
+/* tick callback, writes out everything queue_write put on the dirty list */
+static void flush_dirty_conns(iloop* loop, void* data)
+{
+    server* serv = data;
+
+    /* writing can close connections, which may queue writes on others */
+    while (serv->dirty_head != NULL)
+    {
+        server_conn* conn = serv->dirty_head;
+        INLIST_REMOVE(serv, conn, dirty_next, dirty_prev, dirty_head,
+                      dirty_tail);
+        conn->dirty = false;
+
+        iloop_result ir;
+        endpoint_write_result r = endpoint_write(&conn->endp, conn->fd);
+        switch (r)
+        {
+        case ENDPOINT_WRITE_CONTINUE:
+            if (conn->endp.write_blocked && loop->io_blocked != NULL)
+            {
+                loop->io_blocked(loop, conn->fd, ILOOP_WRITEABLE);
+            }
+            ir = wait_writeable(conn);
+            if (ir != ILOOP_SUCCESS)
+            {
+                hhlog(HHLOG_LEVEL_ERROR, "flush event loop error: %d", ir);
+            }
+            check_write_drained(conn);
+            break;
+        case ENDPOINT_WRITE_DONE:
+            check_write_drained(conn);
+            break;
+        case ENDPOINT_WRITE_ERROR:
+        case ENDPOINT_WRITE_CLOSED:
+            /* proper callback will have been called on error or close */
+            break;
+        }
+    }
+}
+
 static void server_on_ping_callback(endpoint* conn_info, char* payload,
                                     int payload_len, void* userdata)
 {
@@ -295,17 +547,13 @@ static void server_on_pong_callback(endpoint* conn_info, char* payload,
     hhlog(HHLOG_LEVEL_DEBUG_2, "pong received from client %d: %.*s", conn->fd,
           (int)payload_len, payload);
 
-    if (serv->options.heartbeat_interval_ms > 0 &&
-        serv->options.heartbeat_ttl_ms > 0)
+    if (conn->pong_pending && payload_len == sizeof(g_heartbeat_msg) - 1 &&
+        memcmp(payload, g_heartbeat_msg, payload_len) == 0)
     {
-        if (payload_len == sizeof(g_heartbeat_msg) - 1 &&
-            memcmp(payload, g_heartbeat_msg, payload_len) == 0)
-        {
-            /* this conn is safe, move to the back of the list */
-            conn->timeout = SERVER_HEARTEAT_RECEIVED;
-            INLIST_MOVE_BACK(serv, conn, timeout_next, timeout_prev,
-                             heartbeat_head, heartbeat_tail);
-        }
+        /* this conn is safe, next heartbeat is a full interval from now */
+        conn->pong_pending = false;
+        timerwheel_add(serv->timers, &conn->heartbeat,
+                get_now_ms(serv) + serv->options.heartbeat_interval_ms);
     }
 
     if (serv->cbs.on_pong != NULL)
@@ -334,6 +582,7 @@ static void server_on_close_callback(endpoint* conn_info, int code,
 
     /* close the socket */
     close(conn->fd);
+    report_conn_done(serv);
 
     /* set fd to -1 to mark socket dead */
     conn->fd = -1;
@@ -345,12 +594,11 @@ static void server_on_close_callback(endpoint* conn_info, int code,
      * if we're stopping, and we were the last connection, tear down the
      * event loop
      */
-    if (serv->stopping && serv->active_head == NULL && loop->stop != NULL)
+    bool stopping = __atomic_load_n(&serv->stopping, __ATOMIC_ACQUIRE);
+    if (stopping && serv->active_head == NULL && loop->stop != NULL)
     {
         hhlog(HHLOG_LEVEL_DEBUG, "final client disconnected, stopping");
-        loop->delete_time(loop, ILOOP_HEARTBEAT_CB);
-        loop->delete_time(loop, ILOOP_HEARTBEAT_EXPIRE_CB);
-        loop->delete_time(loop, ILOOP_HANDSHAKE_TIMEOUT_CB);
+        loop->delete_time(loop, ILOOP_TIMERS_CB);
         loop->stop(loop);
     }
 }
@@ -363,6 +611,11 @@ static void write_to_client_callback(iloop* loop, int fd, void* data)
     switch (r)
     {
     case ENDPOINT_WRITE_CONTINUE:
+        if (conn->endp.write_blocked && loop->io_blocked != NULL)
+        {
+            loop->io_blocked(loop, fd, ILOOP_WRITEABLE);
+        }
+        check_write_drained(conn);
         return;
     case ENDPOINT_WRITE_DONE:
         /*
@@ -370,6 +623,8 @@ static void write_to_client_callback(iloop* loop, int fd, void* data)
          * there's more data to be sent
          */
         loop->delete_io(loop, fd, ILOOP_WRITEABLE);
+        conn->write_waiting = false;
+        check_write_drained(conn);
         return;
     case ENDPOINT_WRITE_ERROR:
     case ENDPOINT_WRITE_CLOSED:
@@ -464,21 +719,32 @@ server_on_connect_callback(endpoint* conn_info,
         goto reject_client;
     }
 
+    /* done with the handshake deadline, on_open may set a close one */
+    timerwheel_cancel(&conn->deadline);
+
+    config_server_options* opt = &serv->options;
+    uint64_t now = get_now_ms(serv);
+    if (opt->idle_timeout_ms > 0)
+    {
+        conn->last_read_ms = now;
+        timerwheel_add(serv->timers, &conn->deadline,
+                       now + opt->idle_timeout_ms);
+    }
+
+    if (opt->heartbeat_interval_ms > 0)
+    {
+        timerwheel_add(serv->timers, &conn->heartbeat,
+                       now + opt->heartbeat_interval_ms);
+    }
+
     if (serv->cbs.on_open != NULL)
     {
         serv->cbs.on_open(conn, serv->userdata);
     }
 
-    INLIST_REMOVE(serv, conn, timeout_next, timeout_prev, handshake_head,
-                  handshake_tail);
-
-    config_server_options* opt = &serv->options;
-    uint64_t hb_interval = opt->heartbeat_interval_ms;
-    if (hb_interval > 0)
+    if (opt->release_handshake_info)
     {
-        conn->timeout = SERVER_HEARTEAT_RECEIVED;
-        INLIST_APPEND(serv, conn, timeout_next, timeout_prev, heartbeat_head,
-                      heartbeat_tail);
+        protocol_release_handshake(&conn->endp.pconn);
     }
 
     return true;
@@ -506,13 +772,34 @@ static void server_on_message_callback(endpoint* conn_info, endpoint_msg* msg,
     }
 }
 
-static void read_from_client_callback(iloop* loop, int fd, void* data)
+static void server_on_message_chunk_callback(endpoint* conn_info,
+                                             endpoint_msg_chunk* chunk,
+                                             void* userdata)
 {
-    hhunused(loop);
-    server_conn* conn = data;
+    hhunused(conn_info);
+
+    server_conn* conn = userdata;
+    server* serv = conn->serv;
+
+    hhlog(HHLOG_LEVEL_DEBUG_2, "msg chunk received from client %d (%zu bytes)",
+          conn->fd, chunk->len);
+
+    serv->cbs.on_message_chunk(conn, chunk, serv->userdata);
+}
 
+/* see deadline_expired */
+static void note_read(server_conn* conn)
+{
+    if (conn->serv->options.idle_timeout_ms > 0)
+    {
+        conn->last_read_ms = get_now_ms(conn->serv);
+    }
+}
+
+static void handle_read_result(iloop* loop, int fd, server_conn* conn,
+                               endpoint_read_result r)
+{
     iloop_result ir;
-    endpoint_read_result r = endpoint_read(&conn->endp, fd);
     switch (r)
     {
     case ENDPOINT_READ_SUCCESS:
@@ -537,188 +824,773 @@ static void read_from_client_callback(iloop* loop, int fd, void* data)
     hhassert(0);
 }
 
-static void accept_callback(iloop* loop, int fd, void* data)
+static void read_from_client_callback(iloop* loop, int fd, void* data)
 {
-    server* serv = data;
-    struct sockaddr_in addr;
-    socklen_t len = sizeof(addr);
-    int client_fd = accept(fd, (struct sockaddr*)(&addr), &len);
+    server_conn* conn = data;
+    note_read(conn);
 
-    if (client_fd == -1)
+    endpoint_read_result r = endpoint_read(&conn->endp, fd);
+    if (conn->endp.read_blocked && loop->io_blocked != NULL &&
+        (r == ENDPOINT_READ_SUCCESS || r == ENDPOINT_READ_SUCCESS_WROTE_DATA))
     {
-        if (errno != EAGAIN && errno != EWOULDBLOCK)
-        {
-            hhlog(HHLOG_LEVEL_ERROR,
-                  "-1 fd when accepting socket, fd: %d, err: %d (%s)", fd,
-                  errno, strerror(errno));
-        }
-        return;
+        loop->io_blocked(loop, fd, ILOOP_READABLE);
     }
 
-    hhlog(HHLOG_LEVEL_DEBUG, "client connected, fd: %d", client_fd);
+    handle_read_result(loop, fd, conn, r);
+}
 
-    server_conn* conn = activate_conn(serv, client_fd);
-    if (conn == NULL)
+/* the loop did the read, see iloop.h */
+static void recv_from_client_callback(iloop* loop, int fd, const char* buf,
+                                      ssize_t num_read, void* data)
+{
+    server_conn* conn = data;
+    note_read(conn);
+
+    endpoint_read_result r;
+    r = endpoint_read_data(&conn->endp, fd, buf, num_read);
+    handle_read_result(loop, fd, conn, r);
+}
+
+/* send cmd over a worker pipe, with passed_fd attached if it isn't -1 */
+static ssize_t send_command(int fd, char cmd, int passed_fd)
+{
+    struct iovec iov;
+    iov.iov_base = &cmd;
+    iov.iov_len = sizeof(cmd);
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    union
     {
-        hhlog(HHLOG_LEVEL_ERROR, "Server at max client capacity: %d",
-                  serv->options.max_clients);
-        close(client_fd);
-        return;
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    if (passed_fd != -1)
+    {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &passed_fd, sizeof(int));
     }
 
-    iloop_result r;
-    r = loop->add_io(loop, client_fd, ILOOP_READABLE, ILOOP_READ_CB, conn);
+    return sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
 
-    if (r != ILOOP_SUCCESS)
+/* read one cmd from a worker pipe, passed_fd is -1 if none was attached */
+static ssize_t read_command(int fd, char* cmd, int* passed_fd)
+{
+    struct iovec iov;
+    iov.iov_base = cmd;
+    iov.iov_len = sizeof(*cmd);
+
+    union
     {
-        hhlog(HHLOG_LEVEL_ERROR, "add client to event loop error: %d", r);
-        loop->delete_io(loop, client_fd, ILOOP_READABLE);
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    *passed_fd = -1;
+    ssize_t num = recvmsg(fd, &msg, 0);
+    if (num <= 0) return num;
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            memcpy(passed_fd, CMSG_DATA(cmsg), sizeof(int));
+        }
     }
+
+    return num;
 }
 
 /*
- * Only used in worker process mode
+ * send the master every COMMAND_CONN_DONE we owe it. if report_fd is full,
+ * the rest goes out once it has room again, see worker_pipe_callback.
+ * report_fd is shared by loop threads, but the commands are all the same
+ * byte so it doesn't matter how their sends interleave
  */
-static void worker_pipe_callback(iloop* loop, int fd, void* data)
+static void flush_conn_done(server* serv)
 {
-    hhunused(loop);
-
-    server* serv = data;
-
-    char cmd = 0;
-    ssize_t num = read(fd, &cmd, sizeof(cmd));
+    iloop* loop = &serv->loop;
+    char cmds[256];
 
-    if (num <= 0)
+    while (serv->num_unreported > 0)
     {
-        /* error or eof from pipe, close and don't listen anymore */
-        close(fd);
-        loop->delete_io(loop, fd, ILOOP_READABLE | ILOOP_WRITEABLE);
+        size_t len = hhmin((size_t)serv->num_unreported, sizeof(cmds));
+        memset(cmds, COMMAND_CONN_DONE, len);
 
+        ssize_t num = send(serv->report_fd, cmds, len, MSG_NOSIGNAL);
         if (num < 0)
         {
-            hhlog(HHLOG_LEVEL_ERROR,
-                  "invalid worker_pipe_callback read, stopping worker process"
-                  " err: %d (%s)", errno, strerror(errno));
-            server_stop(serv);
-            return;
-        }
-        else if (num == 0)
-        {
-            if (serv->stopping)
-            {
-                hhlog(HHLOG_LEVEL_DEBUG,
-                   "pipe died but server is stopping, silently closed pipe");
-            }
-            else
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
             {
-                hhlog(HHLOG_LEVEL_ERROR,
-                        "master process pipe eof, stopping worker process");
-                server_stop(serv);
+                if (!serv->report_blocked)
+                {
+                    serv->report_blocked = true;
+                    loop->add_io(loop, serv->report_fd, ILOOP_WRITEABLE,
+                                 ILOOP_WORKER_CB, serv);
+                }
+                return;
             }
-            return;
+
+            hhlog(HHLOG_LEVEL_WARNING, "error reporting closed conns: %d (%s)",
+                  errno, strerror(errno));
+            serv->num_unreported = 0;
+            break;
         }
+
+        serv->num_unreported -= (int)num;
     }
 
-    switch (cmd)
+    if (serv->report_blocked)
     {
-    case COMMAND_SHUT_DOWN:
-            hhlog(HHLOG_LEVEL_DEBUG,
-                  "worker received shut down command, shutting down");
-        server_stop(serv);
-        break;
-    default:
-        hhlog(HHLOG_LEVEL_ERROR, "invalid cmd: %c", cmd);
-        break;
+        serv->report_blocked = false;
+        loop->delete_io(loop, serv->report_fd, ILOOP_WRITEABLE);
     }
 }
 
-server* server_create(config_server_options* options,
-                      server_callbacks* callbacks, void* userdata)
+/* tell the master a connection it dispatched to us is gone */
+static void report_conn_done(server* serv)
 {
-    server* serv = server_create_detached(options, callbacks, userdata);
-    if (serv == NULL) return NULL;
+    if (serv->report_fd == -1) return;
 
-    if (!iloop_event_attach_internal(&serv->loop, &serv->options))
-    {
-        server_destroy(serv);
-        return NULL;
-    }
+    serv->num_unreported++;
+    if (!serv->report_blocked) flush_conn_done(serv);
+}
 
-    return serv;
+/* close a client socket that never made it to a connection */
+static void drop_client(server* serv, int client_fd)
+{
+    close(client_fd);
+    report_conn_done(serv);
 }
 
-server* server_create_detached(config_server_options* options,
-                               server_callbacks* callbacks, void* userdata)
+/* start serving a connected client socket on this server's loop */
+static void add_client(server* serv, int client_fd)
 {
-    if (options->enable_workers && options->num_workers < 1)
+    iloop* loop = &serv->loop;
+    server_conn* conn = activate_conn(serv, client_fd);
+    if (conn == NULL)
     {
-        hhlog(HHLOG_LEVEL_ERROR, "Invalid number of workers: %d",
-              options->num_workers);
+        /* logged in one go by report_accept_stats, not once per client */
+        serv->num_rejected++;
+        drop_client(serv, client_fd);
+        return;
     }
 
-    int i = 0;
-    server* serv = hhmalloc(sizeof(*serv));
-    if (serv == NULL) return NULL;
+    /*
+     * in edge triggered mode the socket is registered for writes here too,
+     * later add_io and delete_io calls for ILOOP_WRITEABLE don't go to the
+     * kernel
+     */
+    int mask = ILOOP_READABLE;
+    if (serv->options.edge_triggered) mask |= ILOOP_EDGE_TRIGGERED;
 
-    serv->stopping = false;
-    serv->fd = -1;
-    serv->num_connected = 0;
-    serv->active_head = NULL;
-    serv->active_tail = NULL;
-    serv->free_head = NULL;
-    serv->free_tail = NULL;
-    serv->handshake_head = NULL;
-    serv->handshake_tail = NULL;
-    serv->heartbeat_head = NULL;
-    serv->heartbeat_tail = NULL;
-    serv->cbs = *callbacks;
-    serv->options = *options;
-    serv->userdata = userdata;
-    serv->pipes = NULL;
+    iloop_result r;
+    r = loop->add_io(loop, client_fd, mask, ILOOP_READ_CB, conn);
 
-    int max_clients = options->max_clients;
-    hhassert(max_clients >= 0);
-    serv->connections = hhmalloc((size_t)max_clients * sizeof(server_conn));
-    if (serv->connections == NULL) goto err_create;
+    if (r != ILOOP_SUCCESS)
+    {
+        hhlog(HHLOG_LEVEL_ERROR, "add client to event loop error: %d", r);
+        loop->delete_io(loop, client_fd, ILOOP_READABLE);
+    }
+}
 
-    memset(&serv->loop, 0, sizeof(serv->loop));
-    serv->loop.userdata = NULL;
-    serv->loop.io_cbs = g_io_cbs;
-    serv->loop.time_cbs = g_time_cbs;
+static bool fd_queue_init(server_fd_queue* q, int min_size)
+{
+    unsigned size = SERVER_MIN_HANDOFF_QUEUE;
+    while (size < (unsigned)min_size) size <<= 1;
+
+    q->fds = hhmalloc(size * sizeof(*q->fds));
+    q->mask = size - 1;
+    q->head = 0;
+    q->tail = 0;
+
+    return q->fds != NULL;
+}
+
+/* called by the accepting thread only. false if the queue is full */
+static bool fd_queue_push(server_fd_queue* q, int fd)
+{
+    unsigned tail = q->tail;
+    unsigned head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    if (tail - head > q->mask) return false;
+
+    q->fds[tail & q->mask] = fd;
+
+    /* publish the fd before the loop thread can see the new tail */
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* called by the loop thread only */
+static bool fd_queue_is_empty(server_fd_queue* q)
+{
+    return q->head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+}
+
+/* called by the loop thread only. like fd_queue_pop, but leaves fd queued */
+static bool fd_queue_peek(server_fd_queue* q, int* fd)
+{
+    if (fd_queue_is_empty(q)) return false;
+
+    *fd = q->fds[q->head & q->mask];
+    return true;
+}
+
+/* called by the loop thread only. false if the queue is empty */
+static bool fd_queue_pop(server_fd_queue* q, int* fd)
+{
+    unsigned head = q->head;
+    unsigned tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    if (head == tail) return false;
+
+    *fd = q->fds[head & q->mask];
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static bool open_wakeup(int fds[2])
+{
+#ifdef HAVE_EVENTFD
+    fds[0] = fds[1] = eventfd(0, EFD_NONBLOCK);
+    return fds[0] != -1;
+#else
+    if (pipe(fds) == -1) return false;
+    if (fcntl(fds[0], F_SETFL, O_NONBLOCK) == -1 ||
+        fcntl(fds[1], F_SETFL, O_NONBLOCK) == -1)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        fds[0] = fds[1] = -1;
+        return false;
+    }
+    return true;
+#endif
+}
+
+static void close_wakeup(int fds[2])
+{
+    if (fds[0] != -1) close(fds[0]);
+    if (fds[1] != -1 && fds[1] != fds[0]) close(fds[1]);
+    fds[0] = fds[1] = -1;
+}
+
+static void send_wakeup(int fds[2])
+{
+#ifdef HAVE_EVENTFD
+    uint64_t one = 1;
+    ssize_t num = write(fds[1], &one, sizeof(one));
+#else
+    char one = 1;
+    ssize_t num = write(fds[1], &one, sizeof(one));
+#endif
+
+    /* a full pipe already has a wakeup pending */
+    if (num < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+        hhlog(HHLOG_LEVEL_ERROR, "error waking loop thread: %d (%s)", errno,
+              strerror(errno));
+    }
+}
+
+static void clear_wakeup(int fd)
+{
+#ifdef HAVE_EVENTFD
+    uint64_t count;
+    ssize_t num = read(fd, &count, sizeof(count));
+    hhunused(num);
+#else
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) == (ssize_t)sizeof(buf)) {}
+#endif
+}
+
+/*
+ * Only used in threaded mode, on the accepting thread. passes client_fd to
+ * the next loop thread
+ */
+static void hand_off_client(server* serv, int client_fd)
+{
+    server* thread = serv->threads[serv->next_thread];
+    serv->next_thread = (serv->next_thread + 1) % serv->options.num_threads;
+
+    if (!fd_queue_push(&thread->handoff, client_fd))
+    {
+        hhlog(HHLOG_LEVEL_ERROR, "loop thread is backed up, dropping: %d",
+              client_fd);
+        drop_client(serv, client_fd);
+        return;
+    }
+
+    send_wakeup(thread->wake_fds);
+}
+
+/*
+ * Only used in threaded mode, on a loop thread. picks up connections the
+ * accepting thread handed to us
+ */
+static void handoff_callback(iloop* loop, int fd, void* data)
+{
+    hhunused(loop);
+
+    server* serv = data;
 
     /*
-     * all available connection objects are 'free', initialize each and add it
-     * to the free list
+     * clear before popping, a push after this wakes us again instead of
+     * getting lost
      */
-    for (i = 0; i < max_clients; i++)
+    clear_wakeup(fd);
+
+    int client_fd;
+    while (fd_queue_pop(&serv->handoff, &client_fd))
     {
-        server_conn* conn = &serv->connections[i];
-        if (init_conn(conn, serv) < 0)
+        if (__atomic_load_n(&serv->stopping, __ATOMIC_ACQUIRE))
         {
-            i++; /* need to do this so loop in err_create works correctly */
-            goto err_create;
+            drop_client(serv, client_fd);
+            continue;
         }
-        INLIST_APPEND(serv, conn,  next, prev, free_head, free_tail);
+
+        add_client(serv, client_fd);
     }
+}
 
-    return serv;
+/* serve a new client socket here, or on one of our loop threads */
+static void take_client(server* serv, int client_fd)
+{
+    if (serv->stopping)
+    {
+        drop_client(serv, client_fd);
+    }
+    else if (serv->threads != NULL)
+    {
+        hand_off_client(serv, client_fd);
+    }
+    else
+    {
+        add_client(serv, client_fd);
+    }
+}
 
-err_create:
-    if (serv->connections != NULL)
+/*
+ * Only used with master_dispatch, in the master. the worker with the fewest
+ * open connections that's still alive and has room on its pipe, -1 if none
+ */
+static int pick_worker(server* serv)
+{
+    int best = -1;
+    for (int i = 0; i < serv->options.num_workers; i++)
     {
-        /* have to clean up already allocated connections */
-        for(int j = 0; j < i; j++)
+        if (serv->worker_conns[i] == INT_MAX || serv->pipe_full[i]) continue;
+        if (best == -1 || serv->worker_conns[i] < serv->worker_conns[best])
         {
-           deinit_conn(&serv->connections[j]);
+            best = i;
         }
-        hhfree(serv->connections);
     }
+
+    return best;
+}
+
+/*
+ * Only used with master_dispatch, in the master. passes client_fd to the
+ * least loaded worker that can take it. false if every live worker's pipe
+ * is full, client_fd is still ours then
+ */
+static bool send_to_worker(server* serv, int client_fd)
+{
+    iloop* loop = &serv->loop;
+    int worker;
+    while ((worker = pick_worker(serv)) != -1)
+    {
+        int pipe_fd = serv->pipes[worker];
+        if (send_command(pipe_fd, COMMAND_NEW_CONN, client_fd) >= 0)
+        {
+            serv->worker_conns[worker]++;
+            break;
+        }
+
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            hhlog(HHLOG_LEVEL_ERROR, "error dispatching to worker %d: %d (%s)",
+                  worker, errno, strerror(errno));
+            break;
+        }
+
+        /* try the next one, this one is picked again once it has room */
+        serv->pipe_full[worker] = true;
+        loop->add_io(loop, pipe_fd, ILOOP_WRITEABLE, ILOOP_WORKER_CB, serv);
+    }
+
+    if (worker == -1)
+    {
+        for (int i = 0; i < serv->options.num_workers; i++)
+        {
+            if (serv->worker_conns[i] != INT_MAX) return false;
+        }
+        hhlog(HHLOG_LEVEL_ERROR, "no workers left to dispatch to");
+    }
+
+    /* the worker has its own copy now, or it's been dropped */
+    close(client_fd);
+    return true;
+}
+
+/*
+ * Only used with master_dispatch, in the master. clients that arrive while
+ * every pipe is full wait in dispatch_queue, in order
+ */
+static void dispatch_client(server* serv, int client_fd)
+{
+    if (fd_queue_is_empty(&serv->dispatch_queue) &&
+        send_to_worker(serv, client_fd))
+    {
+        return;
+    }
+
+    if (!fd_queue_push(&serv->dispatch_queue, client_fd))
+    {
+        hhlog(HHLOG_LEVEL_ERROR, "too many clients waiting for a worker");
+        close(client_fd);
+    }
+}
+
+/*
+ * Only used with master_dispatch, in the master. fd is a worker's pipe with
+ * room again, or maybe just something to read
+ */
+static void flush_dispatch_queue(server* serv, int fd)
+{
+    int worker = 0;
+    while (serv->pipes[worker] != fd) worker++;
+    if (!serv->pipe_full[worker]) return;
+
+    serv->pipe_full[worker] = false;
+    serv->loop.delete_io(&serv->loop, fd, ILOOP_WRITEABLE);
+
+    int client_fd;
+    while (fd_queue_peek(&serv->dispatch_queue, &client_fd) &&
+           send_to_worker(serv, client_fd))
+    {
+        fd_queue_pop(&serv->dispatch_queue, &client_fd);
+    }
+}
+
+/*
+ * Only used with master_dispatch, in the master. a worker is telling us
+ * connections we gave it have closed
+ */
+static void count_done_conns(server* serv, int fd)
+{
+    int worker = 0;
+    while (serv->pipes[worker] != fd) worker++;
+
+    char buf[256];
+    ssize_t num = read(fd, buf, sizeof(buf));
+    if (num < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+    if (num <= 0)
+    {
+        /* the worker is gone, never pick it again */
+        if (!serv->stopping)
+        {
+            hhlog(HHLOG_LEVEL_ERROR, "lost worker %d, err: %d (%s)", worker,
+                  errno, strerror(errno));
+        }
+        serv->loop.delete_io(&serv->loop, fd, ILOOP_READABLE);
+        serv->worker_conns[worker] = INT_MAX;
+        return;
+    }
+
+    for (ssize_t i = 0; i < num; i++)
+    {
+        if (buf[i] == COMMAND_CONN_DONE && serv->worker_conns[worker] > 0 &&
+            serv->worker_conns[worker] != INT_MAX)
+        {
+            serv->worker_conns[worker]--;
+        }
+    }
+}
+
+/* accept one client, already nonblocking. -1 with errno set if there's none */
+static int accept_client(int fd)
+{
+#ifdef HAVE_ACCEPT4
+    return accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int client_fd = accept(fd, NULL, NULL);
+    if (client_fd == -1) return -1;
+
+    /* endpoint_read drains the socket until it would block */
+    if (fcntl(client_fd, F_SETFL, O_NONBLOCK) == -1 ||
+        fcntl(client_fd, F_SETFD, FD_CLOEXEC) == -1)
+    {
+        int err = errno;
+        close(client_fd);
+        errno = err;
+        return -1;
+    }
+
+    return client_fd;
+#endif
+}
+
+/* the loop did the accept, see iloop.h */
+static void accepted_callback(iloop* loop, int client_fd, void* data)
+{
+    hhunused(loop);
+
+    server* serv = data;
+    serv->num_accepted++;
+    hhlog(HHLOG_LEVEL_DEBUG, "client connected, fd: %d", client_fd);
+
+    if (serv->pipes != NULL)
+    {
+        dispatch_client(serv, client_fd);
+    }
+    else
+    {
+        take_client(serv, client_fd);
+    }
+}
+
+static void accept_callback(iloop* loop, int fd, void* data)
+{
+    server* serv = data;
+    int budget = serv->options.accept_budget;
+    if (budget <= 0) budget = SERVER_DEFAULT_ACCEPT_BUDGET;
+
+    /*
+     * take everything that's queued up to the budget rather than one client
+     * per trip through the loop. the budget keeps a connect storm from
+     * starving clients we already have, the listener is level triggered so
+     * we're called again for whatever is left
+     */
+    for (int i = 0; i < budget; i++)
+    {
+        int client_fd = accept_client(fd);
+        if (client_fd == -1)
+        {
+            /* the client hung up before we got to it, try the next one */
+            if (errno == ECONNABORTED || errno == EINTR) continue;
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                hhlog(HHLOG_LEVEL_ERROR,
+                      "-1 fd when accepting socket, fd: %d, err: %d (%s)", fd,
+                      errno, strerror(errno));
+            }
+            return;
+        }
+
+        accepted_callback(loop, client_fd, serv);
+    }
+}
+
+/*
+ * Only used in worker process mode
+ */
+static void worker_pipe_callback(iloop* loop, int fd, void* data)
+{
+    server* serv = data;
+
+    /* the master only hears back from workers with master_dispatch */
+    if (serv->pipes != NULL)
+    {
+        count_done_conns(serv, fd);
+        flush_dispatch_queue(serv, fd);
+        return;
+    }
+
+    /* report_fd may have room again */
+    if (serv->report_blocked) flush_conn_done(serv);
+
+    /* loop threads only listen on report_fd, for the above */
+    if (fd != serv->worker_fd) return;
+
+    char cmd = 0;
+    int passed_fd = -1;
+    ssize_t num = read_command(fd, &cmd, &passed_fd);
+    if (num < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+    if (num <= 0)
+    {
+        /*
+         * error or eof from pipe, don't listen anymore. it's closed by
+         * server_destroy, loop threads may still report on it
+         */
+        loop->delete_io(loop, fd, ILOOP_READABLE | ILOOP_WRITEABLE);
+
+        if (num < 0)
+        {
+            hhlog(HHLOG_LEVEL_ERROR,
+                  "invalid worker_pipe_callback read, stopping worker process"
+                  " err: %d (%s)", errno, strerror(errno));
+            server_stop(serv);
+            return;
+        }
+        else if (num == 0)
+        {
+            if (serv->stopping)
+            {
+                hhlog(HHLOG_LEVEL_DEBUG,
+                   "pipe died but server is stopping, silently closed pipe");
+            }
+            else
+            {
+                hhlog(HHLOG_LEVEL_ERROR,
+                        "master process pipe eof, stopping worker process");
+                server_stop(serv);
+            }
+            return;
+        }
+    }
+
+    switch (cmd)
+    {
+    case COMMAND_SHUT_DOWN:
+            hhlog(HHLOG_LEVEL_DEBUG,
+                  "worker received shut down command, shutting down");
+        server_stop(serv);
+        break;
+    case COMMAND_NEW_CONN:
+        if (passed_fd == -1)
+        {
+            hhlog(HHLOG_LEVEL_ERROR, "new conn cmd without a client socket");
+            break;
+        }
+        hhlog(HHLOG_LEVEL_DEBUG, "client dispatched, fd: %d", passed_fd);
+        take_client(serv, passed_fd);
+        passed_fd = -1;
+        break;
+    default:
+        hhlog(HHLOG_LEVEL_ERROR, "invalid cmd: %c", cmd);
+        break;
+    }
+
+    if (passed_fd != -1) close(passed_fd);
+}
+
+server* server_create(config_server_options* options,
+                      server_callbacks* callbacks, void* userdata)
+{
+    server* serv = server_create_detached(options, callbacks, userdata);
+    if (serv == NULL) return NULL;
+
+    if (!iloop_event_attach_internal(&serv->loop, &serv->options))
+    {
+        server_destroy(serv);
+        return NULL;
+    }
+
+    return serv;
+}
+
+server* server_create_detached(config_server_options* options,
+                               server_callbacks* callbacks, void* userdata)
+{
+    if (options->enable_workers && options->num_workers < 1)
+    {
+        hhlog(HHLOG_LEVEL_ERROR, "Invalid number of workers: %d",
+              options->num_workers);
+    }
+
+    server* serv = hhmalloc(sizeof(*serv));
+    if (serv == NULL) return NULL;
+
+    serv->stopping = false;
+    serv->fd = -1;
+    serv->num_connected = 0;
+    serv->num_initialized = 0;
+    serv->active_head = NULL;
+    serv->active_tail = NULL;
+    serv->free_head = NULL;
+    serv->free_tail = NULL;
+    serv->timers = NULL;
+    serv->dirty_head = NULL;
+    serv->dirty_tail = NULL;
+    serv->flush_on_tick = false;
+    serv->cbs = *callbacks;
+    serv->options = *options;
+    serv->userdata = userdata;
+    serv->pipes = NULL;
+    serv->worker_conns = NULL;
+    serv->pipe_full = NULL;
+    serv->dispatch_queue.fds = NULL;
+    serv->worker_fd = -1;
+    serv->report_fd = -1;
+    serv->num_unreported = 0;
+    serv->report_blocked = false;
+    serv->threads = NULL;
+    serv->thread_ids = NULL;
+    serv->num_threads_running = 0;
+    serv->next_thread = 0;
+    serv->handoff.fds = NULL;
+    serv->wake_fds[0] = -1;
+    serv->wake_fds[1] = -1;
+    serv->num_accepted = 0;
+    serv->num_rejected = 0;
+    serv->stats_start_ms = hhclock_get_now_ms();
+
+    /*
+     * connection objects are set up as they're needed by activate_conn, and
+     * only hold buffers from the pool while they have something in them
+     */
+    int max_clients = options->max_clients;
+    hhassert(max_clients >= 0);
+    serv->connections = hhmalloc((size_t)max_clients * sizeof(server_conn));
+    if (serv->connections == NULL) goto err_create;
+    serv->pool = bufpool_create();
+    if (serv->pool == NULL) goto err_create;
+
+    memset(&serv->loop, 0, sizeof(serv->loop));
+    serv->loop.userdata = NULL;
+    serv->loop.io_cbs = g_io_cbs;
+    serv->loop.time_cbs = g_time_cbs;
+    serv->loop.accepted_cb = accepted_callback;
+    serv->loop.recv_cb = recv_from_client_callback;
+
+    return serv;
+
+err_create:
+    if (serv->connections != NULL) hhfree(serv->connections);
     hhfree(serv);
     return NULL;
 }
 
 void server_destroy(server* serv)
 {
+    if (serv->threads != NULL)
+    {
+        /* in case the server's loop was never run, or never stopped */
+        stop_threads(serv);
+        join_threads(serv);
+
+        for (int i = 0; i < serv->options.num_threads; i++)
+        {
+            if (serv->threads[i] != NULL) server_destroy(serv->threads[i]);
+        }
+        hhfree(serv->threads);
+        hhfree(serv->thread_ids);
+    }
+
     if (serv->loop.cleanup != NULL)
     {
         serv->loop.cleanup(&serv->loop);
@@ -726,18 +1598,56 @@ void server_destroy(server* serv)
 
     if (serv->connections != NULL)
     {
-        int max_clients = serv->options.max_clients;
-        for (int i = 0; i < max_clients; i++)
-        {
-            deinit_conn(&serv->connections[i]);
-        }
+        deinit_conns(serv);
     }
+    bufpool_destroy(serv->pool);
 
     if(serv->pipes != NULL)
     {
+        for (int i = 0; i < serv->options.num_workers; i++)
+        {
+            if (serv->pipes[i] != -1) close(serv->pipes[i]);
+        }
         hhfree(serv->pipes);
     }
 
+    if (serv->worker_conns != NULL)
+    {
+        hhfree(serv->worker_conns);
+    }
+
+    if (serv->pipe_full != NULL)
+    {
+        hhfree(serv->pipe_full);
+    }
+
+    if (serv->dispatch_queue.fds != NULL)
+    {
+        /* clients no worker ever had room for */
+        int client_fd;
+        while (fd_queue_pop(&serv->dispatch_queue, &client_fd))
+        {
+            close(client_fd);
+        }
+        hhfree(serv->dispatch_queue.fds);
+    }
+
+    if (serv->worker_fd != -1)
+    {
+        close(serv->worker_fd);
+    }
+
+    if (serv->handoff.fds != NULL)
+    {
+        hhfree(serv->handoff.fds);
+    }
+
+    if (serv->timers != NULL)
+    {
+        timerwheel_destroy(serv->timers);
+    }
+    close_wakeup(serv->wake_fds);
+
     hhfree(serv->connections);
     hhfree(serv);
 }
@@ -785,11 +1695,20 @@ static void server_teardown(server* serv)
 {
     iloop* loop = &serv->loop;
 
-    /* stop listening for new connections */
-    loop->delete_io(loop, serv->fd, ILOOP_READABLE | ILOOP_WRITEABLE);
+    /* loop threads don't have a socket of their own */
+    if (serv->fd != -1)
+    {
+        /* stop listening for new connections */
+        loop->delete_io(loop, serv->fd, ILOOP_READABLE | ILOOP_WRITEABLE);
+
+        /* stop accepting connections to the server */
+        close(serv->fd);
+    }
 
-    /* stop accepting connections to the server */
-    close(serv->fd);
+    if (serv->wake_fds[0] != -1)
+    {
+        loop->delete_io(loop, serv->wake_fds[0], ILOOP_READABLE);
+    }
 
     /*
      * if we don't currently have any client connections, we're pretty
@@ -797,9 +1716,7 @@ static void server_teardown(server* serv)
      */
     if (serv->active_head == NULL)
     {
-        loop->delete_time(loop, ILOOP_HEARTBEAT_CB);
-        loop->delete_time(loop, ILOOP_HEARTBEAT_EXPIRE_CB);
-        loop->delete_time(loop, ILOOP_HANDSHAKE_TIMEOUT_CB);
+        loop->delete_time(loop, ILOOP_TIMERS_CB);
 
         if (loop->stop != NULL)
         {
@@ -821,8 +1738,13 @@ static void kill_workers(server* serv)
     config_server_options* opt = &serv->options;
     for (int i = 0; i < opt->num_workers; i++)
     {
-        char cmd = COMMAND_SHUT_DOWN;
-        ssize_t num = write(serv->pipes[i], &cmd, sizeof(cmd));
+        /* already gone, see count_done_conns */
+        if (serv->worker_conns != NULL && serv->worker_conns[i] == INT_MAX)
+        {
+            continue;
+        }
+
+        ssize_t num = send_command(serv->pipes[i], COMMAND_SHUT_DOWN, -1);
         if (num < 0)
         {
             hhlog(HHLOG_LEVEL_ERROR,
@@ -832,11 +1754,60 @@ static void kill_workers(server* serv)
     }
 }
 
+/* ask every loop thread to close its connections and return */
+static void stop_threads(server* serv)
+{
+    for (int i = 0; i < serv->num_threads_running; i++)
+    {
+        /* their watchdogs pick this up */
+        __atomic_store_n(&serv->threads[i]->stopping, true, __ATOMIC_RELEASE);
+    }
+}
+
+static void join_threads(server* serv)
+{
+    for (int i = 0; i < serv->num_threads_running; i++)
+    {
+        pthread_join(serv->thread_ids[i], NULL);
+    }
+    serv->num_threads_running = 0;
+}
+
+/* log what accept_callback and add_client have counted */
+static void report_accept_stats(server* serv)
+{
+    if (serv->num_rejected > 0)
+    {
+        hhlog(HHLOG_LEVEL_ERROR,
+              "Server at max client capacity: %d, rejected %" PRIu64
+              " clients", serv->options.max_clients, serv->num_rejected);
+        serv->num_rejected = 0;
+    }
+
+    /* written like this, a coarse loop clock a bit behind is harmless */
+    uint64_t now = get_now_ms(serv);
+    if (now < serv->stats_start_ms + SERVER_ACCEPT_REPORT_MS) return;
+    uint64_t elapsed = now - serv->stats_start_ms;
+
+    if (serv->num_accepted > 0)
+    {
+        hhlog(HHLOG_LEVEL_INFO,
+              "accepted %" PRIu64 " clients in %" PRIu64 " ms (%.1f/s)",
+              serv->num_accepted, elapsed,
+              (double)serv->num_accepted * 1000.0 / (double)elapsed);
+    }
+
+    serv->num_accepted = 0;
+    serv->stats_start_ms = now;
+}
+
 /* check if we've been asked to stop, and stop */
 static void stop_watchdog(iloop* loop, iloop_time_cb_type type, void* data)
 {
     server* serv = data;
 
+    report_accept_stats(serv);
+
     if (hhlog_get_level() == HHLOG_LEVEL_DEBUG_4 && !server_is_master(serv))
     {
         hhlog(HHLOG_LEVEL_DEBUG_4, "current_connected: %d",
@@ -849,7 +1820,7 @@ static void stop_watchdog(iloop* loop, iloop_time_cb_type type, void* data)
         serv->stopping = true;
     }
 
-    if (serv->stopping)
+    if (__atomic_load_n(&serv->stopping, __ATOMIC_ACQUIRE))
     {
         hhlog(HHLOG_LEVEL_INFO, "received stop, sending close to all clients");
 
@@ -859,6 +1830,11 @@ static void stop_watchdog(iloop* loop, iloop_time_cb_type type, void* data)
             kill_workers(serv);
         }
 
+        if (serv->threads != NULL)
+        {
+            stop_threads(serv);
+        }
+
         /* we aren't needed any more */
         loop->delete_time(loop, type);
 
@@ -867,77 +1843,81 @@ static void stop_watchdog(iloop* loop, iloop_time_cb_type type, void* data)
     }
 }
 
-static void send_heartbeats(iloop* loop, iloop_time_cb_type type, void* data)
+static void run_timers(iloop* loop, iloop_time_cb_type type, void* data)
 {
     hhunused(loop);
     hhunused(type);
 
     server* serv = data;
+    timerwheel_advance(serv->timers, get_now_ms(serv));
+}
+
+/* the connection's handshake, idle or close timeout is up */
+static void deadline_expired(timerwheel_timer* timer, void* data)
+{
+    server_conn* conn = data;
+    server* serv = conn->serv;
 
-    uint64_t hb_ttl = serv->options.heartbeat_ttl_ms;
-    bool send_ping = (hb_ttl > 0);
-    INLIST_FOREACH(serv, server_conn, conn, timeout_next, timeout_prev,
-                   heartbeat_head, heartbeat_tail)
+    if (conn->write_overflowed)
+    {
+        hhlog(HHLOG_LEVEL_DEBUG, "closing, over write high watermark: %d",
+              conn->fd);
+    }
+    else if (conn->closing)
+    {
+        hhlog(HHLOG_LEVEL_DEBUG, "closing, close handshake timed out: %d",
+              conn->fd);
+    }
+    else if (conn->endp.pconn.state != PROTOCOL_STATE_CONNECTED)
     {
-        if (send_ping)
-        {
-            server_conn_send_ping(conn, g_heartbeat_msg,
-                                  sizeof(g_heartbeat_msg)-1);
-            conn->timeout = SERVER_HEARTBEAT_PENDING;
-        }
-        else
+        hhlog(HHLOG_LEVEL_DEBUG, "closing, handshake timed out (%d, %p)",
+              conn->fd, conn);
+    }
+    else
+    {
+        /* reads don't touch the timer, only last_read_ms */
+        uint64_t idle_until = conn->last_read_ms +
+                              serv->options.idle_timeout_ms;
+        if (get_now_ms(serv) < idle_until)
         {
-            server_conn_send_pong(conn, g_heartbeat_msg,
-                                  sizeof(g_heartbeat_msg)-1);
+            timerwheel_add(serv->timers, timer, idle_until);
+            return;
         }
+
+        hhlog(HHLOG_LEVEL_DEBUG, "closing, idle timed out: %d", conn->fd);
     }
+
+    server_on_close_callback(&conn->endp, 0, NULL, 0, conn);
 }
 
-static void expire_heartbeats(iloop* loop, iloop_time_cb_type type, void* data)
+static void heartbeat_due(timerwheel_timer* timer, void* data)
 {
-    hhunused(loop);
-    hhunused(type);
+    server_conn* conn = data;
+    server* serv = conn->serv;
+    config_server_options* opt = &serv->options;
 
-    server* serv = data;
-    INLIST_FOREACH(serv, server_conn, conn, timeout_next, timeout_prev,
-                   heartbeat_head, heartbeat_tail)
+    if (conn->pong_pending)
     {
-        if (conn->timeout != SERVER_HEARTEAT_RECEIVED)
-        {
-            hhlog(HHLOG_LEVEL_DEBUG, "closing, heartbeat expired for: %d",
-                  conn->fd);
-            server_on_close_callback(&conn->endp, 0, NULL, 0, conn);
-        }
-        else
-        {
-            /* this list is sorted by failed to not failed, so we're done */
-            break;
-        }
+        hhlog(HHLOG_LEVEL_DEBUG, "closing, heartbeat expired for: %d",
+              conn->fd);
+        server_on_close_callback(&conn->endp, 0, NULL, 0, conn);
+        return;
     }
-}
-
-static void timeout_handshakes(iloop* loop, iloop_time_cb_type type, void* data)
-{
-    hhunused(loop);
-    hhunused(type);
 
-    server* serv = data;
-    uint64_t now = hhclock_get_now_ms();
-    INLIST_FOREACH(serv, server_conn, conn, timeout_next, timeout_prev,
-                   handshake_head, handshake_tail)
+    uint64_t now = get_now_ms(serv);
+    if (opt->heartbeat_ttl_ms > 0)
     {
-        if (now >= conn->timeout)
-        {
-            hhlog(HHLOG_LEVEL_DEBUG,
-                "closing, handshake timed out %"PRIu64" >= %"PRIu64" (%d, %p)",
-                 conn->timeout, now, conn->fd, conn);
-            server_on_close_callback(&conn->endp, 0, NULL, 0, conn);
-        }
-        else
-        {
-            /* this list is sorted by time, so we're done */
-            break;
-        }
+        /* the pong has heartbeat_ttl_ms to come back */
+        conn->pong_pending = true;
+        timerwheel_add(serv->timers, timer, now + opt->heartbeat_ttl_ms);
+        server_conn_send_ping(conn, g_heartbeat_msg,
+                              sizeof(g_heartbeat_msg)-1);
+    }
+    else
+    {
+        timerwheel_add(serv->timers, timer, now + opt->heartbeat_interval_ms);
+        server_conn_send_pong(conn, g_heartbeat_msg,
+                              sizeof(g_heartbeat_msg)-1);
     }
 }
 
@@ -961,11 +1941,19 @@ static int fork_workers(server* serv)
 
     int fd = serv->fd;
     serv->pipes = hhcalloc(opt->num_workers, sizeof(int));
+    for (int i = 0; i < opt->num_workers; i++)
+    {
+        serv->pipes[i] = -1;
+    }
 
     for (int i = 0; i < opt->num_workers; i++)
     {
+        /*
+         * a unix socket rather than a real pipe, so it can carry client fds
+         * and workers can talk back
+         */
         int p[2];
-        if (pipe(p) == -1)
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, p) == -1)
         {
             hhlog(HHLOG_LEVEL_ERROR, "failed to create pipe: %s",
                     strerror(errno));
@@ -996,6 +1984,11 @@ static int fork_workers(server* serv)
         case 0:
             hhlog(HHLOG_LEVEL_DEBUG, "forked child %d, parent: %d",
                     getpid(), getppid());
+            /* other workers' pipes would keep them open after they die */
+            for (int j = 0; j < i; j++)
+            {
+                close(serv->pipes[j]);
+            }
             hhfree(serv->pipes);
             serv->pipes = NULL;
 
@@ -1020,11 +2013,19 @@ child_done:
     return fd;
 }
 
+size_t server_conn_get_buffered_bytes(server_conn* conn)
+{
+    return endpoint_get_buffered_bytes(&conn->endp);
+}
+
 /* queue up a message to send on this connection */
 server_result server_conn_send_msg(server_conn* conn, endpoint_msg* msg)
 {
     hhassert(conn->fd != -1);
 
+    server_result sr;
+    if (!can_queue_msg(conn, &sr)) return sr;
+
     hhlog(HHLOG_LEVEL_DEBUG_1, "sending msg to client %d (%zu bytes): %.*s",
           conn->fd, msg->msg_len, (int)msg->msg_len, msg->data);
 
@@ -1040,6 +2041,132 @@ server_result server_conn_send_msg(server_conn* conn, endpoint_msg* msg)
     return endpoint_result_to_server_result(r);
 }
 
+/* queue up a message that's sent from the caller's buffer without a copy */
+server_result server_conn_send_msg_ref(server_conn* conn, endpoint_msg* msg,
+                                       endpoint_on_release* on_release,
+                                       void* release_data)
+{
+    hhassert(conn->fd != -1);
+
+    server_result sr;
+    if (!can_queue_msg(conn, &sr))
+    {
+        if (on_release != NULL) on_release(msg->data, release_data);
+        return sr;
+    }
+
+    hhlog(HHLOG_LEVEL_DEBUG_1, "sending msg ref to client %d (%zu bytes)",
+          conn->fd, msg->msg_len);
+
+    endpoint_result r = endpoint_send_msg_ref(&conn->endp, msg, on_release,
+                                              release_data);
+
+    iloop_result ir = queue_write(conn);
+    if (ir != ILOOP_SUCCESS)
+    {
+        hhlog(HHLOG_LEVEL_ERROR, "send_msg_ref event loop error: %d", ir);
+        return SERVER_RESULT_FAIL;
+    }
+
+    return endpoint_result_to_server_result(r);
+}
+
+server_frame* server_frame_create(server* serv, endpoint_msg* msg)
+{
+    protocol_msg pmsg;
+    pmsg.data = msg->data;
+    pmsg.msg_len = msg->msg_len;
+    pmsg.type = (msg->is_text) ? PROTOCOL_MSG_TEXT : PROTOCOL_MSG_BINARY;
+
+    protocol_settings* settings = &serv->options.endp_settings.conn_settings;
+
+    /* a little room for frame headers on top of the payload */
+    size_t init_len = (size_t)hhmax(msg->msg_len, 0) + 16;
+    darray* data = darray_create(sizeof(char), init_len);
+    if (protocol_encode_server_msg(settings, &pmsg, &data) !=
+        PROTOCOL_RESULT_MESSAGE_FINISHED)
+    {
+        hhlog(HHLOG_LEVEL_ERROR, "protocol_encode_server_msg error");
+        darray_destroy(data);
+        return NULL;
+    }
+
+    server_frame* frame = hhmalloc(sizeof(*frame));
+    frame->refcount = 1;
+    frame->data = data;
+    return frame;
+}
+
+void server_frame_retain(server_frame* frame)
+{
+    hhassert(frame->refcount > 0);
+    frame->refcount++;
+}
+
+void server_frame_release(server_frame* frame)
+{
+    hhassert(frame->refcount > 0);
+    if (--frame->refcount > 0) return;
+
+    darray_destroy(frame->data);
+    hhfree(frame);
+}
+
+static void server_frame_on_release(const char* data, void* release_data)
+{
+    hhunused(data);
+    server_frame_release(release_data);
+}
+
+server_result server_conn_send_frame(server_conn* conn, server_frame* frame)
+{
+    hhassert(conn->fd != -1);
+
+    server_result sr;
+    if (!can_queue_msg(conn, &sr)) return sr;
+
+    hhlog(HHLOG_LEVEL_DEBUG_1, "sending frame to client %d (%zu bytes)",
+          conn->fd, darray_get_len(frame->data));
+
+    /* the connection's reference is dropped by server_frame_on_release */
+    server_frame_retain(frame);
+    endpoint_result r = endpoint_send_frames_ref(&conn->endp,
+                                                 darray_get_data(frame->data),
+                                                 darray_get_len(frame->data),
+                                                 server_frame_on_release,
+                                                 frame);
+
+    iloop_result ir = queue_write(conn);
+    if (ir != ILOOP_SUCCESS)
+    {
+        hhlog(HHLOG_LEVEL_ERROR, "send_frame event loop error: %d", ir);
+        return SERVER_RESULT_FAIL;
+    }
+
+    return endpoint_result_to_server_result(r);
+}
+
+server_result server_broadcast(server* serv, server_conn** conns,
+                               unsigned num_conns, endpoint_msg* msg)
+{
+    if (num_conns == 0) return SERVER_RESULT_SUCCESS;
+
+    server_frame* frame = server_frame_create(serv, msg);
+    if (frame == NULL) return SERVER_RESULT_FAIL;
+
+    server_result result = SERVER_RESULT_SUCCESS;
+    for (unsigned i = 0; i < num_conns; i++)
+    {
+        if (server_conn_send_frame(conns[i], frame) == SERVER_RESULT_FAIL)
+        {
+            result = SERVER_RESULT_FAIL;
+        }
+    }
+
+    server_frame_release(frame);
+    return result;
+}
+
 /* send a ping with payload (NULL for no payload)*/
 server_result server_conn_send_ping(server_conn* conn, char* payload,
                                     int payload_len)
@@ -1099,6 +2226,16 @@ server_result server_conn_close(server_conn* conn, uint16_t code,
     /* it's possible for endpoint_close to directly close the client socket */
     if (conn->fd != -1)
     {
+        /* don't wait forever on the client's close frame */
+        server* serv = conn->serv;
+        if (serv->options.close_timeout_ms > 0 && !conn->closing &&
+            !conn->write_overflowed)
+        {
+            timerwheel_add(serv->timers, &conn->deadline,
+                    get_now_ms(serv) + serv->options.close_timeout_ms);
+        }
+        conn->closing = true;
+
         iloop_result ir = queue_write(conn);
         if (ir != ILOOP_SUCCESS)
         {
@@ -1127,11 +2264,21 @@ const char* server_get_header_name(server_conn* conn, unsigned index)
 }
 
 /*
- * Get the darray of values (type char*) for a given header index
+ * Get the number of values for a given header index
+ */
+unsigned server_get_num_header_values(server_conn* conn, unsigned index)
+{
+    return protocol_get_num_header_values_at(&conn->endp.pconn, index);
+}
+
+/*
+ * Get one of the values for a given header index
  */
-const darray* server_get_header_values(server_conn* conn, unsigned index)
+const char* server_get_header_value(server_conn* conn, unsigned index,
+                                    unsigned value_index)
 {
-    return protocol_get_header_values(&conn->endp.pconn, index);
+    return protocol_get_header_value_at(&conn->endp.pconn, index,
+                                        value_index);
 }
 
 /*
@@ -1183,10 +2330,48 @@ void server_stop(server* serv)
     serv->stopping = true;
 }
 
-server_result server_init(server* serv)
+/* workers each listen on their own socket, see config reuseport */
+static bool uses_reuseport(config_server_options* opt)
+{
+    return opt->enable_workers && opt->reuseport && !opt->master_dispatch;
+}
+
+#ifdef HAVE_REUSEPORT_CBPF
+/* steer connections to the socket at index (receiving cpu % num_workers) */
+static bool attach_cpu_steering(int s, int num_workers)
+{
+    struct sock_filter code[] =
+    {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU) },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)num_workers },
+        { BPF_RET | BPF_A, 0, 0, 0 }
+    };
+
+    /* workers past the number of cpus never get anything */
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_cpus > 0 && num_cpus < num_workers)
+    {
+        hhlog(HHLOG_LEVEL_WARNING,
+              "cpu steering with %d workers but only %ld cpus", num_workers,
+              num_cpus);
+    }
+
+    struct sock_fprog prog;
+    prog.len = hhcountof(code);
+    prog.filter = code;
+
+    return setsockopt(s, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+                      sizeof(prog)) == 0;
+}
+#endif
+
+/*
+ * create a socket bound to the server's address, and listen on it if
+ * should_listen. returns -1 on failure
+ */
+static int open_socket(server* serv, bool should_listen)
 {
     config_server_options* opt = &serv->options;
-    int pipefd = -1;
 
     int s = socket(AF_INET, SOCK_STREAM, 0);
     if (s == -1)
@@ -1203,6 +2388,22 @@ server_result server_init(server* serv)
         goto fail;
     }
 
+    if (uses_reuseport(opt))
+    {
+#ifdef SO_REUSEPORT
+        int one = 1;
+        if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1)
+        {
+            hhlog(HHLOG_LEVEL_ERROR, "failed to set SO_REUSEPORT: %s",
+                  strerror(errno));
+            goto fail;
+        }
+#else
+        hhlog(HHLOG_LEVEL_ERROR, "SO_REUSEPORT not supported");
+        goto fail;
+#endif
+    }
+
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
@@ -1214,7 +2415,6 @@ server_result server_init(server* serv)
         hhlog(HHLOG_LEVEL_ERROR, "invalid bind address: %s",
                   opt->bindaddr);
         goto fail;
-        return SERVER_RESULT_FAIL;
     }
 
     if (bind(s, (struct sockaddr*)(&addr), sizeof(addr)) == -1)
@@ -1222,22 +2422,196 @@ server_result server_init(server* serv)
         hhlog(HHLOG_LEVEL_ERROR, "failed to bind socket: %s",
                   strerror(errno));
         goto fail;
-        return SERVER_RESULT_FAIL;
     }
 
-    if (listen(s, SERVER_LISTEN_BACKLOG) == -1)
+    if (should_listen && listen(s, SERVER_LISTEN_BACKLOG) == -1)
     {
         hhlog(HHLOG_LEVEL_ERROR, "failed to listen on socket: %s",
                   strerror(errno));
         goto fail;
-        return SERVER_RESULT_FAIL;
     }
 
+#ifdef HAVE_REUSEPORT_CBPF
+    /* the program is shared by every socket in the port's group */
+    if (should_listen && uses_reuseport(opt) && opt->reuseport_cpu_steering &&
+        !attach_cpu_steering(s, opt->num_workers))
+    {
+        hhlog(HHLOG_LEVEL_WARNING, "failed to attach cpu steering: %s",
+              strerror(errno));
+    }
+#endif
+
+    return s;
+
+fail:
+    if (s != -1) close(s);
+    return -1;
+}
+
+/* flush writes on every tick, and start the per-connection timers */
+static bool watch_conns(server* serv)
+{
+    iloop* loop = &serv->loop;
+    if (loop->set_tick != NULL)
+    {
+        loop->set_tick(loop, flush_dirty_conns, serv);
+        serv->flush_on_tick = true;
+    }
+
+    serv->timers = timerwheel_create(SERVER_TIMER_RESOLUTION_MS,
+                                     get_now_ms(serv));
+    if (serv->timers == NULL) return false;
+
+    /*
+     * one loop timer drives every connection's deadlines, ticks with nothing
+     * due don't touch any connections. the close overflow policy drops
+     * connections through their deadline too, see can_queue_msg
+     */
+    config_server_options* opt = &serv->options;
+    bool drops_overflowed = opt->write_high_watermark > 0 &&
+        opt->write_overflow_policy == CONFIG_WRITE_OVERFLOW_CLOSE;
+    if (opt->heartbeat_interval_ms > 0 || opt->handshake_timeout_ms > 0 ||
+        opt->idle_timeout_ms > 0 || opt->close_timeout_ms > 0 ||
+        drops_overflowed)
+    {
+        loop->add_time(loop, ILOOP_TIMERS_CB, SERVER_TIMER_RESOLUTION_MS, 0,
+                       serv);
+    }
+
+    return true;
+}
+
+/*
+ * attach a loop for one of serv's loop threads, and get it ready to pick up
+ * connections handed to it
+ */
+static bool init_loop_thread(server* serv, server* thread)
+{
+    /* fds come from the whole process, size every loop for all of them */
+    config_server_options* opt = &serv->options;
+    iloop* loop = &thread->loop;
+    bool attached;
+    if (serv->cbs.attach_loop != NULL)
+    {
+        attached = serv->cbs.attach_loop(thread, loop, opt, serv->userdata);
+    }
+    else
+    {
+        attached = iloop_event_attach_internal(loop, opt);
+    }
+
+    if (!attached) return false;
+
+    if (loop->listen == NULL)
+    {
+        hhlog(HHLOG_LEVEL_ERROR, "loop threads need a loop that can listen");
+        return false;
+    }
+
+    if (!fd_queue_init(&thread->handoff, thread->options.max_clients) ||
+        !open_wakeup(thread->wake_fds))
+    {
+        hhlog(HHLOG_LEVEL_ERROR, "failed to set up loop thread: %s",
+              strerror(errno));
+        return false;
+    }
+
+    iloop_result r = loop->add_io(loop, thread->wake_fds[0], ILOOP_READABLE,
+                                  ILOOP_HANDOFF_CB, thread);
+    if (r != ILOOP_SUCCESS)
+    {
+        hhlog(HHLOG_LEVEL_ERROR, "error adding handoff callback to event"
+                  "loop: %d (err: %s)", r, strerror(errno));
+        return false;
+    }
+
+    loop->add_time(loop, ILOOP_WATCHDOG_CB, SERVER_WATCHDOG_FREQ_MS, 0,
+                   thread);
+
+    return watch_conns(thread);
+}
+
+static void* loop_thread_main(void* data)
+{
+    server* thread = data;
+    thread->loop.listen(&thread->loop);
+    return NULL;
+}
+
+/*
+ * Only used in threaded mode. creates a server for each loop thread with
+ * its share of the connections, and starts the threads
+ */
+static bool start_threads(server* serv)
+{
+    config_server_options* opt = &serv->options;
+    int num_threads = opt->num_threads;
+
+    config_server_options thread_opt = *opt;
+    thread_opt.enable_workers = false;
+    thread_opt.num_threads = 0;
+    thread_opt.max_clients = (opt->max_clients + num_threads - 1) / num_threads;
+
+    /* only the accepting thread decides when to stop */
+    server_callbacks thread_cbs = serv->cbs;
+    thread_cbs.should_stop = NULL;
+
+    serv->threads = hhcalloc((size_t)num_threads, sizeof(*serv->threads));
+    serv->thread_ids = hhcalloc((size_t)num_threads,
+                                sizeof(*serv->thread_ids));
+    if (serv->threads == NULL || serv->thread_ids == NULL) return false;
+
+    for (int i = 0; i < num_threads; i++)
+    {
+        serv->threads[i] = server_create_detached(&thread_opt, &thread_cbs,
+                                                  serv->userdata);
+        if (serv->threads[i] == NULL) return false;
+        if (!init_loop_thread(serv, serv->threads[i])) return false;
+
+        /* not owned, the worker's pipe is closed with serv */
+        serv->threads[i]->report_fd = serv->report_fd;
+    }
+
+    for (int i = 0; i < num_threads; i++)
+    {
+        if (pthread_create(&serv->thread_ids[i], NULL, loop_thread_main,
+                           serv->threads[i]) != 0)
+        {
+            hhlog(HHLOG_LEVEL_ERROR, "failed to start loop thread %d", i);
+            return false;
+        }
+        serv->num_threads_running++;
+    }
+
+    /* connections all live on the loop threads */
+    deinit_conns(serv);
+    hhfree(serv->connections);
+    serv->connections = NULL;
+
+    return true;
+}
+
+server_result server_init(server* serv)
+{
+    config_server_options* opt = &serv->options;
+    int pipefd = -1;
+    bool use_workers = opt->enable_workers && opt->num_workers >= 1;
+    bool reuseport = use_workers && uses_reuseport(opt);
+    bool dispatch = use_workers && opt->master_dispatch;
+
+    /*
+     * with reuseport the master's socket only holds on to the port, it never
+     * listens or it would get a share of the connections. workers open
+     * their own
+     */
+    int s = open_socket(serv, !reuseport);
+    if (s == -1) return SERVER_RESULT_FAIL;
+
     /* socket was set up successfully */
     serv->fd = s;
     iloop* loop = &serv->loop;
 
-    if (opt->enable_workers && opt->num_workers >= 1)
+    if (use_workers)
     {
         if ((pipefd = fork_workers(serv)) == -1)
         {
@@ -1245,14 +2619,36 @@ server_result server_init(server* serv)
         }
     }
 
+    if (server_get_process_type(serv) == SERVER_PROCESS_WORKER)
+    {
+        serv->worker_fd = pipefd;
+        pipefd = -1;
+
+        if (reuseport)
+        {
+            close(s);
+            serv->fd = s = open_socket(serv, true);
+            if (s == -1) goto fail;
+        }
+        else if (dispatch)
+        {
+            /* only the master accepts, we get clients over the pipe */
+            close(s);
+            serv->fd = s = -1;
+            serv->report_fd = serv->worker_fd;
+        }
+    }
+
     /* Now that we've forked, we can start the event loop */
 
     /* call attach callback, or attach default event loop if no cb specified */
-    if (serv->cbs.attach_loop != NULL &&
-        !serv->cbs.attach_loop(serv, &serv->loop, &serv->options,
-                               serv->userdata))
+    if (serv->cbs.attach_loop != NULL)
     {
-        goto fail;
+        if (!serv->cbs.attach_loop(serv, &serv->loop, &serv->options,
+                                   serv->userdata))
+        {
+            goto fail;
+        }
     }
     else
     {
@@ -1264,7 +2660,8 @@ server_result server_init(server* serv)
 
     iloop_result r;
     server_process_type type = server_get_process_type(serv);
-    if (type == SERVER_PROCESS_WORKER || type == SERVER_PROCESS_SINGLETON)
+    bool accepts = (type == SERVER_PROCESS_MASTER) ? dispatch : (s != -1);
+    if (accepts)
     {
         r = loop->add_io(loop, serv->fd, ILOOP_READABLE, ILOOP_ACCEPT_CB, serv);
 
@@ -1286,18 +2683,45 @@ server_result server_init(server* serv)
     {
     case SERVER_PROCESS_MASTER:
         /* we are the master process, we don't need connections */
+        deinit_conns(serv);
         hhfree(serv->connections);
         serv->connections = NULL;
+
+        if (dispatch)
+        {
+            /* workers report back when connections we gave them close */
+            serv->worker_conns = hhcalloc((size_t)opt->num_workers,
+                                          sizeof(*serv->worker_conns));
+            serv->pipe_full = hhcalloc((size_t)opt->num_workers,
+                                       sizeof(*serv->pipe_full));
+            if (serv->worker_conns == NULL || serv->pipe_full == NULL ||
+                !fd_queue_init(&serv->dispatch_queue, opt->max_clients))
+            {
+                goto fail;
+            }
+
+            for (int i = 0; i < opt->num_workers; i++)
+            {
+                r = loop->add_io(loop, serv->pipes[i], ILOOP_READABLE,
+                                 ILOOP_WORKER_CB, serv);
+                if (r != ILOOP_SUCCESS)
+                {
+                    hhlog(HHLOG_LEVEL_ERROR, "error adding worker pipe to "
+                          "event loop: %d (err: %s)", r, strerror(errno));
+                    goto fail;
+                }
+            }
+        }
         break;
     case SERVER_PROCESS_WORKER:
-        hhassert(pipefd != -1);
+        hhassert(serv->worker_fd != -1);
 
         /*
          * the master has opened a pipe to communicate with us, we need to
          * listen for activity on it
          */
-        r = loop->add_io(loop, pipefd, ILOOP_READABLE, ILOOP_WORKER_CB,
-                         serv);
+        r = loop->add_io(loop, serv->worker_fd, ILOOP_READABLE,
+                         ILOOP_WORKER_CB, serv);
 
         if (r != ILOOP_SUCCESS)
         {
@@ -1309,41 +2733,27 @@ server_result server_init(server* serv)
          * fallthru
          */
     case SERVER_PROCESS_SINGLETON:
-    {
-        uint64_t hb_interval = serv->options.heartbeat_interval_ms;
-        uint64_t hb_ttl = serv->options.heartbeat_ttl_ms;
-        uint64_t handshake_timeout = serv->options.handshake_timeout_ms;
-        if (hb_interval > 0)
+        if (opt->num_threads > 0)
         {
-            /* send a ping every hb_interval */
-            loop->add_time(loop, ILOOP_HEARTBEAT_CB, hb_interval, 0,
-                           serv);
-
-            if (hb_ttl > 0)
-            {
-                /*
-                 * check for responses every hb_interval, hb_ttl seconds
-                 * after
-                 */
-                loop->add_time(loop, ILOOP_HEARTBEAT_EXPIRE_CB, hb_interval,
-                               hb_ttl, serv);
-            }
+            /* this thread only accepts, the loop threads do the rest */
+            if (!start_threads(serv)) goto fail;
         }
-
-        if (handshake_timeout > 0)
+        else if (!watch_conns(serv))
         {
-            loop->add_time(loop, ILOOP_HANDSHAKE_TIMEOUT_CB,
-                           SERVER_HANDSHAKE_TIMEOUT_FREQ_MS, 0, serv);
+            goto fail;
         }
         break;
     }
-    }
 
     return SERVER_RESULT_SUCCESS;
 
 fail:
+    if (serv->threads != NULL)
+    {
+        stop_threads(serv);
+        join_threads(serv);
+    }
     if (s != -1) close(s);
-    if (pipefd != -1) close(pipefd);
     return SERVER_RESULT_FAIL;
 }
 
@@ -1375,6 +2785,9 @@ server_result server_listen(server* serv)
     /* block and process all connections */
     serv->loop.listen(&serv->loop);
 
+    /* loop threads finish closing their connections on their own */
+    join_threads(serv);
+
     return SERVER_RESULT_SUCCESS;
 }
 
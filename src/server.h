@@ -40,6 +40,9 @@
 typedef struct server_conn server_conn;
 typedef struct server server;
 
+/* a message encoded once, that can be sent to many connections */
+typedef struct server_frame server_frame;
+
 /* on_connect is called when a client has sent their side of the handshake, but
  * the server has not yet responded
  *
@@ -66,6 +69,16 @@ typedef void (server_on_open)(server_conn* conn, void* userdata);
 typedef void (server_on_message)(server_conn* conn, endpoint_msg* msg,
                                  void* userdata);
 
+/*
+ * on_message_chunk, if set, gets text and binary messages a piece at a time
+ * as they arrive, instead of on_message getting them whole. read_max_msg_size
+ * still limits the size of the whole message. see
+ * endpoint_callbacks.on_message_chunk
+ */
+typedef void (server_on_message_chunk)(server_conn* conn,
+                                       endpoint_msg_chunk* chunk,
+                                       void* userdata);
+
 /*
  * on_ping is called when the client sends the server a ping. If you specify
  * this, you'll have to send a pong yourself to conform to the RFC
@@ -83,6 +96,13 @@ typedef void (server_on_close)(server_conn* conn_info, int code,
                                const char* reason, int reason_len,
                                void* userdata);
 
+/*
+ * on_drain is called when a connection that went over the server's
+ * write_high_watermark has written enough to be down to its
+ * write_low_watermark
+ */
+typedef void (server_on_drain)(server_conn* conn, void* userdata);
+
 /*
  * should_stop will be called periodically, if you return 'true', the server
  * will stop itself (identical to calling server_stop)
@@ -99,7 +119,10 @@ typedef bool (server_attach_iloop)(server* serv, iloop* loop,
 typedef enum
 {
     SERVER_RESULT_SUCCESS,
-    SERVER_RESULT_FAIL
+    SERVER_RESULT_FAIL,
+
+    /* over the write high watermark, try again after on_drain */
+    SERVER_RESULT_WOULD_BLOCK
 } server_result;
 
 typedef struct
@@ -107,9 +130,11 @@ typedef struct
     server_on_open* on_open;
     server_on_connect* on_connect;
     server_on_message* on_message;
+    server_on_message_chunk* on_message_chunk; /* NULL is okay */
     server_on_ping* on_ping;
     server_on_pong* on_pong;
     server_on_close* on_close;
+    server_on_drain* on_drain; /* NULL is okay */
     server_should_stop* should_stop;
 
     /* NULL will cause default loop to be attached */
@@ -162,9 +187,54 @@ void server_conn_set_userdata(server_conn* conn, void* userdata);
 /* get per-connection userdata */
 void* server_conn_get_userdata(server_conn* conn);
 
+/*
+ * number of bytes sent on this connection that are still waiting to be
+ * written to the socket
+ */
+size_t server_conn_get_buffered_bytes(server_conn* conn);
+
 /* queue up a message to send on this connection */
 server_result server_conn_send_msg(server_conn* conn, endpoint_msg* msg);
 
+/*
+ * queue up a message whose payload is written straight from msg->data
+ * without being copied. msg->data must stay valid and unchanged until
+ * on_release(msg->data, release_data) is called. see endpoint_send_msg_ref
+ */
+server_result server_conn_send_msg_ref(server_conn* conn, endpoint_msg* msg,
+                                       endpoint_on_release* on_release,
+                                       void* release_data);
+
+/*
+ * encode msg into frames once, so it can be queued on any number of
+ * connections of serv without being encoded or copied again. the frame
+ * starts out with one reference, owned by the caller. returns NULL if msg
+ * can't be encoded
+ */
+server_frame* server_frame_create(server* serv, endpoint_msg* msg);
+
+/* take another reference to frame */
+void server_frame_retain(server_frame* frame);
+
+/* drop a reference to frame. it's destroyed when the last one is dropped */
+void server_frame_release(server_frame* frame);
+
+/*
+ * queue up an encoded frame on this connection. the connection holds its
+ * own reference until the frame has been written, so the caller can
+ * release theirs right away
+ */
+server_result server_conn_send_frame(server_conn* conn, server_frame* frame);
+
+/*
+ * send msg to every connection in conns, encoding it only once. returns
+ * SERVER_RESULT_FAIL if it couldn't be queued on one or more of them.
+ * connections over the write high watermark are handled as they would be
+ * by server_conn_send_frame, and don't make it fail
+ */
+server_result server_broadcast(server* serv, server_conn** conns,
+                               unsigned num_conns, endpoint_msg* msg);
+
 /* send a ping with payload (NULL for no payload)*/
 server_result
 server_conn_send_ping(server_conn* conn, char* payload, int payload_len);
@@ -180,6 +250,12 @@ server_conn_send_pong(server_conn* conn, char* payload, int payload_len);
 server_result server_conn_close(server_conn* conn, uint16_t code,
                                 const char* reason, int reason_len);
 
+/*
+ * the getters below describe the client's handshake. with
+ * release_handshake_info set in the server's options, they only find
+ * anything during on_connect and on_open
+ */
+
 /*
  * get the total number of headers the client sent
  */
@@ -191,9 +267,15 @@ unsigned server_get_num_client_headers(server_conn* conn);
 const char* server_get_header_name(server_conn* conn, unsigned index);
 
 /*
- * Get the darray of values (type char*) for a given header index
+ * Get the number of values for a given header index
+ */
+unsigned server_get_num_header_values(server_conn* conn, unsigned index);
+
+/*
+ * Get one of the values for a given header index
  */
-const darray* server_get_header_values(server_conn* conn, unsigned index);
+const char* server_get_header_value(server_conn* conn, unsigned index,
+                                    unsigned value_index);
 
 /*
  * get number of subprotocols the client reported they support
@@ -99,11 +99,19 @@ static void broadcast_msg(chatroom* room, endpoint_msg* msg)
 {
     hhlog(HHLOG_LEVEL_DEBUG, "Broadcasting msg: %.*s", (int)msg->msg_len,
           msg->data);
+    if (room->client_head == NULL) return;
+
+    /* encode once, every client in the room shares the same frame */
+    server_frame* frame = server_frame_create(g_serv, msg);
+    if (frame == NULL) return;
+
     INLIST_FOREACH(room,chatroom_client,c,room_next,room_prev,client_head,
                    client_tail)
     {
-        server_conn_send_msg(c->conn, msg);
+        server_conn_send_frame(c->conn, frame);
     }
+
+    server_frame_release(frame);
 }
 
 static void broadcast_chat_msg(chatroom_client* c, const char* type,
@@ -690,6 +698,7 @@ int main(int argc, char** argv)
         .heartbeat_interval_ms = 10000,
         .heartbeat_ttl_ms = 2000,
         .handshake_timeout_ms = 3000,
+        .edge_triggered = true,
 
         .endp_settings =
         {
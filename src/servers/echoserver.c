@@ -40,6 +40,8 @@
 #include <string.h>
 #include <sys/time.h>
 
+#include "../loop_adapters/io_uring_iface.h"
+
 #ifdef HH_WITH_LIBEVENT
 #include "../loop_adapters/libevent_iface.h"
 #endif
@@ -146,6 +148,15 @@ static bool attach_libevent(server* serv, iloop* loop,
 }
 #endif
 
+static bool attach_io_uring(server* serv, iloop* loop,
+                            config_server_options* options, void* userdata)
+{
+    hhunused(serv);
+    hhunused(userdata);
+
+    return iloop_attach_io_uring(loop, options);
+}
+
 static hhlog_options g_log_options =
 {
     .loglevel = HHLOG_LEVEL_DEBUG,
@@ -161,8 +172,9 @@ int main(int argc, char** argv)
     {
         fprintf(stderr,
 "usage: %s port [event loop]\n"
-"    event loop is one of: libevent, libuv, libev. echoserver must have been\n"
-"    built with the proper event support", argv[0]);
+"    event loop is one of: threads, io_uring, libevent, libuv, libev.\n"
+"    threads runs a built-in loop per cpu. echoserver must have been built\n"
+"    with the proper event support", argv[0]);
         exit(1);
     }
 
@@ -181,7 +193,9 @@ int main(int argc, char** argv)
         .heartbeat_interval_ms = 0,
         .heartbeat_ttl_ms = 0,
         .handshake_timeout_ms = 0,
+        .edge_triggered = true,
         .enable_workers = false,
+        .release_handshake_info = true, /* only looked at in on_connect */
 
         .endp_settings =
         {
@@ -192,7 +206,14 @@ int main(int argc, char** argv)
                 .read_max_num_frames = 20 * 1024 * 1024,
                 .max_handshake_size = 4 * 1024,
                 .init_buf_len = 4 * 1024,
-                .rand_func = NULL
+                .rand_func = NULL,
+                .deflate =
+                {
+                    .enabled = true,
+                    .level = 6,
+                    .max_window_bits = 15,
+                    .max_mem = 512 * 1024
+                }
             }
         }
     };
@@ -225,6 +246,33 @@ int main(int argc, char** argv)
 
         goto done;
     }
+    else if (strcmp(eventloop, "threads") == 0)
+    {
+        long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        options.num_threads = (num_cpus > 0) ? (int)num_cpus : 1;
+
+        hhlog(HHLOG_LEVEL_DEBUG, "Starting with %d loop threads",
+              options.num_threads);
+
+        g_serv = server_create(&options, &callbacks, NULL);
+        server_listen(g_serv);
+        server_destroy(g_serv);
+
+        goto done;
+    }
+    else if (strcmp(eventloop, "io_uring") == 0)
+    {
+        hhlog(HHLOG_LEVEL_DEBUG, "Starting with io_uring");
+
+        /* falls back to the built-in event loop on older kernels */
+        callbacks.attach_loop = attach_io_uring;
+
+        g_serv = server_create_detached(&options, &callbacks, NULL);
+        server_listen(g_serv);
+        server_destroy(g_serv);
+
+        goto done;
+    }
     else if (strcmp(eventloop, "libevent") == 0)
     {
 #ifdef HH_WITH_LIBEVENT
@@ -261,8 +309,8 @@ int main(int argc, char** argv)
     }
     else
     {
-        fprintf(stderr, "unknown eventloop: %s. option(s) are: libevent",
-                eventloop);
+        fprintf(stderr, "unknown eventloop: %s. option(s) are: threads, "
+                "io_uring, libevent\n", eventloop);
         goto done;
     }
 
@@ -0,0 +1,164 @@
+/* test_bufpool - Test the bufpool module
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "../bufpool.h"
+#include "../util.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_ASSERT(cond)\
+    if (!(cond))\
+    {\
+        printf("FAIL: %s, line %d\n", #cond, __LINE__);\
+        exit(EXIT_FAILURE);\
+    }
+
+/* a buffer that goes back in is handed out again, whatever it held */
+static void test_reuse(void)
+{
+    bufpool* pool = bufpool_create();
+    TEST_ASSERT(pool != NULL);
+
+    darray* buf = bufpool_get(pool, sizeof(char), 1000);
+    TEST_ASSERT(darray_get_len(buf) == 0);
+    TEST_ASSERT(darray_get_size_reserved(buf) >= 1000);
+    darray_append(&buf, "hello", 5);
+    bufpool_put(pool, buf);
+    TEST_ASSERT(bufpool_get_cached_bytes(pool) == 1024);
+
+    /* same size class, different element type */
+    darray* ints = bufpool_get(pool, sizeof(int), 200);
+    TEST_ASSERT(ints == buf);
+    TEST_ASSERT(darray_get_len(ints) == 0);
+    TEST_ASSERT(darray_get_size_reserved(ints) == 1024 / sizeof(int));
+    TEST_ASSERT(bufpool_get_cached_bytes(pool) == 0);
+
+    /* nothing cached in a bigger class, so this is new */
+    darray* big = bufpool_get(pool, sizeof(char), 5000);
+    TEST_ASSERT(big != ints);
+    TEST_ASSERT(darray_get_size_reserved(big) == 8192);
+
+    bufpool_put(pool, ints);
+    bufpool_put(pool, big);
+    TEST_ASSERT(bufpool_get_cached_bytes(pool) == 1024 + 8192);
+
+    /* an empty class borrows from a couple of classes up... */
+    darray* got = bufpool_get(pool, sizeof(char), 3000);
+    TEST_ASSERT(got == big);
+    bufpool_put(pool, got);
+    got = bufpool_get(pool, sizeof(char), 600);
+    TEST_ASSERT(got == ints);
+
+    /* ...but not from any further */
+    darray* small = bufpool_get(pool, sizeof(char), 10);
+    TEST_ASSERT(small != big);
+    TEST_ASSERT(darray_get_size_reserved(small) == 512);
+    bufpool_put(pool, small);
+    bufpool_put(pool, got);
+
+    bufpool_destroy(pool);
+}
+
+/* grown buffers go back to the class they still fill */
+static void test_sizes(void)
+{
+    bufpool* pool = bufpool_create();
+
+    darray* buf = bufpool_get(pool, sizeof(char), 512);
+    darray_ensure(&buf, 3000);
+    size_t reserved = darray_get_size_reserved(buf);
+    TEST_ASSERT(reserved >= 3000 && reserved < 4096);
+    bufpool_put(pool, buf);
+
+    /* only good for the 2 KB class */
+    darray* got = bufpool_get(pool, sizeof(char), 4096);
+    TEST_ASSERT(darray_get_size_reserved(got) == 4096);
+    bufpool_put(pool, got);
+    got = bufpool_get(pool, sizeof(char), 2048);
+    TEST_ASSERT(darray_get_size_reserved(got) == reserved);
+    bufpool_put(pool, got);
+
+    /* past the biggest class the memory over it goes back to the system */
+    darray* huge = bufpool_get(pool, sizeof(char), 1024 * 1024);
+    TEST_ASSERT(darray_get_size_reserved(huge) == 1024 * 1024);
+    size_t cached = bufpool_get_cached_bytes(pool);
+    bufpool_put(pool, huge);
+    TEST_ASSERT(bufpool_get_cached_bytes(pool) == cached + 64 * 1024);
+
+    /* too small to bother with */
+    darray* tiny = darray_create(sizeof(char), 16);
+    bufpool_put(pool, tiny);
+    TEST_ASSERT(bufpool_get_cached_bytes(pool) == cached + 64 * 1024);
+
+    bufpool_destroy(pool);
+}
+
+/* each class only keeps so much */
+static void test_limit(void)
+{
+    bufpool* pool = bufpool_create();
+
+    darray* bufs[64];
+    for (size_t i = 0; i < hhcountof(bufs); i++)
+    {
+        bufs[i] = bufpool_get(pool, sizeof(char), 64 * 1024);
+    }
+    for (size_t i = 0; i < hhcountof(bufs); i++)
+    {
+        bufpool_put(pool, bufs[i]);
+    }
+    TEST_ASSERT(bufpool_get_cached_bytes(pool) == 512 * 1024);
+
+    bufpool_destroy(pool);
+}
+
+/* without a pool it's just the heap */
+static void test_no_pool(void)
+{
+    darray* buf = bufpool_get(NULL, sizeof(char), 100);
+    TEST_ASSERT(darray_get_size_reserved(buf) == 100);
+    bufpool_put(NULL, buf);
+    bufpool_put(NULL, NULL);
+}
+
+int main(int argc, char** argv)
+{
+    hhunused(argc);
+    hhunused(argv);
+
+    test_reuse();
+    test_sizes();
+    test_limit();
+    test_no_pool();
+
+    exit(EXIT_SUCCESS);
+}
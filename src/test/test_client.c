@@ -561,6 +561,7 @@ static void do_chatserver_test(const char* addr, int port, int num)
     conn_settings->read_max_num_frames = 20 * 1024 * 1024;
     conn_settings->init_buf_len = 4 * 1024;
     conn_settings->rand_func = random_callback;
+    conn_settings->deflate.enabled = false;
 
     /*client_callbacks chatty_cbs;
     chatty_cbs.on_open = cs_chatty_on_open;
@@ -631,6 +632,7 @@ static void do_autobahn_test(const char* addr, int port, int num)
     conn_settings->read_max_num_frames = 20 * 1024 * 1024;
     conn_settings->init_buf_len = 4 * 1024;
     conn_settings->rand_func = random_callback;
+    conn_settings->deflate.enabled = false;
 
     client_callbacks callbacks;
     callbacks.on_open = ab_on_open;
@@ -760,6 +762,7 @@ static void do_mps_test(const char* addr, const char* resource, int port,
     conn_settings->read_max_num_frames = 20 * 1024 * 1024;
     conn_settings->init_buf_len = 4 * 1024;
     conn_settings->rand_func = random_callback;
+    conn_settings->deflate.enabled = false;
 
     client_callbacks cbs;
     cbs.on_open = mps_on_open;
@@ -860,6 +863,7 @@ static void do_timeout_test(const char* addr, const char* resource, int port)
     conn_settings->read_max_num_frames = 20 * 1024 * 1024;
     conn_settings->init_buf_len = 4 * 1024;
     conn_settings->rand_func = random_callback;
+    conn_settings->deflate.enabled = false;
 
     client_callbacks cbs;
     cbs.on_open = NULL;
@@ -1124,6 +1128,7 @@ do_interactive_test(const char* addr, const char* resource, int port,
     conn_settings->read_max_num_frames = 20 * 1024 * 1024;
     conn_settings->init_buf_len = 4 * 1024;
     conn_settings->rand_func = random_callback;
+    conn_settings->deflate.enabled = false;
 
     client_callbacks cbs;
     cbs.on_open = interactive_on_open;
@@ -202,6 +202,19 @@ int main(void)
     test_len(array, hhcountof(removed_arr2), END_ARGS);
     test_data(array, removed_arr2, sizeof(removed_arr2), END_ARGS);
 
+    /* test recycle */
+    cur_test = "recycle";
+    size_t num_bytes = chop_arr_len * sizeof(*chop_arr);
+    EXIT_IF_FAIL(darray_get_bytes_reserved(array) == num_bytes, cur_test,
+                 __FILE__, __LINE__);
+    EXIT_IF_FAIL(darray_recycle(array, sizeof(char)) == num_bytes, cur_test,
+                 __FILE__, __LINE__);
+    test_len(array, 0, END_ARGS);
+    test_size_reserved(array, num_bytes, END_ARGS);
+    darray_append(&array, "abc", 3);
+    test_data(array, "abc", 3, END_ARGS);
+    test_size_reserved(array, num_bytes, END_ARGS);
+
     darray_destroy(array);
     darray_destroy(copy);
     darray_destroy(copy_arr);
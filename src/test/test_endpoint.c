@@ -0,0 +1,1041 @@
+/* test_endpoint - test the endpoint write path
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "../darray.h"
+#include "../endpoint.h"
+#include "../util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define NUM_REFS 3
+
+typedef struct
+{
+    const char* data;
+    int num_released;
+} test_release;
+
+static endpoint_callbacks g_callbacks;
+
+static void test_failed_exit(const char* test, const char* what)
+{
+    printf("%s failed: %s\n", test, what);
+    exit(1);
+}
+
+static void on_release(const char* data, void* release_data)
+{
+    test_release* release = release_data;
+    if (data != release->data)
+    {
+        test_failed_exit("on_release", "wrong data pointer");
+    }
+    release->num_released++;
+}
+
+static void fill_pattern(char* buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        buf[i] = (char)((i * 31 + 7) & 0xff);
+    }
+}
+
+static void init_settings(endpoint_settings* settings)
+{
+    protocol_settings* conn_settings = &settings->conn_settings;
+    conn_settings->write_max_frame_size = 1024;
+    conn_settings->read_max_msg_size = 2048;
+    conn_settings->read_max_num_frames = 1024;
+    conn_settings->max_handshake_size = 2048;
+    conn_settings->init_buf_len = 256;
+    conn_settings->rand_func = NULL;
+    conn_settings->deflate.enabled = false;
+}
+
+static void set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        test_failed_exit("set_nonblocking", strerror(errno));
+    }
+}
+
+/*
+ * open a socketpair between client and server and take them through the
+ * handshake. the server's end is fds[0] and the client's is fds[1]
+ */
+static void connect_endpoints(const char* test, endpoint* client,
+                              endpoint* server, int* fds)
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+    {
+        test_failed_exit("socketpair", strerror(errno));
+    }
+    set_nonblocking(fds[0]);
+    set_nonblocking(fds[1]);
+
+    endpoint_send_handshake_request(client, "/", "localhost", NULL, NULL,
+                                    NULL);
+    if (endpoint_write(client, fds[1]) != ENDPOINT_WRITE_DONE ||
+        endpoint_read(server, fds[0]) != ENDPOINT_READ_SUCCESS ||
+        endpoint_write(server, fds[0]) != ENDPOINT_WRITE_DONE ||
+        endpoint_read(client, fds[1]) != ENDPOINT_READ_SUCCESS)
+    {
+        test_failed_exit(test, "handshake failed");
+    }
+}
+
+static void read_available(int fd, darray** received)
+{
+    for (;;)
+    {
+        char* buf = darray_ensure(received, 4096);
+        ssize_t num_read = read(fd, &buf[darray_get_len(*received)], 4096);
+        if (num_read <= 0) break;
+        darray_add_len(*received, (size_t)num_read);
+    }
+}
+
+/* write everything queued on conn to wfd, reading it back from rfd */
+static void write_all(endpoint* conn, int wfd, int rfd, darray** received)
+{
+    endpoint_write_result r;
+    do
+    {
+        r = endpoint_write(conn, wfd);
+        read_available(rfd, received);
+    } while (r == ENDPOINT_WRITE_CONTINUE);
+
+    if (r != ENDPOINT_WRITE_DONE)
+    {
+        test_failed_exit("write_all", "endpoint_write failed");
+    }
+}
+
+/*
+ * send the same messages by copy and by reference, and make sure the bytes
+ * that come out of the socket are identical. a tiny socket buffer makes
+ * sure writes come up short and the write buffer gets compacted under
+ * queued payloads
+ */
+static void test_send_ref(void)
+{
+    static char copied[] = "hello";
+    static char small[100];
+    static char medium[5000];
+    static char large[200000];
+    fill_pattern(small, sizeof(small));
+    fill_pattern(medium, sizeof(medium));
+    fill_pattern(large, sizeof(large));
+
+    endpoint_settings settings;
+    init_settings(&settings);
+
+    endpoint expected_conn;
+    endpoint conn;
+    endpoint_init(&expected_conn, ENDPOINT_SERVER, &settings, &g_callbacks,
+                  NULL);
+    endpoint_init(&conn, ENDPOINT_SERVER, &settings, &g_callbacks, NULL);
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+    {
+        test_failed_exit("socketpair", strerror(errno));
+    }
+    int sndbuf = 4096;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    set_nonblocking(fds[0]);
+    set_nonblocking(fds[1]);
+
+    char* payloads[NUM_REFS] = { small, medium, large };
+    size_t lens[NUM_REFS] = { sizeof(small), sizeof(medium), sizeof(large) };
+    test_release releases[NUM_REFS];
+
+    endpoint_msg msg;
+    msg.is_text = true;
+    msg.data = copied;
+    msg.msg_len = (int64_t)strlen(copied);
+    endpoint_send_msg(&expected_conn, &msg);
+    endpoint_send_msg(&conn, &msg);
+
+    for (int i = 0; i < NUM_REFS; i++)
+    {
+        msg.is_text = false;
+        msg.data = payloads[i];
+        msg.msg_len = (int64_t)lens[i];
+        releases[i].data = payloads[i];
+        releases[i].num_released = 0;
+
+        endpoint_send_msg(&expected_conn, &msg);
+        if (endpoint_send_msg_ref(&conn, &msg, on_release, &releases[i]) !=
+            ENDPOINT_RESULT_SUCCESS)
+        {
+            test_failed_exit("send_ref", "endpoint_send_msg_ref failed");
+        }
+
+        /* copies in between refs end up in their own segments */
+        msg.is_text = true;
+        msg.data = copied;
+        msg.msg_len = (int64_t)strlen(copied);
+        endpoint_send_msg(&expected_conn, &msg);
+        endpoint_send_msg(&conn, &msg);
+    }
+    endpoint_send_ping(&expected_conn, copied, (int)strlen(copied));
+    endpoint_send_ping(&conn, copied, (int)strlen(copied));
+
+    /* small payloads are copied and released right away, the rest wait */
+    if (releases[0].num_released != 1)
+    {
+        test_failed_exit("send_ref", "small payload not released");
+    }
+    if (releases[1].num_released != 0 || releases[2].num_released != 0)
+    {
+        test_failed_exit("send_ref", "payload released before written");
+    }
+
+    darray* expected = darray_create(sizeof(char), 4096);
+    darray* actual = darray_create(sizeof(char), 4096);
+    write_all(&expected_conn, fds[0], fds[1], &expected);
+    write_all(&conn, fds[0], fds[1], &actual);
+
+    if (darray_get_len(expected) != darray_get_len(actual) ||
+        memcmp(darray_get_data(expected), darray_get_data(actual),
+               darray_get_len(actual)) != 0)
+    {
+        test_failed_exit("send_ref", "written bytes differ");
+    }
+
+    for (int i = 0; i < NUM_REFS; i++)
+    {
+        if (releases[i].num_released != 1)
+        {
+            test_failed_exit("send_ref", "payload not released once");
+        }
+    }
+
+    darray_destroy(expected);
+    darray_destroy(actual);
+    close(fds[0]);
+    close(fds[1]);
+    endpoint_deinit(&expected_conn);
+    endpoint_deinit(&conn);
+}
+
+/*
+ * encode a message once and queue the same bytes on several endpoints.
+ * each one has to write exactly what a plain send would have
+ */
+static void test_send_frames_ref(void)
+{
+    static char payload[30000];
+    fill_pattern(payload, sizeof(payload));
+
+    endpoint_settings settings;
+    init_settings(&settings);
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+    {
+        test_failed_exit("socketpair", strerror(errno));
+    }
+    set_nonblocking(fds[0]);
+    set_nonblocking(fds[1]);
+
+    endpoint_msg msg;
+    msg.is_text = false;
+    msg.data = payload;
+    msg.msg_len = sizeof(payload);
+
+    protocol_msg pmsg;
+    pmsg.data = payload;
+    pmsg.msg_len = sizeof(payload);
+    pmsg.type = PROTOCOL_MSG_BINARY;
+
+    darray* frames = darray_create(sizeof(char), 64);
+    if (protocol_encode_server_msg(&settings.conn_settings, &pmsg, &frames) !=
+        PROTOCOL_RESULT_MESSAGE_FINISHED)
+    {
+        test_failed_exit("send_frames_ref", "encode failed");
+    }
+
+    endpoint expected_conn;
+    endpoint_init(&expected_conn, ENDPOINT_SERVER, &settings, &g_callbacks,
+                  NULL);
+    endpoint_send_msg(&expected_conn, &msg);
+    darray* expected = darray_create(sizeof(char), 4096);
+    write_all(&expected_conn, fds[0], fds[1], &expected);
+    endpoint_deinit(&expected_conn);
+
+    test_release release;
+    release.data = darray_get_data(frames);
+    release.num_released = 0;
+
+    endpoint conns[3];
+    for (int i = 0; i < 3; i++)
+    {
+        endpoint_init(&conns[i], ENDPOINT_SERVER, &settings, &g_callbacks,
+                      NULL);
+        endpoint_send_frames_ref(&conns[i], darray_get_data(frames),
+                                 darray_get_len(frames), on_release,
+                                 &release);
+    }
+
+    if (release.num_released != 0)
+    {
+        test_failed_exit("send_frames_ref", "released before written");
+    }
+
+    for (int i = 0; i < 3; i++)
+    {
+        darray* actual = darray_create(sizeof(char), 4096);
+        write_all(&conns[i], fds[0], fds[1], &actual);
+
+        if (darray_get_len(expected) != darray_get_len(actual) ||
+            memcmp(darray_get_data(expected), darray_get_data(actual),
+                   darray_get_len(actual)) != 0)
+        {
+            test_failed_exit("send_frames_ref", "written bytes differ");
+        }
+
+        if (release.num_released != i + 1)
+        {
+            test_failed_exit("send_frames_ref", "not released once written");
+        }
+
+        darray_destroy(actual);
+        endpoint_deinit(&conns[i]);
+    }
+
+    darray_destroy(frames);
+    darray_destroy(expected);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/* payloads that never get written still have to be handed back */
+static void test_release_unsent(void)
+{
+    static char payload[4096];
+    fill_pattern(payload, sizeof(payload));
+
+    endpoint_settings settings;
+    init_settings(&settings);
+
+    endpoint conn;
+    endpoint_init(&conn, ENDPOINT_SERVER, &settings, &g_callbacks, NULL);
+
+    endpoint_msg msg;
+    msg.is_text = false;
+    msg.data = payload;
+    msg.msg_len = sizeof(payload);
+
+    test_release release;
+    release.data = payload;
+    release.num_released = 0;
+
+    endpoint_send_msg_ref(&conn, &msg, on_release, &release);
+    endpoint_reset(&conn);
+    if (release.num_released != 1)
+    {
+        test_failed_exit("release_unsent", "not released on reset");
+    }
+
+    endpoint_send_msg_ref(&conn, &msg, on_release, &release);
+    endpoint_deinit(&conn);
+    if (release.num_released != 2)
+    {
+        test_failed_exit("release_unsent", "not released on deinit");
+    }
+}
+
+static uint32_t random_callback(protocol_conn* conn)
+{
+    hhunused(conn);
+    return (uint32_t)random();
+}
+
+static bool on_read_connect(endpoint* conn, protocol_conn* proto_conn,
+                            void* userdata)
+{
+    hhunused(proto_conn);
+    hhunused(userdata);
+    return endpoint_send_handshake_response(conn, NULL, NULL) ==
+        ENDPOINT_RESULT_SUCCESS;
+}
+
+static void on_read_message(endpoint* conn, endpoint_msg* msg,
+                            void* userdata)
+{
+    hhunused(conn);
+
+    static char expected[30000];
+    fill_pattern(expected, sizeof(expected));
+
+    int* num_messages = userdata;
+    if (msg->msg_len != sizeof(expected) ||
+        memcmp(msg->data, expected, sizeof(expected)) != 0)
+    {
+        test_failed_exit("read_drain", "wrong message");
+    }
+    (*num_messages)++;
+}
+
+/*
+ * a handshake response followed right away by messages that are each far
+ * bigger than a single read has to come out of one endpoint_read, since it
+ * keeps reading until the socket is drained
+ */
+static void test_read_drain(void)
+{
+    static char payload[30000];
+    fill_pattern(payload, sizeof(payload));
+
+    endpoint_settings settings;
+    init_settings(&settings);
+    settings.conn_settings.read_max_msg_size = 64 * 1024;
+    settings.conn_settings.write_max_frame_size = -1;
+    settings.conn_settings.rand_func = random_callback;
+
+    endpoint_callbacks server_callbacks;
+    memset(&server_callbacks, 0, sizeof(server_callbacks));
+    server_callbacks.on_connect = on_read_connect;
+
+    endpoint_callbacks client_callbacks;
+    memset(&client_callbacks, 0, sizeof(client_callbacks));
+    client_callbacks.on_message = on_read_message;
+
+    int num_messages = 0;
+    endpoint client;
+    endpoint server;
+    endpoint_init(&client, ENDPOINT_CLIENT, &settings, &client_callbacks,
+                  &num_messages);
+    endpoint_init(&server, ENDPOINT_SERVER, &settings, &server_callbacks,
+                  NULL);
+
+    int fds[2];
+    connect_endpoints("read_drain", &client, &server, fds);
+
+    /* nothing to read yet is not an error */
+    if (endpoint_read(&server, fds[0]) != ENDPOINT_READ_SUCCESS)
+    {
+        test_failed_exit("read_drain", "empty socket was an error");
+    }
+
+    endpoint_msg msg;
+    msg.is_text = false;
+    msg.data = payload;
+    msg.msg_len = sizeof(payload);
+    for (int i = 0; i < 3; i++)
+    {
+        endpoint_send_msg(&server, &msg);
+    }
+
+    darray* sent = darray_create(sizeof(char), 4096);
+    write_all(&server, fds[0], fds[1], &sent);
+
+    /*
+     * stop halfway through the second message, so it has to pick up where
+     * it left off after the first one is taken out of the buffer
+     */
+    const char* data = darray_get_data(sent);
+    size_t len = darray_get_len(sent);
+    size_t half = len / 2;
+    int expected_messages[2] = { 1, 3 };
+    for (int i = 0; i < 2; i++)
+    {
+        size_t start = (i == 0) ? 0 : half;
+        size_t end = (i == 0) ? half : len;
+        if (write(fds[0], &data[start], end - start) != (ssize_t)(end - start))
+        {
+            test_failed_exit("read_drain", "write failed");
+        }
+
+        if (endpoint_read(&client, fds[1]) != ENDPOINT_READ_SUCCESS)
+        {
+            test_failed_exit("read_drain", "endpoint_read failed");
+        }
+        if (num_messages != expected_messages[i])
+        {
+            test_failed_exit("read_drain", "socket not drained");
+        }
+    }
+
+    darray_destroy(sent);
+    close(fds[0]);
+    close(fds[1]);
+    endpoint_deinit(&client);
+    endpoint_deinit(&server);
+}
+
+static bool holds_buffers(endpoint* conn)
+{
+    return conn->write_queue != NULL || conn->pconn.read_buffer != NULL ||
+           conn->pconn.write_buffer != NULL;
+}
+
+/*
+ * connected endpoints only hold buffers while they're reading or writing
+ * something, and get them from their pool
+ */
+static void test_idle_buffers(void)
+{
+    static char payload[30000];
+    fill_pattern(payload, sizeof(payload));
+
+    endpoint_settings settings;
+    init_settings(&settings);
+    settings.conn_settings.read_max_msg_size = 64 * 1024;
+    settings.conn_settings.rand_func = random_callback;
+
+    endpoint_callbacks server_callbacks;
+    memset(&server_callbacks, 0, sizeof(server_callbacks));
+    server_callbacks.on_connect = on_read_connect;
+    server_callbacks.on_message = on_read_message;
+
+    endpoint_callbacks client_callbacks;
+    memset(&client_callbacks, 0, sizeof(client_callbacks));
+    client_callbacks.on_message = on_read_message;
+
+    bufpool* pool = bufpool_create();
+    int num_client_messages = 0;
+    int num_server_messages = 0;
+    endpoint client;
+    endpoint server;
+    endpoint_init(&client, ENDPOINT_CLIENT, &settings, &client_callbacks,
+                  &num_client_messages);
+    endpoint_init(&server, ENDPOINT_SERVER, &settings, &server_callbacks,
+                  &num_server_messages);
+    endpoint_set_bufpool(&client, pool);
+    endpoint_set_bufpool(&server, pool);
+
+    if (holds_buffers(&client) || holds_buffers(&server))
+    {
+        test_failed_exit("idle_buffers", "buffers allocated up front");
+    }
+
+    int fds[2];
+    connect_endpoints("idle_buffers", &client, &server, fds);
+
+    if (holds_buffers(&client) || holds_buffers(&server))
+    {
+        test_failed_exit("idle_buffers", "buffers held after handshake");
+    }
+
+    /* the handshake info is the owner's to release */
+    if (protocol_get_num_headers(&server.pconn) == 0)
+    {
+        test_failed_exit("idle_buffers", "handshake info released");
+    }
+
+    endpoint_msg msg;
+    msg.is_text = false;
+    msg.data = payload;
+    msg.msg_len = sizeof(payload);
+    for (int i = 0; i < 3; i++)
+    {
+        endpoint_send_msg(&client, &msg);
+        if (!holds_buffers(&client))
+        {
+            test_failed_exit("idle_buffers", "no buffers to write with");
+        }
+
+        if (endpoint_write(&client, fds[1]) != ENDPOINT_WRITE_DONE ||
+            endpoint_read(&server, fds[0]) != ENDPOINT_READ_SUCCESS)
+        {
+            test_failed_exit("idle_buffers", "message failed");
+        }
+
+        if (num_server_messages != i + 1 || holds_buffers(&client) ||
+            holds_buffers(&server) || bufpool_get_cached_bytes(pool) == 0)
+        {
+            test_failed_exit("idle_buffers", "buffers held after message");
+        }
+    }
+
+    /* half a message keeps the read buffer */
+    endpoint_send_msg(&server, &msg);
+    darray* sent = darray_create(sizeof(char), 4096);
+    write_all(&server, fds[0], fds[1], &sent);
+    if (write(fds[0], darray_get_data(sent), 100) != 100 ||
+        endpoint_read(&client, fds[1]) != ENDPOINT_READ_SUCCESS ||
+        client.pconn.read_buffer == NULL)
+    {
+        test_failed_exit("idle_buffers", "partial message not kept");
+    }
+
+    size_t rest = darray_get_len(sent) - 100;
+    if (write(fds[0], (char*)darray_get_data(sent) + 100, rest) !=
+            (ssize_t)rest ||
+        endpoint_read(&client, fds[1]) != ENDPOINT_READ_SUCCESS ||
+        num_client_messages != 1 || holds_buffers(&client))
+    {
+        test_failed_exit("idle_buffers", "message not read");
+    }
+
+    darray_destroy(sent);
+    close(fds[0]);
+    close(fds[1]);
+    endpoint_deinit(&client);
+    endpoint_deinit(&server);
+    bufpool_destroy(pool);
+}
+
+#define PIPELINED_MESSAGES 200
+
+static size_t pipelined_len(int i)
+{
+    return 1 + (size_t)(i * 37) % 300;
+}
+
+static void on_pipelined_message(endpoint* conn, endpoint_msg* msg,
+                                 void* userdata)
+{
+    hhunused(conn);
+
+    char expected[300];
+    int* num_messages = userdata;
+    size_t len = pipelined_len(*num_messages);
+    memset(expected, 'a' + *num_messages % 26, len);
+    if (msg->msg_len != (int64_t)len || memcmp(msg->data, expected, len) != 0)
+    {
+        test_failed_exit("read_pipelined", "wrong message");
+    }
+    (*num_messages)++;
+}
+
+/*
+ * lots of small messages and pings, trickling in so most reads end halfway
+ * through one. what's parsed is skipped over instead of moving the rest of
+ * the buffer down after every read
+ */
+static void test_read_pipelined(void)
+{
+    endpoint_settings settings;
+    init_settings(&settings);
+    settings.conn_settings.rand_func = random_callback;
+
+    endpoint_callbacks server_callbacks;
+    memset(&server_callbacks, 0, sizeof(server_callbacks));
+    server_callbacks.on_connect = on_read_connect;
+
+    endpoint_callbacks client_callbacks;
+    memset(&client_callbacks, 0, sizeof(client_callbacks));
+    client_callbacks.on_message = on_pipelined_message;
+
+    int num_messages = 0;
+    endpoint client;
+    endpoint server;
+    endpoint_init(&client, ENDPOINT_CLIENT, &settings, &client_callbacks,
+                  &num_messages);
+    endpoint_init(&server, ENDPOINT_SERVER, &settings, &server_callbacks,
+                  NULL);
+
+    int fds[2];
+    connect_endpoints("read_pipelined", &client, &server, fds);
+
+    char payload[300];
+    for (int i = 0; i < PIPELINED_MESSAGES; i++)
+    {
+        size_t len = pipelined_len(i);
+        memset(payload, 'a' + i % 26, len);
+
+        endpoint_msg msg;
+        msg.is_text = false;
+        msg.data = payload;
+        msg.msg_len = len;
+        endpoint_send_msg(&server, &msg);
+        if (i % 10 == 0) endpoint_send_ping(&server, "ping", 4);
+    }
+
+    darray* sent = darray_create(sizeof(char), 4096);
+    write_all(&server, fds[0], fds[1], &sent);
+
+    const char* data = darray_get_data(sent);
+    size_t len = darray_get_len(sent);
+    bool skipped = false;
+    for (size_t pos = 0; pos < len; pos += 97)
+    {
+        size_t chunk_len = hhmin(len - pos, (size_t)97);
+        if (write(fds[0], &data[pos], chunk_len) != (ssize_t)chunk_len)
+        {
+            test_failed_exit("read_pipelined", "write failed");
+        }
+
+        endpoint_read_result r = endpoint_read(&client, fds[1]);
+        if (r != ENDPOINT_READ_SUCCESS &&
+            r != ENDPOINT_READ_SUCCESS_WROTE_DATA)
+        {
+            test_failed_exit("read_pipelined", "endpoint_read failed");
+        }
+        if (client.pconn.read_start > 0) skipped = true;
+    }
+
+    if (num_messages != PIPELINED_MESSAGES || !skipped ||
+        darray_get_len(client.pconn.read_buffer) != 0 ||
+        client.pconn.read_start != 0 || client.read_pos != 0)
+    {
+        test_failed_exit("read_pipelined", "messages not all read");
+    }
+
+    darray_destroy(sent);
+    close(fds[0]);
+    close(fds[1]);
+    endpoint_deinit(&client);
+    endpoint_deinit(&server);
+}
+
+#define STREAMED_MESSAGES 2
+
+typedef struct
+{
+    darray* data; /* the message being put back together */
+    bool in_msg;
+    bool is_text;
+    int num_chunks;
+    int num_messages;
+    const char* expected[STREAMED_MESSAGES];
+    size_t expected_len[STREAMED_MESSAGES];
+} test_stream;
+
+static void on_stream_chunk(endpoint* conn, endpoint_msg_chunk* chunk,
+                            void* userdata)
+{
+    hhunused(conn);
+    test_stream* stream = userdata;
+
+    if (chunk->start == stream->in_msg)
+    {
+        test_failed_exit("read_streamed", "start of message out of order");
+    }
+    if (chunk->start)
+    {
+        darray_clear(stream->data);
+        stream->in_msg = true;
+        stream->is_text = chunk->is_text;
+    }
+    else if (chunk->is_text != stream->is_text)
+    {
+        test_failed_exit("read_streamed", "message changed type");
+    }
+
+    darray_append(&stream->data, chunk->data, chunk->len);
+    stream->num_chunks++;
+    if (!chunk->final) return;
+
+    stream->in_msg = false;
+    int i = stream->num_messages++;
+    if (i >= STREAMED_MESSAGES ||
+        darray_get_len(stream->data) != stream->expected_len[i] ||
+        memcmp(darray_get_data(stream->data), stream->expected[i],
+               stream->expected_len[i]) != 0)
+    {
+        test_failed_exit("read_streamed", "message doesn't match");
+    }
+}
+
+/*
+ * feed fragmented messages larger than the server is willing to buffer to
+ * it a few bytes at a time. they should come out in pieces, with nothing
+ * but the odd partial frame header left in the read buffer in between
+ */
+static void test_read_streamed(void)
+{
+    static char binary[20000];
+    static char text[1 + 749 * 2];
+
+    endpoint_settings settings;
+    init_settings(&settings);
+    settings.conn_settings.rand_func = random_callback;
+
+    endpoint_settings server_settings;
+    init_settings(&server_settings);
+    server_settings.conn_settings.read_max_msg_size = -1;
+
+    endpoint_callbacks server_callbacks;
+    memset(&server_callbacks, 0, sizeof(server_callbacks));
+    server_callbacks.on_connect = on_read_connect;
+    server_callbacks.on_message_chunk = on_stream_chunk;
+
+    endpoint_callbacks client_callbacks;
+    memset(&client_callbacks, 0, sizeof(client_callbacks));
+
+    /* a 2 byte character gets split across the first two frames */
+    text[0] = 'a';
+    for (size_t i = 1; i < sizeof(text); i += 2)
+    {
+        text[i] = (char)0xc3;
+        text[i + 1] = (char)0xa9;
+    }
+    fill_pattern(binary, sizeof(binary));
+
+    test_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    stream.data = darray_create(sizeof(char), 1024);
+    stream.expected[0] = binary;
+    stream.expected_len[0] = sizeof(binary);
+    stream.expected[1] = text;
+    stream.expected_len[1] = sizeof(text);
+
+    endpoint client;
+    endpoint server;
+    endpoint_init(&client, ENDPOINT_CLIENT, &settings, &client_callbacks,
+                  NULL);
+    endpoint_init(&server, ENDPOINT_SERVER, &server_settings,
+                  &server_callbacks, &stream);
+
+    int fds[2];
+    connect_endpoints("read_streamed", &client, &server, fds);
+
+    endpoint_msg msg;
+    msg.is_text = false;
+    msg.data = binary;
+    msg.msg_len = sizeof(binary);
+    endpoint_send_msg(&client, &msg);
+    endpoint_send_ping(&client, "ping", 4);
+    msg.is_text = true;
+    msg.data = text;
+    msg.msg_len = sizeof(text);
+    endpoint_send_msg(&client, &msg);
+
+    darray* sent = darray_create(sizeof(char), 4096);
+    write_all(&client, fds[1], fds[0], &sent);
+
+    const char* data = darray_get_data(sent);
+    size_t len = darray_get_len(sent);
+    for (size_t pos = 0; pos < len; pos += 97)
+    {
+        size_t chunk_len = hhmin(len - pos, (size_t)97);
+        if (write(fds[1], &data[pos], chunk_len) != (ssize_t)chunk_len)
+        {
+            test_failed_exit("read_streamed", "write failed");
+        }
+
+        endpoint_read_result r = endpoint_read(&server, fds[0]);
+        if (r != ENDPOINT_READ_SUCCESS &&
+            r != ENDPOINT_READ_SUCCESS_WROTE_DATA)
+        {
+            test_failed_exit("read_streamed", "endpoint_read failed");
+        }
+
+        /* at most the start of a frame header is waiting on the rest */
+        if (server.pconn.read_buffer != NULL &&
+            darray_get_len(server.pconn.read_buffer) -
+            server.pconn.read_start >= 14)
+        {
+            test_failed_exit("read_streamed", "read data kept around");
+        }
+    }
+
+    if (stream.num_messages != STREAMED_MESSAGES || stream.in_msg ||
+        stream.num_chunks <= 2 * STREAMED_MESSAGES)
+    {
+        test_failed_exit("read_streamed", "messages not all read");
+    }
+
+    darray_destroy(stream.data);
+    darray_destroy(sent);
+    close(fds[0]);
+    close(fds[1]);
+    endpoint_deinit(&client);
+    endpoint_deinit(&server);
+}
+
+#define BACKLOG_MESSAGES 400
+#define BACKLOG_MAX_LEN 1700
+
+static size_t backlog_len(int i)
+{
+    return 1100 + (size_t)(i % 7) * 100;
+}
+
+static void on_backlog_message(endpoint* conn, endpoint_msg* msg,
+                               void* userdata)
+{
+    hhunused(conn);
+
+    char expected[BACKLOG_MAX_LEN];
+    int* num_messages = userdata;
+    size_t len = backlog_len(*num_messages);
+    memset(expected, 'a' + *num_messages % 26, len);
+    if (msg->msg_len != (int64_t)len || memcmp(msg->data, expected, len) != 0)
+    {
+        test_failed_exit("write_backlog", "wrong message");
+    }
+    (*num_messages)++;
+}
+
+/*
+ * queue far more than the socket takes, copies and references mixed, with
+ * a write now and then. the write buffer is swapped out when it fills
+ * instead of growing with the backlog, and it all still comes out in order
+ */
+static void test_write_backlog(void)
+{
+    static char payloads[BACKLOG_MESSAGES][BACKLOG_MAX_LEN];
+
+    endpoint_settings settings;
+    init_settings(&settings);
+    settings.conn_settings.rand_func = random_callback;
+
+    endpoint_callbacks server_callbacks;
+    memset(&server_callbacks, 0, sizeof(server_callbacks));
+    server_callbacks.on_connect = on_read_connect;
+
+    endpoint_callbacks client_callbacks;
+    memset(&client_callbacks, 0, sizeof(client_callbacks));
+    client_callbacks.on_message = on_backlog_message;
+
+    bufpool* pool = bufpool_create();
+    int num_messages = 0;
+    endpoint client;
+    endpoint server;
+    endpoint_init(&client, ENDPOINT_CLIENT, &settings, &client_callbacks,
+                  &num_messages);
+    endpoint_init(&server, ENDPOINT_SERVER, &settings, &server_callbacks,
+                  NULL);
+    endpoint_set_bufpool(&server, pool);
+
+    int fds[2];
+    connect_endpoints("write_backlog", &client, &server, fds);
+    int sndbuf = 4096;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+    test_release releases[BACKLOG_MESSAGES];
+    bool chained = false;
+    for (int i = 0; i < BACKLOG_MESSAGES; i++)
+    {
+        size_t len = backlog_len(i);
+        memset(payloads[i], 'a' + i % 26, len);
+
+        endpoint_msg msg;
+        msg.is_text = false;
+        msg.data = payloads[i];
+        msg.msg_len = (int64_t)len;
+        releases[i].data = payloads[i];
+        releases[i].num_released = 0;
+        size_t buffered = endpoint_get_buffered_bytes(&server);
+        if (i % 5 == 0)
+        {
+            endpoint_send_msg_ref(&server, &msg, on_release, &releases[i]);
+        }
+        else
+        {
+            endpoint_send_msg(&server, &msg);
+            releases[i].num_released = 1;
+        }
+
+        /* the payload and at least a 2 byte frame header */
+        if (endpoint_get_buffered_bytes(&server) < buffered + len + 2)
+        {
+            test_failed_exit("write_backlog", "buffered bytes not counted");
+        }
+
+        if (i % 20 == 19 &&
+            endpoint_write(&server, fds[0]) != ENDPOINT_WRITE_CONTINUE)
+        {
+            test_failed_exit("write_backlog", "socket never filled up");
+        }
+
+        if (darray_get_len(server.pconn.write_buffer) >
+            64 * 1024 + BACKLOG_MAX_LEN)
+        {
+            test_failed_exit("write_backlog", "write buffer kept growing");
+        }
+
+        endpoint_write_seg* segs = darray_get_data(server.write_queue);
+        for (size_t j = server.write_queue_head;
+             j < darray_get_len(server.write_queue); j++)
+        {
+            if (segs[j].chunk != NULL) chained = true;
+        }
+    }
+
+    if (!chained)
+    {
+        test_failed_exit("write_backlog", "write buffer never swapped out");
+    }
+
+    endpoint_write_result wr;
+    do
+    {
+        wr = endpoint_write(&server, fds[0]);
+        endpoint_read(&client, fds[1]);
+    } while (wr == ENDPOINT_WRITE_CONTINUE);
+    endpoint_read(&client, fds[1]);
+
+    if (wr != ENDPOINT_WRITE_DONE || num_messages != BACKLOG_MESSAGES)
+    {
+        test_failed_exit("write_backlog", "messages not all written");
+    }
+    if (endpoint_get_buffered_bytes(&server) != 0)
+    {
+        test_failed_exit("write_backlog", "written bytes still buffered");
+    }
+    for (int i = 0; i < BACKLOG_MESSAGES; i++)
+    {
+        if (releases[i].num_released != 1)
+        {
+            test_failed_exit("write_backlog", "payload not released once");
+        }
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+    endpoint_deinit(&client);
+    endpoint_deinit(&server);
+    bufpool_destroy(pool);
+}
+
+int main(int argc, char** argv)
+{
+    hhunused(argc);
+    hhunused(argv);
+
+    memset(&g_callbacks, 0, sizeof(g_callbacks));
+
+    test_send_ref();
+    test_send_frames_ref();
+    test_release_unsent();
+    test_read_drain();
+    test_idle_buffers();
+    test_read_pipelined();
+    test_read_streamed();
+    test_write_backlog();
+
+    exit(0);
+}
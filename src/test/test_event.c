@@ -29,10 +29,12 @@
  */
 
 #include "../event.h"
+#include "../hhclock.h"
 #include "../util.h"
 
 #include <sys/types.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <signal.h>
 #include <sys/socket.h>
@@ -231,6 +233,225 @@ static void accept_callback(event_loop* loop, int fd, void* data)
 }
 
 
+typedef struct
+{
+    int num_reads;
+    int num_writes;
+    bool fill; /* write until the socket is full, instead of nothing */
+} edge_state;
+
+static void edge_read_callback(event_loop* loop, int fd, void* data)
+{
+    edge_state* state = data;
+    state->num_reads++;
+
+    char buffer[64];
+    while (read(fd, buffer, sizeof(buffer)) > 0) {}
+    if (errno == EAGAIN) event_io_blocked(loop, fd, EVENT_READABLE);
+}
+
+static void edge_write_callback(event_loop* loop, int fd, void* data)
+{
+    edge_state* state = data;
+    state->num_writes++;
+
+    if (!state->fill)
+    {
+        event_delete_io_event(loop, fd, EVENT_WRITEABLE);
+        return;
+    }
+
+    char buffer[4096];
+    memset(buffer, 0, sizeof(buffer));
+    while (write(fd, buffer, sizeof(buffer)) > 0) {}
+    if (errno == EAGAIN) event_io_blocked(loop, fd, EVENT_WRITEABLE);
+}
+
+static void edge_stop_callback(event_loop* loop, event_time_id id,
+                               void* data)
+{
+    hhunused(id);
+    hhunused(data);
+    event_stop_loop(loop);
+}
+
+static void pump_for(event_loop* loop, uint64_t ms)
+{
+    event_time_id id = event_add_time_event(loop, edge_stop_callback, ms,
+                                            NULL);
+    event_pump_events(loop, 0);
+    event_delete_time_event(loop, id);
+}
+
+static void expect_counts(edge_state* state, int num_reads, int num_writes)
+{
+    if (state->num_reads != num_reads || state->num_writes != num_writes)
+    {
+        printf("reads: %d (expected %d), writes: %d (expected %d)\n",
+               state->num_reads, num_reads, state->num_writes, num_writes);
+        error_exit("EDGE TRIGGERED ERROR");
+    }
+}
+
+/*
+ * callbacks on an edge triggered fd fire once per edge, or until they tell
+ * the loop they ran into EAGAIN. write interest can come and go without a
+ * new edge
+ */
+static void test_edge_triggered(void)
+{
+    event_loop* loop = event_create_loop(1024);
+    if (loop == NULL) error_exit("NULL WHEN CREATING EVENT LOOP");
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) error_exit(NULL);
+    for (int i = 0; i < 2; i++)
+    {
+        if (fcntl(fds[i], F_SETFL, O_NONBLOCK) == -1) error_exit(NULL);
+    }
+
+    edge_state state;
+    memset(&state, 0, sizeof(state));
+    event_result r = event_add_io_event(loop, fds[0],
+                                        EVENT_READABLE | EVENT_EDGE_TRIGGERED,
+                                        edge_read_callback, &state);
+    if (r != EVENT_RESULT_SUCCESS)
+    {
+        error_exit("NON-SUCCESS WHEN ADDING EDGE TRIGGERED FD");
+    }
+
+    pump_for(loop, 20);
+    expect_counts(&state, 0, 0);
+
+    if (write(fds[1], "x", 1) != 1) error_exit(NULL);
+    pump_for(loop, 20);
+    expect_counts(&state, 1, 0);
+
+    /* the socket has been writeable all along */
+    event_add_io_event(loop, fds[0], EVENT_WRITEABLE, edge_write_callback,
+                       &state);
+    pump_for(loop, 20);
+    expect_counts(&state, 1, 1);
+
+    /* a full socket doesn't fire again until the other side reads */
+    state.fill = true;
+    event_add_io_event(loop, fds[0], EVENT_WRITEABLE, edge_write_callback,
+                       &state);
+    pump_for(loop, 20);
+    expect_counts(&state, 1, 2);
+
+    char buffer[4096];
+    while (read(fds[1], buffer, sizeof(buffer)) > 0) {}
+    pump_for(loop, 20);
+    expect_counts(&state, 1, 3);
+
+    event_delete_io_event(loop, fds[0], EVENT_READABLE | EVENT_WRITEABLE);
+    close(fds[0]);
+    close(fds[1]);
+    event_destroy_loop(loop);
+}
+
+typedef struct
+{
+    edge_state* edge;
+    int num_ticks;
+    int num_reads_at_tick;
+} tick_state;
+
+static void tick_callback(event_loop* loop, void* data)
+{
+    hhunused(loop);
+    tick_state* state = data;
+    state->num_ticks++;
+    state->num_reads_at_tick = state->edge->num_reads;
+}
+
+/* the tick callback runs after the io callbacks of every iteration */
+static void test_tick(void)
+{
+    event_loop* loop = event_create_loop(1024);
+    if (loop == NULL) error_exit("NULL WHEN CREATING EVENT LOOP");
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) error_exit(NULL);
+    if (fcntl(fds[0], F_SETFL, O_NONBLOCK) == -1) error_exit(NULL);
+
+    edge_state edge;
+    memset(&edge, 0, sizeof(edge));
+    tick_state state;
+    memset(&state, 0, sizeof(state));
+    state.edge = &edge;
+
+    event_add_io_event(loop, fds[0], EVENT_READABLE, edge_read_callback,
+                       &edge);
+    event_set_tick_callback(loop, tick_callback, &state);
+
+    if (write(fds[1], "x", 1) != 1) error_exit(NULL);
+    pump_for(loop, 20);
+    if (state.num_ticks < 1 || state.num_reads_at_tick != 1)
+    {
+        printf("ticks: %d, reads at tick: %d\n", state.num_ticks,
+               state.num_reads_at_tick);
+        error_exit("TICK ERROR");
+    }
+
+    int num_ticks = state.num_ticks;
+    event_set_tick_callback(loop, NULL, NULL);
+    pump_for(loop, 20);
+    if (state.num_ticks != num_ticks) error_exit("TICK NOT REMOVED ERROR");
+
+    event_delete_io_event(loop, fds[0], EVENT_READABLE);
+    close(fds[0]);
+    close(fds[1]);
+    event_destroy_loop(loop);
+}
+
+typedef struct
+{
+    int num_fired;
+    uint64_t last_time_ms;
+} loop_time_state;
+
+static void loop_time_callback(event_loop* loop, event_time_id id, void* data)
+{
+    hhunused(id);
+    loop_time_state* state = data;
+
+    /* sampled when the loop woke up, so never ahead of the clock */
+    uint64_t loop_ms = event_get_time_ms(loop);
+    uint64_t now = hhclock_get_now_ms();
+    if (loop_ms > now || now - loop_ms > 20 || loop_ms < state->last_time_ms)
+    {
+        printf("loop time: %" PRIu64 ", now: %" PRIu64 ", last: %" PRIu64
+               "\n", loop_ms, now, state->last_time_ms);
+        error_exit("LOOP TIME ERROR");
+    }
+
+    state->last_time_ms = loop_ms;
+    state->num_fired++;
+}
+
+/* time events see the time the loop sampled for their iteration */
+static void test_loop_time(int coarse)
+{
+    event_loop* loop = event_create_loop(1024);
+    if (loop == NULL) error_exit("NULL WHEN CREATING EVENT LOOP");
+    event_set_coarse_clock(loop, coarse);
+
+    loop_time_state state;
+    memset(&state, 0, sizeof(state));
+    event_add_time_event(loop, loop_time_callback, 5, &state);
+
+    pump_for(loop, 50);
+    if (state.num_fired < 2)
+    {
+        printf("fired: %d\n", state.num_fired);
+        error_exit("LOOP TIME NOT FIRED ERROR");
+    }
+
+    event_destroy_loop(loop);
+}
+
 static void* event_thread(void* in)
 {
     hhunused(in);
@@ -294,6 +515,11 @@ int main(int argc, char** argv)
     hhunused(argc);
     hhunused(argv);
 
+    test_edge_triggered();
+    test_tick();
+    test_loop_time(0);
+    test_loop_time(1);
+
     pthread_t thread;
 
     if (pthread_create(&thread, NULL, event_thread, NULL) != 0)
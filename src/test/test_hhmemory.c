@@ -0,0 +1,295 @@
+/* test_hhmemory - Test the hhmemory module
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "../hhmemory.h"
+#include "../util.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_ASSERT(cond)\
+    if (!(cond))\
+    {\
+        printf("FAIL: %s, line %d\n", #cond, __LINE__);\
+        exit(EXIT_FAILURE);\
+    }
+
+static size_t g_num_mallocs = 0;
+static size_t g_num_frees = 0;
+
+static void* counting_malloc(size_t size)
+{
+    g_num_mallocs++;
+    return malloc(size);
+}
+
+static void* counting_realloc(void* ptr, size_t size)
+{
+    return realloc(ptr, size);
+}
+
+static void counting_free(void* ptr)
+{
+    g_num_frees++;
+    free(ptr);
+}
+
+/* everything goes through the allocator set, once it has to go anywhere */
+static void test_allocator(void)
+{
+    hhmemory_allocator allocator =
+        { counting_malloc, counting_realloc, counting_free };
+    hhmemory_set_allocator(&allocator);
+
+    char* p = hhmalloc(100);
+    TEST_ASSERT(p != NULL);
+    size_t num_mallocs = g_num_mallocs;
+    TEST_ASSERT(num_mallocs > 0);
+    hhfree(p);
+    TEST_ASSERT(g_num_frees == 1);
+
+    /* a size class block stays with the thread */
+    p = hhmalloc(8000);
+    TEST_ASSERT(g_num_mallocs == num_mallocs + 1);
+    hhfree(p);
+    TEST_ASSERT(g_num_frees == 1);
+    char* again = hhmalloc(8000);
+    TEST_ASSERT(again == p);
+    TEST_ASSERT(g_num_mallocs == num_mallocs + 1);
+    hhfree(again);
+
+    hhmemory_release_thread_cache();
+    TEST_ASSERT(g_num_frees == 2);
+}
+
+/* freed blocks come back for anything else in their size class */
+static void test_classes(void)
+{
+    hhmemory_stats before;
+    hhmemory_get_stats(&before);
+
+    char* a = hhmalloc(5000);
+    char* b = hhmalloc(5100);
+    TEST_ASSERT(a != NULL && b != NULL && a != b);
+    memset(a, 'a', 5000);
+    memset(b, 'b', 5100);
+
+    hhmemory_stats stats;
+    hhmemory_get_stats(&stats);
+    TEST_ASSERT(stats.num_allocs == before.num_allocs + 2);
+    TEST_ASSERT(stats.num_cache_misses == before.num_cache_misses + 2);
+    TEST_ASSERT(stats.bytes_in_use == before.bytes_in_use + 2 * 5120);
+
+    /* the last one freed is the first one out, it's the warmest */
+    hhfree(a);
+    hhfree(b);
+    hhmemory_get_stats(&stats);
+    TEST_ASSERT(stats.bytes_cached == before.bytes_cached + 2 * 5120);
+    TEST_ASSERT(stats.bytes_in_use == before.bytes_in_use);
+
+    char* c = hhmalloc(4097);
+    char* d = hhmalloc(5120);
+    TEST_ASSERT(c == b);
+    TEST_ASSERT(d == a);
+    hhmemory_get_stats(&stats);
+    TEST_ASSERT(stats.num_cache_hits == before.num_cache_hits + 2);
+    TEST_ASSERT(stats.bytes_cached == before.bytes_cached);
+
+    /* the next class up is somewhere else */
+    char* e = hhmalloc(5121);
+    TEST_ASSERT(e != a && e != b);
+
+    /* calloc'd blocks are zeroed even when they come from the cache */
+    hhfree(d);
+    int* zeroed = hhcalloc(1280, sizeof(int));
+    TEST_ASSERT(zeroed == (int*)d);
+    for (size_t i = 0; i < 1280; i++) TEST_ASSERT(zeroed[i] == 0);
+
+    hhfree(c);
+    hhfree(e);
+    hhfree(zeroed);
+}
+
+/* blocks only move when they're too small or mostly empty */
+static void test_realloc(void)
+{
+    hhmemory_stats before;
+    hhmemory_get_stats(&before);
+
+    char* p = hhmalloc(10000);
+    for (size_t i = 0; i < 10000; i++) p[i] = (char)i;
+
+    TEST_ASSERT(hhrealloc(p, 10240) == p);
+    TEST_ASSERT(hhrealloc(p, 6000) == p);
+
+    hhmemory_stats stats;
+    hhmemory_get_stats(&stats);
+    TEST_ASSERT(stats.num_reallocs == before.num_reallocs + 2);
+    TEST_ASSERT(stats.num_reallocs_in_place ==
+                before.num_reallocs_in_place + 2);
+
+    char* bigger = hhrealloc(p, 20000);
+    TEST_ASSERT(bigger != p);
+    for (size_t i = 0; i < 6000; i++) TEST_ASSERT(bigger[i] == (char)i);
+
+    /* trimmed back down it goes in a smaller block, the one it just left */
+    char* smaller = hhrealloc(bigger, 9000);
+    TEST_ASSERT(smaller == p);
+    for (size_t i = 0; i < 9000; i++) TEST_ASSERT(smaller[i] == (char)i);
+
+    /* small and huge ones are left to the allocator underneath */
+    char* small = hhrealloc(smaller, 100);
+    TEST_ASSERT(small != NULL);
+    small = hhrealloc(small, 200);
+    for (size_t i = 0; i < 100; i++) TEST_ASSERT(small[i] == (char)i);
+
+    char* huge = hhrealloc(small, 2 * 1024 * 1024);
+    TEST_ASSERT(huge != NULL);
+    huge = hhrealloc(huge, 3 * 1024 * 1024);
+    for (size_t i = 0; i < 100; i++) TEST_ASSERT(huge[i] == (char)i);
+
+    hhmemory_get_stats(&stats);
+    TEST_ASSERT(stats.bytes_in_use == before.bytes_in_use + 3 * 1024 * 1024);
+    hhfree(huge);
+    hhmemory_get_stats(&stats);
+    TEST_ASSERT(stats.bytes_in_use == before.bytes_in_use);
+
+    p = hhrealloc(NULL, 100);
+    TEST_ASSERT(p != NULL);
+    hhfree(p);
+}
+
+/* sizes with no room left for the header fail, and leave the old block */
+static void test_overflow(void)
+{
+    size_t max = (size_t)-1;
+    TEST_ASSERT(hhmalloc(max) == NULL);
+    TEST_ASSERT(hhmalloc(max - 1) == NULL);
+    TEST_ASSERT(hhcalloc(1, max) == NULL);
+    TEST_ASSERT(hhrealloc(NULL, max) == NULL);
+
+    /* one with a size class, and one left to the allocator underneath */
+    size_t sizes[2] = { 100, 2 * 1024 * 1024 };
+    for (size_t i = 0; i < hhcountof(sizes); i++)
+    {
+        char* p = hhmalloc(sizes[i]);
+        TEST_ASSERT(p != NULL);
+        memset(p, 'x', sizes[i]);
+
+        TEST_ASSERT(hhrealloc(p, max) == NULL);
+        TEST_ASSERT(hhrealloc(p, max - 1) == NULL);
+        TEST_ASSERT(p[0] == 'x' && p[sizes[i] - 1] == 'x');
+        hhfree(p);
+    }
+}
+
+/* caches only hold so much */
+static void test_limits(void)
+{
+    hhmemory_release_thread_cache();
+
+    char* bufs[20];
+    for (size_t i = 0; i < hhcountof(bufs); i++)
+    {
+        bufs[i] = hhmalloc(64 * 1024);
+    }
+    for (size_t i = 0; i < hhcountof(bufs); i++)
+    {
+        hhfree(bufs[i]);
+    }
+
+    /* no more than 1 MB of any one class */
+    hhmemory_stats stats;
+    hhmemory_get_stats(&stats);
+    TEST_ASSERT(stats.bytes_cached == 16 * 64 * 1024);
+    hhmemory_release_thread_cache();
+
+    size_t num_frees = g_num_frees;
+    hhmemory_set_thread_cache_limit(0);
+    hhfree(hhmalloc(64 * 1024));
+    TEST_ASSERT(g_num_frees == num_frees + 1);
+    hhmemory_get_stats(&stats);
+    TEST_ASSERT(stats.bytes_cached == 0);
+
+    hhmemory_set_thread_cache_limit(8 * 1024 * 1024);
+}
+
+static void* thread_main(void* arg)
+{
+    char** bufs = arg;
+    bufs[0] = hhmalloc(16 * 1024);
+    bufs[1] = hhmalloc(16 * 1024);
+
+    char* cached = hhmalloc(16 * 1024);
+    hhfree(cached);
+    return NULL;
+}
+
+/* threads keep their own caches, and give them back when they exit */
+static void test_threads(void)
+{
+    hhmemory_stats before;
+    hhmemory_get_stats(&before);
+
+    char* bufs[2];
+    pthread_t thread;
+    TEST_ASSERT(pthread_create(&thread, NULL, thread_main, bufs) == 0);
+    TEST_ASSERT(pthread_join(thread, NULL) == 0);
+
+    hhmemory_stats stats;
+    hhmemory_get_stats(&stats);
+    TEST_ASSERT(stats.num_allocs == before.num_allocs + 3);
+    TEST_ASSERT(stats.bytes_in_use == before.bytes_in_use + 2 * 16 * 1024);
+    TEST_ASSERT(stats.bytes_cached == before.bytes_cached);
+
+    /* freed here, they're cached here */
+    hhfree(bufs[0]);
+    hhfree(bufs[1]);
+    hhmemory_get_stats(&stats);
+    TEST_ASSERT(stats.bytes_in_use == before.bytes_in_use);
+    TEST_ASSERT(stats.bytes_cached == before.bytes_cached + 2 * 16 * 1024);
+}
+
+int main(int argc, char** argv)
+{
+    hhunused(argc);
+    hhunused(argv);
+
+    /* before anything else allocates */
+    test_allocator();
+    test_classes();
+    test_realloc();
+    test_overflow();
+    test_limits();
+    test_threads();
+
+    exit(EXIT_SUCCESS);
+}
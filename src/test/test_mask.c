@@ -0,0 +1,175 @@
+/* test_mask - test mask module
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "../mask.h"
+#include "../util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_TEST_LEN 300
+#define MAX_TEST_OFFSET 33
+#define MAX_MOVE_DISTANCE 40
+
+static const char g_key[4] = { (char)0x37, (char)0xfa, (char)0x21, (char)0x3d };
+
+static void fill_pattern(char* buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        buf[i] = (char)((i * 31 + 7) & 0xff);
+    }
+}
+
+static void test_failed_exit(const char* impl, const char* test, size_t len,
+                             size_t offset, int64_t mask_index)
+{
+    printf("%s %s failed: len %zu, offset %zu, mask_index %d\n", impl, test,
+           len, offset, (int)mask_index);
+    exit(1);
+}
+
+/* mask in place at every alignment and key position */
+static void test_in_place(mask_impl impl)
+{
+    static char expected[MAX_TEST_LEN + MAX_TEST_OFFSET];
+    static char actual[MAX_TEST_LEN + MAX_TEST_OFFSET];
+    mask_func* reference = mask_get_impl(MASK_IMPL_BYTE);
+    mask_func* func = mask_get_impl(impl);
+
+    for (size_t len = 0; len < MAX_TEST_LEN; len++)
+    {
+        for (size_t offset = 0; offset < MAX_TEST_OFFSET; offset++)
+        {
+            for (int64_t index = 0; index < 8; index++)
+            {
+                fill_pattern(expected, sizeof(expected));
+                fill_pattern(actual, sizeof(actual));
+
+                reference(&expected[offset], &expected[offset], len, g_key,
+                          index);
+                func(&actual[offset], &actual[offset], len, g_key, index);
+
+                if (memcmp(expected, actual, sizeof(actual)) != 0)
+                {
+                    test_failed_exit(mask_impl_name(impl), "in place", len,
+                                     offset, index);
+                }
+            }
+        }
+    }
+}
+
+/* mask while moving data towards the front of the same buffer */
+static void test_move(mask_impl impl)
+{
+    static char expected[MAX_TEST_LEN + MAX_TEST_OFFSET + MAX_MOVE_DISTANCE];
+    static char actual[MAX_TEST_LEN + MAX_TEST_OFFSET + MAX_MOVE_DISTANCE];
+    mask_func* reference = mask_get_impl(MASK_IMPL_BYTE);
+    mask_func* func = mask_get_impl(impl);
+
+    for (size_t len = 0; len < MAX_TEST_LEN; len += 7)
+    {
+        for (size_t offset = 0; offset < MAX_TEST_OFFSET; offset++)
+        {
+            for (size_t dist = 1; dist < MAX_MOVE_DISTANCE; dist++)
+            {
+                int64_t index = (int64_t)(dist % 4);
+                fill_pattern(expected, sizeof(expected));
+                fill_pattern(actual, sizeof(actual));
+
+                reference(&expected[offset], &expected[offset + dist], len,
+                          g_key, index);
+                func(&actual[offset], &actual[offset + dist], len, g_key,
+                     index);
+
+                if (memcmp(expected, actual, sizeof(actual)) != 0)
+                {
+                    test_failed_exit(mask_impl_name(impl), "move", len,
+                                     offset, index);
+                }
+            }
+        }
+    }
+}
+
+/* masking is its own inverse, and mask_apply has to agree with the rest */
+static void test_round_trip(void)
+{
+    char orig[MAX_TEST_LEN];
+    char buf[MAX_TEST_LEN];
+    char expected[MAX_TEST_LEN];
+    fill_pattern(orig, sizeof(orig));
+    memcpy(buf, orig, sizeof(buf));
+    memcpy(expected, orig, sizeof(expected));
+
+    mask_func* reference = mask_get_impl(MASK_IMPL_BYTE);
+    reference(expected, expected, sizeof(expected), g_key, 3);
+
+    mask_apply(buf, buf, sizeof(buf), g_key, 3);
+    if (memcmp(buf, expected, sizeof(buf)) != 0)
+    {
+        test_failed_exit("mask_apply", "mask", sizeof(buf), 0, 3);
+    }
+
+    mask_apply(buf, buf, sizeof(buf), g_key, 3);
+    if (memcmp(buf, orig, sizeof(buf)) != 0)
+    {
+        test_failed_exit("mask_apply", "unmask", sizeof(buf), 0, 3);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    hhunused(argc);
+    hhunused(argv);
+
+    if (mask_get_impl(MASK_IMPL_BEST) == NULL)
+    {
+        printf("no best mask implementation\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < MASK_NUMBER_OF_IMPLS; i++)
+    {
+        mask_impl impl = (mask_impl)i;
+
+        /* skip things this cpu can't run */
+        if (mask_get_impl(impl) == NULL) continue;
+
+        test_in_place(impl);
+        test_move(impl);
+    }
+
+    test_round_trip();
+
+    exit(0);
+}
@@ -0,0 +1,181 @@
+/* test_payload - test the payload kernels against masking and validating a byte at a time
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "../payload.h"
+#include "../utf8.h"
+#include "../util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_TEST_LEN 600
+#define MAX_MOVE_DISTANCE 5
+#define NUM_TEXTS 4
+
+static const char g_key[4] = { (char)0x37, (char)0xfa, (char)0x21, (char)0x3d };
+
+static const char* g_pieces[] =
+{
+    "hello world ",
+    "J\xc3\xbcrgen ",
+    "\xe6\x97\xa5\xe6\x9c\xac ",
+    "\xf0\x9f\x98\x80",
+};
+
+static void test_failed_exit(int flags, const char* test, size_t len,
+                             size_t split, size_t text)
+{
+    printf("kernel %d %s failed: len %zu, split %zu, text %zu\n", flags, test,
+           len, split, text);
+    exit(1);
+}
+
+/*
+ * text number t: valid UTF-8, or for odd t the same with a surrogate
+ * stuck in the middle
+ */
+static void fill_text(char* buf, size_t len, size_t t)
+{
+    size_t i = 0;
+    for (size_t p = t; i < len; p++)
+    {
+        const char* piece = g_pieces[p % hhcountof(g_pieces)];
+        size_t n = hhmin(strlen(piece), len - i);
+        memcpy(&buf[i], piece, n);
+        i += n;
+    }
+
+    if ((t & 1) && len >= 3)
+    {
+        memcpy(&buf[len / 2], "\xed\xa0\x80", 3);
+    }
+}
+
+/* what the kernel for flags should leave in buf and state */
+static void reference(int flags, char* buf, size_t dest, size_t src,
+                      size_t len, int64_t mask_index, uint32_t* state,
+                      uint32_t* codepoint)
+{
+    char key[4];
+    memcpy(key, g_key, sizeof(key));
+    for (size_t i = 0; i < len; i++)
+    {
+        char c = buf[src + i];
+        if (flags & PAYLOAD_UNMASK)
+        {
+            c ^= key[(size_t)(mask_index + (int64_t)i) & 3];
+        }
+        if (flags & PAYLOAD_MOVE) buf[dest + i] = c;
+        else buf[src + i] = c;
+
+        if (flags & PAYLOAD_VALIDATE)
+        {
+            utf8_validate(state, codepoint, &c, 1);
+        }
+    }
+}
+
+/*
+ * run kernel over buf in two calls split at split, like a frame that
+ * arrives in two reads, and compare against the reference
+ */
+static void check(int flags, size_t len, size_t split, size_t text)
+{
+    static char expected[MAX_TEST_LEN + MAX_MOVE_DISTANCE];
+    static char actual[MAX_TEST_LEN + MAX_MOVE_DISTANCE];
+    payload_kernel* kernel = payload_get_kernel(flags);
+
+    size_t dest = 0;
+    size_t src = (flags & PAYLOAD_MOVE) ? 1 + (len % MAX_MOVE_DISTANCE) : 0;
+
+    /* the payload on the wire is the text masked */
+    memset(expected, 'x', sizeof(expected));
+    fill_text(&expected[src], len, text);
+    if (flags & PAYLOAD_UNMASK)
+    {
+        for (size_t i = 0; i < len; i++)
+        {
+            expected[src + i] ^= g_key[i & 3];
+        }
+    }
+    memcpy(actual, expected, sizeof(actual));
+
+    uint32_t expected_state = UTF8_ACCEPT, expected_codepoint = 0;
+    uint32_t actual_state = UTF8_ACCEPT, actual_codepoint = 0;
+    reference(flags, expected, dest, src, len, 0, &expected_state,
+              &expected_codepoint);
+
+    kernel(&actual[dest], &actual[src], split, g_key, 0, &actual_state,
+           &actual_codepoint);
+    kernel(&actual[dest + split], &actual[src + split], len - split, g_key,
+           (int64_t)split, &actual_state, &actual_codepoint);
+
+    /* bytes past the payload are left over from the move, don't care */
+    if (memcmp(expected, actual, dest + len) != 0)
+    {
+        test_failed_exit(flags, "data", len, split, text);
+    }
+
+    if ((flags & PAYLOAD_VALIDATE) &&
+        (expected_state == UTF8_REJECT) != (actual_state == UTF8_REJECT))
+    {
+        test_failed_exit(flags, "reject", len, split, text);
+    }
+
+    if ((flags & PAYLOAD_VALIDATE) && expected_state != UTF8_REJECT &&
+        expected_state != actual_state)
+    {
+        test_failed_exit(flags, "state", len, split, text);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    hhunused(argc);
+    hhunused(argv);
+
+    for (int flags = 0; flags < PAYLOAD_NUMBER_OF_KERNELS; flags++)
+    {
+        for (size_t len = 0; len < MAX_TEST_LEN; len += 13)
+        {
+            for (size_t text = 0; text < NUM_TEXTS; text++)
+            {
+                for (size_t split = 0; split <= len; split += 1 + len / 40)
+                {
+                    check(flags, len, split, text);
+                }
+                check(flags, len, len, text);
+            }
+        }
+    }
+
+    exit(0);
+}
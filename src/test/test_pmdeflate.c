@@ -0,0 +1,589 @@
+/* test_pmdeflate - test permessage-deflate negotiation and compression
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "../darray.h"
+#include "../pmdeflate.h"
+#include "../protocol.h"
+#include "../util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_MESSAGES 200
+
+static void test_failed_exit(const char* test, const char* detail)
+{
+    printf("%s failed: %s\n", test, detail);
+    exit(1);
+}
+
+static void init_deflate_settings(pmdeflate_settings* settings)
+{
+    settings->enabled = true;
+    settings->level = 6;
+    settings->max_window_bits = 15;
+    settings->no_context_takeover = false;
+    settings->peer_no_context_takeover = false;
+    settings->max_mem = -1;
+}
+
+static uint32_t test_random(protocol_conn* conn)
+{
+    hhunused(conn);
+    return (uint32_t)rand();
+}
+
+/* a chat-like json message, similar from one message to the next */
+static size_t make_json(char* buf, size_t len, int i)
+{
+    int n = snprintf(buf, len,
+        "{\"type\":\"message\",\"room\":\"general\",\"user\":\"user%d\","
+        "\"timestamp\":%d,\"text\":\"message number %d from the test\"}",
+        i % 7, 1400000000 + i, i);
+    return (size_t)n;
+}
+
+static void expect_offer(const char* offer, const pmdeflate_settings* settings,
+                         const char* expected_response)
+{
+    pmdeflate_params params;
+    bool accepted = pmdeflate_accept_offer(offer, settings, &params);
+    if (expected_response == NULL)
+    {
+        if (accepted) test_failed_exit("declined offer", offer);
+        return;
+    }
+
+    if (!accepted) test_failed_exit("accepted offer", offer);
+
+    char response[PMDEFLATE_MAX_PARAMS_LEN];
+    pmdeflate_write_params(&params, true, response, sizeof(response));
+    if (strcmp(response, expected_response) != 0)
+    {
+        printf("offer: %s\nexpected: %s\ngot: %s\n", offer,
+               expected_response, response);
+        test_failed_exit("response", offer);
+    }
+}
+
+static void test_accept_offer(void)
+{
+    pmdeflate_settings settings;
+    init_deflate_settings(&settings);
+
+    expect_offer("permessage-deflate", &settings, "permessage-deflate");
+    expect_offer("Permessage-Deflate ; client_max_window_bits", &settings,
+                 "permessage-deflate");
+    expect_offer("permessage-deflate; server_no_context_takeover; "
+                 "client_no_context_takeover", &settings,
+                 "permessage-deflate; server_no_context_takeover; "
+                 "client_no_context_takeover");
+    expect_offer("permessage-deflate; server_max_window_bits=\"10\"",
+                 &settings,
+                 "permessage-deflate; server_max_window_bits=10");
+
+    /* the client's window is only lowered when it says we can */
+    settings.max_window_bits = 12;
+    expect_offer("permessage-deflate", &settings,
+                 "permessage-deflate; server_max_window_bits=12");
+    expect_offer("permessage-deflate; client_max_window_bits; "
+                 "server_max_window_bits=10", &settings,
+                 "permessage-deflate; server_max_window_bits=10; "
+                 "client_max_window_bits=12");
+    expect_offer("permessage-deflate; client_max_window_bits=9", &settings,
+                 "permessage-deflate; server_max_window_bits=12; "
+                 "client_max_window_bits=9");
+
+    /* our own settings end up in the response too */
+    init_deflate_settings(&settings);
+    settings.no_context_takeover = true;
+    settings.peer_no_context_takeover = true;
+    expect_offer("permessage-deflate", &settings,
+                 "permessage-deflate; server_no_context_takeover; "
+                 "client_no_context_takeover");
+
+    /* offers that have to be declined */
+    init_deflate_settings(&settings);
+    expect_offer("x-webkit-deflate-frame", &settings, NULL);
+    expect_offer("permessage-deflatex", &settings, NULL);
+    expect_offer("permessage-deflate; server_max_window_bits", &settings,
+                 NULL);
+    expect_offer("permessage-deflate; server_max_window_bits=16", &settings,
+                 NULL);
+    expect_offer("permessage-deflate; server_max_window_bits=7", &settings,
+                 NULL);
+    expect_offer("permessage-deflate; client_max_window_bits=100",
+                 &settings, NULL);
+    expect_offer("permessage-deflate; server_no_context_takeover=1",
+                 &settings, NULL);
+    expect_offer("permessage-deflate; client_no_context_takeover; "
+                 "client_no_context_takeover", &settings, NULL);
+    expect_offer("permessage-deflate; unknown_param", &settings, NULL);
+    expect_offer("permessage-deflate; server_max_window_bits=\"10",
+                 &settings, NULL);
+
+    /* zlib can't compress with a 256 byte window */
+    expect_offer("permessage-deflate; server_max_window_bits=8", &settings,
+                 NULL);
+}
+
+static void test_max_mem(void)
+{
+    pmdeflate_settings settings;
+    init_deflate_settings(&settings);
+    pmdeflate_params params;
+
+    /* windows and hash tables shrink to fit */
+    settings.max_mem = 64 * 1024;
+    if (!pmdeflate_accept_offer("permessage-deflate", &settings, &params))
+    {
+        test_failed_exit("max mem", "64K without client_max_window_bits");
+    }
+    if (params.read_window_bits != 15 || params.write_window_bits >= 15)
+    {
+        test_failed_exit("max mem", "64K windows");
+    }
+
+    /* the client's window can't be shrunk unless it allows it */
+    settings.max_mem = 32 * 1024;
+    if (pmdeflate_accept_offer("permessage-deflate", &settings, &params))
+    {
+        test_failed_exit("max mem", "32K without client_max_window_bits");
+    }
+    if (!pmdeflate_accept_offer("permessage-deflate; client_max_window_bits",
+                                &settings, &params))
+    {
+        test_failed_exit("max mem", "32K with client_max_window_bits");
+    }
+
+    /* whatever was negotiated really fits, while it's being used */
+    pmdeflate* pmd = pmdeflate_create(&params, settings.level,
+                                      settings.max_mem);
+    if (pmd == NULL) test_failed_exit("max mem", "create");
+
+    pmdeflate_params peer_params = params;
+    peer_params.write_window_bits = params.read_window_bits;
+    peer_params.read_window_bits = params.write_window_bits;
+    pmdeflate* peer = pmdeflate_create(&peer_params, settings.level, -1);
+
+    char msg[256];
+    for (int i = 0; i < NUM_MESSAGES; i++)
+    {
+        size_t len = make_json(msg, sizeof(msg), i);
+        const char* compressed;
+        size_t compressed_len;
+        char* inflated;
+        size_t inflated_len;
+
+        pmdeflate_compress(pmd, msg, len, &compressed, &compressed_len);
+        pmdeflate_compress(peer, msg, len, &compressed, &compressed_len);
+        if (pmdeflate_decompress(pmd, compressed, compressed_len, -1,
+                                 &inflated, &inflated_len)
+                != PMDEFLATE_SUCCESS)
+        {
+            test_failed_exit("max mem", "decompress");
+        }
+    }
+
+    if (pmdeflate_get_mem_used(pmd) > (size_t)settings.max_mem)
+    {
+        test_failed_exit("max mem", "went over");
+    }
+
+    pmdeflate_destroy(peer);
+    pmdeflate_destroy(pmd);
+
+    /* and creating with less than that fails outright */
+    if (pmdeflate_create(&params, settings.level, 4 * 1024) != NULL)
+    {
+        test_failed_exit("max mem", "create under cap");
+    }
+
+    settings.max_mem = 16 * 1024;
+    if (pmdeflate_make_offer(&settings, &params))
+    {
+        test_failed_exit("max mem", "16K offer");
+    }
+}
+
+static bool confirm(const char* response, const pmdeflate_settings* settings,
+                    pmdeflate_params* params)
+{
+    pmdeflate_params offered;
+    if (!pmdeflate_make_offer(settings, &offered))
+    {
+        test_failed_exit("confirm", "make offer");
+    }
+    return pmdeflate_confirm_response(response, &offered, params);
+}
+
+static void test_confirm_response(void)
+{
+    pmdeflate_settings settings;
+    init_deflate_settings(&settings);
+    settings.max_window_bits = 12;
+    pmdeflate_params params;
+
+    pmdeflate_params offered;
+    pmdeflate_make_offer(&settings, &offered);
+    char offer[PMDEFLATE_MAX_PARAMS_LEN];
+    pmdeflate_write_params(&offered, false, offer, sizeof(offer));
+    if (strcmp(offer, "permessage-deflate; client_max_window_bits=12; "
+                      "server_max_window_bits=12") != 0)
+    {
+        test_failed_exit("offer", offer);
+    }
+
+    if (!confirm("permessage-deflate; server_max_window_bits=10; "
+                 "client_max_window_bits=9", &settings, &params) ||
+        params.read_window_bits != 10 || params.write_window_bits != 9)
+    {
+        test_failed_exit("confirm", "lowered windows");
+    }
+
+    if (!confirm("permessage-deflate; server_max_window_bits=12; "
+                 "client_no_context_takeover", &settings, &params) ||
+        !params.write_no_context_takeover || params.read_no_context_takeover)
+    {
+        test_failed_exit("confirm", "client_no_context_takeover");
+    }
+
+    /* the server can't ignore or go over limits we asked for */
+    if (confirm("permessage-deflate", &settings, &params))
+    {
+        test_failed_exit("confirm", "missing server_max_window_bits");
+    }
+    if (confirm("permessage-deflate; server_max_window_bits=13", &settings,
+                &params))
+    {
+        test_failed_exit("confirm", "server window too big");
+    }
+    if (confirm("permessage-deflate; server_max_window_bits=12; "
+                "client_max_window_bits=13", &settings, &params))
+    {
+        test_failed_exit("confirm", "client window too big");
+    }
+    if (confirm("permessage-deflate; server_max_window_bits=12; "
+                "client_max_window_bits", &settings, &params))
+    {
+        test_failed_exit("confirm", "client_max_window_bits without value");
+    }
+
+    settings.peer_no_context_takeover = true;
+    if (confirm("permessage-deflate; server_max_window_bits=12", &settings,
+                &params))
+    {
+        test_failed_exit("confirm", "ignored server_no_context_takeover");
+    }
+}
+
+/* compress with one context and inflate with the other */
+static void round_trip(bool no_context_takeover, int window_bits)
+{
+    pmdeflate_params params;
+    params.write_window_bits = window_bits;
+    params.read_window_bits = window_bits;
+    params.mem_level = 8;
+    params.write_no_context_takeover = no_context_takeover;
+    params.read_no_context_takeover = no_context_takeover;
+
+    pmdeflate* sender = pmdeflate_create(&params, 6, -1);
+    pmdeflate* receiver = pmdeflate_create(&params, 6, -1);
+    if (sender == NULL || receiver == NULL)
+    {
+        test_failed_exit("round trip", "create");
+    }
+
+    size_t total_len = 0;
+    size_t total_compressed = 0;
+    char msg[256];
+    for (int i = 0; i < NUM_MESSAGES; i++)
+    {
+        size_t len = make_json(msg, sizeof(msg), i);
+        const char* compressed;
+        size_t compressed_len;
+        char* inflated;
+        size_t inflated_len;
+
+        if (pmdeflate_compress(sender, msg, len, &compressed,
+                               &compressed_len) != PMDEFLATE_SUCCESS)
+        {
+            test_failed_exit("round trip", "compress");
+        }
+        if (pmdeflate_decompress(receiver, compressed, compressed_len, -1,
+                                 &inflated, &inflated_len)
+                != PMDEFLATE_SUCCESS ||
+            inflated_len != len || memcmp(inflated, msg, len) != 0)
+        {
+            test_failed_exit("round trip", "decompress");
+        }
+
+        total_len += len;
+        total_compressed += compressed_len;
+    }
+
+    /* repetitive messages shrink a lot once the window is shared */
+    if (!no_context_takeover && total_compressed * 3 > total_len)
+    {
+        test_failed_exit("round trip", "context takeover ratio");
+    }
+    if (total_compressed >= total_len)
+    {
+        test_failed_exit("round trip", "ratio");
+    }
+
+    /* a big message that needs more than one pass either way */
+    size_t big_len = 200 * 1024;
+    char* big = malloc(big_len);
+    for (size_t i = 0; i < big_len; i++)
+    {
+        big[i] = (char)((i * 7 + (i >> 9)) & 0x7f);
+    }
+
+    const char* compressed;
+    size_t compressed_len;
+    char* inflated;
+    size_t inflated_len;
+    pmdeflate_compress(sender, big, big_len, &compressed, &compressed_len);
+    if (pmdeflate_decompress(receiver, compressed, compressed_len, -1,
+                             &inflated, &inflated_len) != PMDEFLATE_SUCCESS ||
+        inflated_len != big_len || memcmp(inflated, big, big_len) != 0)
+    {
+        test_failed_exit("round trip", "big message");
+    }
+
+    /* inflating past the limit stops early */
+    pmdeflate_compress(sender, big, big_len, &compressed, &compressed_len);
+    if (pmdeflate_decompress(receiver, compressed, compressed_len, 1024,
+                             &inflated, &inflated_len)
+            != PMDEFLATE_TOO_LARGE)
+    {
+        test_failed_exit("round trip", "max len");
+    }
+
+    free(big);
+    pmdeflate_destroy(sender);
+    pmdeflate_destroy(receiver);
+}
+
+static void test_bad_data(void)
+{
+    pmdeflate_params params;
+    params.write_window_bits = 15;
+    params.read_window_bits = 15;
+    params.mem_level = 8;
+    params.write_no_context_takeover = false;
+    params.read_no_context_takeover = false;
+
+    pmdeflate* pmd = pmdeflate_create(&params, 6, -1);
+    static const char garbage[] = { (char)0xff, (char)0xff, (char)0xff,
+                                    (char)0xff, 0x12, 0x34 };
+    char* out;
+    size_t out_len;
+    if (pmdeflate_decompress(pmd, garbage, sizeof(garbage), -1, &out,
+                             &out_len) != PMDEFLATE_ERROR)
+    {
+        test_failed_exit("bad data", "garbage inflated");
+    }
+    pmdeflate_destroy(pmd);
+}
+
+static void init_protocol_settings(protocol_settings* settings,
+                                   bool deflate)
+{
+    settings->write_max_frame_size = 64;
+    settings->read_max_msg_size = 64 * 1024;
+    settings->read_max_num_frames = 1024;
+    settings->max_handshake_size = 2048;
+    settings->init_buf_len = 256;
+    settings->rand_func = test_random;
+    init_deflate_settings(&settings->deflate);
+    settings->deflate.enabled = deflate;
+}
+
+/* run a handshake between two protocol_conns, result is the client's */
+static protocol_handshake_result handshake(protocol_conn* client,
+                                           protocol_conn* server)
+{
+    protocol_write_handshake_request(client, "/", "localhost", NULL, NULL,
+                                     NULL);
+    darray_append(&server->info.buffer, darray_get_data(client->write_buffer),
+                  darray_get_len(client->write_buffer));
+    darray_clear(client->write_buffer);
+
+    if (protocol_read_handshake_request(server) != PROTOCOL_HANDSHAKE_SUCCESS ||
+        protocol_write_handshake_response(server, NULL, NULL)
+            != PROTOCOL_HANDSHAKE_SUCCESS)
+    {
+        test_failed_exit("handshake", "server");
+    }
+
+    darray_append(&client->info.buffer, darray_get_data(server->write_buffer),
+                  darray_get_len(server->write_buffer));
+    darray_clear(server->write_buffer);
+
+    return protocol_read_handshake_response(client);
+}
+
+/* move everything from's write buffer to to's read buffer, and read it */
+static protocol_result deliver(protocol_conn* from, protocol_conn* to,
+                               bool to_server, protocol_msg* msg)
+{
+    darray_append(&to->read_buffer, darray_get_data(from->write_buffer),
+                  darray_get_len(from->write_buffer));
+    darray_clear(from->write_buffer);
+
+    size_t pos = 0;
+    protocol_result r;
+    do
+    {
+        r = to_server ? protocol_read_client_msg(to, &pos, msg)
+                      : protocol_read_server_msg(to, &pos, msg);
+    } while (r == PROTOCOL_RESULT_FRAME_FINISHED);
+
+    return r;
+}
+
+static void test_protocol_conns(void)
+{
+    protocol_settings client_settings;
+    protocol_settings server_settings;
+    init_protocol_settings(&client_settings, true);
+    init_protocol_settings(&server_settings, true);
+
+    protocol_conn* client = protocol_create_conn(&client_settings, NULL);
+    protocol_conn* server = protocol_create_conn(&server_settings, NULL);
+    if (handshake(client, server) != PROTOCOL_HANDSHAKE_SUCCESS ||
+        client->deflate == NULL || server->deflate == NULL)
+    {
+        test_failed_exit("protocol", "negotiate");
+    }
+
+    char text[256];
+    for (int i = 0; i < 10; i++)
+    {
+        protocol_msg msg;
+        protocol_msg read;
+        msg.type = PROTOCOL_MSG_TEXT;
+        msg.data = text;
+        msg.msg_len = (int64_t)make_json(text, sizeof(text), i);
+
+        /* client to server, spread over several frames */
+        protocol_write_client_msg(client, &msg);
+        char first = *(char*)darray_get_data(client->write_buffer);
+        if ((first & 0x40) == 0)
+        {
+            test_failed_exit("protocol", "RSV1 not set");
+        }
+        if (deliver(client, server, true, &read)
+                != PROTOCOL_RESULT_MESSAGE_FINISHED ||
+            read.type != PROTOCOL_MSG_TEXT ||
+            read.msg_len != msg.msg_len ||
+            memcmp(read.data, text, (size_t)msg.msg_len) != 0)
+        {
+            test_failed_exit("protocol", "client to server");
+        }
+        darray_clear(server->read_buffer);
+
+        /* and back */
+        protocol_write_server_msg(server, &msg);
+        if (deliver(server, client, false, &read)
+                != PROTOCOL_RESULT_MESSAGE_FINISHED ||
+            read.msg_len != msg.msg_len ||
+            memcmp(read.data, text, (size_t)msg.msg_len) != 0)
+        {
+            test_failed_exit("protocol", "server to client");
+        }
+        darray_clear(client->read_buffer);
+    }
+
+    /* short messages and control frames go out as they are */
+    protocol_msg msg;
+    protocol_msg read;
+    msg.type = PROTOCOL_MSG_PING;
+    msg.data = text;
+    msg.msg_len = 50;
+    protocol_write_server_msg(server, &msg);
+    char first = *(char*)darray_get_data(server->write_buffer);
+    if ((first & 0x40) != 0 ||
+        deliver(server, client, false, &read)
+            != PROTOCOL_RESULT_MESSAGE_FINISHED)
+    {
+        test_failed_exit("protocol", "ping");
+    }
+    darray_clear(client->read_buffer);
+
+    /* a compressed control frame is a protocol error */
+    protocol_write_server_msg(server, &msg);
+    *(char*)darray_get_data(server->write_buffer) |= 0x40;
+    if (deliver(server, client, false, &read) != PROTOCOL_RESULT_FAIL)
+    {
+        test_failed_exit("protocol", "compressed ping");
+    }
+
+    /* without the extension, RSV1 is still rejected */
+    protocol_reset_conn(client);
+    protocol_reset_conn(server);
+    server_settings.deflate.enabled = false;
+    if (handshake(client, server) != PROTOCOL_HANDSHAKE_SUCCESS ||
+        client->deflate != NULL || server->deflate != NULL)
+    {
+        test_failed_exit("protocol", "not negotiated");
+    }
+    msg.type = PROTOCOL_MSG_TEXT;
+    msg.msg_len = (int64_t)make_json(text, sizeof(text), 0);
+    protocol_write_client_msg(client, &msg);
+    *(char*)darray_get_data(client->write_buffer) |= 0x40;
+    if (deliver(client, server, true, &read) != PROTOCOL_RESULT_FAIL)
+    {
+        test_failed_exit("protocol", "RSV1 without extension");
+    }
+
+    protocol_destroy_conn(client);
+    protocol_destroy_conn(server);
+}
+
+int main(int argc, char** argv)
+{
+    hhunused(argc);
+    hhunused(argv);
+
+    test_accept_offer();
+    test_max_mem();
+    test_confirm_response();
+    round_trip(false, 15);
+    round_trip(true, 15);
+    round_trip(false, 9);
+    test_bad_data();
+    test_protocol_conns();
+
+    return 0;
+}
@@ -199,6 +199,40 @@ static void compare_headers(protocol_conn* conn, const char* test)
             }
         }
     }
+
+    /* looking headers up by index has to agree with looking them up by name */
+    for (unsigned i = 0; i < protocol_get_num_headers(conn); i++)
+    {
+        const char* name = protocol_get_header_name(conn, i);
+        unsigned num_values = protocol_get_num_header_values_at(conn, i);
+        if (num_values != protocol_get_num_header_values(conn, name))
+        {
+            printf("%s: VALUE COUNTS DON'T MATCH: %s\n", test, name);
+            exit(1);
+        }
+
+        for (unsigned j = 0; j < num_values; j++)
+        {
+            if (protocol_get_header_value_at(conn, i, j) !=
+                protocol_get_header_value(conn, name, j))
+            {
+                printf("%s: VALUES DON'T MATCH: %s, %u\n", test, name, j);
+                exit(1);
+            }
+        }
+    }
+
+    /* header names are case insensitive, known or not */
+    const char* key = protocol_get_header_value(conn, "sec-websocket-key", 0);
+    const char* origin = protocol_get_header_value(conn, "ORIGIN", 0);
+    if (key == NULL || strcmp(key, "dGhlIHNhbXBsZSBub25jZQ==") != 0 ||
+        origin == NULL || strcmp(origin, "http://example.com") != 0 ||
+        protocol_get_header_value(conn, "X-Not-Sent", 0) != NULL ||
+        protocol_get_num_header_values(conn, "Sec-WebSocket-Accept") != 0)
+    {
+        printf("%s: CASE INSENSITIVE LOOKUP FAILED\n", test);
+        exit(1);
+    }
 }
 
 static void test_frame_write(
@@ -297,6 +331,7 @@ int main(int argc, char** argv)
     settings.max_handshake_size = 2048;
     settings.init_buf_len = 20;
     settings.rand_func = test_random;
+    settings.deflate.enabled = false;
     protocol_conn* conn =
         protocol_create_conn(&settings, NULL);
     darray_append(&conn->info.buffer, buffer, num_written);
@@ -545,5 +580,30 @@ int main(int argc, char** argv)
 
     protocol_destroy_conn(conn);
 
+    /* the request trickling in a byte at a time */
+    conn = protocol_create_conn(&settings, NULL);
+    for (int i = 0; i < num_written; i++)
+    {
+        char* read_buf = protocol_prepare_read(conn, 1);
+        *read_buf = buffer[i];
+        protocol_update_read(conn, 1);
+
+        hr = protocol_read_handshake_request(conn);
+        if (i + 1 < num_written && hr != PROTOCOL_HANDSHAKE_CONTINUE)
+        {
+            printf("TRICKLE HANDSHAKE: FAIL AT %d, RETURN: %d\n", i, hr);
+            exit(1);
+        }
+    }
+
+    if (hr != PROTOCOL_HANDSHAKE_SUCCESS)
+    {
+        printf("TRICKLE HANDSHAKE: FAIL, RETURN: %d\n", hr);
+        exit(1);
+    }
+
+    compare_headers(conn, "TEST TRICKLE HANDSHAKE");
+    protocol_destroy_conn(conn);
+
     exit(0);
 }
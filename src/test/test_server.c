@@ -0,0 +1,395 @@
+/* test_server - test the server write path over a real socket
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "../config.h"
+#include "../server.h"
+#include "../util.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MSG_LEN 16384
+
+/* messages on_open manages to queue before going over the high watermark */
+#define NUM_FIT 3
+
+/* on_open sends this many, the rest go over the high watermark */
+#define NUM_SENT (NUM_FIT + 2)
+
+#define TIMEOUT_MS 5000
+
+typedef struct
+{
+    server* serv;
+    server_result results[NUM_SENT];
+    int num_drained;
+    bool closed;
+} test_server;
+
+typedef struct
+{
+    int num_messages;
+    bool drained;
+} test_client;
+
+static char g_payload[MSG_LEN];
+
+static void test_failed_exit(const char* test, const char* what)
+{
+    printf("%s failed: %s\n", test, what);
+    exit(1);
+}
+
+static uint32_t random_callback(protocol_conn* conn)
+{
+    hhunused(conn);
+    return (uint32_t)random();
+}
+
+static void init_settings(endpoint_settings* settings)
+{
+    protocol_settings* conn_settings = &settings->conn_settings;
+    conn_settings->write_max_frame_size = -1;
+    conn_settings->read_max_msg_size = 64 * 1024;
+    conn_settings->read_max_num_frames = 1024;
+    conn_settings->max_handshake_size = 2048;
+    conn_settings->init_buf_len = 4096;
+    conn_settings->rand_func = random_callback;
+    conn_settings->deflate.enabled = false;
+}
+
+/* a port nothing is listening on, the server doesn't set SO_REUSEADDR */
+static int get_free_port(void)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s == -1 || bind(s, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+        getsockname(s, (struct sockaddr*)&addr, &len) == -1)
+    {
+        test_failed_exit("get_free_port", strerror(errno));
+    }
+
+    close(s);
+    return ntohs(addr.sin_port);
+}
+
+/* queue everything in one go, so nothing is written in between */
+static void on_open(server_conn* conn, void* userdata)
+{
+    test_server* state = userdata;
+
+    endpoint_msg msg;
+    msg.is_text = false;
+    msg.data = g_payload;
+    msg.msg_len = MSG_LEN;
+    for (int i = 0; i < NUM_SENT; i++)
+    {
+        state->results[i] = server_conn_send_msg(conn, &msg);
+    }
+}
+
+static void on_drain(server_conn* conn, void* userdata)
+{
+    test_server* state = userdata;
+    state->num_drained++;
+
+    static char drained[] = "drained";
+    endpoint_msg msg;
+    msg.is_text = true;
+    msg.data = drained;
+    msg.msg_len = (int64_t)strlen(drained);
+    server_conn_send_msg(conn, &msg);
+}
+
+static void on_close(server_conn* conn, int code, const char* reason,
+                     int reason_len, void* userdata)
+{
+    hhunused(conn);
+    hhunused(code);
+    hhunused(reason);
+    hhunused(reason_len);
+
+    test_server* state = userdata;
+    state->closed = true;
+    server_stop(state->serv);
+}
+
+static void on_client_message(endpoint* conn, endpoint_msg* msg,
+                              void* userdata)
+{
+    hhunused(conn);
+
+    test_client* state = userdata;
+    if (msg->is_text)
+    {
+        state->drained = msg->msg_len == (int64_t)strlen("drained") &&
+                         memcmp(msg->data, "drained", strlen("drained")) == 0;
+    }
+    else if (msg->msg_len == MSG_LEN &&
+             memcmp(msg->data, g_payload, MSG_LEN) == 0)
+    {
+        state->num_messages++;
+    }
+}
+
+static void* run_server(void* data)
+{
+    test_server* state = data;
+    server_listen(state->serv);
+    return NULL;
+}
+
+static int connect_client(const char* test, int port)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    /* the server thread may not be listening yet */
+    for (int i = 0; i < TIMEOUT_MS / 10; i++)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1) test_failed_exit(test, strerror(errno));
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0)
+        {
+            return fd;
+        }
+        close(fd);
+
+        struct timespec ts = { 0, 10 * 1000 * 1000 };
+        nanosleep(&ts, NULL);
+    }
+
+    test_failed_exit(test, "couldn't connect");
+    return -1;
+}
+
+/*
+ * run a server with policy on another thread, and a client that reads
+ * everything it's sent until it gets the message sent by on_drain, or the
+ * server drops it
+ */
+static void run_policy(const char* test, config_write_overflow_policy policy,
+                       test_server* server_state, test_client* client_state)
+{
+    config_server_options options;
+    memset(&options, 0, sizeof(options));
+    options.port = get_free_port();
+    options.bindaddr = "127.0.0.1";
+    options.max_clients = 4;
+    options.write_high_watermark = (NUM_FIT - 1) * MSG_LEN + 1024;
+    options.write_low_watermark = 0;
+    options.write_overflow_policy = policy;
+    init_settings(&options.endp_settings);
+
+    server_callbacks callbacks;
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.on_open = on_open;
+    callbacks.on_drain = on_drain;
+    callbacks.on_close = on_close;
+
+    memset(server_state, 0, sizeof(*server_state));
+    memset(client_state, 0, sizeof(*client_state));
+    server_state->serv = server_create(&options, &callbacks, server_state);
+    if (server_state->serv == NULL)
+    {
+        test_failed_exit(test, "server_create failed");
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run_server, server_state) != 0)
+    {
+        test_failed_exit(test, "pthread_create failed");
+    }
+
+    endpoint_settings settings;
+    init_settings(&settings);
+
+    endpoint_callbacks callbacks_client;
+    memset(&callbacks_client, 0, sizeof(callbacks_client));
+    callbacks_client.on_message = on_client_message;
+
+    endpoint client;
+    endpoint_init(&client, ENDPOINT_CLIENT, &settings, &callbacks_client,
+                  client_state);
+
+    int fd = connect_client(test, options.port);
+    endpoint_send_handshake_request(&client, "/", "localhost", NULL, NULL,
+                                    NULL);
+    if (endpoint_write(&client, fd) != ENDPOINT_WRITE_DONE)
+    {
+        test_failed_exit(test, "handshake write failed");
+    }
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
+    {
+        test_failed_exit(test, strerror(errno));
+    }
+
+    while (!client_state->drained)
+    {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, TIMEOUT_MS) != 1)
+        {
+            test_failed_exit(test, "timed out waiting for the server");
+        }
+
+        endpoint_read_result r = endpoint_read(&client, fd);
+        if (r == ENDPOINT_READ_ERROR || r == ENDPOINT_READ_CLOSED) break;
+    }
+
+    /* on_close stops the server */
+    close(fd);
+    pthread_join(thread, NULL);
+    endpoint_deinit(&client);
+    server_destroy(server_state->serv);
+
+    if (!server_state->closed)
+    {
+        test_failed_exit(test, "on_close wasn't called");
+    }
+    for (int i = 0; i < NUM_FIT; i++)
+    {
+        if (server_state->results[i] != SERVER_RESULT_SUCCESS)
+        {
+            test_failed_exit(test, "send under the high watermark failed");
+        }
+    }
+}
+
+/* sends over the high watermark are refused until on_drain */
+static void test_overflow_block(void)
+{
+    test_server server_state;
+    test_client client_state;
+    run_policy("overflow_block", CONFIG_WRITE_OVERFLOW_BLOCK, &server_state,
+               &client_state);
+
+    for (int i = NUM_FIT; i < NUM_SENT; i++)
+    {
+        if (server_state.results[i] != SERVER_RESULT_WOULD_BLOCK)
+        {
+            test_failed_exit("overflow_block", "send wasn't refused");
+        }
+    }
+    if (server_state.num_drained != 1 || !client_state.drained)
+    {
+        test_failed_exit("overflow_block", "on_drain wasn't called once");
+    }
+    if (client_state.num_messages != NUM_FIT)
+    {
+        test_failed_exit("overflow_block", "wrong number of messages");
+    }
+}
+
+/* sends over the high watermark succeed, but never go out */
+static void test_overflow_drop(void)
+{
+    test_server server_state;
+    test_client client_state;
+    run_policy("overflow_drop", CONFIG_WRITE_OVERFLOW_DROP, &server_state,
+               &client_state);
+
+    for (int i = NUM_FIT; i < NUM_SENT; i++)
+    {
+        if (server_state.results[i] != SERVER_RESULT_SUCCESS)
+        {
+            test_failed_exit("overflow_drop", "dropped send failed");
+        }
+    }
+    if (server_state.num_drained != 1 || !client_state.drained)
+    {
+        test_failed_exit("overflow_drop", "on_drain wasn't called once");
+    }
+    if (client_state.num_messages != NUM_FIT)
+    {
+        test_failed_exit("overflow_drop", "dropped messages were sent");
+    }
+}
+
+/*
+ * the connection is dropped as soon as a send goes over the high watermark,
+ * without any timeouts set
+ */
+static void test_overflow_close(void)
+{
+    test_server server_state;
+    test_client client_state;
+    run_policy("overflow_close", CONFIG_WRITE_OVERFLOW_CLOSE, &server_state,
+               &client_state);
+
+    for (int i = NUM_FIT; i < NUM_SENT; i++)
+    {
+        if (server_state.results[i] != SERVER_RESULT_FAIL)
+        {
+            test_failed_exit("overflow_close", "send didn't fail");
+        }
+    }
+    if (server_state.num_drained != 0 || client_state.drained)
+    {
+        test_failed_exit("overflow_close", "on_drain was called");
+    }
+}
+
+int main(int argc, char** argv)
+{
+    hhunused(argc);
+    hhunused(argv);
+
+    for (int i = 0; i < MSG_LEN; i++)
+    {
+        g_payload[i] = (char)((i * 31 + 7) & 0xff);
+    }
+
+    test_overflow_block();
+    test_overflow_drop();
+    test_overflow_close();
+
+    exit(0);
+}
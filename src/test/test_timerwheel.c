@@ -0,0 +1,189 @@
+/* test_timerwheel - test the hierarchical timing wheel
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "../timerwheel.h"
+#include "../util.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define TEST_RESOLUTION_MS  10
+#define TEST_NUM_TIMERS     20000
+
+typedef struct
+{
+    timerwheel_timer timer;
+    uint64_t expires_ms;
+    int times_fired;
+    bool cancelled;
+} test_timer;
+
+static uint64_t g_now_ms;
+
+static void fail(const char* what, test_timer* t)
+{
+    printf("FAIL: %s, expires: %"PRIu64" now: %"PRIu64" fired: %d\n", what,
+           t->expires_ms, g_now_ms, t->times_fired);
+    exit(EXIT_FAILURE);
+}
+
+static void on_fire(timerwheel_timer* timer, void* data)
+{
+    hhunused(timer);
+    test_timer* t = data;
+
+    if (t->cancelled) fail("cancelled timer fired", t);
+    if (g_now_ms < t->expires_ms) fail("fired early", t);
+    t->times_fired++;
+}
+
+/*
+ * random deadlines from right now to past the end of the wheel, random
+ * cancels, and the clock moving in random steps
+ */
+static void test_random(void)
+{
+    test_timer* timers = calloc(TEST_NUM_TIMERS, sizeof(*timers));
+    g_now_ms = 123456789;
+    timerwheel* wheel = timerwheel_create(TEST_RESOLUTION_MS, g_now_ms);
+
+    for (int i = 0; i < TEST_NUM_TIMERS; i++)
+    {
+        test_timer* t = &timers[i];
+        timerwheel_timer_init(&t->timer, on_fire, t);
+
+        uint64_t delay;
+        switch (rand() % 4)
+        {
+        case 0: delay = (uint64_t)(rand() % 1000); break;
+        case 1: delay = (uint64_t)(rand() % 100000); break;
+        case 2: delay = (uint64_t)rand() % 10000000; break;
+        default: delay = (uint64_t)rand() % 400000000; break;
+        }
+        t->expires_ms = g_now_ms + delay;
+        timerwheel_add(wheel, &t->timer, t->expires_ms);
+    }
+
+    /* cancel some, re-arm some */
+    for (int i = 0; i < TEST_NUM_TIMERS; i += 7)
+    {
+        timerwheel_cancel(&timers[i].timer);
+        timers[i].cancelled = true;
+    }
+    for (int i = 3; i < TEST_NUM_TIMERS; i += 11)
+    {
+        timers[i].expires_ms = g_now_ms + (uint64_t)(rand() % 50000);
+        timers[i].cancelled = false;
+        timerwheel_add(wheel, &timers[i].timer, timers[i].expires_ms);
+    }
+
+    uint64_t end = g_now_ms + 400000000 + 2 * TEST_RESOLUTION_MS;
+    while (g_now_ms < end)
+    {
+        uint64_t step = (rand() % 2) ? (uint64_t)(rand() % 50) :
+                                       (uint64_t)(rand() % 200000);
+        g_now_ms += step;
+        timerwheel_advance(wheel, g_now_ms);
+
+        /* anything a full tick overdue should have gone off already */
+        for (int i = 0; i < TEST_NUM_TIMERS; i += 97)
+        {
+            test_timer* t = &timers[i];
+            if (!t->cancelled && t->times_fired == 0 &&
+                g_now_ms >= t->expires_ms + TEST_RESOLUTION_MS)
+            {
+                fail("fired late", t);
+            }
+        }
+    }
+
+    for (int i = 0; i < TEST_NUM_TIMERS; i++)
+    {
+        test_timer* t = &timers[i];
+        if (!t->cancelled && t->times_fired != 1) fail("fire count", t);
+        if (timerwheel_is_pending(&t->timer)) fail("still pending", t);
+    }
+
+    timerwheel_destroy(wheel);
+    free(timers);
+}
+
+static timerwheel* g_wheel;
+
+static void on_fire_rearm_wheel(timerwheel_timer* timer, void* data)
+{
+    test_timer* t = data;
+    t->times_fired++;
+
+    /* re-arming from the callback, every other time already due */
+    if (t->times_fired < 5)
+    {
+        t->expires_ms = g_now_ms + (uint64_t)(t->times_fired % 2) * 1000;
+        timerwheel_add(g_wheel, timer, t->expires_ms);
+    }
+}
+
+static void test_rearm(void)
+{
+    g_now_ms = 0;
+    g_wheel = timerwheel_create(TEST_RESOLUTION_MS, g_now_ms);
+
+    test_timer t;
+    memset(&t, 0, sizeof(t));
+    timerwheel_timer_init(&t.timer, on_fire_rearm_wheel, &t);
+    timerwheel_add(g_wheel, &t.timer, 5);
+
+    for (int i = 0; i < 1000; i++)
+    {
+        g_now_ms += 5;
+        timerwheel_advance(g_wheel, g_now_ms);
+    }
+
+    if (t.times_fired != 5) fail("re-armed fire count", &t);
+    if (timerwheel_is_pending(&t.timer)) fail("re-armed still pending", &t);
+
+    timerwheel_destroy(g_wheel);
+}
+
+int main(int argc, char **argv)
+{
+    hhunused(argc);
+    hhunused(argv);
+
+    srand((unsigned)time(NULL));
+
+    test_rearm();
+    test_random();
+
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,274 @@
+/* test_utf8 - test the UTF-8 validators against the reference DFA
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "../utf8.h"
+#include "../util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_PAD 40
+#define MAX_FUZZ_LEN 300
+#define FUZZ_ITERATIONS 20000
+
+typedef struct
+{
+    const char* str;
+    bool valid;
+} utf8_case;
+
+static const utf8_case g_cases[] =
+{
+    { "", true },
+    { "hello", true },
+    { "\xc2\xa2", true },                   /* U+00A2 */
+    { "\xe2\x82\xac", true },               /* U+20AC */
+    { "\xf0\x9f\x98\x80", true },           /* U+1F600 */
+    { "\xf4\x8f\xbf\xbf", true },           /* U+10FFFF */
+    { "\xed\x9f\xbf", true },               /* U+D7FF */
+    { "\xee\x80\x80", true },               /* U+E000 */
+    { "\xe0\xa0\x80", true },               /* U+0800 */
+    { "\xf0\x90\x80\x80", true },           /* U+10000 */
+    { "\xce\xba\xe1\xbd\xb9\xcf\x83\xce\xbc\xce\xb5", true },
+    { "\x80", false },                      /* lone continuation */
+    { "\xbf", false },
+    { "\xc2", false },                      /* cut off */
+    { "\xe2\x82", false },
+    { "\xf0\x9f\x98", false },
+    { "\xc0\x80", false },                  /* overlong 2 */
+    { "\xc1\xbf", false },
+    { "\xe0\x80\x80", false },              /* overlong 3 */
+    { "\xe0\x9f\xbf", false },
+    { "\xf0\x80\x80\x80", false },          /* overlong 4 */
+    { "\xf0\x8f\xbf\xbf", false },
+    { "\xed\xa0\x80", false },              /* surrogates */
+    { "\xed\xbf\xbf", false },
+    { "\xf4\x90\x80\x80", false },          /* too large */
+    { "\xf5\x80\x80\x80", false },
+    { "\xf7\xbf\xbf\xbf", false },
+    { "\xf8\x88\x80\x80\x80", false },      /* 5 and 6 byte forms */
+    { "\xfc\x84\x80\x80\x80\x80", false },
+    { "\xfe", false },
+    { "\xff", false },
+    { "\xc2\x41", false },                  /* lead then ASCII */
+    { "\xe2\x82\x41", false },
+    { "\xc2\xc2\xa2", false },              /* lead then lead */
+    { "\xe2\x82\xac\x80", false },          /* one continuation too many */
+    { "\xf0\x9f\x98\x80\x80", false },
+    { "\xce\xba\xe1\xbd\xb9\xcf\x83\xce\xbc\xce\xb5\xed\xa0\x80" "abc",
+      false },
+};
+
+static uint32_t g_seed = 12345;
+
+static uint32_t next_rand(void)
+{
+    g_seed = g_seed * 1103515245 + 12345;
+    return (g_seed >> 16) & 0x7fff;
+}
+
+static void test_failed_exit(const char* impl, const char* test,
+                             const char* data, size_t len)
+{
+    printf("%s %s failed, len %zu:", impl, test, len);
+    for (size_t i = 0; i < len; i++)
+    {
+        printf(" %02x", (unsigned char)data[i]);
+    }
+    printf("\n");
+    exit(1);
+}
+
+/* DFA state after feeding data a byte at a time */
+static uint32_t reference_state(const char* data, size_t len)
+{
+    uint32_t state = UTF8_ACCEPT;
+    uint32_t codepoint = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        utf8_validate(&state, &codepoint, &data[i], 1);
+    }
+
+    return state;
+}
+
+/*
+ * every implementation, plus the streaming API split in two at every
+ * position, has to agree with the DFA
+ */
+static void check_all(const char* data, size_t len, bool valid)
+{
+    for (int i = 0; i < UTF8_NUMBER_OF_IMPLS; i++)
+    {
+        utf8_impl impl = (utf8_impl)i;
+        utf8_func* func = utf8_get_impl(impl);
+        if (func == NULL) continue;
+
+        if (func(data, len) != valid)
+        {
+            test_failed_exit(utf8_impl_name(impl), "validate", data, len);
+        }
+    }
+
+    if (utf8_is_valid(data, len) != valid)
+    {
+        test_failed_exit("utf8_is_valid", "validate", data, len);
+    }
+
+    uint32_t expected = reference_state(data, len);
+    if ((expected == UTF8_ACCEPT) != valid)
+    {
+        test_failed_exit("reference", "streaming", data, len);
+    }
+
+    for (size_t split = 0; split <= len; split++)
+    {
+        uint32_t state = UTF8_ACCEPT;
+        uint32_t codepoint = 0;
+        utf8_validate(&state, &codepoint, data, split);
+        utf8_validate(&state, &codepoint, &data[split], len - split);
+
+        bool rejected = expected == UTF8_REJECT;
+        if (state != expected && !(rejected && state == UTF8_REJECT))
+        {
+            test_failed_exit("utf8_validate", "split", data, len);
+        }
+    }
+}
+
+/* the known cases surrounded by varying amounts of ASCII */
+static void test_cases(void)
+{
+    static char buf[2 * MAX_PAD + 64];
+    for (size_t c = 0; c < hhcountof(g_cases); c++)
+    {
+        size_t case_len = strlen(g_cases[c].str);
+        for (size_t pre = 0; pre < MAX_PAD; pre++)
+        {
+            for (size_t post = 0; post < MAX_PAD; post += 3)
+            {
+                memset(buf, 'a', pre);
+                memcpy(&buf[pre], g_cases[c].str, case_len);
+                memset(&buf[pre + case_len], 'z', post);
+                check_all(buf, pre + case_len + post, g_cases[c].valid);
+            }
+        }
+    }
+}
+
+/* append the UTF-8 encoding of cp */
+static size_t encode(char* out, uint32_t cp)
+{
+    if (cp < 0x80)
+    {
+        out[0] = (char)cp;
+        return 1;
+    }
+    else if (cp < 0x800)
+    {
+        out[0] = (char)(0xc0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3f));
+        return 2;
+    }
+    else if (cp < 0x10000)
+    {
+        out[0] = (char)(0xe0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+        out[2] = (char)(0x80 | (cp & 0x3f));
+        return 3;
+    }
+    else
+    {
+        out[0] = (char)(0xf0 | (cp >> 18));
+        out[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+        out[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+        out[3] = (char)(0x80 | (cp & 0x3f));
+        return 4;
+    }
+}
+
+/* valid text with the odd corrupted byte, checked against the DFA */
+static void test_fuzz(void)
+{
+    static char buf[MAX_FUZZ_LEN + 4];
+    for (int iter = 0; iter < FUZZ_ITERATIONS; iter++)
+    {
+        size_t target = next_rand() % MAX_FUZZ_LEN;
+        size_t len = 0;
+        while (len < target)
+        {
+            uint32_t cp;
+            switch (next_rand() % 4)
+            {
+            case 0:
+                cp = next_rand() % 0x80;
+                break;
+            case 1:
+                cp = 0x80 + next_rand() % 0x780;
+                break;
+            case 2:
+                cp = 0x800 + (next_rand() * 3) % 0xf800;
+                if (cp >= 0xd800 && cp <= 0xdfff) cp = 0x20ac;
+                break;
+            default:
+                cp = 0x10000 + ((next_rand() << 5) ^ next_rand()) % 0x100000;
+                break;
+            }
+            len += encode(&buf[len], cp);
+        }
+
+        /* corrupt about half of them */
+        int corruptions = (int)(next_rand() % 4) - 1;
+        for (int i = 0; i < corruptions && len > 0; i++)
+        {
+            buf[next_rand() % len] = (char)(next_rand() & 0xff);
+        }
+
+        check_all(buf, len, reference_state(buf, len) == UTF8_ACCEPT);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    hhunused(argc);
+    hhunused(argv);
+
+    if (utf8_get_impl(UTF8_IMPL_BEST) == NULL)
+    {
+        printf("no best utf8 implementation\n");
+        exit(1);
+    }
+
+    test_cases();
+    test_fuzz();
+
+    exit(0);
+}
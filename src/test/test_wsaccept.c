@@ -0,0 +1,140 @@
+/* test_wsaccept - test Sec-WebSocket-Accept computation
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "../wsaccept.h"
+#include "../util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUM_RANDOM_KEYS 1000
+
+static const char g_base64_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static void test_failed_exit(const char* impl, const char* test,
+                             const char* key)
+{
+    printf("%s %s failed: key %.*s\n", impl, test, WSACCEPT_KEY_LEN, key);
+    exit(1);
+}
+
+/* a well formed key is base64 of 16 bytes: 22 characters and "==" */
+static void random_key(char* key)
+{
+    for (int i = 0; i < WSACCEPT_KEY_LEN - 2; i++)
+    {
+        key[i] = g_base64_chars[rand() % 64];
+    }
+    key[WSACCEPT_KEY_LEN - 2] = '=';
+    key[WSACCEPT_KEY_LEN - 1] = '=';
+}
+
+/* the worked example from section 1.3 of RFC 6455 */
+static void test_rfc_example(wsaccept_impl impl)
+{
+    static const char key[] = "dGhlIHNhbXBsZSBub25jZQ==";
+    static const char expected[] = "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=";
+
+    char accept[WSACCEPT_LEN];
+    wsaccept_get_impl(impl)(key, accept);
+
+    if (memcmp(accept, expected, WSACCEPT_LEN) != 0)
+    {
+        test_failed_exit(wsaccept_impl_name(impl), "rfc example", key);
+    }
+}
+
+/* every implementation has to agree with the reference */
+static void test_random_keys(wsaccept_impl impl)
+{
+    wsaccept_func* reference = wsaccept_get_impl(WSACCEPT_IMPL_REFERENCE);
+    wsaccept_func* func = wsaccept_get_impl(impl);
+
+    for (int i = 0; i < NUM_RANDOM_KEYS; i++)
+    {
+        char key[WSACCEPT_KEY_LEN];
+        char expected[WSACCEPT_LEN];
+        char actual[WSACCEPT_LEN];
+        random_key(key);
+
+        reference(key, expected);
+        func(key, actual);
+        if (memcmp(actual, expected, WSACCEPT_LEN) != 0)
+        {
+            test_failed_exit(wsaccept_impl_name(impl), "random keys", key);
+        }
+    }
+}
+
+static void test_compute(void)
+{
+    char key[WSACCEPT_KEY_LEN];
+    char expected[WSACCEPT_LEN];
+    char actual[WSACCEPT_LEN];
+    random_key(key);
+
+    wsaccept_get_impl(WSACCEPT_IMPL_REFERENCE)(key, expected);
+
+    wsaccept_compute(key, actual);
+    if (memcmp(actual, expected, WSACCEPT_LEN) != 0)
+    {
+        test_failed_exit("wsaccept_compute", "compute", key);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    hhunused(argc);
+    hhunused(argv);
+
+    if (wsaccept_get_impl(WSACCEPT_IMPL_BEST) == NULL)
+    {
+        printf("no best wsaccept implementation\n");
+        exit(1);
+    }
+
+    srand(1);
+    for (int i = 0; i < WSACCEPT_NUMBER_OF_IMPLS; i++)
+    {
+        wsaccept_impl impl = (wsaccept_impl)i;
+
+        /* skip things this cpu can't run */
+        if (wsaccept_get_impl(impl) == NULL) continue;
+
+        test_rfc_example(impl);
+        test_random_keys(impl);
+    }
+
+    test_compute();
+
+    exit(0);
+}
@@ -0,0 +1,240 @@
+/* timerwheel - hierarchical timing wheel, O(1) timer arm and cancel.
+ *              Based on the scheme described by Varghese and Lauck and the
+ *              classic Linux kernel timer wheel
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "timerwheel.h"
+#include "hhassert.h"
+#include "hhmemory.h"
+
+#include <stddef.h>
+
+/*
+ * four levels of 64 slots. level 0 holds timers due in the next 64 ticks,
+ * one slot per tick. each level up covers 64 times as long, and a slot's
+ * timers are moved down a level when the level below wraps around
+ */
+#define TIMERWHEEL_LEVELS       4
+#define TIMERWHEEL_SLOT_BITS    6
+#define TIMERWHEEL_SLOTS        (1 << TIMERWHEEL_SLOT_BITS)
+#define TIMERWHEEL_SLOT_MASK    ((uint64_t)(TIMERWHEEL_SLOTS - 1))
+
+/* farthest out a timer is placed, ones after that are re-placed as we go */
+#define TIMERWHEEL_MAX_TICKS \
+    ((UINT64_C(1) << (TIMERWHEEL_LEVELS * TIMERWHEEL_SLOT_BITS)) - 1)
+
+struct timerwheel
+{
+    uint64_t resolution_ms;
+    uint64_t current; /* the next tick to run */
+
+    /* circular lists, the heads are never real timers */
+    timerwheel_timer slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+};
+
+static void list_init(timerwheel_timer* head)
+{
+    head->next = head;
+    head->prev = head;
+}
+
+static void list_append(timerwheel_timer* head, timerwheel_timer* timer)
+{
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void list_unlink(timerwheel_timer* timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+/* move everything in from to the empty list to */
+static void list_take(timerwheel_timer* to, timerwheel_timer* from)
+{
+    if (from->next == from)
+    {
+        list_init(to);
+        return;
+    }
+
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    list_init(from);
+}
+
+static void place(timerwheel* wheel, timerwheel_timer* timer)
+{
+    uint64_t expires = timer->expires;
+    timerwheel_timer* slot;
+
+    if (expires < wheel->current)
+    {
+        /* already late, goes out on the next tick */
+        slot = &wheel->slots[0][wheel->current & TIMERWHEEL_SLOT_MASK];
+    }
+    else
+    {
+        uint64_t delta = expires - wheel->current;
+        if (delta > TIMERWHEEL_MAX_TICKS)
+        {
+            delta = TIMERWHEEL_MAX_TICKS;
+            expires = wheel->current + delta;
+        }
+
+        int level = 0;
+        while (level < TIMERWHEEL_LEVELS - 1 &&
+               delta >= (UINT64_C(1) << ((level + 1) * TIMERWHEEL_SLOT_BITS)))
+        {
+            level++;
+        }
+
+        uint64_t index = expires >> (level * TIMERWHEEL_SLOT_BITS);
+        slot = &wheel->slots[level][index & TIMERWHEEL_SLOT_MASK];
+    }
+
+    list_append(slot, timer);
+}
+
+/* re-place every timer in a slot, they all end up on lower levels */
+static uint64_t cascade(timerwheel* wheel, int level, uint64_t index)
+{
+    timerwheel_timer work;
+    list_take(&work, &wheel->slots[level][index]);
+
+    while (work.next != &work)
+    {
+        timerwheel_timer* timer = work.next;
+        list_unlink(timer);
+        place(wheel, timer);
+    }
+
+    return index;
+}
+
+timerwheel* timerwheel_create(uint64_t resolution_ms, uint64_t now_ms)
+{
+    hhassert(resolution_ms > 0);
+
+    timerwheel* wheel = hhmalloc(sizeof(*wheel));
+    if (wheel == NULL) return NULL;
+
+    wheel->resolution_ms = resolution_ms;
+    wheel->current = now_ms / resolution_ms;
+
+    for (int level = 0; level < TIMERWHEEL_LEVELS; level++)
+    {
+        for (int i = 0; i < TIMERWHEEL_SLOTS; i++)
+        {
+            list_init(&wheel->slots[level][i]);
+        }
+    }
+
+    return wheel;
+}
+
+void timerwheel_destroy(timerwheel* wheel)
+{
+    hhfree(wheel);
+}
+
+void timerwheel_timer_init(timerwheel_timer* timer, timerwheel_callback* cb,
+                           void* data)
+{
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+    timer->cb = cb;
+    timer->data = data;
+}
+
+void timerwheel_add(timerwheel* wheel, timerwheel_timer* timer,
+                    uint64_t expires_ms)
+{
+    if (timer->next != NULL) list_unlink(timer);
+
+    /* round up, never fire early */
+    uint64_t res = wheel->resolution_ms;
+    timer->expires = expires_ms / res + ((expires_ms % res) != 0);
+    place(wheel, timer);
+}
+
+void timerwheel_cancel(timerwheel_timer* timer)
+{
+    if (timer->next != NULL) list_unlink(timer);
+}
+
+bool timerwheel_is_pending(timerwheel_timer* timer)
+{
+    return timer->next != NULL;
+}
+
+void timerwheel_advance(timerwheel* wheel, uint64_t now_ms)
+{
+    uint64_t now = now_ms / wheel->resolution_ms;
+
+    while (wheel->current <= now)
+    {
+        uint64_t tick = wheel->current;
+        uint64_t index = tick & TIMERWHEEL_SLOT_MASK;
+
+        /* each time a level wraps, bring down the next slot above it */
+        uint64_t wrapped = index;
+        for (int level = 1; wrapped == 0 && level < TIMERWHEEL_LEVELS; level++)
+        {
+            wrapped = cascade(wheel, level,
+                    (tick >> (level * TIMERWHEEL_SLOT_BITS)) &
+                    TIMERWHEEL_SLOT_MASK);
+        }
+
+        wheel->current++;
+
+        /*
+         * take the whole slot first, callbacks can add timers that land
+         * back in it
+         */
+        timerwheel_timer work;
+        list_take(&work, &wheel->slots[0][index]);
+
+        while (work.next != &work)
+        {
+            timerwheel_timer* timer = work.next;
+            list_unlink(timer);
+            timer->cb(timer, timer->data);
+        }
+    }
+}
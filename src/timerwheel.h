@@ -0,0 +1,98 @@
+/* timerwheel - hierarchical timing wheel, O(1) timer arm and cancel.
+ *              Based on the scheme described by Varghese and Lauck and the
+ *              classic Linux kernel timer wheel
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TIMERWHEEL_H__
+#define TIMERWHEEL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct timerwheel timerwheel;
+typedef struct timerwheel_timer timerwheel_timer;
+
+typedef void (timerwheel_callback)(timerwheel_timer* timer, void* data);
+
+/*
+ * a timer, embed it in whatever it's timing. the wheel never allocates per
+ * timer. fields are private
+ */
+struct timerwheel_timer
+{
+    timerwheel_timer* next; /* NULL when not pending */
+    timerwheel_timer* prev;
+    uint64_t expires; /* in ticks */
+    timerwheel_callback* cb;
+    void* data;
+};
+
+/*
+ * create a timing wheel that ticks every resolution_ms. now_ms is the
+ * current time on whatever clock you pass to timerwheel_advance
+ */
+timerwheel* timerwheel_create(uint64_t resolution_ms, uint64_t now_ms);
+
+/*
+ * destroy a timing wheel. pending timers are forgotten, not fired
+ */
+void timerwheel_destroy(timerwheel* wheel);
+
+/*
+ * set up a timer, must be called once before anything else touches it
+ */
+void timerwheel_timer_init(timerwheel_timer* timer, timerwheel_callback* cb,
+                           void* data);
+
+/*
+ * call timer's callback once, the first time timerwheel_advance is called
+ * at or after expires_ms. rounded up to the wheel's resolution, so it never
+ * fires early. re-arms it if it's already pending
+ */
+void timerwheel_add(timerwheel* wheel, timerwheel_timer* timer,
+                    uint64_t expires_ms);
+
+/*
+ * stop a timer from firing. okay to call on one that isn't pending
+ */
+void timerwheel_cancel(timerwheel_timer* timer);
+
+/*
+ * is the timer waiting to fire
+ */
+bool timerwheel_is_pending(timerwheel_timer* timer);
+
+/*
+ * fire everything that expired by now_ms. callbacks may add or cancel any
+ * timer, including the one that fired
+ */
+void timerwheel_advance(timerwheel* wheel, uint64_t now_ms);
+
+#endif /* TIMERWHEEL_H__ */
@@ -0,0 +1,365 @@
+/* utf8 - streaming UTF-8 validation for text frames
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "utf8.h"
+#include "utf8_lookup.h"
+#include "hhassert.h"
+#include "util.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * below this, the zero padded final block of the vector validators costs
+ * more than it saves and the word loop wins
+ */
+#define UTF8_VECTOR_THRESHOLD 64
+
+#define UTF8_HIGH_BITS_64 UINT64_C(0x8080808080808080)
+
+static utf8_func* g_utf8_best = NULL;
+
+/*
+ * Copyright (c) 2008-2009 Bjoern Hoehrmann <bjoern@hoehrmann.de>
+ * See http://bjoern.hoehrmann.de/utf-8/decoder/dfa/ for details.
+ */
+
+static const uint32_t utf8d[] = {
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // 00..1f
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // 20..3f
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // 40..5f
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // 60..7f
+    1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, // 80..9f
+    7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7, // a0..bf
+    8,8,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2, // c0..df
+    0xa,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x4,0x3,0x3, // e0..ef
+    0xb,0x6,0x6,0x6,0x5,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8, // f0..ff
+    0x0,0x1,0x2,0x3,0x5,0x8,0x7,0x1,0x1,0x1,0x4,0x6,0x1,0x1,0x1,0x1, // s0..s0
+    1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,0,1,1,1,1,1,0,1,0,1,1,1,1,1,1, // s1..s2
+    1,2,1,1,1,1,1,2,1,2,1,1,1,1,1,1,1,1,1,1,1,1,1,2,1,1,1,1,1,1,1,1, // s3..s4
+    1,2,1,1,1,1,1,1,1,2,1,1,1,1,1,1,1,1,1,1,1,1,1,3,1,3,1,1,1,1,1,1, // s5..s6
+    1,3,1,1,1,1,1,3,1,3,1,1,1,1,1,1,1,3,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // s7..s8
+};
+
+static HH_INLINE uint32_t utf8_decode(uint32_t* state, uint32_t* codep,
+                                      uint32_t byte)
+{
+    uint32_t type = utf8d[byte];
+
+    *codep = (*state != UTF8_ACCEPT) ?
+        (byte & 0x3fu) | (*codep << 6) :
+        (0xff >> type) & (byte);
+
+    *state = utf8d[256 + *state*16 + type];
+    return *state;
+}
+
+/*
+ * the original loop. everything else is checked against this in
+ * test_utf8, and the benchmark uses it as the baseline
+ */
+static bool utf8_valid_dfa(const char* data, size_t len)
+{
+    uint32_t codepoint = 0, state = UTF8_ACCEPT;
+    const uint8_t* s = (const uint8_t*)data;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (utf8_decode(&state, &codepoint, s[i]) == UTF8_REJECT) return false;
+    }
+
+    return state == UTF8_ACCEPT;
+}
+
+/*
+ * skip ASCII 64 bits at a time whenever we're between characters, and run
+ * the DFA over everything else
+ */
+static bool utf8_valid_word(const char* data, size_t len)
+{
+    uint32_t codepoint = 0, state = UTF8_ACCEPT;
+    const uint8_t* s = (const uint8_t*)data;
+    size_t i = 0;
+
+    while (i < len)
+    {
+        if (state == UTF8_ACCEPT)
+        {
+            while (i + sizeof(uint64_t) <= len)
+            {
+                uint64_t w;
+                memcpy(&w, &s[i], sizeof(w));
+                if (w & UTF8_HIGH_BITS_64) break;
+                i += sizeof(uint64_t);
+            }
+
+            while (i < len && s[i] < 0x80) i++;
+            if (i == len) break;
+        }
+
+        if (utf8_decode(&state, &codepoint, s[i++]) == UTF8_REJECT)
+        {
+            return false;
+        }
+    }
+
+    return state == UTF8_ACCEPT;
+}
+
+#ifdef UTF8_HAVE_X86
+
+UTF8_TARGET("ssse3")
+static bool utf8_valid_ssse3(const char* data, size_t len)
+{
+    const uint8_t* s = (const uint8_t*)data;
+    utf8_sse_state st;
+    st.prev_input = _mm_setzero_si128();
+    st.prev_incomplete = _mm_setzero_si128();
+    st.error = _mm_setzero_si128();
+
+    size_t i = 0;
+    for (; i + 4 * sizeof(__m128i) <= len; i += 4 * sizeof(__m128i))
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)&s[i]);
+        __m128i b = _mm_loadu_si128((const __m128i*)&s[i + 16]);
+        __m128i c = _mm_loadu_si128((const __m128i*)&s[i + 32]);
+        __m128i d = _mm_loadu_si128((const __m128i*)&s[i + 48]);
+
+        __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (_mm_movemask_epi8(any) == 0)
+        {
+            st.error = _mm_or_si128(st.error, st.prev_incomplete);
+            st.prev_incomplete = _mm_setzero_si128();
+            st.prev_input = d;
+            continue;
+        }
+
+        utf8_check_ssse3(&st, a);
+        utf8_check_ssse3(&st, b);
+        utf8_check_ssse3(&st, c);
+        utf8_check_ssse3(&st, d);
+    }
+
+    for (; i + sizeof(__m128i) <= len; i += sizeof(__m128i))
+    {
+        utf8_check_ssse3(&st, _mm_loadu_si128((const __m128i*)&s[i]));
+    }
+
+    /*
+     * the rest padded with zeros. always checked, even when empty, so a
+     * character cut off at the end of the last full block gets caught
+     */
+    uint8_t last[sizeof(__m128i)];
+    memset(last, 0, sizeof(last));
+    memcpy(last, &s[i], len - i);
+    utf8_check_ssse3(&st, _mm_loadu_si128((const __m128i*)last));
+
+    __m128i zero = _mm_setzero_si128();
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(st.error, zero)) == 0xffff;
+}
+
+UTF8_TARGET("avx2")
+static bool utf8_valid_avx2(const char* data, size_t len)
+{
+    const uint8_t* s = (const uint8_t*)data;
+    utf8_avx_state st;
+    st.prev_input = _mm256_setzero_si256();
+    st.prev_incomplete = _mm256_setzero_si256();
+    st.error = _mm256_setzero_si256();
+
+    size_t i = 0;
+    for (; i + 2 * sizeof(__m256i) <= len; i += 2 * sizeof(__m256i))
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*)&s[i]);
+        __m256i b = _mm256_loadu_si256((const __m256i*)&s[i + 32]);
+
+        if (_mm256_movemask_epi8(_mm256_or_si256(a, b)) == 0)
+        {
+            st.error = _mm256_or_si256(st.error, st.prev_incomplete);
+            st.prev_incomplete = _mm256_setzero_si256();
+            st.prev_input = b;
+            continue;
+        }
+
+        utf8_check_avx2(&st, a);
+        utf8_check_avx2(&st, b);
+    }
+
+    for (; i + sizeof(__m256i) <= len; i += sizeof(__m256i))
+    {
+        utf8_check_avx2(&st, _mm256_loadu_si256((const __m256i*)&s[i]));
+    }
+
+    uint8_t last[sizeof(__m256i)];
+    memset(last, 0, sizeof(last));
+    memcpy(last, &s[i], len - i);
+    utf8_check_avx2(&st, _mm256_loadu_si256((const __m256i*)last));
+
+    return _mm256_testz_si256(st.error, st.error) != 0;
+}
+
+#endif /* UTF8_HAVE_X86 */
+
+static bool utf8_cpu_supports(utf8_impl impl)
+{
+    switch (impl)
+    {
+    case UTF8_IMPL_DFA:
+    case UTF8_IMPL_WORD:
+    case UTF8_IMPL_BEST:
+        return true;
+    case UTF8_IMPL_SSSE3:
+#ifdef UTF8_HAVE_X86
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("ssse3");
+#else
+        return false;
+#endif
+    case UTF8_IMPL_AVX2:
+#ifdef UTF8_HAVE_X86
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#else
+        return false;
+#endif
+    case UTF8_NUMBER_OF_IMPLS:
+        break;
+    }
+
+    return false;
+}
+
+static utf8_func* utf8_resolve_best(void)
+{
+#ifdef UTF8_HAVE_X86
+    if (utf8_cpu_supports(UTF8_IMPL_AVX2)) return utf8_valid_avx2;
+    if (utf8_cpu_supports(UTF8_IMPL_SSSE3)) return utf8_valid_ssse3;
+#endif
+    return utf8_valid_word;
+}
+
+/* shared by the loops on every thread, so only touched atomically */
+static utf8_func* utf8_get_best(void)
+{
+    utf8_func* best = __atomic_load_n(&g_utf8_best, __ATOMIC_ACQUIRE);
+    if (best == NULL)
+    {
+        best = utf8_resolve_best();
+        __atomic_store_n(&g_utf8_best, best, __ATOMIC_RELEASE);
+    }
+
+    return best;
+}
+
+utf8_func* utf8_get_impl(utf8_impl impl)
+{
+    if (!utf8_cpu_supports(impl)) return NULL;
+
+    switch (impl)
+    {
+    case UTF8_IMPL_DFA:
+        return utf8_valid_dfa;
+    case UTF8_IMPL_WORD:
+        return utf8_valid_word;
+#ifdef UTF8_HAVE_X86
+    case UTF8_IMPL_SSSE3:
+        return utf8_valid_ssse3;
+    case UTF8_IMPL_AVX2:
+        return utf8_valid_avx2;
+#endif
+    case UTF8_IMPL_BEST:
+        return utf8_get_best();
+    default:
+        return NULL;
+    }
+}
+
+const char* utf8_impl_name(utf8_impl impl)
+{
+    switch (impl)
+    {
+    case UTF8_IMPL_DFA:
+        return "dfa";
+    case UTF8_IMPL_WORD:
+        return "word";
+    case UTF8_IMPL_SSSE3:
+        return "ssse3";
+    case UTF8_IMPL_AVX2:
+        return "avx2";
+    case UTF8_IMPL_BEST:
+        return "best";
+    case UTF8_NUMBER_OF_IMPLS:
+        break;
+    }
+
+    hhassert(0);
+    return "unknown";
+}
+
+bool utf8_is_valid(const char* data, size_t len)
+{
+    if (len < UTF8_VECTOR_THRESHOLD) return utf8_valid_word(data, len);
+
+    return utf8_get_best()(data, len);
+}
+
+uint32_t utf8_validate(uint32_t* state, uint32_t* codepoint,
+                       const char* data, size_t len)
+{
+    const uint8_t* s = (const uint8_t*)data;
+    const uint8_t* end = s + len;
+
+    /* finish a character left over from the last call */
+    while (s != end && *state != UTF8_ACCEPT && *state != UTF8_REJECT)
+    {
+        utf8_decode(state, codepoint, *s++);
+    }
+
+    if (s == end || *state == UTF8_REJECT) return *state;
+
+    /*
+     * we're between characters now. the validators only take whole
+     * strings, so give them everything up to where the last character
+     * starts, and run the DFA over that character to carry it into the
+     * next call
+     */
+    size_t boundary = utf8_last_boundary(s, (size_t)(end - s));
+    if (!utf8_is_valid((const char*)s, boundary))
+    {
+        *state = UTF8_REJECT;
+        return *state;
+    }
+
+    for (s += boundary; s != end; s++)
+    {
+        if (utf8_decode(state, codepoint, *s) == UTF8_REJECT) break;
+    }
+
+    return *state;
+}
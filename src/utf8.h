@@ -0,0 +1,82 @@
+/* utf8 - streaming UTF-8 validation for text frames
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __UTF8_H_
+#define __UTF8_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "util.h"
+
+/* validator states, see utf8_validate */
+#define UTF8_ACCEPT 0
+#define UTF8_REJECT 1
+
+typedef enum
+{
+    UTF8_IMPL_DFA,   /* Hoehrmann's DFA a byte at a time, the reference */
+    UTF8_IMPL_WORD,  /* skips ASCII 64 bits at a time, DFA for the rest */
+    UTF8_IMPL_SSSE3, /* vectorized lookup validator, 16 bytes at a time */
+    UTF8_IMPL_AVX2,  /* vectorized lookup validator, 32 bytes at a time */
+    UTF8_IMPL_BEST,  /* fastest implementation supported by this cpu */
+    UTF8_NUMBER_OF_IMPLS
+} utf8_impl;
+
+/*
+ * validate a complete string: returns true if all len bytes of data are
+ * well formed UTF-8 and the string doesn't end in the middle of a character
+ */
+typedef bool (utf8_func)(const char* data, size_t len);
+
+/*
+ * get the validator for impl, or NULL if this cpu doesn't support it.
+ * UTF8_IMPL_BEST is always supported
+ */
+utf8_func* utf8_get_impl(utf8_impl impl);
+
+/* get a printable name for impl */
+const char* utf8_impl_name(utf8_impl impl);
+
+/*
+ * feed the next len bytes of a string to the validator. state and codepoint
+ * carry a partial character from one call to the next, so a string can be
+ * validated in pieces as it arrives. start with both set to 0 (UTF8_ACCEPT).
+ *
+ * returns the new state: UTF8_ACCEPT if everything so far is a complete
+ * valid string, UTF8_REJECT if it's invalid (and always will be), anything
+ * else if it's valid but ends in the middle of a character
+ */
+uint32_t utf8_validate(uint32_t* state, uint32_t* codepoint,
+                       const char* data, size_t len);
+
+/* validate a complete string with the best implementation for this cpu */
+bool utf8_is_valid(const char* data, size_t len);
+
+#endif /* __UTF8_H_ */
@@ -0,0 +1,246 @@
+/* utf8_lookup - vector UTF-8 validation internals
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __UTF8_LOOKUP_H_
+#define __UTF8_LOOKUP_H_
+
+/*
+ * internals of the vector validators, shared by utf8.c and the fused
+ * payload kernels in payload.c
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "util.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define UTF8_HAVE_X86
+    #include <immintrin.h>
+    #define UTF8_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+/*
+ * find where the last character in s might start, so that everything
+ * before the returned offset is whole characters if it's valid at all.
+ * a character is at most 4 bytes: back up over at most 3 continuation
+ * bytes and the lead byte in front of them
+ */
+static HH_INLINE size_t utf8_last_boundary(const uint8_t* s, size_t len)
+{
+    size_t p = len;
+    while (p > 0 && len - p < 3 && (s[p - 1] & 0xc0) == 0x80) p--;
+    if (p > 0 && s[p - 1] >= 0xc0) p--;
+
+    return p;
+}
+
+#ifdef UTF8_HAVE_X86
+
+/*
+ * The vector validators are the lookup algorithm from Keiser and Lemire,
+ * "Validating UTF-8 In Less Than One Instruction Per Byte" (2020). Each
+ * byte is classified by three 16 entry table lookups on the high nibble of
+ * the previous byte, the low nibble of the previous byte and the high
+ * nibble of the byte itself. The tables hold a bit per kind of error, so
+ * and-ing the lookups leaves a bit set only where two adjacent bytes make
+ * that error. 3rd and 4th bytes of a character are checked separately, by
+ * looking back 2 and 3 bytes for a 3 or 4 byte lead.
+ */
+#define UTF8_TOO_SHORT  (1 << 0) /* lead not followed by continuation */
+#define UTF8_TOO_LONG   (1 << 1) /* ASCII followed by continuation */
+#define UTF8_OVERLONG_3 (1 << 2) /* 11100000 100_____ */
+#define UTF8_TOO_LARGE  (1 << 3) /* past U+10FFFF */
+#define UTF8_SURROGATE  (1 << 4) /* 11101101 101_____ */
+#define UTF8_OVERLONG_2 (1 << 5) /* 1100000_ 10______ */
+#define UTF8_TOO_LARGE_1000 (1 << 6) /* past U+10FFFF, 2nd byte 1000____ */
+#define UTF8_OVERLONG_4 (1 << 6) /* 11110000 1000____ */
+#define UTF8_TWO_CONTS  (1 << 7) /* continuation after continuation */
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+#define UTF8_TABLE_BYTE_1_HIGH \
+    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, \
+    UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, \
+    (char)UTF8_TWO_CONTS, (char)UTF8_TWO_CONTS, \
+    (char)UTF8_TWO_CONTS, (char)UTF8_TWO_CONTS, \
+    UTF8_TOO_SHORT | UTF8_OVERLONG_2, \
+    UTF8_TOO_SHORT, \
+    UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE, \
+    (char)(UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | \
+           UTF8_OVERLONG_4)
+
+#define UTF8_TABLE_BYTE_1_LOW \
+    (char)(UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4), \
+    (char)(UTF8_CARRY | UTF8_OVERLONG_2), \
+    (char)UTF8_CARRY, \
+    (char)UTF8_CARRY, \
+    (char)(UTF8_CARRY | UTF8_TOO_LARGE), \
+    (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000), \
+    (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000), \
+    (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000), \
+    (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000), \
+    (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000), \
+    (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000), \
+    (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000), \
+    (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000), \
+    (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | \
+           UTF8_SURROGATE), \
+    (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000), \
+    (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000)
+
+#define UTF8_TABLE_BYTE_2_HIGH \
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, \
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, \
+    (char)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | \
+           UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4), \
+    (char)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | \
+           UTF8_OVERLONG_3 | UTF8_TOO_LARGE), \
+    (char)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | \
+           UTF8_SURROGATE | UTF8_TOO_LARGE), \
+    (char)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | \
+           UTF8_SURROGATE | UTF8_TOO_LARGE), \
+    UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT
+
+/*
+ * a block ends in the middle of a character if any of the last 3 bytes
+ * is greater than these
+ */
+#define UTF8_INCOMPLETE_TAIL (char)(0xf0 - 1), (char)(0xe0 - 1), \
+                             (char)(0xc0 - 1)
+
+typedef struct
+{
+    __m128i prev_input;
+    __m128i prev_incomplete;
+    __m128i error;
+} utf8_sse_state;
+
+UTF8_TARGET("ssse3")
+static HH_INLINE void utf8_check_ssse3(utf8_sse_state* st, __m128i input)
+{
+    if (_mm_movemask_epi8(input) == 0)
+    {
+        /* all ASCII, only an unfinished character before it can be wrong */
+        st->error = _mm_or_si128(st->error, st->prev_incomplete);
+        st->prev_incomplete = _mm_setzero_si128();
+        st->prev_input = input;
+        return;
+    }
+
+    const __m128i byte_1_high = _mm_setr_epi8(UTF8_TABLE_BYTE_1_HIGH);
+    const __m128i byte_1_low = _mm_setr_epi8(UTF8_TABLE_BYTE_1_LOW);
+    const __m128i byte_2_high = _mm_setr_epi8(UTF8_TABLE_BYTE_2_HIGH);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    const __m128i max_tail = _mm_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        UTF8_INCOMPLETE_TAIL);
+
+    __m128i prev1 = _mm_alignr_epi8(input, st->prev_input, 15);
+    __m128i prev2 = _mm_alignr_epi8(input, st->prev_input, 14);
+    __m128i prev3 = _mm_alignr_epi8(input, st->prev_input, 13);
+
+    __m128i sc = _mm_shuffle_epi8(byte_1_high,
+        _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+    sc = _mm_and_si128(sc, _mm_shuffle_epi8(byte_1_low,
+        _mm_and_si128(prev1, nibble)));
+    sc = _mm_and_si128(sc, _mm_shuffle_epi8(byte_2_high,
+        _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+
+    /* high bit set where this byte has to be a 3rd or 4th byte */
+    __m128i third = _mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xe0 - 0x80)));
+    __m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xf0 - 0x80)));
+    __m128i must23 = _mm_and_si128(_mm_or_si128(third, fourth),
+                                   _mm_set1_epi8((char)0x80));
+
+    st->error = _mm_or_si128(st->error, _mm_xor_si128(must23, sc));
+    st->prev_incomplete = _mm_subs_epu8(input, max_tail);
+    st->prev_input = input;
+}
+
+typedef struct
+{
+    __m256i prev_input;
+    __m256i prev_incomplete;
+    __m256i error;
+} utf8_avx_state;
+
+/* input shifted n bytes later, with the bytes from prev shifted in */
+#define UTF8_AVX2_PREV(input, prev, n) \
+    _mm256_alignr_epi8((input), \
+        _mm256_permute2x128_si256((prev), (input), 0x21), 16 - (n))
+
+UTF8_TARGET("avx2")
+static HH_INLINE void utf8_check_avx2(utf8_avx_state* st, __m256i input)
+{
+    if (_mm256_movemask_epi8(input) == 0)
+    {
+        st->error = _mm256_or_si256(st->error, st->prev_incomplete);
+        st->prev_incomplete = _mm256_setzero_si256();
+        st->prev_input = input;
+        return;
+    }
+
+    const __m256i byte_1_high = _mm256_setr_epi8(UTF8_TABLE_BYTE_1_HIGH,
+                                                 UTF8_TABLE_BYTE_1_HIGH);
+    const __m256i byte_1_low = _mm256_setr_epi8(UTF8_TABLE_BYTE_1_LOW,
+                                                UTF8_TABLE_BYTE_1_LOW);
+    const __m256i byte_2_high = _mm256_setr_epi8(UTF8_TABLE_BYTE_2_HIGH,
+                                                 UTF8_TABLE_BYTE_2_HIGH);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i max_tail = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        UTF8_INCOMPLETE_TAIL);
+
+    __m256i prev1 = UTF8_AVX2_PREV(input, st->prev_input, 1);
+    __m256i prev2 = UTF8_AVX2_PREV(input, st->prev_input, 2);
+    __m256i prev3 = UTF8_AVX2_PREV(input, st->prev_input, 3);
+
+    __m256i sc = _mm256_shuffle_epi8(byte_1_high,
+        _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+    sc = _mm256_and_si256(sc, _mm256_shuffle_epi8(byte_1_low,
+        _mm256_and_si256(prev1, nibble)));
+    sc = _mm256_and_si256(sc, _mm256_shuffle_epi8(byte_2_high,
+        _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+
+    __m256i third = _mm256_subs_epu8(prev2,
+                                     _mm256_set1_epi8((char)(0xe0 - 0x80)));
+    __m256i fourth = _mm256_subs_epu8(prev3,
+                                      _mm256_set1_epi8((char)(0xf0 - 0x80)));
+    __m256i must23 = _mm256_and_si256(_mm256_or_si256(third, fourth),
+                                      _mm256_set1_epi8((char)0x80));
+
+    st->error = _mm256_or_si256(st->error, _mm256_xor_si256(must23, sc));
+    st->prev_incomplete = _mm256_subs_epu8(input, max_tail);
+    st->prev_input = input;
+}
+
+#endif /* UTF8_HAVE_X86 */
+
+#endif /* __UTF8_LOOKUP_H_ */
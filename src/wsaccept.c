@@ -0,0 +1,483 @@
+/* wsaccept - compute Sec-WebSocket-Accept values for the opening handshake
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "wsaccept.h"
+#include "base64/cencode.h"
+#include "hhassert.h"
+#include "sha1/sha1.h"
+#include "util.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define WSACCEPT_HAVE_X86
+    #include <immintrin.h>
+    #define WSACCEPT_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+/*
+ * the accept value is base64(sha1(key + guid)). the key is always 24
+ * characters, so the hashed message is always 60 bytes: the first SHA-1
+ * block is the key, the guid and the 0x80 pad byte, and the second block
+ * is all zeros apart from the message length (480 bits). only the first
+ * 24 bytes ever change.
+ */
+#define WSACCEPT_BLOCK_LEN 64
+#define WSACCEPT_DIGEST_LEN 20
+
+/* libb64 writes a newline at the end */
+#define BASE64_MAX_OUTPUT_LEN(n) ((4 * (((n) + 3) / 3)) + 1)
+
+/* this constant comes straight from RFC 6455 */
+static const char g_key_guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+/* the guid and the pad byte as big endian words 6 through 15 */
+static const uint32_t g_guid_words[] =
+{
+    0x32353845, 0x41464135, 0x2d453931, 0x342d3437, 0x44412d39,
+    0x3543412d, 0x43354142, 0x30444338, 0x35423131, 0x80000000
+};
+
+/* the second block as bytes, for the SHA extensions */
+static const unsigned char g_pad_block[WSACCEPT_BLOCK_LEN] =
+{
+    [WSACCEPT_BLOCK_LEN - 2] = 0x01,
+    [WSACCEPT_BLOCK_LEN - 1] = 0xe0
+};
+
+/*
+ * W[t] + K[t] for every round of the second block. the block never changes,
+ * so neither does its message schedule
+ */
+static const uint32_t g_pad_wk[80] =
+{
+    0x5a827999, 0x5a827999, 0x5a827999, 0x5a827999, 0x5a827999,
+    0x5a827999, 0x5a827999, 0x5a827999, 0x5a827999, 0x5a827999,
+    0x5a827999, 0x5a827999, 0x5a827999, 0x5a827999, 0x5a827999,
+    0x5a827b79, 0x5a827999, 0x5a827999, 0x5a827d59, 0x5a827999,
+    0x6ed9eba1, 0x6ed9f321, 0x6ed9eba1, 0x6ed9ef61, 0x6ed9faa1,
+    0x6ed9eba1, 0x6ed9eba1, 0x6eda09a1, 0x6ed9eba1, 0x6ed9f861,
+    0x6eda27a1, 0x6ed9efe1, 0x6ed9eba1, 0x6eda63a1, 0x6ed9faa1,
+    0x6eda1ea1, 0x6edadba1, 0x6ed9faa1, 0x6ed9eba1, 0x6edbdaa1,
+    0x8f1bbcdc, 0x8f1c88dc, 0x8f1f7cdc, 0x8f1c005c, 0x8f1bbcdc,
+    0x8f234bdc, 0x8f1cbbdc, 0x8f1ee35c, 0x8f2abcdc, 0x8f1cacdc,
+    0x8f1befdc, 0x8f3abbdc, 0x8f1bbcdc, 0x8f2874dc, 0x8f57bcdc,
+    0x8f1fc7dc, 0x8f1cacdc, 0x8f94bbdc, 0x8f2bacdc, 0x8f4f43dc,
+    0xcb52c1d6, 0xca7284d6, 0xca63b1d6, 0xcc527cd6, 0xca62c1d6,
+    0xcb2ec1d6, 0xce23b1d6, 0xcaa641d6, 0xca62c1d6, 0xd1f1c1d6,
+    0xcb61c1d6, 0xcd895fd6, 0xd962c1d6, 0xcb53b1d6, 0xca95fdd6,
+    0xe96249d6, 0xca62c1d6, 0xd71b49d6, 0x0663b1d6, 0xce6d0bd6
+};
+
+static const uint32_t g_sha1_init[5] =
+{
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+};
+
+static const char g_base64_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static wsaccept_func* g_wsaccept_best = NULL;
+
+/* 20 digest bytes make 6 full groups of 4 characters and one padded group */
+static void wsaccept_base64(char* out, const unsigned char* digest)
+{
+    for (int i = 0; i < 18; i += 3)
+    {
+        uint32_t v = (uint32_t)digest[i] << 16 |
+                     (uint32_t)digest[i + 1] << 8 |
+                     (uint32_t)digest[i + 2];
+        out[0] = g_base64_chars[v >> 18];
+        out[1] = g_base64_chars[(v >> 12) & 0x3f];
+        out[2] = g_base64_chars[(v >> 6) & 0x3f];
+        out[3] = g_base64_chars[v & 0x3f];
+        out += 4;
+    }
+
+    uint32_t v = (uint32_t)digest[18] << 16 | (uint32_t)digest[19] << 8;
+    out[0] = g_base64_chars[v >> 18];
+    out[1] = g_base64_chars[(v >> 12) & 0x3f];
+    out[2] = g_base64_chars[(v >> 6) & 0x3f];
+    out[3] = '=';
+}
+
+/*
+ * the original code from protocol_write_handshake_response. everything
+ * else is checked against this in test_wsaccept, and the benchmark uses
+ * it as the baseline
+ */
+static void wsaccept_reference(const char* key, char* out)
+{
+    char sha_buf[64];
+    int num_written = snprintf(sha_buf, sizeof(sha_buf), "%.*s%s",
+                               WSACCEPT_KEY_LEN, key, g_key_guid);
+    hhassert(num_written >= 0);
+
+    char sha_result[SHA1HashSize];
+    SHA1Context context;
+    SHA1Reset(&context);
+    SHA1Input(&context, (uint8_t*)sha_buf, (unsigned)num_written);
+    SHA1Result(&context, (uint8_t*)sha_result);
+
+    char response_key[BASE64_MAX_OUTPUT_LEN(SHA1HashSize)];
+    base64_encodestate encode_state;
+    base64_init_encodestate(&encode_state);
+    int num_encoded = base64_encode_block(sha_result, SHA1HashSize,
+                                          response_key, &encode_state);
+    num_encoded += base64_encode_blockend(&response_key[num_encoded],
+                                          &encode_state);
+    hhassert(num_encoded - 1 == WSACCEPT_LEN);
+    memcpy(out, response_key, WSACCEPT_LEN);
+}
+
+#define SHA1_ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define SHA1_F0(b, c, d) ((d) ^ ((b) & ((c) ^ (d))))
+#define SHA1_F1(b, c, d) ((b) ^ (c) ^ (d))
+#define SHA1_F2(b, c, d) (((b) & (c)) | ((d) & ((b) | (c))))
+#define SHA1_F3(b, c, d) SHA1_F1(b, c, d)
+
+/* message schedule kept in a 16 word ring */
+#define SHA1_MSG(t) \
+    ((t) < 16 ? w[(t) & 15] : \
+        (w[(t) & 15] = SHA1_ROL(w[((t) + 13) & 15] ^ w[((t) + 8) & 15] ^ \
+                                w[((t) + 2) & 15] ^ w[(t) & 15], 1)))
+
+#define SHA1_PAD(t) g_pad_wk[t]
+
+#define SHA1_ROUND(a, b, c, d, e, f, x) \
+    do \
+    { \
+        e += SHA1_ROL(a, 5) + f(b, c, d) + (x); \
+        b = SHA1_ROL(b, 30); \
+    } while (0)
+
+#define SHA1_ROUNDS5(f, X, k, t) \
+    SHA1_ROUND(a, b, c, d, e, f, X(t) + (k)); \
+    SHA1_ROUND(e, a, b, c, d, f, X((t) + 1) + (k)); \
+    SHA1_ROUND(d, e, a, b, c, f, X((t) + 2) + (k)); \
+    SHA1_ROUND(c, d, e, a, b, f, X((t) + 3) + (k)); \
+    SHA1_ROUND(b, c, d, e, a, f, X((t) + 4) + (k))
+
+#define SHA1_ROUNDS20(f, X, k, t) \
+    SHA1_ROUNDS5(f, X, k, (t)); \
+    SHA1_ROUNDS5(f, X, k, (t) + 5); \
+    SHA1_ROUNDS5(f, X, k, (t) + 10); \
+    SHA1_ROUNDS5(f, X, k, (t) + 15)
+
+#define SHA1_ROUNDS80(X, k0, k1, k2, k3) \
+    SHA1_ROUNDS20(SHA1_F0, X, k0, 0); \
+    SHA1_ROUNDS20(SHA1_F1, X, k1, 20); \
+    SHA1_ROUNDS20(SHA1_F2, X, k2, 40); \
+    SHA1_ROUNDS20(SHA1_F3, X, k3, 60)
+
+static HH_INLINE uint32_t wsaccept_load_be32(const char* p)
+{
+    const unsigned char* b = (const unsigned char*)p;
+    return (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 |
+           (uint32_t)b[2] << 8 | (uint32_t)b[3];
+}
+
+/*
+ * fully unrolled SHA-1 of the 60 byte message. the guid words are
+ * constants and the second block's schedule comes from g_pad_wk
+ */
+static void wsaccept_digest_scalar(unsigned char* digest, const char* key)
+{
+    uint32_t w[16];
+    for (int i = 0; i < WSACCEPT_KEY_LEN / 4; i++)
+    {
+        w[i] = wsaccept_load_be32(&key[i * 4]);
+    }
+    memcpy(&w[WSACCEPT_KEY_LEN / 4], g_guid_words, sizeof(g_guid_words));
+
+    uint32_t a = g_sha1_init[0];
+    uint32_t b = g_sha1_init[1];
+    uint32_t c = g_sha1_init[2];
+    uint32_t d = g_sha1_init[3];
+    uint32_t e = g_sha1_init[4];
+
+    SHA1_ROUNDS80(SHA1_MSG, 0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6);
+
+    uint32_t h[5];
+    h[0] = a += g_sha1_init[0];
+    h[1] = b += g_sha1_init[1];
+    h[2] = c += g_sha1_init[2];
+    h[3] = d += g_sha1_init[3];
+    h[4] = e += g_sha1_init[4];
+
+    SHA1_ROUNDS80(SHA1_PAD, 0, 0, 0, 0);
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+
+    for (int i = 0; i < 5; i++)
+    {
+        digest[i * 4] = (unsigned char)(h[i] >> 24);
+        digest[i * 4 + 1] = (unsigned char)(h[i] >> 16);
+        digest[i * 4 + 2] = (unsigned char)(h[i] >> 8);
+        digest[i * 4 + 3] = (unsigned char)h[i];
+    }
+}
+
+static void wsaccept_scalar(const char* key, char* out)
+{
+    unsigned char digest[WSACCEPT_DIGEST_LEN];
+    wsaccept_digest_scalar(digest, key);
+    wsaccept_base64(out, digest);
+}
+
+#ifdef WSACCEPT_HAVE_X86
+
+/*
+ * state of one hash in flight on the SHA extensions. abcd holds a in the
+ * top lane, e0/e1 alternate between rounds holding e (in the top lane)
+ * plus the next four message words, and m is the message schedule
+ */
+typedef struct
+{
+    __m128i abcd;
+    __m128i e0;
+    __m128i e1;
+    __m128i m[4];
+    __m128i abcd_save;
+    __m128i e_save;
+} wsaccept_shani_lane;
+
+/*
+ * rounds 4g to 4g+3. the schedule for rounds 16 and up is built a group
+ * ahead with msg1, xor and msg2 while sha1rnds4 works
+ */
+#define SHANI_GROUP(l, g, ein, eout) \
+    do \
+    { \
+        if ((g) == 0) (l).ein = _mm_add_epi32((l).ein, (l).m[0]); \
+        else (l).ein = _mm_sha1nexte_epu32((l).ein, (l).m[(g) & 3]); \
+        (l).eout = (l).abcd; \
+        if ((g) >= 3 && (g) <= 18) \
+        { \
+            (l).m[((g) + 1) & 3] = \
+                _mm_sha1msg2_epu32((l).m[((g) + 1) & 3], (l).m[(g) & 3]); \
+        } \
+        (l).abcd = _mm_sha1rnds4_epu32((l).abcd, (l).ein, (g) / 5); \
+        if ((g) >= 1 && (g) <= 16) \
+        { \
+            (l).m[((g) + 3) & 3] = \
+                _mm_sha1msg1_epu32((l).m[((g) + 3) & 3], (l).m[(g) & 3]); \
+        } \
+        if ((g) >= 2 && (g) <= 17) \
+        { \
+            (l).m[((g) + 2) & 3] = \
+                _mm_xor_si128((l).m[((g) + 2) & 3], (l).m[(g) & 3]); \
+        } \
+    } while (0)
+
+#define SHANI_GROUPS(G) \
+    G(0, e0, e1); G(1, e1, e0); G(2, e0, e1); G(3, e1, e0); \
+    G(4, e0, e1); G(5, e1, e0); G(6, e0, e1); G(7, e1, e0); \
+    G(8, e0, e1); G(9, e1, e0); G(10, e0, e1); G(11, e1, e0); \
+    G(12, e0, e1); G(13, e1, e0); G(14, e0, e1); G(15, e1, e0); \
+    G(16, e0, e1); G(17, e1, e0); G(18, e0, e1); G(19, e1, e0)
+
+#define SHANI_GROUP_1(g, ein, eout) SHANI_GROUP(x, g, ein, eout)
+
+WSACCEPT_TARGET("sha,sse4.1")
+static HH_INLINE void wsaccept_shani_start(wsaccept_shani_lane* l)
+{
+    l->abcd = _mm_set_epi32((int)g_sha1_init[0], (int)g_sha1_init[1],
+                            (int)g_sha1_init[2], (int)g_sha1_init[3]);
+    l->e0 = _mm_set_epi32((int)g_sha1_init[4], 0, 0, 0);
+}
+
+/* load a block with its big endian words reversed into lane order */
+WSACCEPT_TARGET("sha,sse4.1")
+static HH_INLINE void wsaccept_shani_load(wsaccept_shani_lane* l,
+                                          const unsigned char* block)
+{
+    const __m128i swap = _mm_set_epi64x(0x0001020304050607LL,
+                                        0x08090a0b0c0d0e0fLL);
+
+    l->abcd_save = l->abcd;
+    l->e_save = l->e0;
+    for (int i = 0; i < 4; i++)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)&block[i * 16]);
+        l->m[i] = _mm_shuffle_epi8(v, swap);
+    }
+}
+
+WSACCEPT_TARGET("sha,sse4.1")
+static HH_INLINE void wsaccept_shani_finish_block(wsaccept_shani_lane* l)
+{
+    l->e0 = _mm_sha1nexte_epu32(l->e0, l->e_save);
+    l->abcd = _mm_add_epi32(l->abcd, l->abcd_save);
+}
+
+WSACCEPT_TARGET("sha,sse4.1")
+static HH_INLINE void wsaccept_shani_output(wsaccept_shani_lane* l,
+                                            char* out)
+{
+    const __m128i swap = _mm_set_epi64x(0x0001020304050607LL,
+                                        0x08090a0b0c0d0e0fLL);
+
+    unsigned char digest[32];
+    _mm_storeu_si128((__m128i*)digest, _mm_shuffle_epi8(l->abcd, swap));
+    _mm_storeu_si128((__m128i*)&digest[16], _mm_shuffle_epi8(l->e0, swap));
+    wsaccept_base64(out, digest);
+}
+
+static HH_INLINE void wsaccept_make_block(unsigned char* block,
+                                          const char* key)
+{
+    memcpy(block, key, WSACCEPT_KEY_LEN);
+    memcpy(&block[WSACCEPT_KEY_LEN], g_key_guid, sizeof(g_key_guid) - 1);
+    block[WSACCEPT_KEY_LEN + sizeof(g_key_guid) - 1] = 0x80;
+    memset(&block[WSACCEPT_KEY_LEN + sizeof(g_key_guid)], 0,
+           WSACCEPT_BLOCK_LEN - WSACCEPT_KEY_LEN - sizeof(g_key_guid));
+}
+
+WSACCEPT_TARGET("sha,sse4.1")
+static void wsaccept_shani(const char* key, char* out)
+{
+    unsigned char block[WSACCEPT_BLOCK_LEN];
+    wsaccept_shani_lane x;
+
+    wsaccept_make_block(block, key);
+
+    wsaccept_shani_start(&x);
+    wsaccept_shani_load(&x, block);
+    SHANI_GROUPS(SHANI_GROUP_1);
+    wsaccept_shani_finish_block(&x);
+
+    wsaccept_shani_load(&x, g_pad_block);
+    SHANI_GROUPS(SHANI_GROUP_1);
+    wsaccept_shani_finish_block(&x);
+
+    wsaccept_shani_output(&x, out);
+}
+
+#endif /* WSACCEPT_HAVE_X86 */
+
+static bool wsaccept_cpu_supports(wsaccept_impl impl)
+{
+    switch (impl)
+    {
+    case WSACCEPT_IMPL_REFERENCE:
+    case WSACCEPT_IMPL_SCALAR:
+    case WSACCEPT_IMPL_BEST:
+        return true;
+    case WSACCEPT_IMPL_SHANI:
+#ifdef WSACCEPT_HAVE_X86
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sha") &&
+               __builtin_cpu_supports("sse4.1");
+#else
+        return false;
+#endif
+    case WSACCEPT_NUMBER_OF_IMPLS:
+        break;
+    }
+
+    return false;
+}
+
+static wsaccept_func* wsaccept_resolve_best(void)
+{
+#ifdef WSACCEPT_HAVE_X86
+    if (wsaccept_cpu_supports(WSACCEPT_IMPL_SHANI)) return wsaccept_shani;
+#endif
+    return wsaccept_scalar;
+}
+
+/*
+ * resolving is idempotent, so threads racing here at worst both do the
+ * cpuid check. the atomics keep that from being a data race
+ */
+static wsaccept_func* wsaccept_get_best(void)
+{
+    wsaccept_func* best = __atomic_load_n(&g_wsaccept_best, __ATOMIC_ACQUIRE);
+    if (best == NULL)
+    {
+        best = wsaccept_resolve_best();
+        __atomic_store_n(&g_wsaccept_best, best, __ATOMIC_RELEASE);
+    }
+
+    return best;
+}
+
+wsaccept_func* wsaccept_get_impl(wsaccept_impl impl)
+{
+    if (!wsaccept_cpu_supports(impl)) return NULL;
+
+    switch (impl)
+    {
+    case WSACCEPT_IMPL_REFERENCE:
+        return wsaccept_reference;
+    case WSACCEPT_IMPL_SCALAR:
+        return wsaccept_scalar;
+#ifdef WSACCEPT_HAVE_X86
+    case WSACCEPT_IMPL_SHANI:
+        return wsaccept_shani;
+#endif
+    case WSACCEPT_IMPL_BEST:
+        return wsaccept_get_best();
+    default:
+        return NULL;
+    }
+}
+
+const char* wsaccept_impl_name(wsaccept_impl impl)
+{
+    switch (impl)
+    {
+    case WSACCEPT_IMPL_REFERENCE:
+        return "reference";
+    case WSACCEPT_IMPL_SCALAR:
+        return "scalar";
+    case WSACCEPT_IMPL_SHANI:
+        return "sha-ni";
+    case WSACCEPT_IMPL_BEST:
+        return "best";
+    case WSACCEPT_NUMBER_OF_IMPLS:
+        break;
+    }
+
+    hhassert(0);
+    return "unknown";
+}
+
+void wsaccept_compute(const char* key, char* out)
+{
+    wsaccept_get_best()(key, out);
+}
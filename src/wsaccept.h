@@ -0,0 +1,74 @@
+/* wsaccept - compute Sec-WebSocket-Accept values for the opening handshake
+ *
+ * Copyright (c) 2013, Alex O'Konski
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of heelhook nor the
+ *      names of its contributors may be used to endorse or promote products
+ *      derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __WSACCEPT_H_
+#define __WSACCEPT_H_
+
+#include <stddef.h>
+#include "util.h"
+
+/* length of a Sec-WebSocket-Key: base64 of 16 random bytes */
+#define WSACCEPT_KEY_LEN 24
+
+/* length of a Sec-WebSocket-Accept: base64 of a 20 byte SHA-1 */
+#define WSACCEPT_LEN 28
+
+typedef enum
+{
+    WSACCEPT_IMPL_REFERENCE, /* RFC 3174 SHA-1 and libb64, the original */
+    WSACCEPT_IMPL_SCALAR,    /* unrolled SHA-1 specialized for the key */
+    WSACCEPT_IMPL_SHANI,     /* x86 SHA extensions, checked with cpuid */
+    WSACCEPT_IMPL_BEST,      /* fastest implementation supported by this cpu */
+    WSACCEPT_NUMBER_OF_IMPLS
+} wsaccept_impl;
+
+/*
+ * compute the Sec-WebSocket-Accept value for key. key must point at
+ * WSACCEPT_KEY_LEN characters (no terminator needed) and WSACCEPT_LEN
+ * characters are written to out, also without a terminator
+ */
+typedef void (wsaccept_func)(const char* key, char* out);
+
+/*
+ * get the implementation for impl, or NULL if this cpu doesn't support it.
+ * WSACCEPT_IMPL_BEST is always supported
+ */
+wsaccept_func* wsaccept_get_impl(wsaccept_impl impl);
+
+/* get a printable name for impl */
+const char* wsaccept_impl_name(wsaccept_impl impl);
+
+/*
+ * compute the accept value for one key with the best implementation for
+ * this cpu. see wsaccept_func for a description of the arguments
+ */
+void wsaccept_compute(const char* key, char* out);
+
+#endif /* __WSACCEPT_H_ */